@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "aggregate.h"
+
+#ifndef DEBUG_AGGREGATE
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+// Number of value slots covered by one word of the selection mask
+#define AGGREGATE_RUN 64
+
+static inline void
+_aggregate_merge_long(
+    Database_aggregate *acc,
+    int op,
+    long value,
+    unsigned long count
+) {
+    if(op == DATABASE_AGGREGATE_SUM) {
+        acc->value.i += value;
+    }
+    else if(op == DATABASE_AGGREGATE_MIN) {
+        if(!acc->count || value < acc->value.i) acc->value.i = value;
+    }
+    else if(op == DATABASE_AGGREGATE_MAX) {
+        if(!acc->count || value > acc->value.i) acc->value.i = value;
+    }
+    acc->count += count;
+}
+
+static inline void
+_aggregate_merge_double(
+    Database_aggregate *acc,
+    int op,
+    double value,
+    unsigned long count
+) {
+    if(op == DATABASE_AGGREGATE_SUM) {
+        acc->value.d += value;
+    }
+    else if(op == DATABASE_AGGREGATE_MIN) {
+        if(!acc->count || value < acc->value.d) acc->value.d = value;
+    }
+    else if(op == DATABASE_AGGREGATE_MAX) {
+        if(!acc->count || value > acc->value.d) acc->value.d = value;
+    }
+    acc->count += count;
+}
+
+// Visits every slot selected by mask, one at a time
+static void
+_aggregate_scalar(
+    Database_aggregate *acc,
+    unsigned char type,
+    int op,
+    unsigned char *base,
+    unsigned long stride,
+    unsigned long mask
+) {
+    while(mask) {
+        unsigned char *value = base + __builtin_ctzl(mask) * stride;
+        mask &= mask - 1;
+
+        if(type == KV_RECORD_TYPE_DOUBLE) {
+            double d;
+            memcpy(&d, value, sizeof(d));
+            _aggregate_merge_double(acc, op, d, 1);
+        }
+        else if(type == KV_RECORD_TYPE_INT64) {
+            long i;
+            memcpy(&i, value, sizeof(i));
+            _aggregate_merge_long(acc, op, i, 1);
+        }
+        else {
+            int i;
+            memcpy(&i, value, sizeof(i));
+            _aggregate_merge_long(acc, op, i, 1);
+        }
+    }
+}
+
+#if defined(__x86_64__)
+
+// Visits AGGREGATE_RUN consecutive slots, four at a time using strided gathers
+__attribute__((target("avx2")))
+static void
+_aggregate_run_avx2(
+    Database_aggregate *acc,
+    unsigned char type,
+    int op,
+    unsigned char *base,
+    unsigned long stride
+) {
+    __m256i vindex = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+    unsigned long step = 4 * stride;
+
+    if(type == KV_RECORD_TYPE_DOUBLE) {
+        __m256d a = _mm256_i64gather_pd((const double *)base, vindex, 1);
+        for(int i = 1; i < AGGREGATE_RUN / 4; i++) {
+            __m256d v = _mm256_i64gather_pd((const double *)(base + i * step), vindex, 1);
+            a = (op == DATABASE_AGGREGATE_SUM) ? _mm256_add_pd(a, v) :
+                (op == DATABASE_AGGREGATE_MIN) ? _mm256_min_pd(a, v) : _mm256_max_pd(a, v);
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, a);
+        if(op == DATABASE_AGGREGATE_SUM) {
+            _aggregate_merge_double(acc, op, (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]), AGGREGATE_RUN);
+        }
+        else {
+            for(int i = 0; i < 4; i++) _aggregate_merge_double(acc, op, lanes[i], (i == 0) ? AGGREGATE_RUN : 0);
+        }
+        return;
+    }
+
+    __m256i a;
+    if(type == KV_RECORD_TYPE_INT64) {
+        a = _mm256_i64gather_epi64((const long long *)base, vindex, 1);
+        for(int i = 1; i < AGGREGATE_RUN / 4; i++) {
+            __m256i v = _mm256_i64gather_epi64((const long long *)(base + i * step), vindex, 1);
+            if(op == DATABASE_AGGREGATE_SUM) {
+                a = _mm256_add_epi64(a, v);
+            }
+            else {
+                __m256i gt = _mm256_cmpgt_epi64(a, v);
+                a = (op == DATABASE_AGGREGATE_MIN) ? _mm256_blendv_epi8(a, v, gt) : _mm256_blendv_epi8(v, a, gt);
+            }
+        }
+    }
+    else {
+        // 32-bit values are widened so that sums can't overflow the lanes
+        a = _mm256_cvtepi32_epi64(_mm256_i64gather_epi32((const int *)base, vindex, 1));
+        for(int i = 1; i < AGGREGATE_RUN / 4; i++) {
+            __m256i v = _mm256_cvtepi32_epi64(_mm256_i64gather_epi32((const int *)(base + i * step), vindex, 1));
+            if(op == DATABASE_AGGREGATE_SUM) {
+                a = _mm256_add_epi64(a, v);
+            }
+            else {
+                __m256i gt = _mm256_cmpgt_epi64(a, v);
+                a = (op == DATABASE_AGGREGATE_MIN) ? _mm256_blendv_epi8(a, v, gt) : _mm256_blendv_epi8(v, a, gt);
+            }
+        }
+    }
+
+    long lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, a);
+    if(op == DATABASE_AGGREGATE_SUM) {
+        _aggregate_merge_long(acc, op, lanes[0] + lanes[1] + lanes[2] + lanes[3], AGGREGATE_RUN);
+    }
+    else {
+        for(int i = 0; i < 4; i++) _aggregate_merge_long(acc, op, lanes[i], (i == 0) ? AGGREGATE_RUN : 0);
+    }
+}
+
+// Visits AGGREGATE_RUN consecutive slots, two at a time. SSE2 has no 64-bit integer compare, so
+// this returns 0 for the combinations it can't handle and the caller falls back to the scalar kernel.
+static int
+_aggregate_run_sse2(
+    Database_aggregate *acc,
+    unsigned char type,
+    int op,
+    unsigned char *base,
+    unsigned long stride
+) {
+    if(type == KV_RECORD_TYPE_DOUBLE) {
+        __m128d a = _mm_loadh_pd(_mm_load_sd((const double *)base), (const double *)(base + stride));
+        for(int i = 2; i < AGGREGATE_RUN; i += 2) {
+            unsigned char *p = base + i * stride;
+            __m128d v = _mm_loadh_pd(_mm_load_sd((const double *)p), (const double *)(p + stride));
+            a = (op == DATABASE_AGGREGATE_SUM) ? _mm_add_pd(a, v) :
+                (op == DATABASE_AGGREGATE_MIN) ? _mm_min_pd(a, v) : _mm_max_pd(a, v);
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, a);
+        if(op == DATABASE_AGGREGATE_SUM) {
+            _aggregate_merge_double(acc, op, lanes[0] + lanes[1], AGGREGATE_RUN);
+        }
+        else {
+            _aggregate_merge_double(acc, op, lanes[0], AGGREGATE_RUN);
+            _aggregate_merge_double(acc, op, lanes[1], 0);
+        }
+        return 1;
+    }
+
+    if(type == KV_RECORD_TYPE_INT64 && op == DATABASE_AGGREGATE_SUM) {
+        __m128i a = _mm_setzero_si128();
+        for(int i = 0; i < AGGREGATE_RUN; i += 2) {
+            unsigned char *p = base + i * stride;
+            a = _mm_add_epi64(a, _mm_set_epi64x(*(long *)(p + stride), *(long *)p));
+        }
+        long lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, a);
+        _aggregate_merge_long(acc, op, lanes[0] + lanes[1], AGGREGATE_RUN);
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif
+
+int
+database_aggregate(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    int bucket,
+    unsigned char type,
+    int op,
+    Database_aggregate *result
+) {
+    DEBUG_PRINT("database_aggregate(bucket = %d, type = %02x, op = %d);\n", bucket, type, op);
+
+    if(type != KV_RECORD_TYPE_INT32 && type != KV_RECORD_TYPE_INT64 && type != KV_RECORD_TYPE_DOUBLE) {
+        DEBUG_PRINT("\tERR unknown type\n");
+        return 0;
+    }
+
+    if(op < DATABASE_AGGREGATE_COUNT || op > DATABASE_AGGREGATE_MAX) {
+        DEBUG_PRINT("\tERR unknown op\n");
+        return 0;
+    }
+
+    memset(result, 0, sizeof(Database_aggregate));
+
+    char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+    if(ptbl_index == -1) {
+        DEBUG_PRINT("\tNo such bucket\n");
+        return 1;
+    }
+
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+    unsigned long type_size = (type == KV_RECORD_TYPE_INT32) ? sizeof(int) : sizeof(long);
+    unsigned long stride = PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+    unsigned long slot_count = (unsigned long)PTBL_RECORD_GET_PAGE_COUNT(_PTBL) * PTBL_CALC_PAGE_USAGE_BITS(bucket);
+    unsigned long mask_words = (slot_count + AGGREGATE_RUN - 1) / AGGREGATE_RUN;
+
+    unsigned long *mask = (unsigned long *)memory_alloc(mask_words * sizeof(unsigned long));
+    if(!mask) {
+        DEBUG_PRINT("\tERR failed to allocate selection mask\n");
+        return 0;
+    }
+
+    // The data type of a value only lives in its kv_record, so one sequential pass over
+    // kv_record_tbl selects the slots of this bucket that hold values of the right type
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+#define _REC_KV rec_database->kv_record_tbl[k]
+        if(KV_RECORD_GET_SIZE(_REC_KV) >= type_size &&
+                KV_RECORD_GET_BUCKET(_REC_KV) == bucket &&
+                KV_RECORD_GET_FLAGS(_REC_KV) == type) {
+            unsigned long index = KV_RECORD_GET_INDEX(_REC_KV);
+            mask[index / AGGREGATE_RUN] |= (1UL << (index % AGGREGATE_RUN));
+        }
+#undef _REC_KV
+    }
+
+#if defined(__x86_64__)
+    int has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    for(unsigned long w = 0; w < mask_words; w++) {
+        // page_usage is the authority on which slots are live
+        unsigned long usage = 0;
+        for(int b = 0; b < sizeof(unsigned long) && w * sizeof(unsigned long) + b < _PTBL.page_usage_length; b++) {
+            usage |= (unsigned long)_PTBL.page_usage[w * sizeof(unsigned long) + b] << (8 * b);
+        }
+
+        unsigned long selected = mask[w] & usage;
+        if(!selected) {
+            continue;
+        }
+
+        if(op == DATABASE_AGGREGATE_COUNT) {
+            result->count += __builtin_popcountl(selected);
+            continue;
+        }
+
+        unsigned char *base = _PTBL.m_offset + w * AGGREGATE_RUN * stride;
+
+#if defined(__x86_64__)
+        if(selected == ~0UL) {
+            if(has_avx2) {
+                _aggregate_run_avx2(result, type, op, base, stride);
+                continue;
+            }
+            if(_aggregate_run_sse2(result, type, op, base, stride)) {
+                continue;
+            }
+        }
+#endif
+
+        _aggregate_scalar(result, type, op, base, stride, selected);
+    }
+
+#undef _PTBL
+
+    memory_free(mask);
+
+    DEBUG_PRINT("\tcount = %lu\n", result->count);
+
+    return 1;
+}
@@ -0,0 +1,47 @@
+/** @file  aggregate.h
+ *  @brief Vectorized aggregation over the typed values stored in a bucket
+ */
+
+/** @brief Aggregate operations understood by database_aggregate() */
+enum database_aggregate_op {
+    DATABASE_AGGREGATE_COUNT, ///< Number of matching values
+    DATABASE_AGGREGATE_SUM,   ///< Sum of all matching values
+    DATABASE_AGGREGATE_MIN,   ///< Smallest matching value
+    DATABASE_AGGREGATE_MAX    ///< Largest matching value
+};
+
+/** @brief The result of a call to database_aggregate()
+ *
+ * Integer types (KV_RECORD_TYPE_INT32, KV_RECORD_TYPE_INT64) are accumulated into \a value.i and
+ * KV_RECORD_TYPE_DOUBLE into \a value.d. When \a count is 0, \a value is left 0.
+ */
+typedef struct database_aggregate {
+    unsigned long count; ///< Number of values that were visited
+    union {
+        long i;          ///< Result for integer types
+        double d;        ///< Result for floating-point types
+    } value;
+} Database_aggregate;
+
+/** @brief Computes \a op over every live value of data type \a type in \a bucket
+ *
+ * Rather than resolving every key through database_kv_get_value(), the values of \a bucket are streamed
+ * directly out of ptbl_record.m_offset at a stride of PTBL_CALC_BUCKET_WORD_SIZE(\a bucket). A slot is
+ * visited when it is marked as used in ptbl_record.page_usage and the kv_record occupying it has
+ * \a type in its \a flags.
+ *
+ * Runs of 64 consecutive matching slots are handed to an AVX2 or SSE2 kernel (chosen at runtime),
+ * everything else goes through the scalar kernel.
+ *
+ * @returns 1 on success, 0 on failure (unknown \a type or \a op)
+ * @see     kv_record_type
+ */
+int
+database_aggregate(
+    Context_main *ctx_main,        ///<[in]  main context
+    Record_database *rec_database, ///<[in]  database record
+    int bucket,                    ///<[in]  bucket to aggregate
+    unsigned char type,            ///<[in]  kv_record_type of the values to visit
+    int op,                        ///<[in]  database_aggregate_op to compute
+    Database_aggregate *result     ///<[out] Where the result should be written
+    );
@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "async.h"
+
+#ifndef DEBUG_ASYNC
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define _ASYNC_CACHE_LINE 64
+
+// Sorts after every slot of its bucket, for allocations, which don't have one yet
+#define _ASYNC_KEY_ALLOC(bucket) (((unsigned long)(bucket) << KV_RECORD_BUCKET_SHIFT) | ~KV_RECORD_BUCKET_BITMASK)
+
+// An operation taken off the submission queue
+typedef struct async_work {
+    Async_sqe sqe;
+    unsigned long key;      // bucket_and_index of the record, which sorts by bucket then slot
+    unsigned long seq;      // Position in the batch, which keeps the sort stable
+    unsigned char *region;  // The value, as of the lookup, to prefetch
+} Async_work;
+
+struct database_async {
+    Context_main *ctx_main;
+    Record_database *rec_database;
+    unsigned long mask;     // Depth - 1
+    Async_sqe *sq;
+    Async_cqe *cq;
+    Async_work *work;       // The worker's, as big as the queues
+    pthread_t thread;
+
+    // The caller's side
+    unsigned long sq_pending; // Entries handed out by database_async_sqe(), submitted or not
+    unsigned long cq_head;    // Completions reaped
+    char pad_caller[_ASYNC_CACHE_LINE];
+
+    unsigned long sq_tail;    // Entries submitted
+    char pad_sq_tail[_ASYNC_CACHE_LINE - sizeof(unsigned long)];
+    unsigned long cq_tail;    // Completions posted
+    char pad_cq_tail[_ASYNC_CACHE_LINE - sizeof(unsigned long)];
+
+    // Set by each side before it sleeps, for the other to wake it up. Both sleep under lock.
+    int sleeping;
+    int waiting;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+};
+
+static int
+_async_compare(
+    const void *a,
+    const void *b
+) {
+    const Async_work *x = (const Async_work *)a, *y = (const Async_work *)b;
+    if(x->key != y->key) return (x->key < y->key) ? -1 : 1;
+    return (x->seq < y->seq) ? -1 : (x->seq > y->seq);
+}
+
+#undef _REC_KV
+#define _REC_KV rec_database->kv_record_tbl[w->sqe.k]
+
+// Looks every record up, and sorts the batch by where its values are
+static void
+_async_prepare(
+    Database_async *async,
+    unsigned long count
+) {
+    Record_database *rec_database = async->rec_database;
+    unsigned char *m_offset[64] = { 0 };
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        m_offset[PTBL_RECORD_GET_KEY(rec_database->ptbl_record_tbl[i]) & 63] = rec_database->ptbl_record_tbl[i].m_offset;
+    }
+
+    for(unsigned long i = 0; i < count; i++) {
+        if(i + ASYNC_PREFETCH_DISTANCE < count) {
+            unsigned long k = async->work[i + ASYNC_PREFETCH_DISTANCE].sqe.k;
+            if(k < rec_database->kv_record_count) __builtin_prefetch(&rec_database->kv_record_tbl[k]);
+        }
+
+        Async_work *w = &async->work[i];
+        w->seq = i;
+        w->region = 0;
+        w->key = 0;
+        if(w->sqe.op == ASYNC_OP_ALLOC) {
+            w->key = _ASYNC_KEY_ALLOC(database_calc_bucket(w->sqe.length));
+        }
+        else if(w->sqe.op != ASYNC_OP_NOP && w->sqe.k < rec_database->kv_record_count && KV_RECORD_GET_SIZE(_REC_KV)) {
+            int bucket = KV_RECORD_GET_BUCKET(_REC_KV);
+            w->key = _REC_KV.bucket_and_index;
+            if(m_offset[bucket]) {
+                w->region = m_offset[bucket] + KV_RECORD_GET_INDEX(_REC_KV) * PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+            }
+        }
+    }
+
+    qsort(async->work, count, sizeof(Async_work), _async_compare);
+}
+
+static void
+_async_run(
+    Database_async *async,
+    Async_work *w,
+    Async_cqe *cqe
+) {
+    Context_main *ctx_main = async->ctx_main;
+    Record_database *rec_database = async->rec_database;
+
+    cqe->user_data = w->sqe.user_data;
+    cqe->k = w->sqe.k;
+    cqe->length = 0;
+    cqe->flags = 0;
+    cqe->result = 0;
+
+    switch(w->sqe.op) {
+        case ASYNC_OP_NOP:
+            cqe->result = 1;
+            break;
+        case ASYNC_OP_ALLOC:
+            cqe->k = database_kv_alloc(ctx_main, rec_database, w->sqe.flags, w->sqe.length, w->sqe.buffer);
+            cqe->result = (cqe->k != -1);
+            break;
+        case ASYNC_OP_GET: {
+            unsigned char *value = database_kv_get_value(ctx_main, rec_database, 0, w->sqe.k);
+            if(value) {
+                cqe->length = KV_RECORD_GET_SIZE(_REC_KV);
+                cqe->flags = KV_RECORD_GET_FLAGS(_REC_KV);
+                memcpy(w->sqe.buffer, value, (cqe->length < w->sqe.length) ? cqe->length : w->sqe.length);
+                cqe->result = 1;
+            }
+            break;
+        }
+        case ASYNC_OP_SET_VALUE:
+            cqe->result = database_kv_set_value(ctx_main, rec_database, w->sqe.k, w->sqe.length, w->sqe.buffer);
+            break;
+        case ASYNC_OP_FREE:
+            cqe->result = database_kv_free(ctx_main, rec_database, w->sqe.k);
+            break;
+    }
+}
+
+static void *
+_async_thread(
+    void *arg
+) {
+    Database_async *async = (Database_async *)arg;
+    unsigned long sq_head = 0, cq_tail = 0;
+
+    for(int spin = 0; ; ) {
+        unsigned long sq_tail = __atomic_load_n(&async->sq_tail, __ATOMIC_ACQUIRE);
+        if(sq_head == sq_tail) {
+            if(__atomic_load_n(&async->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            if(spin++ < ASYNC_SPIN) {
+                continue;
+            }
+            pthread_mutex_lock(&async->lock);
+            __atomic_store_n(&async->sleeping, 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&async->sq_tail, __ATOMIC_SEQ_CST) == sq_head && !async->stop) {
+                pthread_cond_wait(&async->submitted, &async->lock);
+            }
+            __atomic_store_n(&async->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&async->lock);
+            spin = 0;
+            continue;
+        }
+
+        // The caller can't have more in flight than there is room for, so neither queue overflows
+        unsigned long count = sq_tail - sq_head;
+        DEBUG_PRINT("\tbatch of %lu\n", count);
+        for(unsigned long i = 0; i < count; i++) {
+            async->work[i].sqe = async->sq[(sq_head + i) & async->mask];
+        }
+        sq_head = sq_tail;
+
+        _async_prepare(async, count);
+        for(unsigned long i = 0; i < count; i++) {
+            if(i + ASYNC_PREFETCH_DISTANCE < count && async->work[i + ASYNC_PREFETCH_DISTANCE].region) {
+                __builtin_prefetch(async->work[i + ASYNC_PREFETCH_DISTANCE].region);
+            }
+            _async_run(async, &async->work[i], &async->cq[(cq_tail + i) & async->mask]);
+        }
+        cq_tail += count;
+
+        __atomic_store_n(&async->cq_tail, cq_tail, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&async->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&async->lock);
+            pthread_cond_signal(&async->completed);
+            pthread_mutex_unlock(&async->lock);
+        }
+        spin = 0;
+    }
+
+    return 0;
+}
+
+Database_async *
+database_async_create(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned long depth
+) {
+    DEBUG_PRINT("database_async_create(depth = %lu);\n", depth);
+
+    unsigned long slots = 1;
+    while(slots < (depth ? depth : ASYNC_DEPTH_DEFAULT)) {
+        slots <<= 1;
+    }
+
+    RECORD_CREATE(Database_async, async);
+    if(!async) {
+        return 0;
+    }
+    async->ctx_main = ctx_main;
+    async->rec_database = rec_database;
+    async->mask = slots - 1;
+    async->sq = (Async_sqe *)memory_alloc(slots * sizeof(Async_sqe));
+    async->cq = (Async_cqe *)memory_alloc(slots * sizeof(Async_cqe));
+    async->work = (Async_work *)memory_alloc(slots * sizeof(Async_work));
+    pthread_mutex_init(&async->lock, 0);
+    pthread_cond_init(&async->submitted, 0);
+    pthread_cond_init(&async->completed, 0);
+
+    if(!async->sq || !async->cq || !async->work || pthread_create(&async->thread, 0, _async_thread, async) != 0) {
+        DEBUG_PRINT("\tERR failed to start the worker\n");
+        if(async->sq) memory_free(async->sq);
+        if(async->cq) memory_free(async->cq);
+        if(async->work) memory_free(async->work);
+        pthread_mutex_destroy(&async->lock);
+        pthread_cond_destroy(&async->submitted);
+        pthread_cond_destroy(&async->completed);
+        memory_free(async);
+        return 0;
+    }
+
+    return async;
+}
+
+void
+database_async_free(
+    Database_async *async
+) {
+    DEBUG_PRINT("database_async_free();\n");
+
+    pthread_mutex_lock(&async->lock);
+    __atomic_store_n(&async->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&async->submitted);
+    pthread_mutex_unlock(&async->lock);
+    pthread_join(async->thread, 0);
+
+    memory_free(async->sq);
+    memory_free(async->cq);
+    memory_free(async->work);
+    pthread_mutex_destroy(&async->lock);
+    pthread_cond_destroy(&async->submitted);
+    pthread_cond_destroy(&async->completed);
+    memory_free(async);
+}
+
+Async_sqe *
+database_async_sqe(
+    Database_async *async
+) {
+    // An entry's slot is free once the completion of the entry a ring before it has been reaped
+    if(async->sq_pending - async->cq_head > async->mask) {
+        return 0;
+    }
+    Async_sqe *sqe = &async->sq[async->sq_pending++ & async->mask];
+    memset(sqe, 0, sizeof(Async_sqe));
+    return sqe;
+}
+
+unsigned long
+database_async_submit(
+    Database_async *async
+) {
+    unsigned long count = async->sq_pending - async->sq_tail;
+    if(!count) {
+        return 0;
+    }
+
+    __atomic_store_n(&async->sq_tail, async->sq_pending, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&async->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&async->lock);
+        pthread_cond_signal(&async->submitted);
+        pthread_mutex_unlock(&async->lock);
+    }
+
+    return count;
+}
+
+unsigned long
+database_async_complete(
+    Database_async *async,
+    Async_cqe *cqe,
+    unsigned long count,
+    unsigned long wait
+) {
+    unsigned long in_flight = async->sq_tail - async->cq_head;
+    if(wait > in_flight) wait = in_flight;
+    if(wait > count) wait = count;
+
+    unsigned long cq_tail = __atomic_load_n(&async->cq_tail, __ATOMIC_ACQUIRE);
+    if(cq_tail - async->cq_head < wait) {
+        pthread_mutex_lock(&async->lock);
+        __atomic_store_n(&async->waiting, 1, __ATOMIC_SEQ_CST);
+        while((cq_tail = __atomic_load_n(&async->cq_tail, __ATOMIC_SEQ_CST)) - async->cq_head < wait) {
+            pthread_cond_wait(&async->completed, &async->lock);
+        }
+        __atomic_store_n(&async->waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&async->lock);
+    }
+
+    unsigned long ready = cq_tail - async->cq_head;
+    if(ready > count) ready = count;
+    for(unsigned long i = 0; i < ready; i++) {
+        cqe[i] = async->cq[(async->cq_head + i) & async->mask];
+    }
+    async->cq_head += ready;
+
+    return ready;
+}
@@ -0,0 +1,109 @@
+/** @file  async.h
+ *  @brief Asynchronous operations on a Record_database, through a submission queue and a completion queue
+ */
+
+/** @brief Most operations that may be in flight (submitted, or completed and not yet reaped) when none is given */
+#define ASYNC_DEPTH_DEFAULT 4096
+
+/** @brief How many operations ahead of the one being run the worker prefetches records and values for */
+#define ASYNC_PREFETCH_DISTANCE 8
+
+/** @brief How many times the worker checks an empty submission queue before it goes to sleep */
+#define ASYNC_SPIN 64
+
+/** @brief What an Async_sqe asks for */
+enum async_op {
+    ASYNC_OP_NOP = 0,       ///< Nothing, completed with a \a result of 1
+    ASYNC_OP_ALLOC = 1,     ///< database_kv_alloc() of \a length bytes of \a buffer, with \a flags. Completes with the new key in \a k.
+    ASYNC_OP_GET = 2,       ///< Copies the value of \a k into \a buffer, up to \a length bytes. Completes with the value's size in \a length.
+    ASYNC_OP_SET_VALUE = 3, ///< database_kv_set_value() of \a k to \a length bytes of \a buffer
+    ASYNC_OP_FREE = 4       ///< database_kv_free() of \a k
+};
+
+/** @brief A submission queue entry: one operation */
+typedef struct async_sqe {
+    unsigned long user_data; ///< Anything, handed back in the Async_cqe
+    unsigned long k;         ///< Key, for every op but ASYNC_OP_ALLOC and ASYNC_OP_NOP
+    unsigned long length;    ///< Length of \a buffer in bytes
+    unsigned char *buffer;   ///< The caller's, which must stay as it is until the operation completes
+    unsigned char op;        ///< One of async_op
+    unsigned char flags;     ///< kv_record flags, for ASYNC_OP_ALLOC
+} Async_sqe;
+
+/** @brief A completion queue entry: how an operation went */
+typedef struct async_cqe {
+    unsigned long user_data; ///< The Async_sqe's \a user_data
+    unsigned long k;         ///< The Async_sqe's \a k, or the new key for ASYNC_OP_ALLOC
+    unsigned long length;    ///< Size of the value for ASYNC_OP_GET, which is more than was copied if \a buffer was too short
+    int result;              ///< 1 if the operation succeeded, 0 if it failed
+    unsigned char flags;     ///< kv_record flags of the value, for ASYNC_OP_GET
+} Async_cqe;
+
+/** @brief A worker thread that runs the operations submitted to it on a Record_database, in batches
+ *
+ * The caller fills in entries from database_async_sqe(), hands them over with database_async_submit()
+ * and picks up how they went with database_async_complete(), so that it can have up to the queues'
+ * depth of operations in flight from one thread. Both queues are rings shared with the worker, which
+ * only take locks when one side has to wake the other up.
+ *
+ * The worker takes everything submitted in one go. It looks up every record first, prefetching them
+ * ASYNC_PREFETCH_DISTANCE ahead, then sorts the batch by bucket and slot and runs it in that order,
+ * prefetching values as far ahead. Operations on the same key run in the order they were submitted,
+ * but operations on different keys run, and complete, in any order: a caller that needs one to follow
+ * another waits for the first to complete before submitting the second.
+ *
+ * Only the worker may use the database while the Database_async is open. Only one thread may submit to
+ * it and reap from it.
+ */
+typedef struct database_async Database_async;
+
+/** @brief Starts a worker on \a rec_database, with room for \a depth operations in flight
+ *
+ * \a depth is rounded up to a power of two, and is ASYNC_DEPTH_DEFAULT if 0.
+ *
+ * @returns A pointer to the Database_async on success, or 0 on failure
+ * @see     database_async_free()
+ */
+Database_async *
+database_async_create(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    unsigned long depth            ///<[in] most operations in flight
+    );
+
+/** @brief Runs what was submitted, stops the worker and frees \a async. Completions not yet reaped are lost. */
+void
+database_async_free(
+    Database_async *async ///<[in] async queues
+    );
+
+/** @brief   Returns the next submission queue entry, to be filled in, then handed over by database_async_submit()
+ *  @returns A pointer to the entry, cleared, or 0 if there are \a depth operations in flight already
+ */
+Async_sqe *
+database_async_sqe(
+    Database_async *async ///<[in] async queues
+    );
+
+/** @brief   Hands every entry filled in since the last call over to the worker
+ *  @returns The number of entries handed over
+ */
+unsigned long
+database_async_submit(
+    Database_async *async ///<[in] async queues
+    );
+
+/** @brief Copies up to \a count completions into \a cqe, waiting for at least \a wait of them first
+ *
+ * \a wait is cut down to the number of operations submitted and not yet reaped, so that it can't wait
+ * forever.
+ *
+ * @returns The number of completions copied
+ */
+unsigned long
+database_async_complete(
+    Database_async *async, ///<[in]  async queues
+    Async_cqe *cqe,        ///<[out] completions
+    unsigned long count,   ///<[in]  room in \a cqe
+    unsigned long wait     ///<[in]  completions to wait for
+    );
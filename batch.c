@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "cdc.h"
+#include "batch.h"
+
+#ifndef DEBUG_BATCH
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+enum {
+    BATCH_OP_ALLOC,
+    BATCH_OP_SET_VALUE,
+    BATCH_OP_FREE
+};
+
+typedef struct batch_op {
+    int type;
+    unsigned char flags;
+    unsigned long k;      // Record to change, or the record an allocation got at commit
+    unsigned long size;
+    unsigned long data;   // Offset of the value in data
+    unsigned long index;  // Slot the value got at commit
+    Record_kv undo;       // The record as it was before this write
+} Batch_op;
+
+struct database_batch {
+    Batch_op *op;
+    unsigned long op_count;
+    unsigned long op_capacity;
+
+    unsigned char *data;  // Every staged value, back to back
+    unsigned long data_length;
+    unsigned long data_capacity;
+
+    unsigned long *index; // Room for one slot per op, used while committing
+};
+
+Database_batch *
+database_batch_create(
+    Context_main *ctx_main
+) {
+    DEBUG_PRINT("database_batch_create();\n");
+
+    RECORD_CREATE(Database_batch, batch);
+    if(!batch) {
+        return 0;
+    }
+
+    batch->op = (Batch_op *)memory_alloc(BATCH_INITIAL_CAPACITY * sizeof(Batch_op));
+    batch->index = (unsigned long *)memory_alloc(BATCH_INITIAL_CAPACITY * sizeof(unsigned long));
+    if(!batch->op || !batch->index) {
+        database_batch_free(ctx_main, batch);
+        return 0;
+    }
+    batch->op_capacity = BATCH_INITIAL_CAPACITY;
+
+    return batch;
+}
+
+void
+database_batch_free(
+    Context_main *ctx_main,
+    Database_batch *batch
+) {
+    DEBUG_PRINT("database_batch_free();\n");
+
+    memory_free(batch->op);
+    memory_free(batch->index);
+    memory_free(batch->data);
+    memory_free(batch);
+}
+
+void
+database_batch_clear(
+    Database_batch *batch
+) {
+    batch->op_count = 0;
+    batch->data_length = 0;
+}
+
+// Appends an op, and copies size bytes of buffer into data for it
+static Batch_op *
+_batch_push(
+    Database_batch *batch,
+    int type,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    if(batch->op_count == batch->op_capacity) {
+        unsigned long new_capacity = batch->op_capacity * 2;
+        Batch_op *new_op = (Batch_op *)memory_realloc(batch->op, batch->op_capacity * sizeof(Batch_op), new_capacity * sizeof(Batch_op));
+        if(!new_op) {
+            return 0;
+        }
+        batch->op = new_op;
+
+        unsigned long *new_index = (unsigned long *)memory_realloc(batch->index, batch->op_capacity * sizeof(unsigned long), new_capacity * sizeof(unsigned long));
+        if(!new_index) {
+            return 0;
+        }
+        batch->index = new_index;
+        batch->op_capacity = new_capacity;
+    }
+
+    if(batch->data_length + size > batch->data_capacity) {
+        unsigned long new_capacity = batch->data_capacity ? batch->data_capacity : 256;
+        while(new_capacity < batch->data_length + size) {
+            new_capacity *= 2;
+        }
+        unsigned char *new_data = memory_realloc(batch->data, batch->data_capacity, new_capacity);
+        if(!new_data) {
+            return 0;
+        }
+        batch->data = new_data;
+        batch->data_capacity = new_capacity;
+    }
+
+    Batch_op *op = &batch->op[batch->op_count++];
+    memset(op, 0, sizeof(Batch_op));
+    op->type = type;
+    op->size = size;
+    op->data = batch->data_length;
+    op->k = -1;
+    if(size) {
+        memcpy(batch->data + batch->data_length, buffer, size);
+        batch->data_length += size;
+    }
+
+    return op;
+}
+
+int
+database_batch_kv_alloc(
+    Database_batch *batch,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_batch_kv_alloc(flags = %02x, size = %lu);\n", flags, size);
+
+    Batch_op *op = _batch_push(batch, BATCH_OP_ALLOC, size, buffer);
+    if(!op) {
+        DEBUG_PRINT("\tERR failed to stage allocation\n");
+        return -1;
+    }
+    op->flags = flags;
+
+    return batch->op_count - 1;
+}
+
+int
+database_batch_kv_set_value(
+    Database_batch *batch,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_batch_kv_set_value(k = %lu, length = %lu);\n", k, length);
+
+    Batch_op *op = _batch_push(batch, BATCH_OP_SET_VALUE, length, buffer);
+    if(!op) {
+        DEBUG_PRINT("\tERR failed to stage value\n");
+        return 0;
+    }
+    op->k = k;
+
+    return 1;
+}
+
+int
+database_batch_kv_free(
+    Database_batch *batch,
+    unsigned long k
+) {
+    DEBUG_PRINT("database_batch_kv_free(k = %lu);\n", k);
+
+    Batch_op *op = _batch_push(batch, BATCH_OP_FREE, 0, 0);
+    if(!op) {
+        DEBUG_PRINT("\tERR failed to stage free\n");
+        return 0;
+    }
+    op->k = k;
+
+    return 1;
+}
+
+// Gives back the slots that step 1 allocated for ops
+static void
+_batch_slots_release(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    Database_batch *batch
+) {
+    for(unsigned long i = 0; i < batch->op_count; i++) {
+        Batch_op *op = &batch->op[i];
+        if(op->type != BATCH_OP_FREE && op->index != -1) {
+            char ptbl_index = database_ptbl_get(ctx_main, rec_database, database_calc_bucket(op->size));
+            PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, op->index);
+            op->index = -1;
+        }
+    }
+}
+
+#undef _REC_KV
+#define _REC_KV rec_database->kv_record_tbl[op->k]
+
+int
+database_batch_commit(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    Database_batch *batch
+) {
+    DEBUG_PRINT("database_batch_commit(op_count = %lu);\n", batch->op_count);
+
+    unsigned long need[64] = { 0 }, offset[64], allocs = 0;
+
+    // Step 1: every slot, one pass per bucket
+    for(unsigned long i = 0; i < batch->op_count; i++) {
+        Batch_op *op = &batch->op[i];
+        op->index = -1;
+        if(op->type == BATCH_OP_ALLOC) {
+            op->k = -1;
+            allocs++;
+        }
+        if(op->type != BATCH_OP_FREE) {
+            need[database_calc_bucket(op->size)]++;
+        }
+    }
+    for(int bucket = 0, next = 0; bucket < 64; bucket++) {
+        offset[bucket] = next;
+        if(need[bucket] && !_database_value_alloc_many(ctx_main, rec_database, bucket, need[bucket], batch->index + next)) {
+            DEBUG_PRINT("\tERR failed to allocate %lu values in bucket %d\n", need[bucket], bucket);
+            // Hand the buckets that did work out back
+            for(int done = 0; done < bucket; done++) {
+                char ptbl_index = database_ptbl_get(ctx_main, rec_database, done);
+                for(unsigned long j = 0; j < need[done]; j++) {
+                    PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, batch->index[offset[done] + j]);
+                }
+            }
+            return 0;
+        }
+        next += need[bucket];
+    }
+    for(unsigned long i = 0; i < batch->op_count; i++) {
+        Batch_op *op = &batch->op[i];
+        if(op->type != BATCH_OP_FREE) {
+            op->index = batch->index[offset[database_calc_bucket(op->size)]++];
+        }
+    }
+
+    // ... and every record, reusing free ones from the end of the table first, like database_kv_alloc()
+    unsigned long kv_record_count = rec_database->kv_record_count,
+                  kv_record_free_count = rec_database->kv_record_free_count,
+                  claimed = 0, i = 0;
+    for(long k = kv_record_count - 1; k >= 0 && claimed < allocs && rec_database->kv_record_free_count > 0; k--) {
+        if(!KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) {
+            while(batch->op[i].type != BATCH_OP_ALLOC) i++;
+            batch->op[i++].k = k;
+            rec_database->kv_record_free_count--;
+            claimed++;
+        }
+    }
+    if(claimed < allocs) {
+        Record_kv *new_kv_tbl = (Record_kv *)memory_realloc(rec_database->kv_record_tbl, kv_record_count * sizeof(Record_kv), (kv_record_count + allocs - claimed) * sizeof(Record_kv));
+        if(!new_kv_tbl) {
+            DEBUG_PRINT("\tERR failed to grow kv_record_tbl\n");
+            rec_database->kv_record_free_count = kv_record_free_count;
+            _batch_slots_release(ctx_main, rec_database, batch);
+            for(i = 0; i < batch->op_count; i++) {
+                if(batch->op[i].type == BATCH_OP_ALLOC) batch->op[i].k = -1;
+            }
+            return 0;
+        }
+        rec_database->kv_record_tbl = new_kv_tbl;
+        for(; claimed < allocs; claimed++) {
+            while(batch->op[i].type != BATCH_OP_ALLOC) i++;
+            batch->op[i++].k = rec_database->kv_record_count++;
+        }
+    }
+
+    // Step 2: apply the writes in order, logging what each one replaced
+    for(i = 0; i < batch->op_count; i++) {
+        Batch_op *op = &batch->op[i];
+
+        if(op->type != BATCH_OP_ALLOC && (op->k >= rec_database->kv_record_count || (op->type == BATCH_OP_SET_VALUE && !KV_RECORD_GET_SIZE(_REC_KV)))) {
+            DEBUG_PRINT("\tERR op %lu: no such record %lu, rolling back\n", i, op->k);
+            while(i-- > 0) {
+                op = &batch->op[i];
+                _REC_KV = op->undo;
+            }
+            rec_database->kv_record_count = kv_record_count;
+            rec_database->kv_record_free_count = kv_record_free_count;
+            _batch_slots_release(ctx_main, rec_database, batch);
+            for(i = 0; i < batch->op_count; i++) {
+                if(batch->op[i].type == BATCH_OP_ALLOC) batch->op[i].k = -1;
+            }
+            return 0;
+        }
+
+        op->undo = _REC_KV;
+        database_dirty_mark_kv(rec_database, op->k);
+        if(op->type == BATCH_OP_FREE) {
+            KV_RECORD_SET_SIZE(_REC_KV, 0);
+            continue;
+        }
+
+        int bucket = database_calc_bucket(op->size);
+        char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+        if(op->type == BATCH_OP_ALLOC) {
+            KV_RECORD_SET_FLAGS(_REC_KV, op->flags);
+        }
+        KV_RECORD_SET_BUCKET(_REC_KV, bucket);
+        KV_RECORD_SET_INDEX(_REC_KV, op->index);
+        KV_RECORD_SET_SIZE(_REC_KV, op->size);
+        memcpy(PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, _REC_KV), batch->data + op->data, op->size);
+        database_dirty_mark(ctx_main, rec_database, ptbl_index, PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, _REC_KV), op->size);
+    }
+
+    // Step 3: every write went through, so the values they replaced can go
+    for(i = 0; i < batch->op_count; i++) {
+        Batch_op *op = &batch->op[i];
+        if(op->type == BATCH_OP_ALLOC || !KV_RECORD_GET_SIZE(op->undo)) {
+            continue;
+        }
+
+        int bucket = KV_RECORD_GET_BUCKET(op->undo);
+        char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+        if(op->type == BATCH_OP_FREE) {
+            // Same as database_kv_free()
+            memset(PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, op->undo), 0, PTBL_CALC_BUCKET_WORD_SIZE(bucket));
+            database_dirty_mark(ctx_main, rec_database, ptbl_index, PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, op->undo), PTBL_CALC_BUCKET_WORD_SIZE(bucket));
+            if(op->k == rec_database->kv_record_count - 1) rec_database->kv_record_count--;
+            else rec_database->kv_record_free_count++;
+        }
+        PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, KV_RECORD_GET_INDEX(op->undo));
+    }
+    if(rec_database->kv_record_count == 0) {
+        memory_free(rec_database->kv_record_tbl);
+        rec_database->kv_record_tbl = 0;
+    }
+
+    // The feed only hears of the batch once all of it is in place, freeing a free record aside
+    for(i = 0; rec_database->cdc && i < batch->op_count; i++) {
+        Batch_op *op = &batch->op[i];
+        if(op->type == BATCH_OP_FREE && !KV_RECORD_GET_SIZE(op->undo)) {
+            continue;
+        }
+        cdc_publish(rec_database->cdc,
+                (op->type == BATCH_OP_ALLOC) ? CDC_OP_ALLOC : (op->type == BATCH_OP_SET_VALUE) ? CDC_OP_SET_VALUE : CDC_OP_FREE,
+                op->k, (op->type == BATCH_OP_FREE) ? 0 : op->size);
+    }
+
+    return 1;
+}
+
+unsigned long
+database_batch_key(
+    Database_batch *batch,
+    int position
+) {
+    if(position < 0 || position >= batch->op_count || batch->op[position].type != BATCH_OP_ALLOC) {
+        return -1;
+    }
+
+    return batch->op[position].k;
+}
@@ -0,0 +1,95 @@
+/** @file  batch.h
+ *  @brief Write batches: several allocations, value changes and frees applied to a Record_database as one
+ */
+
+/** @brief Number of operations a batch has room for before it first grows */
+#define BATCH_INITIAL_CAPACITY 16
+
+/** @brief A list of writes that database_batch_commit() applies either all together, or not at all
+ *
+ * Values are copied into the batch as they're staged, so the caller's buffers may be reused straight
+ * away. Nothing touches the database until the commit, which goes in three steps:
+ *
+ * 1. Every slot the batch needs is allocated, one pass over page_usage per bucket, and every record
+ *    its allocations need is claimed. Failing here leaves the database as it was.
+ * 2. The writes are applied in order, and each one logs the record it replaced. If a write turns out
+ *    to be invalid (a key that doesn't exist, or that an earlier write in the batch freed), the log is
+ *    played back in reverse and the slots and records from step 1 are given back.
+ * 3. Only once every write has gone through are the old values freed.
+ *
+ * A batch may be committed to any number of databases, and cleared to be reused.
+ */
+typedef struct database_batch Database_batch;
+
+/** @brief   Creates an empty batch
+ *  @returns A pointer to the batch on success, or 0 on failure
+ *  @see     database_batch_free()
+ */
+Database_batch *
+database_batch_create(
+    Context_main *ctx_main ///<[in] main context
+    );
+
+/** @brief Frees \a batch */
+void
+database_batch_free(
+    Context_main *ctx_main, ///<[in] main context
+    Database_batch *batch   ///<[in] batch
+    );
+
+/** @brief Empties \a batch, keeping its memory for the next one */
+void
+database_batch_clear(
+    Database_batch *batch ///<[in] batch
+    );
+
+/** @brief   Stages a database_kv_alloc()
+ *  @returns The position of the allocation within the batch, to look its key up with database_batch_key()
+ *           after the commit, or -1 on failure
+ */
+int
+database_batch_kv_alloc(
+    Database_batch *batch, ///<[in] batch
+    unsigned char flags,   ///<[in] flags of the new record
+    unsigned long size,    ///<[in] size of the value in bytes
+    unsigned char *buffer  ///<[in] \a size bytes to initialize the value with
+    );
+
+/** @brief   Stages a database_kv_set_value()
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_batch_kv_set_value(
+    Database_batch *batch, ///<[in] batch
+    unsigned long k,       ///<[in] key of the record to change
+    unsigned long length,  ///<[in] length of \a buffer in bytes
+    unsigned char *buffer  ///<[in] new value
+    );
+
+/** @brief   Stages a database_kv_free()
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_batch_kv_free(
+    Database_batch *batch, ///<[in] batch
+    unsigned long k        ///<[in] key of the record to free
+    );
+
+/** @brief   Applies every write in \a batch to \a rec_database, or none of them
+ *  @returns 1 if every write was applied, 0 if none were
+ */
+int
+database_batch_commit(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    Database_batch *batch          ///<[in] batch
+    );
+
+/** @brief   Returns the key that the allocation at \a position got in the last commit of \a batch
+ *  @returns The key on success, or -1 if \a position isn't an allocation, or the commit failed
+ */
+unsigned long
+database_batch_key(
+    Database_batch *batch, ///<[in] batch
+    int position           ///<[in] value returned by database_batch_kv_alloc()
+    );
@@ -0,0 +1,83 @@
+#include <unistd.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "bench.h"
+
+static struct {
+    const char *name;
+    bench_fn fn;
+} benchmarks[] = {
+    { "btree", bench_btree },
+    { "concurrent", bench_concurrent },
+    { "shard", bench_shard },
+    { "batch", bench_batch },
+    { "persist", bench_persist },
+    { "wal", bench_wal },
+    { "io", bench_io },
+    { "paged", bench_paged },
+    { "shared", bench_shared },
+    { "cluster", bench_cluster },
+    { "replica", bench_replica },
+    { "cdc", bench_cdc },
+    { "async", bench_async },
+};
+
+#define BENCH_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+double
+bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+bench_report(
+    const char *name,
+    unsigned long ops,
+    double seconds
+) {
+    printf("%-40s %12lu ops %10.3f s %14.0f ops/s %10.1f ns/op\n",
+            name, ops, seconds, ops / seconds, (seconds * 1e9) / ops);
+}
+
+int main(int argc, char **argv) {
+    RECORD_CREATE(struct main_context, main_context);
+    if(!main_context) {
+        return 1;
+    }
+    main_context->system_page_size = sysconf(_SC_PAGE_SIZE);
+    main_context->system_phys_page_count = sysconf(_SC_PHYS_PAGES);
+    main_context->system_cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int ran = 0;
+    for(int i = 0; i < BENCH_COUNT; i++) {
+        if(argc < 2 || 0 == strcmp(argv[1], benchmarks[i].name)) {
+            printf("== %s\n", benchmarks[i].name);
+            if(!benchmarks[i].fn(main_context, (argc > 2) ? argc - 2 : 0, argv + 2)) {
+                fprintf(stderr, "FAIL: %s\n", benchmarks[i].name);
+                return 1;
+            }
+            ran++;
+        }
+    }
+
+    if(!ran) {
+        fprintf(stderr, "usage: %s [benchmark [args...]]\nbenchmarks:", argv[0]);
+        for(int i = 0; i < BENCH_COUNT; i++) {
+            fprintf(stderr, " %s", benchmarks[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    memory_free(main_context);
+    return 0;
+}
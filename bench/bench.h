@@ -0,0 +1,130 @@
+/** @file  bench.h
+ *  @brief Helpers shared by the benchmarks, and the list of benchmarks that out/bench can run
+ */
+
+/** @brief   Returns a monotonic timestamp
+ *  @returns Seconds since an arbitrary point in time
+ */
+double
+bench_now(void);
+
+/** @brief Prints one line of results: throughput and time per operation */
+void
+bench_report(
+    const char *name,    ///<[in] what was measured
+    unsigned long ops,   ///<[in] number of operations performed
+    double seconds       ///<[in] time taken
+    );
+
+/** @brief A benchmark
+ *  @returns 1 on success, 0 on failure
+ */
+typedef int (*bench_fn)(
+    Context_main *ctx_main, ///<[in] main context
+    int argc,               ///<[in] number of arguments after the benchmark's name
+    char **argv             ///<[in] arguments after the benchmark's name
+    );
+
+/** @brief Compares Index_btree against Index_hash and a linear search of kv_record_tbl */
+int
+bench_btree(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Throughput of Database_concurrent against the plain API behind one mutex, for 1 to 8 threads */
+int
+bench_concurrent(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Throughput of a Context_shard on a mostly partitioned workload, against Database_concurrent, for 1 to 8 shards */
+int
+bench_shard(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Database_batch commits against the same database_kv_set_value() calls made one at a time */
+int
+bench_batch(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Throughput of database_save() and database_load(), in GB/s of snapshot file, the time database_map() takes to open one, and what a database_bgsave() costs */
+int
+bench_persist(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Throughput of writes through a Database_wal with each wal_sync policy, for 1 to 8 threads */
+int
+bench_wal(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Writes of a whole region and of scattered pages of it, with pwrite() against every io_engine */
+int
+bench_io(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Reads through a Database_paged whose pool holds all of the working set, some of it, and little of it, against a database in memory */
+int
+bench_paged(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Random reads from several processes of one Database_shared segment, against every process building its own copy */
+int
+bench_shared(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Batched requests through a Cluster_router to 1, 2 and 4 server processes, and while a partition is being added */
+int
+bench_cluster(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Random reads from 1, 2 and 4 replica processes that follow a primary's log while it's written to */
+int
+bench_replica(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief set_value with no change feed, a feed nobody reads, and 1, 2 and 4 consumers following it, against rescanning for changes */
+int
+bench_cdc(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
+
+/** @brief Random gets and set_values from one thread, synchronous against 1 to 4096 in flight through a Database_async */
+int
+bench_async(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+    );
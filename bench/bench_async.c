@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "async.h"
+#include "bench.h"
+
+#define BENCH_ASYNC_VALUE_LENGTH 64
+
+// Keeps depth random reads, or writes, in flight until ops of them have completed
+static int
+_bench_async_round(
+    Database_async *async,
+    unsigned long *keys,
+    unsigned long key_count,
+    unsigned long ops,
+    unsigned long depth,
+    unsigned char op
+) {
+    unsigned char value[BENCH_ASYNC_VALUE_LENGTH], *read = malloc(depth * BENCH_ASYNC_VALUE_LENGTH);
+    Async_cqe *cqe = malloc(depth * sizeof(Async_cqe));
+    unsigned long seed = 1, submitted = 0, completed = 0, sum = 0;
+    if(!read || !cqe) {
+        return 0;
+    }
+    memset(value, 0xCD, sizeof(value));
+
+    while(completed < ops) {
+        Async_sqe *sqe;
+        while(submitted < ops && submitted - completed < depth && (sqe = database_async_sqe(async))) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            sqe->op = op;
+            sqe->k = keys[(seed >> 33) % key_count];
+            sqe->length = BENCH_ASYNC_VALUE_LENGTH;
+            sqe->buffer = (op == ASYNC_OP_GET) ? read + (submitted % depth) * BENCH_ASYNC_VALUE_LENGTH : value;
+            submitted++;
+        }
+        database_async_submit(async);
+        unsigned long got = database_async_complete(async, cqe, depth, 1);
+        for(unsigned long i = 0; i < got; i++) {
+            if(!cqe[i].result) {
+                return 0;
+            }
+            sum += cqe[i].length;
+        }
+        completed += got;
+    }
+
+    free(read);
+    free(cqe);
+    return (op != ASYNC_OP_GET) || sum > 0;
+}
+
+int
+bench_async(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long key_count = (argc > 0) ? strtoul(argv[0], 0, 10) : 1000000,
+                  ops = (argc > 1) ? strtoul(argv[1], 0, 10) : 2000000;
+    unsigned char value[BENCH_ASYNC_VALUE_LENGTH], read[BENCH_ASYNC_VALUE_LENGTH];
+    char label[64];
+
+    RECORD_CREATE(Record_database, rec_database);
+    unsigned long *keys = malloc(key_count * sizeof(unsigned long));
+    if(!rec_database || !keys) {
+        return 0;
+    }
+    memset(value, 0xAB, sizeof(value));
+    for(unsigned long i = 0; i < key_count; i++) {
+        keys[i] = database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        if(keys[i] == -1) {
+            return 0;
+        }
+    }
+    printf("%lu keys, %d-byte values, random reads from one thread\n", key_count, BENCH_ASYNC_VALUE_LENGTH);
+
+    unsigned long seed = 1, sum = 0;
+    double start = bench_now();
+    for(unsigned long i = 0; i < ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned long k = keys[(seed >> 33) % key_count];
+        unsigned char *region = database_kv_get_value(ctx_main, rec_database, 0, k);
+        memcpy(read, region, KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]));
+        sum += read[0];
+    }
+    bench_report("get, synchronous", ops, bench_now() - start);
+    if(!sum) {
+        return 0;
+    }
+
+    unsigned long depths[] = { 1, 16, 256, 4096 };
+    for(int d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        Database_async *async = database_async_create(ctx_main, rec_database, depths[d]);
+        start = bench_now();
+        if(!async || !_bench_async_round(async, keys, key_count, ops, depths[d], ASYNC_OP_GET)) {
+            return 0;
+        }
+        snprintf(label, sizeof(label), "get, %lu in flight", depths[d]);
+        bench_report(label, ops, bench_now() - start);
+        database_async_free(async);
+    }
+
+    // Writes are much slower, so fewer of them
+    ops /= 10;
+    seed = 1;
+    start = bench_now();
+    for(unsigned long i = 0; i < ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        database_kv_set_value(ctx_main, rec_database, keys[(seed >> 33) % key_count], sizeof(value), value);
+    }
+    bench_report("set_value, synchronous", ops, bench_now() - start);
+    for(int d = 0; d < sizeof(depths) / sizeof(depths[0]); d += 3) {
+        Database_async *async = database_async_create(ctx_main, rec_database, depths[d]);
+        start = bench_now();
+        if(!async || !_bench_async_round(async, keys, key_count, ops, depths[d], ASYNC_OP_SET_VALUE)) {
+            return 0;
+        }
+        snprintf(label, sizeof(label), "set_value, %lu in flight", depths[d]);
+        bench_report(label, ops, bench_now() - start);
+        database_async_free(async);
+    }
+
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    free(keys);
+
+    return 1;
+}
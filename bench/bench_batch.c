@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "batch.h"
+#include "bench.h"
+
+#define BENCH_BATCH_VALUE_LENGTH 64
+
+int
+bench_batch(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long key_count = (argc > 0) ? strtoul(argv[0], 0, 10) : 100000,
+                  ops = (argc > 1) ? strtoul(argv[1], 0, 10) : 200000;
+    unsigned char value[BENCH_BATCH_VALUE_LENGTH];
+    char label[64];
+
+    RECORD_CREATE(Record_database, rec_database);
+    unsigned long *keys = malloc(key_count * sizeof(unsigned long));
+    Database_batch *batch = database_batch_create(ctx_main);
+    if(!rec_database || !keys || !batch) {
+        return 0;
+    }
+
+    memset(value, 0xAB, sizeof(value));
+    for(unsigned long i = 0; i < key_count; i++) {
+        keys[i] = database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        if(keys[i] == -1) {
+            return 0;
+        }
+    }
+
+    printf("%lu keys, %d-byte values\n", key_count, BENCH_BATCH_VALUE_LENGTH);
+    for(unsigned long batch_size = 4; batch_size <= 256; batch_size *= 4) {
+        unsigned long seed = 1, rounds = ops / batch_size;
+
+        double start = bench_now();
+        for(unsigned long r = 0; r < rounds; r++) {
+            for(unsigned long j = 0; j < batch_size; j++) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                database_kv_set_value(ctx_main, rec_database, keys[(seed >> 33) % key_count], sizeof(value), value);
+            }
+        }
+        snprintf(label, sizeof(label), "set_value, %lu at a time", batch_size);
+        bench_report(label, rounds * batch_size, bench_now() - start);
+
+        seed = 1;
+        start = bench_now();
+        for(unsigned long r = 0; r < rounds; r++) {
+            database_batch_clear(batch);
+            for(unsigned long j = 0; j < batch_size; j++) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                database_batch_kv_set_value(batch, keys[(seed >> 33) % key_count], sizeof(value), value);
+            }
+            if(!database_batch_commit(ctx_main, rec_database, batch)) {
+                return 0;
+            }
+        }
+        snprintf(label, sizeof(label), "batch of %lu", batch_size);
+        bench_report(label, rounds * batch_size, bench_now() - start);
+    }
+
+    database_batch_free(ctx_main, batch);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    free(keys);
+
+    return 1;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "hash.h"
+#include "btree.h"
+#include "bench.h"
+
+// Lookups by linear search are O(n) each, so only a few of them are timed
+#define BENCH_LINEAR_LOOKUPS 200
+
+#define BENCH_KEY_LENGTH 16
+
+static int
+bench_btree_count(
+    unsigned char *key,
+    unsigned long key_length,
+    unsigned long value_k,
+    void *arg
+) {
+    ((unsigned long *)arg)[0] += value_k;
+    return 1;
+}
+
+// What callers have to do today: walk kv_record_tbl comparing stored key bytes
+static unsigned long
+bench_linear_get(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        if(KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]) == key_length &&
+                0 == memcmp(database_kv_get_value(ctx_main, rec_database, 0, k), key, key_length)) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+int
+bench_btree(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long count = (argc > 0) ? strtoul(argv[0], 0, 10) : 200000, checksum = 0;
+    unsigned char (*keys)[BENCH_KEY_LENGTH] = malloc(count * BENCH_KEY_LENGTH);
+    unsigned char **sorted = malloc(count * sizeof(unsigned char *));
+    unsigned long *lengths = malloc(count * sizeof(unsigned long));
+    unsigned long *values = malloc(count * sizeof(unsigned long));
+    unsigned long *order = malloc(count * sizeof(unsigned long));
+    double start;
+
+    for(unsigned long i = 0; i < count; i++) {
+        lengths[i] = snprintf((char *)keys[i], BENCH_KEY_LENGTH, "key:%010lu", i);
+        sorted[i] = keys[i];
+        values[i] = i;
+        order[i] = i;
+    }
+
+    // Random insertion and lookup order
+    srand(1);
+    for(unsigned long i = count - 1; i > 0; i--) {
+        unsigned long j = rand() % (i + 1), t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    RECORD_CREATE(Record_database, rec_btree);
+    RECORD_CREATE(Record_database, rec_bulk);
+    RECORD_CREATE(Record_database, rec_hash);
+    Index_btree *btree = btree_index_create(ctx_main, rec_btree);
+    Index_btree *bulk = btree_index_create(ctx_main, rec_bulk);
+    Index_hash *hash = hash_index_create(ctx_main, rec_hash);
+
+    start = bench_now();
+    for(unsigned long i = 0; i < count; i++) {
+        if(!btree_index_put(ctx_main, btree, keys[order[i]], lengths[order[i]], order[i])) return 0;
+    }
+    bench_report("btree put (random order)", count, bench_now() - start);
+
+    start = bench_now();
+    if(!btree_index_bulk_load(ctx_main, bulk, sorted, lengths, values, count)) return 0;
+    bench_report("btree bulk load", count, bench_now() - start);
+
+    start = bench_now();
+    for(unsigned long i = 0; i < count; i++) {
+        if(!hash_index_put(ctx_main, hash, keys[order[i]], lengths[order[i]], order[i])) return 0;
+    }
+    bench_report("hash put (random order)", count, bench_now() - start);
+
+    start = bench_now();
+    for(unsigned long i = 0; i < count; i++) {
+        checksum += btree_index_get(ctx_main, btree, keys[order[i]], lengths[order[i]]);
+    }
+    bench_report("btree get", count, bench_now() - start);
+
+    start = bench_now();
+    for(unsigned long i = 0; i < count; i++) {
+        checksum += hash_index_get(ctx_main, hash, keys[order[i]], lengths[order[i]]);
+    }
+    bench_report("hash get", count, bench_now() - start);
+
+    unsigned long lookups = (count < BENCH_LINEAR_LOOKUPS) ? count : BENCH_LINEAR_LOOKUPS;
+    start = bench_now();
+    for(unsigned long i = 0; i < lookups; i++) {
+        // Keys were stored in the order given by order[], so look them up in a different one
+        unsigned long n = (i * 7919) % count;
+        checksum += bench_linear_get(ctx_main, rec_hash, keys[n], lengths[n]);
+    }
+    bench_report("linear kv_record_tbl search", lookups, bench_now() - start);
+
+    // Ordered access: 1000-key ranges from the tree, versus filtering every key and sorting
+    unsigned long ranges = 1000, visited = 0;
+    start = bench_now();
+    for(unsigned long i = 0; i < ranges; i++) {
+        unsigned long low = order[i] % (count > 1000 ? count - 1000 : 1);
+        visited += btree_index_range(ctx_main, btree, keys[low], lengths[low], (low + 1000 < count) ? keys[low + 1000] : 0, BENCH_KEY_LENGTH - 1, bench_btree_count, &checksum);
+    }
+    bench_report("btree range scan (keys visited)", visited, bench_now() - start);
+
+    visited = 0;
+    start = bench_now();
+    for(unsigned long i = 0; i < 10; i++) {
+        unsigned long low = order[i] % (count > 1000 ? count - 1000 : 1);
+        for(unsigned long k = 0; k < count; k++) {
+            if(memcmp(keys[k], keys[low], BENCH_KEY_LENGTH - 1) >= 0 &&
+                    (low + 1000 >= count || memcmp(keys[k], keys[low + 1000], BENCH_KEY_LENGTH - 1) < 0)) {
+                checksum += values[k];
+                visited++;
+            }
+        }
+    }
+    bench_report("linear range filter (keys visited)", visited, bench_now() - start);
+
+    printf("btree: %lu nodes, height %d (checksum %lu)\n", btree->node_count, btree->height, checksum);
+
+    btree_index_free(ctx_main, btree);
+    btree_index_free(ctx_main, bulk);
+    hash_index_free(ctx_main, hash);
+    database_ptbl_free(ctx_main, rec_btree);
+    database_ptbl_free(ctx_main, rec_bulk);
+    database_ptbl_free(ctx_main, rec_hash);
+    memory_free(rec_btree);
+    memory_free(rec_bulk);
+    memory_free(rec_hash);
+    free(keys);
+    free(sorted);
+    free(lengths);
+    free(values);
+    free(order);
+
+    return 1;
+}
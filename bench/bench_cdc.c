@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "cdc.h"
+#include "bench.h"
+
+#define BENCH_CDC_VALUE_LENGTH 64
+#define BENCH_CDC_CAPACITY 65536
+
+typedef struct bench_cdc_consumer {
+    Cdc_feed *feed;
+    atomic_int *done;
+    unsigned long events;
+    unsigned long resyncs;
+} Bench_cdc_consumer;
+
+static void *
+_bench_cdc_consume(
+    void *arg
+) {
+    Bench_cdc_consumer *consumer = (Bench_cdc_consumer *)arg;
+    Cdc_cursor cursor;
+    Cdc_event event;
+    cdc_cursor_init(consumer->feed, &cursor);
+
+    for(int finished = 0, got = CDC_EVENT; !finished || got != CDC_NONE; ) {
+        finished = atomic_load(consumer->done);
+        got = cdc_next(consumer->feed, &cursor, &event);
+        if(got == CDC_EVENT) consumer->events++;
+        else if(got == CDC_RESYNC) consumer->resyncs++;
+        else sched_yield();
+    }
+
+    return 0;
+}
+
+static double
+_bench_cdc_writes(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned long *keys,
+    unsigned long key_count,
+    unsigned long ops
+) {
+    unsigned char value[BENCH_CDC_VALUE_LENGTH];
+    unsigned long seed = 1;
+    memset(value, 0xAB, sizeof(value));
+
+    double start = bench_now();
+    for(unsigned long i = 0; i < ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        database_kv_set_value(ctx_main, rec_database, keys[(seed >> 33) % key_count], sizeof(value), value);
+    }
+    return bench_now() - start;
+}
+
+int
+bench_cdc(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long key_count = (argc > 0) ? strtoul(argv[0], 0, 10) : 100000,
+                  ops = (argc > 1) ? strtoul(argv[1], 0, 10) : 1000000;
+    unsigned char value[BENCH_CDC_VALUE_LENGTH];
+    char label[64];
+
+    RECORD_CREATE(Record_database, rec_database);
+    unsigned long *keys = malloc(key_count * sizeof(unsigned long));
+    if(!rec_database || !keys) {
+        return 0;
+    }
+    memset(value, 0xAB, sizeof(value));
+    for(unsigned long i = 0; i < key_count; i++) {
+        keys[i] = database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        if(keys[i] == -1) {
+            return 0;
+        }
+    }
+    printf("%lu keys, %d-byte values, a feed of %d events\n", key_count, BENCH_CDC_VALUE_LENGTH, BENCH_CDC_CAPACITY);
+
+    bench_report("set_value, no feed", ops, _bench_cdc_writes(ctx_main, rec_database, keys, key_count, ops));
+
+    Cdc_feed *feed = cdc_feed_create(ctx_main, rec_database, BENCH_CDC_CAPACITY);
+    if(!feed) {
+        return 0;
+    }
+    bench_report("set_value, feed without consumers", ops, _bench_cdc_writes(ctx_main, rec_database, keys, key_count, ops));
+
+    for(int consumers = 1; consumers <= 4; consumers *= 2) {
+        Bench_cdc_consumer consumer[4];
+        pthread_t threads[4];
+        atomic_int done;
+        atomic_init(&done, 0);
+        for(int c = 0; c < consumers; c++) {
+            consumer[c] = (Bench_cdc_consumer){ feed, &done, 0, 0 };
+            pthread_create(&threads[c], 0, _bench_cdc_consume, &consumer[c]);
+        }
+        double seconds = _bench_cdc_writes(ctx_main, rec_database, keys, key_count, ops);
+        atomic_store(&done, 1);
+        unsigned long events = 0, resyncs = 0;
+        for(int c = 0; c < consumers; c++) {
+            pthread_join(threads[c], 0);
+            events += consumer[c].events;
+            resyncs += consumer[c].resyncs;
+        }
+        snprintf(label, sizeof(label), "set_value, %d consumer%s", consumers, (consumers > 1) ? "s" : "");
+        bench_report(label, ops, seconds);
+        printf("  consumers read %.1f%% of the events, %lu resyncs\n", 100.0 * events / ((double)ops * consumers), resyncs);
+    }
+
+    // What a consumer without a feed does instead: compare every record against a copy from last time
+    unsigned long length = rec_database->kv_record_count * sizeof(Record_kv), changed = 0;
+    Record_kv *copy = malloc(length);
+    if(!copy) {
+        return 0;
+    }
+    memcpy(copy, rec_database->kv_record_tbl, length);
+    _bench_cdc_writes(ctx_main, rec_database, keys, key_count, key_count / 100);
+    double start = bench_now();
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        if(memcmp(&copy[k], &rec_database->kv_record_tbl[k], sizeof(Record_kv)) != 0) changed++;
+    }
+    memcpy(copy, rec_database->kv_record_tbl, length);
+    bench_report("rescan for changes, records compared", rec_database->kv_record_count, bench_now() - start);
+    printf("  to find %lu changed records\n", changed);
+
+    free(copy);
+    cdc_feed_free(ctx_main, rec_database);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    free(keys);
+
+    return 1;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "server.h"
+#include "cluster.h"
+#include "bench.h"
+
+#define BENCH_CLUSTER_VALUE 100
+#define BENCH_CLUSTER_BATCH 256
+#define BENCH_CLUSTER_KEY 16
+
+// Batches of BENCH_CLUSTER_BATCH ops on random keys, 90% lookups, until ops have been run or, if
+// until_balanced is set, the router is done moving keys
+static int
+_bench_cluster_run(
+    Cluster_router *router,
+    char *keys,
+    unsigned long count,
+    unsigned long ops,
+    int until_balanced,
+    unsigned long *done
+) {
+    static Cluster_op batch[BENCH_CLUSTER_BATCH];
+    static unsigned char values[BENCH_CLUSTER_BATCH][BENCH_CLUSTER_VALUE];
+    unsigned long random = 1;
+
+    for(*done = 0; until_balanced ? cluster_router_rebalancing(router) : (*done < ops); *done += BENCH_CLUSTER_BATCH) {
+        for(int i = 0; i < BENCH_CLUSTER_BATCH; i++) {
+            random = random * 6364136223846793005UL + 1442695040888963407UL;
+            char *key = keys + ((random >> 33) % count) * BENCH_CLUSTER_KEY;
+            batch[i] = (Cluster_op){
+                .op = ((random >> 20) % 10) ? SERVER_OP_LOOKUP : SERVER_OP_PUT,
+                .key = (unsigned char *)key, .key_length = strlen(key),
+                .value = values[i], .value_length = BENCH_CLUSTER_VALUE
+            };
+        }
+        if(!cluster_router_execute(router, batch, BENCH_CLUSTER_BATCH)) {
+            return 0;
+        }
+        for(int i = 0; i < BENCH_CLUSTER_BATCH; i++) {
+            if(batch[i].status != SERVER_STATUS_OK) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int
+_bench_cluster_load(
+    Cluster_router *router,
+    char *keys,
+    unsigned long count
+) {
+    static Cluster_op batch[BENCH_CLUSTER_BATCH];
+    unsigned char value[BENCH_CLUSTER_VALUE];
+    memset(value, 1, sizeof(value));
+
+    for(unsigned long i = 0; i < count; i += BENCH_CLUSTER_BATCH) {
+        unsigned long n = (count - i < BENCH_CLUSTER_BATCH) ? count - i : BENCH_CLUSTER_BATCH;
+        for(unsigned long j = 0; j < n; j++) {
+            char *key = keys + (i + j) * BENCH_CLUSTER_KEY;
+            batch[j] = (Cluster_op){
+                .op = SERVER_OP_PUT, .key = (unsigned char *)key, .key_length = strlen(key),
+                .value = value, .value_length = sizeof(value)
+            };
+        }
+        if(!cluster_router_execute(router, batch, n)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+bench_cluster(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long count = (argc > 0) ? strtoul(argv[0], 0, 10) : 100000,
+                  ops = (argc > 1) ? strtoul(argv[1], 0, 10) : 1000000,
+                  done;
+    char prefix[64], name[96];
+    snprintf(prefix, sizeof(prefix), "/tmp/b-key-bench-%d", (int)getpid());
+
+    char *keys = (char *)memory_alloc(count * BENCH_CLUSTER_KEY);
+    if(!keys) {
+        return 0;
+    }
+    for(unsigned long i = 0; i < count; i++) {
+        snprintf(keys + i * BENCH_CLUSTER_KEY, BENCH_CLUSTER_KEY, "key-%lu", i);
+    }
+    printf("%lu keys of %d bytes, batches of %d ops, 90%% lookups, on %ld cores\n",
+            count, BENCH_CLUSTER_VALUE, BENCH_CLUSTER_BATCH, ctx_main->system_cpu_count);
+
+    // The same load over more and more partitions
+    int partitions[] = { 1, 2, 4 };
+    for(int p = 0; p < sizeof(partitions) / sizeof(partitions[0]); p++) {
+        Context_cluster *cluster = cluster_create(ctx_main, prefix, partitions[p]);
+        const char *paths[CLUSTER_MAX];
+        for(int i = 0; cluster && i < partitions[p]; i++) paths[i] = cluster_path(cluster, i);
+        Cluster_router *router = cluster ? cluster_router_create(ctx_main, paths, partitions[p]) : 0;
+        if(!router) {
+            return 0;
+        }
+
+        double start = bench_now();
+        if(!_bench_cluster_load(router, keys, count)) {
+            return 0;
+        }
+        snprintf(name, sizeof(name), "load, %d partition%s", partitions[p], (partitions[p] > 1) ? "s" : "");
+        bench_report(name, count, bench_now() - start);
+
+        start = bench_now();
+        if(!_bench_cluster_run(router, keys, count, ops, 0, &done)) {
+            return 0;
+        }
+        snprintf(name, sizeof(name), "run, %d partition%s", partitions[p], (partitions[p] > 1) ? "s" : "");
+        bench_report(name, done, bench_now() - start);
+
+        cluster_router_free(router);
+        cluster_free(cluster);
+    }
+
+    // Scaling out from 2 partitions to 3, with the load running while keys move
+    const char *paths[CLUSTER_MAX];
+    Context_cluster *cluster = cluster_create(ctx_main, prefix, 2);
+    for(int i = 0; cluster && i < 2; i++) paths[i] = cluster_path(cluster, i);
+    Cluster_router *router = cluster ? cluster_router_create(ctx_main, paths, 2) : 0;
+    if(!router || !_bench_cluster_load(router, keys, count) || cluster_add(cluster) != 2
+            || !cluster_router_add(router, cluster_path(cluster, 2))) {
+        return 0;
+    }
+    double start = bench_now();
+    if(!_bench_cluster_run(router, keys, count, 0, 1, &done)) {
+        return 0;
+    }
+    double seconds = bench_now() - start;
+    bench_report("run while adding a 3rd partition", done, seconds);
+    printf("keys moved over in %.3f s, one step per batch\n", seconds);
+
+    start = bench_now();
+    if(!_bench_cluster_run(router, keys, count, ops, 0, &done)) {
+        return 0;
+    }
+    bench_report("run, 3 partitions after adding one", done, bench_now() - start);
+
+    cluster_router_free(router);
+    cluster_free(cluster);
+    memory_free(keys);
+
+    return 1;
+}
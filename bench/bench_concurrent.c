@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "concurrent.h"
+#include "bench.h"
+
+#define BENCH_CONCURRENT_VALUE_LENGTH 64
+
+typedef struct bench_concurrent_worker {
+    Context_main *ctx_main;
+    Database_concurrent *dbc;        // Fine-grained locking, or
+    Record_database *rec_database;   // the plain API behind one mutex
+    pthread_mutex_t *global_lock;
+    unsigned long *keys;
+    unsigned long key_count;
+    unsigned long ops;
+    int write_percent;
+    int index;
+    unsigned long checksum;
+} Bench_concurrent_worker;
+
+static void *
+bench_concurrent_run(
+    void *arg
+) {
+    Bench_concurrent_worker *w = (Bench_concurrent_worker *)arg;
+    unsigned char value[BENCH_CONCURRENT_VALUE_LENGTH];
+    unsigned long seed = w->index * 7919 + 1, size;
+
+    for(unsigned long i = 0; i < w->ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned long k = w->keys[(seed >> 33) % w->key_count];
+        int write = ((seed >> 20) % 100) < w->write_percent;
+
+        if(w->dbc) {
+            if(write) {
+                memset(value, i, sizeof(value));
+                database_concurrent_kv_set_value(w->ctx_main, w->dbc, k, sizeof(value), value);
+            }
+            else {
+                database_concurrent_kv_get(w->ctx_main, w->dbc, k, value, sizeof(value), &size, 0);
+            }
+        }
+        else {
+            pthread_mutex_lock(w->global_lock);
+            if(write) {
+                memset(value, i, sizeof(value));
+                database_kv_set_value(w->ctx_main, w->rec_database, k, sizeof(value), value);
+            }
+            else {
+                memcpy(value, database_kv_get_value(w->ctx_main, w->rec_database, 0, k), sizeof(value));
+            }
+            pthread_mutex_unlock(w->global_lock);
+        }
+        w->checksum += value[0];
+    }
+
+    return 0;
+}
+
+// Allocates a batch of small values and frees them again, the pattern magazines are for
+static void *
+bench_concurrent_churn(
+    void *arg
+) {
+    Bench_concurrent_worker *w = (Bench_concurrent_worker *)arg;
+    unsigned char value[BENCH_CONCURRENT_VALUE_LENGTH];
+    unsigned long batch[64];
+
+    memset(value, w->index, sizeof(value));
+    for(unsigned long i = 0; i < w->ops; i += 64) {
+        for(int j = 0; j < 64; j++) {
+            if(w->dbc) {
+                batch[j] = database_concurrent_kv_alloc(w->ctx_main, w->dbc, KV_RECORD_TYPE_RAW, 16 + j, value);
+            }
+            else {
+                pthread_mutex_lock(w->global_lock);
+                batch[j] = database_kv_alloc(w->ctx_main, w->rec_database, KV_RECORD_TYPE_RAW, 16 + j, value);
+                pthread_mutex_unlock(w->global_lock);
+            }
+        }
+        for(int j = 0; j < 64; j++) {
+            if(w->dbc) {
+                database_concurrent_kv_free(w->ctx_main, w->dbc, batch[j]);
+            }
+            else {
+                pthread_mutex_lock(w->global_lock);
+                database_kv_free(w->ctx_main, w->rec_database, batch[j]);
+                pthread_mutex_unlock(w->global_lock);
+            }
+        }
+        w->checksum += batch[0];
+    }
+
+    return 0;
+}
+
+static int
+bench_concurrent_round(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    Record_database *rec_database,
+    unsigned long *keys,
+    unsigned long key_count,
+    unsigned long ops,
+    int write_percent,
+    int thread_count,
+    void *(*run)(void *),
+    const char *name
+) {
+    pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t threads[thread_count];
+    Bench_concurrent_worker workers[thread_count];
+    char label[64];
+
+    double start = bench_now();
+    for(int i = 0; i < thread_count; i++) {
+        workers[i] = (Bench_concurrent_worker){ ctx_main, dbc, rec_database, &global_lock, keys, key_count, ops / thread_count, write_percent, i, 0 };
+        if(pthread_create(&threads[i], 0, run, &workers[i])) {
+            return 0;
+        }
+    }
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], 0);
+    }
+
+    snprintf(label, sizeof(label), "%s, %d thread%s", name, thread_count, (thread_count > 1) ? "s" : "");
+    bench_report(label, (ops / thread_count) * thread_count, bench_now() - start);
+
+    return 1;
+}
+
+int
+bench_concurrent(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long key_count = (argc > 0) ? strtoul(argv[0], 0, 10) : 100000,
+                  ops = (argc > 1) ? strtoul(argv[1], 0, 10) : 2000000;
+    int write_percent = (argc > 2) ? atoi(argv[2]) : 10;
+    unsigned char value[BENCH_CONCURRENT_VALUE_LENGTH];
+
+    unsigned long *keys = malloc(key_count * sizeof(unsigned long));
+    unsigned long *plain_keys = malloc(key_count * sizeof(unsigned long));
+    Database_concurrent *dbc = database_concurrent_create(ctx_main);
+    RECORD_CREATE(Record_database, rec_database);
+    if(!keys || !plain_keys || !dbc || !rec_database) {
+        return 0;
+    }
+
+    memset(value, 0xAB, sizeof(value));
+    for(unsigned long i = 0; i < key_count; i++) {
+        keys[i] = database_concurrent_kv_alloc(ctx_main, dbc, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        plain_keys[i] = database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        if(keys[i] == -1 || plain_keys[i] == -1) {
+            return 0;
+        }
+    }
+
+    printf("%lu keys, %d%% writes, %lu cores\n", key_count, write_percent, ctx_main->system_cpu_count);
+    for(int threads = 1; threads <= 8; threads *= 2) {
+        if(!bench_concurrent_round(ctx_main, 0, rec_database, plain_keys, key_count, ops, write_percent, threads, bench_concurrent_run, "global mutex") ||
+                !bench_concurrent_round(ctx_main, dbc, 0, keys, key_count, ops, write_percent, threads, bench_concurrent_run, "fine-grained locks")) {
+            return 0;
+        }
+    }
+
+    // Read-mostly: readers take no locks, so only the writers should ever get in each other's way
+    for(int mostly_read_percent = 0; mostly_read_percent <= 1; mostly_read_percent++) {
+        printf("read-mostly, %d%% writes\n", mostly_read_percent);
+        for(int threads = 1; threads <= 8; threads *= 2) {
+            if(!bench_concurrent_round(ctx_main, 0, rec_database, plain_keys, key_count, ops, mostly_read_percent, threads, bench_concurrent_run, "global mutex") ||
+                    !bench_concurrent_round(ctx_main, dbc, 0, keys, key_count, ops, mostly_read_percent, threads, bench_concurrent_run, "seqlock reads")) {
+                return 0;
+            }
+        }
+    }
+
+    printf("alloc/free churn, 64 values per batch\n");
+    for(int threads = 1; threads <= 8; threads *= 2) {
+        if(!bench_concurrent_round(ctx_main, 0, rec_database, plain_keys, key_count, ops, 0, threads, bench_concurrent_churn, "global mutex") ||
+                !bench_concurrent_round(ctx_main, dbc, 0, keys, key_count, ops, 0, threads, bench_concurrent_churn, "magazines")) {
+            return 0;
+        }
+    }
+
+    database_concurrent_free(ctx_main, dbc);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    free(keys);
+    free(plain_keys);
+
+    return 1;
+}
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "io.h"
+#include "bench.h"
+
+#define BENCH_IO_PAGES 16384
+
+// How each round gets the writes to the file: a pwrite() at a time, or through a Context_io
+typedef struct bench_io_engine {
+    const char *name;
+    int engine;     // -1 for plain pwrite()
+    int registered;
+} Bench_io_engine;
+
+static int
+_bench_io_round(
+    Context_main *ctx_main,
+    Bench_io_engine *engine,
+    const char *path,
+    unsigned char *region,
+    unsigned long length,
+    unsigned long *page,
+    int pages,
+    double *seconds
+) {
+    Context_io *io = 0;
+    if(engine->engine != -1) {
+        io = io_create(ctx_main, engine->engine, IO_DEPTH);
+        if(!io) {
+            return 0;
+        }
+        if(engine->registered && !io_register(io, &region, &length, 1)) {
+            io_free(io);
+            return 0;
+        }
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, length) != 0) {
+        return 0;
+    }
+
+    int ok = 1;
+    double start = bench_now();
+    for(int i = 0; ok && i < pages; i++) {
+        // A whole region, or scattered pages of it, like an incremental checkpoint
+        unsigned long offset = page ? page[i] * ctx_main->system_page_size : 0,
+                      size = page ? ctx_main->system_page_size : length;
+        if(io) {
+            ok = io_write(io, fd, region + offset, size, offset, engine->registered ? 0 : -1);
+        }
+        else {
+            for(unsigned long done = 0; ok && done < size; ) {
+                ssize_t written = pwrite(fd, region + offset + done, size - done, offset + done);
+                ok = (written > 0);
+                done += written;
+            }
+        }
+    }
+    if(io) {
+        ok = ok && io_fsync(io, fd, 0);
+        ok = io_wait(io) && ok;
+        io_free(io);
+    }
+    else {
+        ok = ok && (fsync(fd) == 0);
+    }
+    *seconds = bench_now() - start;
+    close(fd);
+
+    return ok;
+}
+
+int
+bench_io(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long megabytes = (argc > 0) ? strtoul(argv[0], 0, 10) : 256;
+    const char *path = (argc > 1) ? argv[1] : "/tmp/b-key-bench.io";
+    unsigned long length = megabytes << 20,
+                  region_pages = length / ctx_main->system_page_size;
+
+    unsigned char *region = memory_page_alloc(ctx_main, region_pages);
+    unsigned long *page = (unsigned long *)memory_alloc(BENCH_IO_PAGES * sizeof(unsigned long));
+    if(!region || !page) {
+        return 0;
+    }
+    memset(region, 0xAB, length);
+    unsigned long seed = 1;
+    for(int i = 0; i < BENCH_IO_PAGES; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        page[i] = (seed >> 33) % region_pages;
+    }
+
+    Bench_io_engine engines[] = {
+        { "pwrite()", -1, 0 },
+        { "IO_ENGINE_THREADS", IO_ENGINE_THREADS, 0 },
+        { "IO_ENGINE_URING", IO_ENGINE_URING, 0 },
+        { "IO_ENGINE_URING, registered", IO_ENGINE_URING, 1 },
+    };
+    printf("%lu MB region, %d scattered pages, %s\n", megabytes, BENCH_IO_PAGES, path);
+    for(int e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        double seconds;
+        if(!_bench_io_round(ctx_main, &engines[e], path, region, length, 0, 1, &seconds)) {
+            printf("%-40s unavailable\n", engines[e].name);
+            continue;
+        }
+        printf("%-40s %8.2f GB/s  whole region, fsync included\n", engines[e].name, length / seconds / 1e9);
+        if(!_bench_io_round(ctx_main, &engines[e], path, region, length, page, BENCH_IO_PAGES, &seconds)) {
+            return 0;
+        }
+        bench_report(engines[e].name, BENCH_IO_PAGES, seconds);
+    }
+
+    unlink(path);
+    memory_page_free(ctx_main, region, region_pages);
+    memory_free(page);
+
+    return 1;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "paged.h"
+#include "bench.h"
+
+#define BENCH_PAGED_VALUE 1000
+#define BENCH_PAGED_READS 2000000
+
+static unsigned long
+_bench_paged_next(
+    unsigned long *seed
+) {
+    seed[0] = seed[0] * 6364136223846793005UL + 1442695040888963407UL;
+    return seed[0] >> 33;
+}
+
+// Reads BENCH_PAGED_READS values: hot_share percent of them from the first hot keys, the rest from
+// all of them
+static int
+_bench_paged_round(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    const char *name,
+    unsigned long *keys,
+    unsigned long count,
+    unsigned long hot,
+    int hot_share
+) {
+    Paged_stats before, after;
+    unsigned long seed = 7, sum = 0, pin;
+
+    database_paged_stats(dbp, &before);
+    double start = bench_now();
+    for(int i = 0; i < BENCH_PAGED_READS; i++) {
+        unsigned long r = _bench_paged_next(&seed);
+        unsigned long k = keys[((r % 100) < hot_share) ? (r >> 8) % hot : (r >> 8) % count];
+        unsigned char *value = database_paged_kv_get_value(ctx_main, dbp, &pin, k);
+        if(!value) {
+            return 0;
+        }
+        sum += value[0];
+        database_paged_unpin(dbp, pin);
+    }
+    double seconds = bench_now() - start;
+    database_paged_stats(dbp, &after);
+
+    bench_report(name, BENCH_PAGED_READS, seconds);
+    printf("%-40s %11.1f%% hits %9lu evictions %9lu MB resident\n", "",
+            100.0 * (after.hits - before.hits) / BENCH_PAGED_READS,
+            after.evictions - before.evictions,
+            (after.resident_pages * ctx_main->system_page_size) >> 20);
+
+    return sum != -1;
+}
+
+int
+bench_paged(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long megabytes = (argc > 0) ? strtoul(argv[0], 0, 10) : 256,
+                  pool_megabytes = (argc > 1) ? strtoul(argv[1], 0, 10) : 32;
+    const char *path = (argc > 2) ? argv[2] : "/tmp/b-key-bench.paged";
+
+    unsigned long per_page = ctx_main->system_page_size / PTBL_CALC_BUCKET_WORD_SIZE(database_calc_bucket(BENCH_PAGED_VALUE)),
+                  pool_pages = (pool_megabytes << 20) / ctx_main->system_page_size,
+                  count = ((megabytes << 20) / ctx_main->system_page_size) * per_page,
+                  fits = (pool_pages / 2) * per_page;
+
+    Database_paged *dbp = database_paged_open(ctx_main, path, pool_pages);
+    unsigned long *keys = (unsigned long *)memory_alloc(count * sizeof(unsigned long));
+    unsigned char value[BENCH_PAGED_VALUE];
+    if(!dbp || !keys) {
+        return 0;
+    }
+
+    printf("%lu MB of %d-byte values, %lu MB pool, %s (reads come from the page cache when it has room)\n",
+            megabytes, BENCH_PAGED_VALUE, pool_megabytes, path);
+
+    double start = bench_now();
+    for(unsigned long i = 0; i < count; i++) {
+        memset(value, (unsigned char)i, sizeof(value));
+        keys[i] = database_paged_kv_alloc(ctx_main, dbp, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        if(keys[i] == -1) {
+            return 0;
+        }
+    }
+    if(!database_paged_flush(ctx_main, dbp)) {
+        return 0;
+    }
+    bench_report("database_paged_kv_alloc(), flushed", count, bench_now() - start);
+
+    int ok = _bench_paged_round(ctx_main, dbp, "working set half the pool", keys, fits, fits, 0)
+          && _bench_paged_round(ctx_main, dbp, "90% on half the pool, 10% anywhere", keys, count, fits, 90)
+          && _bench_paged_round(ctx_main, dbp, "uniform over everything", keys, count, count, 0);
+
+    database_paged_close(ctx_main, dbp);
+    memory_free(keys);
+
+    // The same reads of a database held in memory, for comparison
+    Record_database *rec_database = (Record_database *)memory_alloc(sizeof(Record_database));
+    keys = (unsigned long *)memory_alloc(count * sizeof(unsigned long));
+    if(!ok || !rec_database || !keys) {
+        return 0;
+    }
+    for(unsigned long i = 0; i < count; i++) {
+        keys[i] = database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value);
+    }
+    unsigned long seed = 7, sum = 0;
+    start = bench_now();
+    for(int i = 0; i < BENCH_PAGED_READS; i++) {
+        sum += database_kv_get_value(ctx_main, rec_database, 0, keys[(_bench_paged_next(&seed) >> 8) % count])[0];
+    }
+    bench_report("in memory, uniform over everything", BENCH_PAGED_READS, bench_now() - start);
+
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    memory_free(keys);
+
+    return sum != -1;
+}
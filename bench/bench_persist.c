@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "persist.h"
+#include "bench.h"
+
+int
+bench_persist(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long megabytes = (argc > 0) ? strtoul(argv[0], 0, 10) : 256;
+    const char *path = (argc > 1) ? argv[1] : "/tmp/b-key-bench.snap";
+    unsigned char value[1024];
+
+    RECORD_CREATE(Record_database, rec_database);
+    RECORD_CREATE(Record_database, loaded);
+    if(!rec_database || !loaded) {
+        return 0;
+    }
+
+    // A mix of value sizes, so that several buckets and their page_usage are written
+    unsigned long seed = 1, total = 0, count = 0;
+    memset(value, 0xAB, sizeof(value));
+    while(total < megabytes << 20) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned long size = 16 << ((seed >> 33) % 7);
+        if(database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, size, value) == -1) {
+            return 0;
+        }
+        total += size;
+        count++;
+    }
+    printf("%lu keys, %lu MB of values, %s\n", count, total >> 20, path);
+
+    double start = bench_now();
+    if(!database_save(ctx_main, rec_database, path)) {
+        return 0;
+    }
+    double seconds = bench_now() - start;
+
+    FILE *file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    unsigned long length = ftell(file);
+    fclose(file);
+    printf("%-40s %8.2f GB/s  (%lu MB, fsync included)\n", "database_save()", length / seconds / 1e9, length >> 20);
+
+    // The file was just written, so these loads read the page cache rather than the disk
+    for(int round = 0; round < 3; round++) {
+        start = bench_now();
+        if(!database_load(ctx_main, loaded, path)) {
+            return 0;
+        }
+        seconds = bench_now() - start;
+        printf("%-40s %8.2f GB/s  (%.1f ms)\n", "database_load(), warm page cache", length / seconds / 1e9, seconds * 1e3);
+        database_ptbl_free(ctx_main, loaded);
+    }
+
+    // Mapping only reads the tables, the values come in as they're touched
+    for(int prefetch = 0; prefetch < 2; prefetch++) {
+        start = bench_now();
+        if(!database_map(ctx_main, loaded, path) || (prefetch && !database_map_prefetch(ctx_main, loaded))) {
+            return 0;
+        }
+        double ready = bench_now() - start;
+
+        unsigned long sum = 0;
+        for(unsigned long k = 0; k < loaded->kv_record_count; k++) {
+            unsigned char *v = database_kv_get_value(ctx_main, loaded, 0, k);
+            if(v) sum += v[0];
+        }
+        seconds = bench_now() - start;
+        printf("%-40s %8.1f ms to open, %.1f ms to touch every value (%lu)\n",
+                prefetch ? "database_map() + prefetch" : "database_map()", ready * 1e3, seconds * 1e3, sum);
+        database_ptbl_free(ctx_main, loaded);
+    }
+
+    // A background save, while this process keeps overwriting values
+    Persist_bgsave bgsave;
+    unsigned long writes = 0;
+    int done;
+    start = bench_now();
+    if(!database_bgsave(ctx_main, rec_database, path, &bgsave)) {
+        return 0;
+    }
+    double forked = bench_now() - start;
+    while((done = database_bgsave_wait(ctx_main, &bgsave, 0)) == -1) {
+        for(int i = 0; i < 1000; i++, writes++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            unsigned long k = (seed >> 33) % count;
+            database_kv_set_value(ctx_main, rec_database, k, KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]), value);
+        }
+    }
+    if(!done) {
+        return 0;
+    }
+    printf("%-40s %8.2f GB/s  (%.1f ms, fork %.1f ms, %lu writes meanwhile, %.1f MB copied)\n", "database_bgsave()",
+            length / bgsave.seconds / 1e9, bgsave.seconds * 1e3, forked * 1e3, writes, bgsave.cow_bytes / 1048576.0);
+
+    // Incremental checkpoints after overwriting a growing share of the keys, against the full save above
+    char delta_path[256];
+    snprintf(delta_path, sizeof(delta_path), "%s.delta", path);
+    if(!database_checkpoint(ctx_main, rec_database, path, 0)) {
+        return 0;
+    }
+    for(unsigned long sequence = 1, permille = 1; permille <= 100; sequence++, permille *= 10) {
+        for(unsigned long i = 0; i < count * permille / 1000; i++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            unsigned long k = (seed >> 33) % count;
+            database_kv_set_value(ctx_main, rec_database, k, KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]), value);
+        }
+        start = bench_now();
+        if(!database_checkpoint(ctx_main, rec_database, delta_path, sequence)) {
+            return 0;
+        }
+        seconds = bench_now() - start;
+        file = fopen(delta_path, "rb");
+        fseek(file, 0, SEEK_END);
+        unsigned long delta_length = ftell(file);
+        fclose(file);
+        printf("database_checkpoint(), %4.1f%% of keys written %8.1f ms  (%.1f MB, %.1f%% of the snapshot)\n",
+                permille / 10.0, seconds * 1e3, delta_length / 1048576.0, 100.0 * delta_length / length);
+    }
+    unlink(delta_path);
+
+    unlink(path);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    memory_free(loaded);
+
+    return 1;
+}
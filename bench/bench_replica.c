@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "wal.h"
+#include "replica.h"
+#include "bench.h"
+
+#define BENCH_REPLICA_VALUE 100
+#define BENCH_REPLICA_READS 10000000
+#define BENCH_REPLICA_READ_BATCH 64
+#define BENCH_REPLICA_WRITE_INTERVAL_NS 100000
+
+// What each replica process reports back, in memory shared with the primary
+typedef struct bench_replica_result {
+    int ok;
+    double start;              // bench_now() is CLOCK_MONOTONIC, which every process shares
+    double end;
+    Replica_stats stats;
+} Bench_replica_result;
+
+// Runs in a replica process: catches up to lsn, then reads BENCH_REPLICA_READS random values while
+// the primary keeps writing
+static int
+_bench_replica_reader(
+    Context_main *ctx_main,
+    int fd,
+    unsigned long lsn,
+    unsigned long count,
+    int seed,
+    Bench_replica_result *result
+) {
+    Record_database *rec_database = (Record_database *)memory_alloc(sizeof(Record_database));
+    Database_replica *replica = rec_database ? database_replica_open(ctx_main, rec_database, fd) : 0;
+    if(!replica || !database_replica_wait(replica, lsn, 30000)) {
+        return 0;
+    }
+
+    unsigned long sum = 0, random = seed;
+    result->start = bench_now();
+    for(int i = 0; i < BENCH_REPLICA_READS; i += BENCH_REPLICA_READ_BATCH) {
+        database_replica_read_begin(replica);
+        for(int j = 0; j < BENCH_REPLICA_READ_BATCH; j++) {
+            random = random * 6364136223846793005UL + 1442695040888963407UL;
+            unsigned char *value = database_kv_get_value(ctx_main, rec_database, 0, (random >> 33) % count);
+            sum += value ? value[0] : 0;
+        }
+        database_replica_read_end(replica);
+    }
+    result->end = bench_now();
+    database_replica_stats(replica, &result->stats);
+
+    int ok = database_replica_close(replica) && sum > 0;
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    return ok;
+}
+
+static int
+_bench_replica_round(
+    Context_main *ctx_main,
+    Database_wal *wal,
+    unsigned long count,
+    int replicas,
+    Bench_replica_result *results
+) {
+    unsigned long lsn = database_wal_lsn(wal);
+    memset(results, 0, replicas * sizeof(Bench_replica_result));
+
+    fflush(stdout);
+    for(int r = 0; r < replicas; r++) {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            return 0;
+        }
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(fds[0]);
+            results[r].ok = _bench_replica_reader(ctx_main, fds[1], lsn, count, r + 1, &results[r]);
+            _exit(0);
+        }
+        close(fds[1]);
+        if(pid < 0 || !database_wal_ship(ctx_main, wal, fds[0])) {
+            return 0;
+        }
+    }
+
+    // The primary keeps writing at a steady rate while the replicas read
+    unsigned char value[BENCH_REPLICA_VALUE];
+    unsigned long writes = 0, random = 7;
+    struct timespec interval = { 0, BENCH_REPLICA_WRITE_INTERVAL_NS };
+    double start = bench_now();
+    for(int running = replicas; running > 0; ) {
+        random = random * 6364136223846793005UL + 1442695040888963407UL;
+        memset(value, (int)writes | 1, sizeof(value));
+        if(!database_wal_kv_set_value(ctx_main, wal, (random >> 33) % count, sizeof(value), value)) {
+            return 0;
+        }
+        writes++;
+        nanosleep(&interval, 0);
+        while(running > 0 && waitpid(-1, 0, WNOHANG) > 0) {
+            running--;
+        }
+    }
+    double seconds = bench_now() - start;
+
+    // Drops the followers that are gone
+    memset(value, 1, sizeof(value));
+    database_wal_kv_set_value(ctx_main, wal, 0, sizeof(value), value);
+
+    // From the first replica starting to read to the last one done
+    double first = results[0].start, last = results[0].end, delay_max = 0;
+    unsigned long lag = 0;
+    for(int r = 0; r < replicas; r++) {
+        if(!results[r].ok) {
+            return 0;
+        }
+        if(results[r].start < first) first = results[r].start;
+        if(results[r].end > last) last = results[r].end;
+        if(results[r].stats.delay_max > delay_max) delay_max = results[r].stats.delay_max;
+        if(results[r].stats.lag > lag) lag = results[r].stats.lag;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "reads, %d replica%s", replicas, (replicas > 1) ? "s" : "");
+    bench_report(name, (unsigned long)replicas * BENCH_REPLICA_READS, last - first);
+    printf("  primary wrote %.0f values/s meanwhile; worst batch took %.1f us to apply, last lag %lu bytes\n",
+            writes / seconds, delay_max * 1e6, lag);
+
+    return 1;
+}
+
+int
+bench_replica(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long count = (argc > 0) ? strtoul(argv[0], 0, 10) : 50000;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-bench-%d.wal", (int)getpid());
+    unlink(path);
+
+    Record_database *rec_database = (Record_database *)memory_alloc(sizeof(Record_database));
+    Database_wal *wal = rec_database ? database_wal_open(ctx_main, rec_database, path, WAL_SYNC_NONE, 0) : 0;
+    Bench_replica_result *results = mmap(0, 4 * sizeof(Bench_replica_result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(!wal || results == MAP_FAILED) {
+        return 0;
+    }
+
+    unsigned char value[BENCH_REPLICA_VALUE];
+    memset(value, 1, sizeof(value));
+    for(unsigned long i = 0; i < count; i++) {
+        if(database_wal_kv_alloc(ctx_main, wal, KV_RECORD_TYPE_RAW, sizeof(value), value) == -1) {
+            return 0;
+        }
+    }
+    printf("%lu values of %d bytes, every replica reads %d of them while the primary writes one every %d us\n",
+            count, BENCH_REPLICA_VALUE, BENCH_REPLICA_READS, BENCH_REPLICA_WRITE_INTERVAL_NS / 1000);
+
+    int replicas[] = { 1, 2, 4 };
+    for(int i = 0; i < sizeof(replicas) / sizeof(replicas[0]); i++) {
+        if(!_bench_replica_round(ctx_main, wal, count, replicas[i], results)) {
+            return 0;
+        }
+    }
+
+    munmap(results, 4 * sizeof(Bench_replica_result));
+    database_wal_close(ctx_main, wal);
+    unlink(path);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+
+    return 1;
+}
@@ -0,0 +1,175 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "concurrent.h"
+#include "shard.h"
+#include "bench.h"
+
+#define BENCH_SHARD_VALUE_LENGTH 64
+
+typedef struct bench_shard_task {
+    Shard_handle *handles;  // Every shard's handles, key_count per shard
+    unsigned long key_count;
+    unsigned long ops;
+    int remote_percent;
+    int shard;
+    int shard_count;
+    unsigned long checksum;
+} Bench_shard_task;
+
+static void
+bench_shard_load(
+    Context_main *ctx_main,
+    Shard_client *self,
+    void *arg
+) {
+    Bench_shard_task *task = (Bench_shard_task *)arg;
+    unsigned char value[BENCH_SHARD_VALUE_LENGTH];
+    memset(value, task->shard, sizeof(value));
+    for(unsigned long i = 0; i < task->key_count; i++) {
+        task->handles[task->shard * task->key_count + i] = shard_kv_alloc(ctx_main, self, task->shard, KV_RECORD_TYPE_RAW, sizeof(value), value);
+    }
+}
+
+// Mostly works on its own partition: 10% writes, and remote_percent of the reads go to another shard
+static void
+bench_shard_run(
+    Context_main *ctx_main,
+    Shard_client *self,
+    void *arg
+) {
+    Bench_shard_task *task = (Bench_shard_task *)arg;
+    unsigned char value[BENCH_SHARD_VALUE_LENGTH];
+    unsigned long seed = task->shard * 7919 + 1;
+
+    for(unsigned long i = 0; i < task->ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        int shard = task->shard, roll = (seed >> 20) % 100;
+        if(roll < task->remote_percent) {
+            shard = (seed >> 8) % task->shard_count;
+        }
+        Shard_handle handle = task->handles[shard * task->key_count + (seed >> 33) % task->key_count];
+
+        if(roll >= 90 && shard == task->shard) {
+            memset(value, i, sizeof(value));
+            shard_kv_set_value(ctx_main, self, handle, sizeof(value), value);
+        }
+        else {
+            shard_kv_get(ctx_main, self, handle, value, sizeof(value), 0);
+        }
+        task->checksum += value[0];
+    }
+}
+
+typedef struct bench_shard_thread {
+    Context_main *ctx_main;
+    Database_concurrent *dbc;
+    unsigned long *keys;
+    Bench_shard_task task;
+} Bench_shard_thread;
+
+// The same workload on one Database_concurrent
+static void *
+bench_shard_concurrent_run(
+    void *arg
+) {
+    Bench_shard_thread *t = (Bench_shard_thread *)arg;
+    Bench_shard_task *task = &t->task;
+    unsigned char value[BENCH_SHARD_VALUE_LENGTH];
+    unsigned long seed = task->shard * 7919 + 1, size;
+
+    for(unsigned long i = 0; i < task->ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        int shard = task->shard, roll = (seed >> 20) % 100;
+        if(roll < task->remote_percent) {
+            shard = (seed >> 8) % task->shard_count;
+        }
+        unsigned long k = t->keys[shard * task->key_count + (seed >> 33) % task->key_count];
+
+        if(roll >= 90 && shard == task->shard) {
+            memset(value, i, sizeof(value));
+            database_concurrent_kv_set_value(t->ctx_main, t->dbc, k, sizeof(value), value);
+        }
+        else {
+            database_concurrent_kv_get(t->ctx_main, t->dbc, k, value, sizeof(value), &size, 0);
+        }
+        task->checksum += value[0];
+    }
+
+    return 0;
+}
+
+int
+bench_shard(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long key_count = (argc > 0) ? strtoul(argv[0], 0, 10) : 100000,
+                  ops = (argc > 1) ? strtoul(argv[1], 0, 10) : 2000000;
+    int remote_percent = (argc > 2) ? atoi(argv[2]) : 5;
+    unsigned char value[BENCH_SHARD_VALUE_LENGTH];
+    char label[64];
+
+    printf("%lu keys, %d%% cross-shard reads, %lu cores\n", key_count, remote_percent, ctx_main->system_cpu_count);
+    memset(value, 0, sizeof(value));
+
+    for(int shard_count = 1; shard_count <= 8; shard_count *= 2) {
+        unsigned long per_shard = key_count / shard_count;
+        Bench_shard_task tasks[shard_count];
+        Context_shard *runtime = shard_runtime_create(ctx_main, shard_count, 1);
+        Shard_client *client = runtime ? shard_client_attach(runtime) : 0;
+        Shard_handle *handles = malloc(per_shard * shard_count * sizeof(Shard_handle));
+        if(!client || !handles) {
+            return 0;
+        }
+
+        for(int i = 0; i < shard_count; i++) {
+            tasks[i] = (Bench_shard_task){ handles, per_shard, ops / shard_count, remote_percent, i, shard_count, 0 };
+            shard_submit(client, i, bench_shard_load, &tasks[i]);
+        }
+        shard_wait(runtime);
+
+        double start = bench_now();
+        for(int i = 0; i < shard_count; i++) {
+            shard_submit(client, i, bench_shard_run, &tasks[i]);
+        }
+        shard_wait(runtime);
+        snprintf(label, sizeof(label), "shards, %d shard%s", shard_count, (shard_count > 1) ? "s" : "");
+        bench_report(label, (ops / shard_count) * shard_count, bench_now() - start);
+
+        shard_client_detach(client);
+        shard_runtime_free(runtime);
+
+        // Same partitions and access pattern, one thread per partition on a shared database
+        Database_concurrent *dbc = database_concurrent_create(ctx_main);
+        Bench_shard_thread threads[shard_count];
+        pthread_t ids[shard_count];
+        for(unsigned long i = 0; i < per_shard * shard_count; i++) {
+            handles[i] = database_concurrent_kv_alloc(ctx_main, dbc, KV_RECORD_TYPE_RAW, sizeof(value), value);
+        }
+
+        start = bench_now();
+        for(int i = 0; i < shard_count; i++) {
+            threads[i] = (Bench_shard_thread){ ctx_main, dbc, handles, tasks[i] };
+            threads[i].task.checksum = 0;
+            pthread_create(&ids[i], 0, bench_shard_concurrent_run, &threads[i]);
+        }
+        for(int i = 0; i < shard_count; i++) {
+            pthread_join(ids[i], 0);
+        }
+        snprintf(label, sizeof(label), "fine-grained locks, %d thread%s", shard_count, (shard_count > 1) ? "s" : "");
+        bench_report(label, (ops / shard_count) * shard_count, bench_now() - start);
+
+        database_concurrent_free(ctx_main, dbc);
+        free(handles);
+    }
+
+    return 1;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "shared.h"
+#include "bench.h"
+
+#define BENCH_SHARED_VALUE 100
+#define BENCH_SHARED_READS 2000000
+
+// Reads BENCH_SHARED_READS random values, from the segment if dbs is set, otherwise from a copy of
+// the dataset the process builds for itself, as every worker has to without a shared segment
+static int
+_bench_shared_worker(
+    Context_main *ctx_main,
+    Database_shared *dbs,
+    unsigned long count,
+    int seed
+) {
+    unsigned char value[BENCH_SHARED_VALUE];
+    unsigned long sum = 0, random = seed, sequence, size;
+    Record_database *rec_database = 0;
+
+    if(!dbs) {
+        rec_database = (Record_database *)memory_alloc(sizeof(Record_database));
+        memset(value, 1, sizeof(value));
+        for(unsigned long i = 0; i < count; i++) {
+            if(database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value) == -1) {
+                return 0;
+            }
+        }
+    }
+
+    for(int i = 0; i < BENCH_SHARED_READS; i++) {
+        random = random * 6364136223846793005UL + 1442695040888963407UL;
+        unsigned long k = (random >> 33) % count;
+        if(dbs) {
+            unsigned char *v;
+            do {
+                database_shared_read_begin(dbs, &sequence);
+                v = database_shared_kv_get_value(dbs, k, &size);
+                sum += v ? v[0] : 0;
+            } while(!database_shared_read_end(dbs, sequence));
+        }
+        else {
+            sum += database_kv_get_value(ctx_main, rec_database, 0, k)[0];
+        }
+    }
+
+    if(rec_database) {
+        database_ptbl_free(ctx_main, rec_database);
+        memory_free(rec_database);
+    }
+    return sum == (unsigned long)BENCH_SHARED_READS;
+}
+
+static int
+_bench_shared_round(
+    Context_main *ctx_main,
+    Database_shared *dbs,
+    unsigned long count,
+    int processes
+) {
+    fflush(stdout);
+    double start = bench_now();
+    for(int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if(pid == 0) {
+            // A fresh mapping of its own, as an unrelated process would have
+            Database_shared *mine = dbs ? database_shared_attach(ctx_main, database_shared_fd(dbs)) : 0;
+            _exit((dbs && !mine) || !_bench_shared_worker(ctx_main, mine, count, p + 1));
+        }
+        if(pid < 0) {
+            return 0;
+        }
+    }
+    int ok = 1, status;
+    for(int p = 0; p < processes; p++) {
+        ok = (wait(&status) > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) && ok;
+    }
+    double seconds = bench_now() - start;
+
+    char name[64];
+    snprintf(name, sizeof(name), "%s, %d process%s", dbs ? "shared segment" : "private copies", processes, (processes > 1) ? "es" : "");
+    bench_report(name, (unsigned long)processes * BENCH_SHARED_READS, seconds);
+
+    return ok;
+}
+
+int
+bench_shared(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long count = (argc > 0) ? strtoul(argv[0], 0, 10) : 100000;
+    unsigned char value[BENCH_SHARED_VALUE];
+    memset(value, 1, sizeof(value));
+
+    Database_shared *dbs = database_shared_create(ctx_main, 0, count * 2 * PTBL_CALC_BUCKET_WORD_SIZE(database_calc_bucket(BENCH_SHARED_VALUE)) + (64 << 20));
+    if(!dbs) {
+        return 0;
+    }
+    double start = bench_now();
+    for(unsigned long i = 0; i < count; i++) {
+        if(database_shared_kv_alloc(ctx_main, dbs, KV_RECORD_TYPE_RAW, sizeof(value), value) == -1) {
+            return 0;
+        }
+    }
+    bench_report("database_shared_kv_alloc()", count, bench_now() - start);
+    printf("%lu values of %d bytes, %lu MB of segment in use, one copy for every process\n",
+            count, BENCH_SHARED_VALUE, database_shared_used(dbs) >> 20);
+    printf("private copies: every process builds its own, of about the same size, and the time includes that\n");
+
+    int processes[] = { 1, 2, 4 };
+    for(int i = 0; i < sizeof(processes) / sizeof(processes[0]); i++) {
+        if(!_bench_shared_round(ctx_main, dbs, count, processes[i])
+                || !_bench_shared_round(ctx_main, 0, count, processes[i])) {
+            return 0;
+        }
+    }
+
+    database_shared_detach(ctx_main, dbs);
+
+    return 1;
+}
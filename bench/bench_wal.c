@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "wal.h"
+#include "bench.h"
+
+#define BENCH_WAL_VALUE_LENGTH 64
+#define BENCH_WAL_KEYS 1024
+
+typedef struct bench_wal_worker {
+    Context_main *ctx_main;
+    Database_wal *wal;
+    unsigned long *keys;
+    unsigned long ops;
+    int index;
+    int failed;
+} Bench_wal_worker;
+
+static void *
+_bench_wal_run(
+    void *arg
+) {
+    Bench_wal_worker *w = (Bench_wal_worker *)arg;
+    unsigned char value[BENCH_WAL_VALUE_LENGTH];
+    unsigned long seed = w->index + 1;
+
+    memset(value, w->index, sizeof(value));
+    for(unsigned long i = 0; i < w->ops; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        if(!database_wal_kv_set_value(w->ctx_main, w->wal, w->keys[(seed >> 33) % BENCH_WAL_KEYS], sizeof(value), value)) {
+            w->failed = 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int
+bench_wal(
+    Context_main *ctx_main,
+    int argc,
+    char **argv
+) {
+    unsigned long ops = (argc > 0) ? strtoul(argv[0], 0, 10) : 200000;
+    const char *path = (argc > 1) ? argv[1] : "/tmp/b-key-bench.wal";
+    static const struct {
+        const char *name;
+        int sync;
+        unsigned long interval_ms;
+        unsigned long divisor;  // Syncing every write is a lot slower, so it does fewer
+    } policies[] = {
+        { "WAL_SYNC_ALWAYS", WAL_SYNC_ALWAYS, 0, 50 },
+        { "WAL_SYNC_INTERVAL 10ms", WAL_SYNC_INTERVAL, 10, 1 },
+        { "WAL_SYNC_NONE", WAL_SYNC_NONE, 0, 1 }
+    };
+    unsigned char value[BENCH_WAL_VALUE_LENGTH] = { 0 };
+    unsigned long keys[BENCH_WAL_KEYS];
+    char label[64];
+
+    RECORD_CREATE(Record_database, rec_database);
+    if(!rec_database) {
+        return 0;
+    }
+    for(int i = 0; i < BENCH_WAL_KEYS; i++) {
+        keys[i] = database_kv_alloc(ctx_main, rec_database, KV_RECORD_TYPE_RAW, sizeof(value), value);
+    }
+
+    printf("%d-byte values, %s\n", BENCH_WAL_VALUE_LENGTH, path);
+    for(int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        for(int thread_count = 1; thread_count <= 8; thread_count *= 2) {
+            unlink(path);
+            Database_wal *wal = database_wal_open(ctx_main, rec_database, path, policies[p].sync, policies[p].interval_ms);
+            if(!wal) {
+                return 0;
+            }
+
+            Bench_wal_worker workers[thread_count];
+            pthread_t threads[thread_count];
+            unsigned long per_thread = ops / policies[p].divisor / thread_count;
+            double start = bench_now();
+            for(int t = 0; t < thread_count; t++) {
+                workers[t] = (Bench_wal_worker){ ctx_main, wal, keys, per_thread, t, 0 };
+                pthread_create(&threads[t], 0, _bench_wal_run, &workers[t]);
+            }
+            for(int t = 0; t < thread_count; t++) {
+                pthread_join(threads[t], 0);
+                if(workers[t].failed) {
+                    return 0;
+                }
+            }
+            // Everything has to be on disk by the end, whatever the policy
+            if(!database_wal_close(ctx_main, wal)) {
+                return 0;
+            }
+            snprintf(label, sizeof(label), "%s, %d threads", policies[p].name, thread_count);
+            bench_report(label, per_thread * thread_count, bench_now() - start);
+        }
+    }
+
+    unlink(path);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+
+    return 1;
+}
@@ -0,0 +1,684 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "btree.h"
+
+#ifndef DEBUG_BTREE
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+_Static_assert(sizeof(Btree_node) <= BTREE_NODE_SIZE, "Btree_node must fit in BTREE_NODE_SIZE");
+
+// A node with room for one key too many, used while splitting
+typedef struct btree_wide_node {
+    unsigned long prefix[BTREE_ORDER + 1];
+    unsigned long key_k[BTREE_ORDER + 1];
+    unsigned long value[BTREE_ORDER + 2];
+} Btree_wide_node;
+
+#define _CHILD(x,i) ((Btree_node *)(x)->value[i])
+
+// Packs the first eight bytes of key big-endian, so that integer order matches byte order
+static inline unsigned long
+_btree_pack(
+    unsigned char *key,
+    unsigned long key_length
+) {
+    unsigned long prefix = 0;
+    for(int i = 0; i < sizeof(unsigned long); i++) {
+        prefix = (prefix << 8) | ((i < key_length) ? key[i] : 0);
+    }
+    return prefix;
+}
+
+static inline int
+_btree_bytes_compare(
+    unsigned char *a,
+    unsigned long a_length,
+    unsigned char *b,
+    unsigned long b_length
+) {
+    int c = memcmp(a, b, (a_length < b_length) ? a_length : b_length);
+    if(c) {
+        return c;
+    }
+    return (a_length < b_length) ? -1 : (a_length > b_length) ? 1 : 0;
+}
+
+static inline unsigned char *
+_btree_key(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned long key_k,
+    unsigned long *key_length
+) {
+    key_length[0] = KV_RECORD_GET_SIZE(index->rec_database->kv_record_tbl[key_k]);
+    return database_kv_get_value(ctx_main, index->rec_database, 0, key_k);
+}
+
+// Compares key i of node to key, which packs to prefix. Only leaves the node on a prefix tie.
+static inline int
+_btree_compare(
+    Context_main *ctx_main,
+    Index_btree *index,
+    Btree_node *node,
+    int i,
+    unsigned long prefix,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    if(node->prefix[i] != prefix) {
+        return (node->prefix[i] < prefix) ? -1 : 1;
+    }
+    unsigned long node_key_length;
+    unsigned char *node_key = _btree_key(ctx_main, index, node->key_k[i], &node_key_length);
+    return _btree_bytes_compare(node_key, node_key_length, key, key_length);
+}
+
+// First i where key i >= key (upper = 0), or key i > key (upper = 1)
+static int
+_btree_search(
+    Context_main *ctx_main,
+    Index_btree *index,
+    Btree_node *node,
+    unsigned long prefix,
+    unsigned char *key,
+    unsigned long key_length,
+    int upper
+) {
+    int low = 0, high = node->count;
+    while(low < high) {
+        int mid = (low + high) / 2;
+        int c = _btree_compare(ctx_main, index, node, mid, prefix, key, key_length);
+        if(c < 0 || (upper && c == 0)) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static Btree_node *
+_btree_node_alloc(
+    Context_main *ctx_main,
+    Index_btree *index,
+    int is_leaf
+) {
+    Btree_node *node = (Btree_node *)memory_page_alloc(ctx_main, 1);
+    if(node) {
+        node->is_leaf = is_leaf;
+        index->node_count++;
+    }
+    return node;
+}
+
+// Descends to the leaf that key belongs in, recording the path taken
+static Btree_node *
+_btree_descend(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned long prefix,
+    unsigned char *key,
+    unsigned long key_length,
+    Btree_node **path,
+    int *path_slots,
+    int *depth
+) {
+    Btree_node *node = index->root;
+    int d = 0;
+    while(node && !node->is_leaf) {
+        int i = _btree_search(ctx_main, index, node, prefix, key, key_length, 1);
+        if(path) {
+            path[d] = node;
+            path_slots[d] = i;
+        }
+        d++;
+        node = _CHILD(node, i);
+    }
+    if(depth) depth[0] = d;
+    return node;
+}
+
+// Inserts (prefix, key_k, value) at position of node. A full node is split with sibling, which
+// becomes its right sibling and is returned through right, with the separator to push up through
+// sep_*. A leaf's separator is sep_copy_k, a copy of the bytes of the sibling's first key.
+static void
+_btree_node_insert(
+    Btree_node *node,
+    int position,
+    unsigned long prefix,
+    unsigned long key_k,
+    unsigned long value,
+    Btree_node *sibling,
+    unsigned long sep_copy_k,
+    Btree_node **right,
+    unsigned long *sep_prefix,
+    unsigned long *sep_key_k
+) {
+    // Internal nodes store the child to the right of the new key
+    int value_position = node->is_leaf ? position : position + 1;
+    int values = node->is_leaf ? node->count : node->count + 1;
+
+    right[0] = 0;
+
+    if(node->count < BTREE_ORDER) {
+        memmove(&node->prefix[position + 1], &node->prefix[position], (node->count - position) * sizeof(unsigned long));
+        memmove(&node->key_k[position + 1], &node->key_k[position], (node->count - position) * sizeof(unsigned long));
+        memmove(&node->value[value_position + 1], &node->value[value_position], (values - value_position) * sizeof(unsigned long));
+        node->prefix[position] = prefix;
+        node->key_k[position] = key_k;
+        node->value[value_position] = value;
+        node->count++;
+        return;
+    }
+
+    Btree_wide_node wide;
+    memcpy(wide.prefix, node->prefix, position * sizeof(unsigned long));
+    memcpy(wide.key_k, node->key_k, position * sizeof(unsigned long));
+    memcpy(wide.value, node->value, value_position * sizeof(unsigned long));
+    wide.prefix[position] = prefix;
+    wide.key_k[position] = key_k;
+    wide.value[value_position] = value;
+    memcpy(&wide.prefix[position + 1], &node->prefix[position], (node->count - position) * sizeof(unsigned long));
+    memcpy(&wide.key_k[position + 1], &node->key_k[position], (node->count - position) * sizeof(unsigned long));
+    memcpy(&wide.value[value_position + 1], &node->value[value_position], (values - value_position) * sizeof(unsigned long));
+
+    int total = BTREE_ORDER + 1, half = total / 2;
+
+    if(node->is_leaf) {
+        // Leaves keep [0, half) and the sibling gets [half, total)
+        node->count = half;
+        sibling->count = total - half;
+        memcpy(node->prefix, wide.prefix, half * sizeof(unsigned long));
+        memcpy(node->key_k, wide.key_k, half * sizeof(unsigned long));
+        memcpy(node->value, wide.value, half * sizeof(unsigned long));
+        memcpy(sibling->prefix, &wide.prefix[half], sibling->count * sizeof(unsigned long));
+        memcpy(sibling->key_k, &wide.key_k[half], sibling->count * sizeof(unsigned long));
+        memcpy(sibling->value, &wide.value[half], sibling->count * sizeof(unsigned long));
+
+        sibling->next = node->next;
+        node->next = sibling;
+
+        sep_prefix[0] = sibling->prefix[0];
+        sep_key_k[0] = sep_copy_k;
+    }
+    else {
+        // Internal nodes keep keys [0, half) and the key at half moves up into the parent
+        node->count = half;
+        sibling->count = total - half - 1;
+        memcpy(node->prefix, wide.prefix, half * sizeof(unsigned long));
+        memcpy(node->key_k, wide.key_k, half * sizeof(unsigned long));
+        memcpy(node->value, wide.value, (half + 1) * sizeof(unsigned long));
+        memcpy(sibling->prefix, &wide.prefix[half + 1], sibling->count * sizeof(unsigned long));
+        memcpy(sibling->key_k, &wide.key_k[half + 1], sibling->count * sizeof(unsigned long));
+        memcpy(sibling->value, &wide.value[half + 1], (sibling->count + 1) * sizeof(unsigned long));
+
+        sep_prefix[0] = wide.prefix[half];
+        sep_key_k[0] = wide.key_k[half];
+    }
+
+    right[0] = sibling;
+}
+
+Index_btree *
+btree_index_create(
+    Context_main *ctx_main,
+    Record_database *rec_database
+) {
+    DEBUG_PRINT("btree_index_create();\n");
+
+    if(ctx_main->system_page_size < BTREE_NODE_SIZE) {
+        DEBUG_PRINT("\tERR system pages are too small for a node\n");
+        return 0;
+    }
+
+    RECORD_CREATE(Index_btree, index);
+    if(!index) {
+        return 0;
+    }
+    index->rec_database = rec_database;
+    return index;
+}
+
+int
+btree_index_put(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned char *key,
+    unsigned long key_length,
+    unsigned long value_k
+) {
+    DEBUG_PRINT("btree_index_put(key_length = %lu, value_k = %lu);\n", key_length, value_k);
+
+    if(!key_length) {
+        DEBUG_PRINT("\tERR empty key\n");
+        return 0;
+    }
+
+    if(!index->root) {
+        if(!(index->root = _btree_node_alloc(ctx_main, index, 1))) {
+            return 0;
+        }
+        index->height = 1;
+    }
+
+    Btree_node *path[BTREE_MAX_HEIGHT];
+    int path_slots[BTREE_MAX_HEIGHT], depth;
+    unsigned long prefix = _btree_pack(key, key_length);
+
+    Btree_node *leaf = _btree_descend(ctx_main, index, prefix, key, key_length, path, path_slots, &depth);
+
+    int position = _btree_search(ctx_main, index, leaf, prefix, key, key_length, 0);
+    if(position < leaf->count && 0 == _btree_compare(ctx_main, index, leaf, position, prefix, key, key_length)) {
+        leaf->value[position] = value_k;
+        return 1;
+    }
+
+    if(depth + 1 >= BTREE_MAX_HEIGHT) {
+        DEBUG_PRINT("\tERR tree is too tall\n");
+        return 0;
+    }
+
+    // Everything the insert may need is taken before the tree is touched, so that it either goes
+    // in whole or not at all: the leaf and every full node above it split, into a node each, and a
+    // new root is needed if they all do
+    int splits = 0;
+    if(leaf->count == BTREE_ORDER) {
+        for(splits = 1; splits <= depth && path[depth - splits]->count == BTREE_ORDER; splits++);
+    }
+    int spares = splits + (splits == depth + 1);
+    Btree_node *spare[BTREE_MAX_HEIGHT + 1];
+
+    unsigned long key_k = database_kv_alloc(ctx_main, index->rec_database, KV_RECORD_TYPE_RAW, key_length, key),
+                  sep_copy_k = -1;
+    if(key_k == -1) {
+        DEBUG_PRINT("\tERR failed to store key\n");
+        return 0;
+    }
+    int reserved = 0;
+    if(splits) {
+        // The leaf's separator is a copy of what will be the sibling's first key, which has to be
+        // copied out first, since allocating the copy may move the bucket it lives in
+        int half = (BTREE_ORDER + 1) / 2;
+        unsigned long first_k = (half < position) ? leaf->key_k[half] : (half == position) ? key_k : leaf->key_k[half - 1],
+                      sep_length;
+        unsigned char *sep = _btree_key(ctx_main, index, first_k, &sep_length),
+                      *sep_bytes = memory_alloc(sep_length);
+        if(sep_bytes) {
+            memcpy(sep_bytes, sep, sep_length);
+            sep_copy_k = database_kv_alloc(ctx_main, index->rec_database, KV_RECORD_TYPE_RAW, sep_length, sep_bytes);
+            memory_free(sep_bytes);
+        }
+        for(; sep_copy_k != -1 && reserved < spares; reserved++) {
+            if(!(spare[reserved] = _btree_node_alloc(ctx_main, index, reserved == 0))) {
+                break;
+            }
+        }
+        if(reserved < spares) {
+            DEBUG_PRINT("\tERR failed to allocate the split\n");
+            while(reserved-- > 0) {
+                memory_page_free(ctx_main, (unsigned char *)spare[reserved], 1);
+                index->node_count--;
+            }
+            if(sep_copy_k != -1) database_kv_free(ctx_main, index->rec_database, sep_copy_k);
+            database_kv_free(ctx_main, index->rec_database, key_k);
+            return 0;
+        }
+    }
+
+    Btree_node *right;
+    unsigned long sep_prefix, sep_key_k;
+    _btree_node_insert(leaf, position, prefix, key_k, value_k, splits ? spare[0] : 0, sep_copy_k, &right, &sep_prefix, &sep_key_k);
+    index->count++;
+
+    // Push separators up for as long as nodes keep splitting
+    for(int level = 1; right; level++) {
+        if(depth == 0) {
+            Btree_node *root = spare[level];
+            root->is_leaf = 0;
+            root->count = 1;
+            root->prefix[0] = sep_prefix;
+            root->key_k[0] = sep_key_k;
+            root->value[0] = (unsigned long)index->root;
+            root->value[1] = (unsigned long)right;
+            index->root = root;
+            index->height++;
+            break;
+        }
+
+        depth--;
+        _btree_node_insert(path[depth], path_slots[depth], sep_prefix, sep_key_k, (unsigned long)right, (level < splits) ? spare[level] : 0, -1, &right, &sep_prefix, &sep_key_k);
+    }
+
+    return 1;
+}
+
+unsigned long
+btree_index_get(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    unsigned long prefix = _btree_pack(key, key_length);
+    Btree_node *leaf = _btree_descend(ctx_main, index, prefix, key, key_length, 0, 0, 0);
+    if(!leaf) {
+        return -1;
+    }
+
+    int position = _btree_search(ctx_main, index, leaf, prefix, key, key_length, 0);
+    if(position < leaf->count && 0 == _btree_compare(ctx_main, index, leaf, position, prefix, key, key_length)) {
+        return leaf->value[position];
+    }
+
+    return -1;
+}
+
+int
+btree_index_delete(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    DEBUG_PRINT("btree_index_delete(key_length = %lu);\n", key_length);
+
+    unsigned long prefix = _btree_pack(key, key_length);
+    Btree_node *leaf = _btree_descend(ctx_main, index, prefix, key, key_length, 0, 0, 0);
+    if(!leaf) {
+        return 0;
+    }
+
+    int position = _btree_search(ctx_main, index, leaf, prefix, key, key_length, 0);
+    if(position >= leaf->count || 0 != _btree_compare(ctx_main, index, leaf, position, prefix, key, key_length)) {
+        return 0;
+    }
+
+    database_kv_free(ctx_main, index->rec_database, leaf->key_k[position]);
+
+    leaf->count--;
+    memmove(&leaf->prefix[position], &leaf->prefix[position + 1], (leaf->count - position) * sizeof(unsigned long));
+    memmove(&leaf->key_k[position], &leaf->key_k[position + 1], (leaf->count - position) * sizeof(unsigned long));
+    memmove(&leaf->value[position], &leaf->value[position + 1], (leaf->count - position) * sizeof(unsigned long));
+    index->count--;
+
+    return 1;
+}
+
+int
+btree_index_bulk_load(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned char **keys,
+    unsigned long *key_lengths,
+    unsigned long *values,
+    unsigned long count
+) {
+    DEBUG_PRINT("btree_index_bulk_load(count = %lu);\n", count);
+
+    if(index->root) {
+        DEBUG_PRINT("\tERR tree is not empty\n");
+        return 0;
+    }
+
+    for(unsigned long i = 0; i < count; i++) {
+        if(!key_lengths[i] || (i > 0 && _btree_bytes_compare(keys[i - 1], key_lengths[i - 1], keys[i], key_lengths[i]) >= 0)) {
+            DEBUG_PRINT("\tERR key %lu is empty or out of order\n", i);
+            return 0;
+        }
+    }
+
+    if(!count) {
+        return 1;
+    }
+
+    // Every level is a list of nodes, along with the input index of the smallest key under each.
+    // All nodes are also remembered in nodes so that they can be released if anything fails.
+    unsigned long level_count = (count + BTREE_ORDER - 1) / BTREE_ORDER, node_count = 0;
+    Btree_node **level = (Btree_node **)memory_alloc(level_count * sizeof(Btree_node *));
+    Btree_node **nodes = (Btree_node **)memory_alloc(2 * level_count * sizeof(Btree_node *));
+    unsigned long *level_first = (unsigned long *)memory_alloc(level_count * sizeof(unsigned long));
+    if(!level || !nodes || !level_first) {
+        if(level) memory_free(level);
+        if(nodes) memory_free(nodes);
+        if(level_first) memory_free(level_first);
+        return 0;
+    }
+
+    int ret = 0;
+    Btree_node *previous = 0;
+
+    for(unsigned long n = 0; n < level_count; n++) {
+        Btree_node *leaf = _btree_node_alloc(ctx_main, index, 1);
+        if(!leaf) {
+            goto done;
+        }
+        nodes[node_count++] = leaf;
+        level[n] = leaf;
+        level_first[n] = n * BTREE_ORDER;
+        if(previous) previous->next = leaf;
+        previous = leaf;
+
+        for(unsigned long i = n * BTREE_ORDER; i < count && leaf->count < BTREE_ORDER; i++) {
+            unsigned long key_k = database_kv_alloc(ctx_main, index->rec_database, KV_RECORD_TYPE_RAW, key_lengths[i], keys[i]);
+            if(key_k == -1) {
+                goto done;
+            }
+            leaf->prefix[leaf->count] = _btree_pack(keys[i], key_lengths[i]);
+            leaf->key_k[leaf->count] = key_k;
+            leaf->value[leaf->count] = values[i];
+            leaf->count++;
+            index->count++;
+        }
+    }
+    index->height = 1;
+
+    while(level_count > 1) {
+        unsigned long parent_count = (level_count + BTREE_ORDER) / (BTREE_ORDER + 1);
+
+        for(unsigned long p = 0; p < parent_count; p++) {
+            Btree_node *parent = _btree_node_alloc(ctx_main, index, 0);
+            if(!parent) {
+                goto done;
+            }
+            nodes[node_count++] = parent;
+
+            unsigned long first = p * (BTREE_ORDER + 1), last = first + BTREE_ORDER + 1;
+            if(last > level_count) last = level_count;
+
+            parent->value[0] = (unsigned long)level[first];
+            for(unsigned long c = first + 1; c < last; c++) {
+                unsigned long i = level_first[c];
+                unsigned long key_k = database_kv_alloc(ctx_main, index->rec_database, KV_RECORD_TYPE_RAW, key_lengths[i], keys[i]);
+                if(key_k == -1) {
+                    goto done;
+                }
+                parent->prefix[parent->count] = _btree_pack(keys[i], key_lengths[i]);
+                parent->key_k[parent->count] = key_k;
+                parent->value[parent->count + 1] = (unsigned long)level[c];
+                parent->count++;
+            }
+
+            // Parents are written over the front of the list, which is never read again
+            level_first[p] = level_first[first];
+            level[p] = parent;
+        }
+
+        level_count = parent_count;
+        index->height++;
+    }
+
+    index->root = level[0];
+    ret = 1;
+
+done:
+    if(!ret) {
+        DEBUG_PRINT("\tERR bulk load failed, releasing %lu nodes\n", node_count);
+        for(unsigned long n = 0; n < node_count; n++) {
+            for(int i = 0; i < nodes[n]->count; i++) {
+                database_kv_free(ctx_main, index->rec_database, nodes[n]->key_k[i]);
+            }
+            memory_page_free(ctx_main, (unsigned char *)nodes[n], 1);
+        }
+        index->root = 0;
+        index->count = index->node_count = 0;
+        index->height = 0;
+    }
+
+    memory_free(level);
+    memory_free(nodes);
+    memory_free(level_first);
+
+    return ret;
+}
+
+void
+btree_index_seek(
+    Context_main *ctx_main,
+    Index_btree *index,
+    Btree_cursor *cursor,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    cursor->index = index;
+    cursor->position = 0;
+
+    if(!key) {
+        Btree_node *node = index->root;
+        while(node && !node->is_leaf) {
+            node = _CHILD(node, 0);
+        }
+        cursor->leaf = node;
+        return;
+    }
+
+    unsigned long prefix = _btree_pack(key, key_length);
+    cursor->leaf = _btree_descend(ctx_main, index, prefix, key, key_length, 0, 0, 0);
+    if(cursor->leaf) {
+        cursor->position = _btree_search(ctx_main, index, cursor->leaf, prefix, key, key_length, 0);
+    }
+}
+
+int
+btree_index_next(
+    Context_main *ctx_main,
+    Btree_cursor *cursor,
+    unsigned char **key,
+    unsigned long *key_length,
+    unsigned long *value_k
+) {
+    // Leaves may have been emptied by btree_index_delete()
+    while(cursor->leaf && cursor->position >= cursor->leaf->count) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->position = 0;
+    }
+
+    if(!cursor->leaf) {
+        return 0;
+    }
+
+    unsigned long length;
+    unsigned char *bytes = _btree_key(ctx_main, cursor->index, cursor->leaf->key_k[cursor->position], &length);
+    if(key) key[0] = bytes;
+    if(key_length) key_length[0] = length;
+    if(value_k) value_k[0] = cursor->leaf->value[cursor->position];
+
+    cursor->position++;
+
+    return 1;
+}
+
+unsigned long
+btree_index_range(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned char *low,
+    unsigned long low_length,
+    unsigned char *high,
+    unsigned long high_length,
+    btree_visit_fn fn,
+    void *arg
+) {
+    Btree_cursor cursor;
+    unsigned char *key;
+    unsigned long key_length, value_k, visited = 0;
+
+    btree_index_seek(ctx_main, index, &cursor, low, low_length);
+    while(btree_index_next(ctx_main, &cursor, &key, &key_length, &value_k)) {
+        if(high && _btree_bytes_compare(key, key_length, high, high_length) >= 0) {
+            break;
+        }
+        visited++;
+        if(!fn(key, key_length, value_k, arg)) {
+            break;
+        }
+    }
+
+    return visited;
+}
+
+unsigned long
+btree_index_prefix(
+    Context_main *ctx_main,
+    Index_btree *index,
+    unsigned char *prefix,
+    unsigned long prefix_length,
+    btree_visit_fn fn,
+    void *arg
+) {
+    Btree_cursor cursor;
+    unsigned char *key;
+    unsigned long key_length, value_k, visited = 0;
+
+    btree_index_seek(ctx_main, index, &cursor, prefix, prefix_length);
+    while(btree_index_next(ctx_main, &cursor, &key, &key_length, &value_k)) {
+        if(key_length < prefix_length || memcmp(key, prefix, prefix_length)) {
+            break;
+        }
+        visited++;
+        if(!fn(key, key_length, value_k, arg)) {
+            break;
+        }
+    }
+
+    return visited;
+}
+
+static void
+_btree_node_free(
+    Context_main *ctx_main,
+    Index_btree *index,
+    Btree_node *node
+) {
+    if(!node->is_leaf) {
+        for(int i = 0; i <= node->count; i++) {
+            _btree_node_free(ctx_main, index, _CHILD(node, i));
+        }
+    }
+    for(int i = 0; i < node->count; i++) {
+        database_kv_free(ctx_main, index->rec_database, node->key_k[i]);
+    }
+    memory_page_free(ctx_main, (unsigned char *)node, 1);
+}
+
+void
+btree_index_free(
+    Context_main *ctx_main,
+    Index_btree *index
+) {
+    DEBUG_PRINT("btree_index_free();\n");
+
+    if(index->root) {
+        _btree_node_free(ctx_main, index, index->root);
+    }
+
+    memory_free(index);
+}
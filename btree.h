@@ -0,0 +1,192 @@
+/** @file  btree.h
+ *  @brief An ordered B+tree index from byte-string keys to kv_record keys
+ */
+
+/** @brief Size of a node in bytes. Every node occupies exactly one page from memory_page_alloc(). */
+#define BTREE_NODE_SIZE 4096
+
+/** @brief Maximum number of keys in a node, chosen so that a btree_node fits in BTREE_NODE_SIZE bytes */
+#define BTREE_ORDER 168
+
+/** @brief Maximum height of a tree. With BTREE_ORDER keys per node this is never reached. */
+#define BTREE_MAX_HEIGHT 16
+
+/** @brief A node of an Index_btree
+ *
+ * Keys are stored as two parallel arrays: \a prefix holds the first eight bytes of every key packed
+ * big-endian into an integer, so that most comparisons during a search never leave the node, and
+ * \a key_k holds the kv_record with the full key bytes for breaking ties.
+ *
+ * In a leaf, \a value[i] is the kv_record that key i maps to. In an internal node, \a value[i] is a
+ * pointer to the child holding keys smaller than key i, and \a value[count] the child holding the rest.
+ */
+typedef struct btree_node {
+    unsigned short is_leaf;              ///< 1 for leaves, 0 for internal nodes
+    unsigned short count;                ///< Number of keys in the node
+    unsigned int reserved;               ///< Padding
+    struct btree_node *next;             ///< The leaf to the right of this one (leaves only)
+    unsigned long prefix[BTREE_ORDER];   ///< Packed first eight bytes of each key
+    unsigned long key_k[BTREE_ORDER];    ///< kv_record holding the bytes of each key
+    unsigned long value[BTREE_ORDER + 1];///< kv_record of each key (leaves) or child pointers (internal nodes)
+} Btree_node;
+
+/** @brief Maps byte-string keys, in lexicographic order, to kv_record keys
+ *
+ * Key bytes are stored as KV_RECORD_TYPE_RAW values in \a rec_database. Separator keys in internal nodes
+ * have their own copy, so that removing a key from a leaf never invalidates a separator.
+ *
+ * Removal does not rebalance the tree: leaves may become underfull or even empty, and are skipped over
+ * when iterating.
+ */
+typedef struct btree_index {
+    Record_database *rec_database; ///< Database the key bytes are stored in
+    Btree_node *root;              ///< Root node (a leaf while the tree is small), or 0 when empty
+    unsigned long count;           ///< Number of keys in the tree
+    unsigned long node_count;      ///< Number of nodes allocated
+    int height;                    ///< Number of levels
+} Index_btree;
+
+/** @brief A position in an Index_btree
+ *  @see   btree_index_seek()
+ *  @see   btree_index_next()
+ */
+typedef struct btree_cursor {
+    Index_btree *index; ///< The tree being iterated
+    Btree_node *leaf;   ///< The current leaf, or 0 once iteration is complete
+    int position;       ///< The next key of \a leaf to return
+} Btree_cursor;
+
+/** @brief Called for every key visited by btree_index_range() and btree_index_prefix()
+ *  @returns 1 to continue, 0 to stop
+ */
+typedef int (*btree_visit_fn)(
+    unsigned char *key,       ///<[in] key bytes
+    unsigned long key_length, ///<[in] length of \a key in bytes
+    unsigned long value_k,    ///<[in] kv_record the key maps to
+    void *arg                 ///<[in] caller's argument
+    );
+
+/** @brief   Creates an empty B+tree that stores its key bytes in \a rec_database
+ *  @returns A pointer to the tree on success, or 0 on failure
+ *  @see     btree_index_free()
+ */
+Index_btree *
+btree_index_create(
+    Context_main *ctx_main,       ///<[in] main context
+    Record_database *rec_database ///<[in] database record
+    );
+
+/** @brief Maps \a key to \a value_k, replacing any previous mapping of \a key
+ *  @returns 1 on success, 0 on failure
+ */
+int
+btree_index_put(
+    Context_main *ctx_main,   ///<[in] main context
+    Index_btree *index,       ///<[in] tree
+    unsigned char *key,       ///<[in] key bytes
+    unsigned long key_length, ///<[in] length of \a key in bytes
+    unsigned long value_k     ///<[in] kv_record to map \a key to
+    );
+
+/** @brief   Looks up \a key
+ *  @returns The kv_record key that \a key maps to, or -1 if there is none
+ */
+unsigned long
+btree_index_get(
+    Context_main *ctx_main,  ///<[in] main context
+    Index_btree *index,      ///<[in] tree
+    unsigned char *key,      ///<[in] key bytes
+    unsigned long key_length ///<[in] length of \a key in bytes
+    );
+
+/** @brief Removes \a key, freeing the copy of its bytes (but not the kv_record it mapped to)
+ *  @returns 1 if \a key was removed, 0 if it wasn't in the tree
+ */
+int
+btree_index_delete(
+    Context_main *ctx_main,  ///<[in] main context
+    Index_btree *index,      ///<[in] tree
+    unsigned char *key,      ///<[in] key bytes
+    unsigned long key_length ///<[in] length of \a key in bytes
+    );
+
+/** @brief Builds the tree from \a count keys that are already sorted in strictly ascending order
+ *
+ * Leaves are packed full and the internal levels are built bottom-up, which is much faster than
+ * \a count calls to btree_index_put(). The tree must be empty.
+ *
+ * @returns 1 on success, 0 on failure (including when the input isn't sorted)
+ */
+int
+btree_index_bulk_load(
+    Context_main *ctx_main,       ///<[in] main context
+    Index_btree *index,           ///<[in] tree
+    unsigned char **keys,         ///<[in] key bytes
+    unsigned long *key_lengths,   ///<[in] length of each key in bytes
+    unsigned long *values,        ///<[in] kv_record each key maps to
+    unsigned long count           ///<[in] number of keys
+    );
+
+/** @brief Positions \a cursor at the first key that is >= \a key, or at the first key if \a key is 0 */
+void
+btree_index_seek(
+    Context_main *ctx_main,   ///<[in]  main context
+    Index_btree *index,       ///<[in]  tree
+    Btree_cursor *cursor,     ///<[out] cursor
+    unsigned char *key,       ///<[in]  key bytes, or 0
+    unsigned long key_length  ///<[in]  length of \a key in bytes
+    );
+
+/** @brief Returns the key under \a cursor and advances it, in ascending key order
+ *
+ * The pointer written to \a key points into bucket memory, with the same caveats as the one
+ * returned by database_kv_get_value().
+ *
+ * @returns 1 if a key was returned, 0 at the end of the tree
+ */
+int
+btree_index_next(
+    Context_main *ctx_main,   ///<[in]  main context
+    Btree_cursor *cursor,     ///<[in]  cursor
+    unsigned char **key,      ///<[out] key bytes
+    unsigned long *key_length,///<[out] length of the key in bytes
+    unsigned long *value_k    ///<[out] kv_record the key maps to
+    );
+
+/** @brief Calls \a fn for every key in [\a low, \a high), in ascending order
+ *
+ * Either bound may be 0 to leave that side of the range open.
+ *
+ * @returns The number of keys visited
+ */
+unsigned long
+btree_index_range(
+    Context_main *ctx_main,    ///<[in] main context
+    Index_btree *index,        ///<[in] tree
+    unsigned char *low,        ///<[in] inclusive lower bound, or 0
+    unsigned long low_length,  ///<[in] length of \a low in bytes
+    unsigned char *high,       ///<[in] exclusive upper bound, or 0
+    unsigned long high_length, ///<[in] length of \a high in bytes
+    btree_visit_fn fn,         ///<[in] called for every key
+    void *arg                  ///<[in] passed through to \a fn
+    );
+
+/** @brief Calls \a fn for every key that starts with \a prefix, in ascending order
+ *  @returns The number of keys visited
+ */
+unsigned long
+btree_index_prefix(
+    Context_main *ctx_main,      ///<[in] main context
+    Index_btree *index,          ///<[in] tree
+    unsigned char *prefix,       ///<[in] prefix bytes
+    unsigned long prefix_length, ///<[in] length of \a prefix in bytes
+    btree_visit_fn fn,           ///<[in] called for every key
+    void *arg                    ///<[in] passed through to \a fn
+    );
+
+/** @brief Frees every node of \a index along with the copies of its key bytes */
+void
+btree_index_free(
+    Context_main *ctx_main, ///<[in] main context
+    Index_btree *index      ///<[in] tree
+    );
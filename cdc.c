@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "cdc.h"
+
+#ifndef DEBUG_CDC
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define _CDC_CACHE_LINE 64
+
+// The event in a slot is complete when its sequence is 2 * position + 2, and being written when
+// it's 2 * position + 1, where position is the place in the feed it's been claimed for
+typedef struct cdc_slot {
+    unsigned long sequence;
+    Cdc_event event;
+} Cdc_slot;
+
+struct cdc_feed {
+    unsigned long head;        // Position the next event goes to
+    char pad_head[_CDC_CACHE_LINE - sizeof(unsigned long)];
+    unsigned long mask;        // Slots - 1
+    Cdc_slot *slots;
+};
+
+Cdc_feed *
+cdc_feed_create(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned long capacity
+) {
+    DEBUG_PRINT("cdc_feed_create(capacity = %lu);\n", capacity);
+
+    if(rec_database->cdc || capacity == 0) {
+        return 0;
+    }
+    unsigned long slots = 1;
+    while(slots < capacity) {
+        slots <<= 1;
+    }
+
+    RECORD_CREATE(Cdc_feed, feed);
+    if(!feed) {
+        return 0;
+    }
+    feed->mask = slots - 1;
+    feed->slots = (Cdc_slot *)memory_alloc(slots * sizeof(Cdc_slot));
+    if(!feed->slots) {
+        memory_free(feed);
+        return 0;
+    }
+
+    // Released, for the writers of a concurrent database that check for a feed without a lock
+    __atomic_store_n(&rec_database->cdc, feed, __ATOMIC_RELEASE);
+    return feed;
+}
+
+void
+cdc_feed_free(
+    Context_main *ctx_main,
+    Record_database *rec_database
+) {
+    DEBUG_PRINT("cdc_feed_free();\n");
+
+    Cdc_feed *feed = rec_database->cdc;
+    if(!feed) {
+        return;
+    }
+    rec_database->cdc = 0;
+    memory_free(feed->slots);
+    memory_free(feed);
+}
+
+void
+cdc_publish(
+    Cdc_feed *feed,
+    unsigned char op,
+    unsigned long k,
+    unsigned long size
+) {
+    unsigned long position = __atomic_fetch_add(&feed->head, 1, __ATOMIC_RELAXED);
+    Cdc_slot *slot = &feed->slots[position & feed->mask];
+
+    __atomic_store_n(&slot->sequence, 2 * position + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->event.k = k;
+    slot->event.version = position + 1;
+    slot->event.size = size;
+    slot->event.op = op;
+    __atomic_store_n(&slot->sequence, 2 * position + 2, __ATOMIC_RELEASE);
+}
+
+void
+cdc_cursor_init(
+    Cdc_feed *feed,
+    Cdc_cursor *cursor
+) {
+    cursor->position = __atomic_load_n(&feed->head, __ATOMIC_ACQUIRE);
+}
+
+int
+cdc_next(
+    Cdc_feed *feed,
+    Cdc_cursor *cursor,
+    Cdc_event *event
+) {
+    unsigned long position = cursor->position,
+                  head = __atomic_load_n(&feed->head, __ATOMIC_ACQUIRE);
+    if(position >= head) {
+        return CDC_NONE;
+    }
+
+    if(head - position <= feed->mask + 1) {
+        Cdc_slot *slot = &feed->slots[position & feed->mask];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if(sequence < 2 * position + 2) {
+            // Claimed, but its writer isn't done with it yet
+            return CDC_NONE;
+        }
+        if(sequence == 2 * position + 2) {
+            memcpy(event, &slot->event, sizeof(Cdc_event));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+                cursor->position = position + 1;
+                return CDC_EVENT;
+            }
+        }
+    }
+
+    // Overwritten before it was read
+    DEBUG_PRINT("\tcursor at %lu fell behind head %lu\n", position, head);
+    cursor->position = __atomic_load_n(&feed->head, __ATOMIC_ACQUIRE);
+    return CDC_RESYNC;
+}
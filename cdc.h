@@ -0,0 +1,98 @@
+/** @file  cdc.h
+ *  @brief Change data capture: a feed of every change made to a Record_database, that consumers follow at their own pace
+ */
+
+/** @brief What happened to a record */
+enum cdc_op {
+    CDC_OP_ALLOC = 1,     ///< database_kv_alloc(), or a record put in place by database_wal_replay()
+    CDC_OP_SET_VALUE = 2, ///< database_kv_set_value()
+    CDC_OP_FREE = 3       ///< database_kv_free() of a record that wasn't already free
+};
+
+/** @brief What cdc_next() found */
+enum cdc_result {
+    CDC_NONE = 0,   ///< Nothing new since the last event
+    CDC_EVENT = 1,  ///< The next event
+    CDC_RESYNC = -1 ///< The cursor fell too far behind, and events were lost
+};
+
+/** @brief A change to a record */
+typedef struct cdc_event {
+    unsigned long k;       ///< Key of the record
+    unsigned long version; ///< Count of changes made to the database since the feed started, this one included
+    unsigned long size;    ///< Size of the value after the change, 0 for CDC_OP_FREE
+    unsigned char op;      ///< One of cdc_op
+    unsigned char reserved[7];
+} Cdc_event;
+
+/** @brief A bounded ring of the latest Cdc_event of a database
+ *
+ * Every change is written to the next slot, overwriting the oldest, without locks: writers claim
+ * slots with an atomic increment, so writes may come from several threads at once, as long as
+ * there are fewer of them than slots. Consumers never hold up writers. Each consumer keeps its own
+ * Cdc_cursor, and one that falls more than a ring behind is told to resync.
+ *
+ * Events are published by database_kv_alloc(), database_kv_set_value(), database_kv_free(),
+ * database_batch_commit() and database_wal_replay() once the change is made, and by their
+ * database_concurrent_ counterparts for the database_concurrent_record() of a Database_concurrent,
+ * where the changes to any one record are published in the order they're made. A database without
+ * a feed only pays for checking that it has none.
+ */
+typedef struct cdc_feed Cdc_feed;
+
+/** @brief Where a consumer is in a feed */
+typedef struct cdc_cursor {
+    unsigned long position; ///< Version of the next event to read, minus one
+} Cdc_cursor;
+
+/** @brief Starts a feed of the changes to \a rec_database, holding the latest \a capacity of them
+ *
+ * \a capacity is rounded up to a power of two.
+ *
+ * @returns A pointer to the feed on success, or 0 on failure, or if \a rec_database has one already
+ * @see     cdc_feed_free()
+ */
+Cdc_feed *
+cdc_feed_create(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    unsigned long capacity         ///<[in] number of events kept
+    );
+
+/** @brief Stops the feed of \a rec_database, and frees it. No consumer may be reading it. */
+void
+cdc_feed_free(
+    Context_main *ctx_main,       ///<[in] main context
+    Record_database *rec_database ///<[in] database record
+    );
+
+/** @brief Adds an event to \a feed. Called by the functions that change a database. */
+void
+cdc_publish(
+    Cdc_feed *feed,      ///<[in] feed
+    unsigned char op,    ///<[in] one of cdc_op
+    unsigned long k,     ///<[in] key of the record
+    unsigned long size   ///<[in] size of the value after the change
+    );
+
+/** @brief Sets \a cursor to read the events published from now on */
+void
+cdc_cursor_init(
+    Cdc_feed *feed,    ///<[in]  feed
+    Cdc_cursor *cursor ///<[out] cursor
+    );
+
+/** @brief Reads the event at \a cursor, and moves it on
+ *
+ * On CDC_RESYNC, the cursor is moved to the newest event, and the consumer should rescan the
+ * database, as the changes it missed are gone. Events from the moment it was told to resync on
+ * are then read as usual.
+ *
+ * @returns One of cdc_result, with the event in \a event for CDC_EVENT
+ */
+int
+cdc_next(
+    Cdc_feed *feed,     ///<[in]     feed
+    Cdc_cursor *cursor, ///<[in,out] cursor
+    Cdc_event *event    ///<[out]    event
+    );
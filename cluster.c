@@ -0,0 +1,729 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "hash.h"
+#include "server.h"
+#include "cluster.h"
+
+#ifndef DEBUG_CLUSTER
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define _CLUSTER_PATH_MAX sizeof(((struct sockaddr_un *)0)->sun_path)
+
+struct cluster_context {
+    Context_main *ctx_main;
+    char prefix[_CLUSTER_PATH_MAX];
+    int count;
+    pid_t pids[CLUSTER_MAX];
+    char paths[CLUSTER_MAX][_CLUSTER_PATH_MAX];
+};
+
+// A connection to one partition, with the requests not yet written and the responses not yet read
+typedef struct cluster_link {
+    int fd;
+    unsigned char *out;
+    unsigned long out_start;
+    unsigned long out_length;
+    unsigned long out_capacity;
+    unsigned char *in;
+    unsigned long in_length;
+    unsigned long in_capacity;
+    unsigned long expected;    // Responses still to come
+} Cluster_link;
+
+struct cluster_router {
+    Context_main *ctx_main;
+    Cluster_link links[CLUSTER_MAX];
+    int count;                 // Partitions keys are routed by, not counting the one being filled
+
+    int *targets;              // Partition each op of a batch goes to, or -1
+    unsigned char *statuses;   // Status each op of a batch had in the first round
+    unsigned long *order;      // Inserts and deletes of a batch into the new partition, by key then position
+    unsigned long capacity;    // Ops targets, statuses and order have room for
+
+    // Moving keys into partition count
+    int rebalancing;
+    int source;                // Partition being gone through
+    unsigned long cursor;      // Where in it, for SERVER_OP_SCAN
+    unsigned long moved;       // Keys moved out of it in this pass over it
+    unsigned char *scan;       // The last response to SERVER_OP_SCAN
+    unsigned long scan_length;
+    unsigned long scan_capacity;
+    Cluster_op *moves;
+    unsigned long moves_capacity;
+};
+
+int
+cluster_partition(
+    unsigned char *key,
+    unsigned long key_length,
+    int count
+) {
+    unsigned long hash = hash_bytes(key, key_length);
+    long b = -1, j = 0;
+
+    while(j < count) {
+        b = j;
+        hash = hash * 2862933555777941757UL + 1;
+        j = (long)((b + 1) * ((double)(1L << 31) / (double)((hash >> 33) + 1)));
+    }
+
+    return (int)b;
+}
+
+static Context_server *_cluster_server;
+
+static void
+_cluster_signal(
+    int signal
+) {
+    server_stop(_cluster_server);
+}
+
+// Runs in the forked server process, and reports whether it's listening on ready
+static void
+_cluster_serve(
+    Context_main *ctx_main,
+    const char *path,
+    int ready
+) {
+    // Let go of everything inherited but the pipe, so no connection of the parent's stays open here
+    if(ready > 3) close_range(3, ready - 1, 0);
+    close_range(ready + 1, ~0U, 0);
+
+    unsigned char ok = 0;
+    Record_database *rec_database = (Record_database *)memory_alloc(sizeof(Record_database));
+    _cluster_server = rec_database ? server_create(ctx_main, rec_database, path) : 0;
+    if(_cluster_server) {
+        struct sigaction action = { .sa_handler = _cluster_signal };
+        sigaction(SIGTERM, &action, 0);
+        ok = 1;
+    }
+    if(write(ready, &ok, 1) != 1 || !ok) {
+        _exit(1);
+    }
+    close(ready);
+
+    ok = server_run(_cluster_server);
+    server_free(_cluster_server);
+    database_ptbl_free(ctx_main, rec_database);
+    memory_free(rec_database);
+    _exit(ok ? 0 : 1);
+}
+
+Context_cluster *
+cluster_create(
+    Context_main *ctx_main,
+    const char *prefix,
+    int count
+) {
+    DEBUG_PRINT("cluster_create(prefix = %s, count = %d);\n", prefix, count);
+
+    if(count < 1 || count > CLUSTER_MAX || strlen(prefix) + 4 >= _CLUSTER_PATH_MAX) {
+        return 0;
+    }
+    RECORD_CREATE(Context_cluster, cluster);
+    if(!cluster) {
+        return 0;
+    }
+    cluster->ctx_main = ctx_main;
+    strcpy(cluster->prefix, prefix);
+
+    for(int i = 0; i < count; i++) {
+        if(cluster_add(cluster) == -1) {
+            cluster_free(cluster);
+            return 0;
+        }
+    }
+
+    return cluster;
+}
+
+int
+cluster_add(
+    Context_cluster *cluster
+) {
+    int partition = cluster->count, ready[2];
+    if(partition == CLUSTER_MAX || pipe(ready) != 0) {
+        return -1;
+    }
+    snprintf(cluster->paths[partition], _CLUSTER_PATH_MAX, "%s.%d", cluster->prefix, partition);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if(pid == 0) {
+        close(ready[0]);
+        _cluster_serve(cluster->ctx_main, cluster->paths[partition], ready[1]);
+    }
+    close(ready[1]);
+
+    unsigned char ok = 0;
+    ssize_t length;
+    do {
+        length = (pid > 0) ? read(ready[0], &ok, 1) : 0;
+    } while(length < 0 && errno == EINTR);
+    close(ready[0]);
+    if(length != 1 || !ok) {
+        DEBUG_PRINT("\tERR server for %s didn't start\n", cluster->paths[partition]);
+        if(pid > 0) waitpid(pid, 0, 0);
+        return -1;
+    }
+
+    cluster->pids[partition] = pid;
+    cluster->count++;
+    return partition;
+}
+
+int
+cluster_count(
+    Context_cluster *cluster
+) {
+    return cluster->count;
+}
+
+const char *
+cluster_path(
+    Context_cluster *cluster,
+    int partition
+) {
+    return cluster->paths[partition];
+}
+
+void
+cluster_free(
+    Context_cluster *cluster
+) {
+    for(int i = 0; i < cluster->count; i++) {
+        kill(cluster->pids[i], SIGTERM);
+    }
+    for(int i = 0; i < cluster->count; i++) {
+        while(waitpid(cluster->pids[i], 0, 0) < 0 && errno == EINTR);
+    }
+    memory_free(cluster);
+}
+
+static int
+_cluster_reserve(
+    unsigned char **buffer,
+    unsigned long *capacity,
+    unsigned long needed
+) {
+    if(needed <= *capacity) {
+        return 1;
+    }
+    unsigned long new_capacity = *capacity ? *capacity : SERVER_READ_CHUNK;
+    while(new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    unsigned char *new_buffer = memory_realloc(*buffer, *capacity, new_capacity);
+    if(!new_buffer) {
+        return 0;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static int
+_cluster_link_open(
+    Cluster_link *link,
+    const char *path
+) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    link->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(link->fd < 0 || connect(link->fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        DEBUG_PRINT("\tERR failed to connect to %s\n", path);
+        if(link->fd >= 0) close(link->fd);
+        link->fd = -1;
+        return 0;
+    }
+    // Connected first, as a nonblocking connect() may not be done when it returns
+    int flags = fcntl(link->fd, F_GETFL);
+    fcntl(link->fd, F_SETFL, flags | O_NONBLOCK);
+    return 1;
+}
+
+static void
+_cluster_link_close(
+    Cluster_link *link
+) {
+    if(link->fd >= 0) close(link->fd);
+    if(link->out) memory_free(link->out);
+    if(link->in) memory_free(link->in);
+    memset(link, 0, sizeof(Cluster_link));
+}
+
+// Queues a request for op, with id, on link
+static int
+_cluster_link_request(
+    Cluster_link *link,
+    Cluster_op *op,
+    unsigned int id,
+    unsigned long k
+) {
+    unsigned int value_length = (op->op == SERVER_OP_PUT || op->op == SERVER_OP_INSERT) ? op->value_length : 0,
+                 length = op->key_length + value_length;
+    if(!_cluster_reserve(&link->out, &link->out_capacity, link->out_length + sizeof(Server_request) + length)) {
+        return 0;
+    }
+    Server_request request = { length, op->op, op->flags, 0, id, 0, k };
+    unsigned char *out = link->out + link->out_length;
+    memcpy(out, &request, sizeof(request));
+    if(op->key_length) memcpy(out + sizeof(request), op->key, op->key_length);
+    if(value_length) memcpy(out + sizeof(request) + op->key_length, op->value, value_length);
+    link->out_length += sizeof(request) + length;
+    link->expected++;
+    return 1;
+}
+
+// Takes every whole response out of link->in
+static int
+_cluster_link_responses(
+    Cluster_router *router,
+    Cluster_link *link,
+    Cluster_op *ops
+) {
+    unsigned long at = 0;
+    Server_response response;
+
+    while(link->in_length - at >= sizeof(response)) {
+        memcpy(&response, link->in + at, sizeof(response));
+        if(link->in_length - at < sizeof(response) + response.length) {
+            break;
+        }
+        unsigned char *value = link->in + at + sizeof(response);
+        Cluster_op *op = &ops[response.id];
+
+        op->status = response.status;
+        if(op->op == SERVER_OP_LOOKUP && response.status == SERVER_STATUS_OK) {
+            op->flags = response.flags;
+            op->size = response.length;
+            memcpy(op->value, value, (response.length < op->value_length) ? response.length : op->value_length);
+        }
+        else if(op->op == SERVER_OP_SCAN) {
+            if(!_cluster_reserve(&router->scan, &router->scan_capacity, response.length)) {
+                return 0;
+            }
+            memcpy(router->scan, value, response.length);
+            router->scan_length = response.length;
+            router->cursor = response.k;
+        }
+
+        link->expected--;
+        at += sizeof(response) + response.length;
+    }
+
+    memmove(link->in, link->in + at, link->in_length - at);
+    link->in_length -= at;
+    return 1;
+}
+
+// Sends ops[i] to partition targets[i], for every target that isn't -1, and waits for all of them.
+// Every partition's requests go out before any response is waited on, and writing and reading are
+// interleaved, so that no server stalls on responses nobody reads.
+static int
+_cluster_router_round(
+    Cluster_router *router,
+    Cluster_op *ops,
+    int *targets,
+    unsigned long count,
+    unsigned long k
+) {
+    int links = router->count + router->rebalancing;
+
+    for(unsigned long i = 0; i < count; i++) {
+        if(targets[i] != -1 && !_cluster_link_request(&router->links[targets[i]], &ops[i], i, (ops[i].op == SERVER_OP_SCAN) ? k : ops[i].key_length)) {
+            return 0;
+        }
+    }
+
+    struct pollfd fds[CLUSTER_MAX];
+    for(;;) {
+        int waiting = 0;
+        for(int p = 0; p < links; p++) {
+            Cluster_link *link = &router->links[p];
+            fds[p].fd = link->fd;
+            fds[p].events = ((link->out_start < link->out_length) ? POLLOUT : 0) | (link->expected ? POLLIN : 0);
+            fds[p].revents = 0;
+            waiting += (fds[p].events != 0);
+            if(!fds[p].events) fds[p].fd = -1;
+        }
+        if(!waiting) {
+            return 1;
+        }
+        if(poll(fds, links, -1) < 0) {
+            if(errno == EINTR) continue;
+            return 0;
+        }
+
+        for(int p = 0; p < links; p++) {
+            Cluster_link *link = &router->links[p];
+            if(fds[p].revents & POLLOUT) {
+                ssize_t written = send(link->fd, link->out + link->out_start, link->out_length - link->out_start, MSG_NOSIGNAL);
+                if(written < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return 0;
+                }
+                if(written > 0) link->out_start += written;
+                if(link->out_start == link->out_length) {
+                    link->out_start = link->out_length = 0;
+                }
+            }
+            if(fds[p].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if(!_cluster_reserve(&link->in, &link->in_capacity, link->in_length + SERVER_READ_CHUNK)) {
+                    return 0;
+                }
+                ssize_t length = recv(link->fd, link->in + link->in_length, link->in_capacity - link->in_length, 0);
+                if(length == 0 || (length < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    DEBUG_PRINT("\tERR partition %d hung up\n", p);
+                    return 0;
+                }
+                if(length > 0) {
+                    link->in_length += length;
+                    if(!_cluster_link_responses(router, link, ops)) {
+                        return 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static int
+_cluster_router_reserve(
+    Cluster_router *router,
+    unsigned long count
+) {
+    if(count <= router->capacity) {
+        return 1;
+    }
+    int *targets = (int *)memory_realloc(router->targets, router->capacity * sizeof(int), count * sizeof(int));
+    if(!targets) {
+        return 0;
+    }
+    router->targets = targets;
+    unsigned char *statuses = memory_realloc(router->statuses, router->capacity, count);
+    if(!statuses) {
+        return 0;
+    }
+    router->statuses = statuses;
+    unsigned long *order = (unsigned long *)memory_realloc(router->order, router->capacity * sizeof(unsigned long), count * sizeof(unsigned long));
+    if(!order) {
+        return 0;
+    }
+    router->order = order;
+    router->capacity = count;
+    return 1;
+}
+
+// Compares the keys of ops x and y, shortest first
+static int
+_cluster_key_compare(
+    Cluster_op *ops,
+    unsigned long x,
+    unsigned long y
+) {
+    if(ops[x].key_length != ops[y].key_length) return (ops[x].key_length < ops[y].key_length) ? -1 : 1;
+    return memcmp(ops[x].key, ops[y].key, ops[x].key_length);
+}
+
+// Orders positions in a batch by the key of their op, then by position
+static int
+_cluster_order_compare(
+    const void *a,
+    const void *b,
+    void *arg
+) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    int c = _cluster_key_compare((Cluster_op *)arg, x, y);
+    if(c) return c;
+    return (x < y) ? -1 : (x > y);
+}
+
+Cluster_router *
+cluster_router_create(
+    Context_main *ctx_main,
+    const char **paths,
+    int count
+) {
+    DEBUG_PRINT("cluster_router_create(count = %d);\n", count);
+
+    if(count < 1 || count > CLUSTER_MAX) {
+        return 0;
+    }
+    RECORD_CREATE(Cluster_router, router);
+    if(!router) {
+        return 0;
+    }
+    router->ctx_main = ctx_main;
+    for(int p = 0; p < count; p++) {
+        if(!_cluster_link_open(&router->links[p], paths[p])) {
+            cluster_router_free(router);
+            return 0;
+        }
+        router->count++;
+    }
+    return router;
+}
+
+static int
+_cluster_router_reserve_moves(
+    Cluster_router *router,
+    unsigned long count
+) {
+    if(count <= router->moves_capacity) {
+        return 1;
+    }
+    unsigned long new_capacity = router->moves_capacity ? router->moves_capacity : 256;
+    while(new_capacity < count) {
+        new_capacity *= 2;
+    }
+    Cluster_op *moves = (Cluster_op *)memory_realloc(router->moves, router->moves_capacity * sizeof(Cluster_op), new_capacity * sizeof(Cluster_op));
+    if(!moves) {
+        return 0;
+    }
+    router->moves = moves;
+    router->moves_capacity = new_capacity;
+    return 1;
+}
+
+// Goes through the next part of the source partition, and moves the keys in it that belong to the new one
+static int
+_cluster_router_migrate(
+    Cluster_router *router
+) {
+    Cluster_op scan = { .op = SERVER_OP_SCAN };
+    int target = router->source;
+    if(!_cluster_router_round(router, &scan, &target, 1, router->cursor) || scan.status != SERVER_STATUS_OK) {
+        return 0;
+    }
+
+    unsigned long count = 0;
+    for(unsigned long at = 0; at < router->scan_length; ) {
+        Server_entry entry;
+        memcpy(&entry, router->scan + at, sizeof(entry));
+        unsigned char *key = router->scan + at + sizeof(entry);
+        at += sizeof(entry) + entry.key_length + entry.value_length;
+        if(cluster_partition(key, entry.key_length, router->count + 1) != router->count) {
+            continue;
+        }
+
+        if(!_cluster_router_reserve_moves(router, count + 1)) {
+            return 0;
+        }
+        router->moves[count++] = (Cluster_op){
+            .op = SERVER_OP_INSERT, .flags = entry.flags,
+            .key = key, .key_length = entry.key_length,
+            .value = key + entry.key_length, .value_length = entry.value_length
+        };
+    }
+
+    if(count) {
+        DEBUG_PRINT("\tmoving %lu keys from partition %d\n", count, router->source);
+        if(!_cluster_router_reserve(router, count)) {
+            return 0;
+        }
+        // Into the new partition, keeping any value written there since, then out of the old one
+        for(unsigned long i = 0; i < count; i++) router->targets[i] = router->count;
+        if(!_cluster_router_round(router, router->moves, router->targets, count, 0)) {
+            return 0;
+        }
+        for(unsigned long i = 0; i < count; i++) {
+            if(router->moves[i].status != SERVER_STATUS_OK && router->moves[i].status != SERVER_STATUS_EXISTS) {
+                return 0;
+            }
+            router->moves[i].op = SERVER_OP_DELETE;
+            router->targets[i] = router->source;
+        }
+        if(!_cluster_router_round(router, router->moves, router->targets, count, 0)) {
+            return 0;
+        }
+        router->moved += count;
+    }
+
+    if(router->cursor == 0) {
+        // Writes to the partition may have moved keys across the cursor, so it's gone through again
+        // until a pass finds nothing to move. Nothing new for the new partition is written to it.
+        if(router->moved == 0) {
+            router->source++;
+        }
+        router->moved = 0;
+        if(router->source == router->count) {
+            DEBUG_PRINT("\tpartition %d filled\n", router->count);
+            router->rebalancing = 0;
+            router->count++;
+        }
+    }
+
+    return 1;
+}
+
+int
+cluster_router_execute(
+    Cluster_router *router,
+    Cluster_op *ops,
+    unsigned long count
+) {
+    if(!_cluster_router_reserve(router, count)) {
+        return 0;
+    }
+
+    int partitions = router->count + router->rebalancing;
+    if(router->rebalancing) {
+        // An insert into the new partition has to miss in the old one too, where the key may still be,
+        // unless the batch deletes the key before it: that delete reaches the old partition in the
+        // last round, and the insert has to find the key gone
+        unsigned long probes = 0, ordered = 0;
+        for(unsigned long i = 0; i < count; i++) {
+            router->targets[i] = -1;
+            if((ops[i].op == SERVER_OP_INSERT || ops[i].op == SERVER_OP_DELETE)
+                    && cluster_partition(ops[i].key, ops[i].key_length, partitions) == router->count) {
+                router->order[ordered++] = i;
+            }
+        }
+        qsort_r(router->order, ordered, sizeof(unsigned long), _cluster_order_compare, ops);
+        for(unsigned long j = 0, deleted = 0; j < ordered; j++) {
+            unsigned long i = router->order[j];
+            if(j == 0 || _cluster_key_compare(ops, router->order[j - 1], i) != 0) {
+                deleted = 0;
+            }
+            if(ops[i].op == SERVER_OP_DELETE) {
+                deleted = 1;
+            }
+            else if(!deleted) {
+                router->targets[i] = cluster_partition(ops[i].key, ops[i].key_length, router->count);
+                probes++;
+            }
+        }
+        if(probes) {
+            if(!_cluster_router_reserve_moves(router, count)) {
+                return 0;
+            }
+            for(unsigned long i = 0; i < count; i++) {
+                if(router->targets[i] != -1) {
+                    router->moves[i] = (Cluster_op){ .op = SERVER_OP_LOOKUP, .key = ops[i].key, .key_length = ops[i].key_length, .value = ops[i].key };
+                }
+            }
+            if(!_cluster_router_round(router, router->moves, router->targets, count, 0)) {
+                return 0;
+            }
+        }
+    }
+    for(unsigned long i = 0; i < count; i++) {
+        if(router->rebalancing && router->targets[i] != -1 && router->moves[i].status == SERVER_STATUS_OK) {
+            ops[i].status = SERVER_STATUS_EXISTS;
+            router->targets[i] = -1;
+            continue;
+        }
+        router->targets[i] = cluster_partition(ops[i].key, ops[i].key_length, partitions);
+    }
+    if(!_cluster_router_round(router, ops, router->targets, count, 0)) {
+        return 0;
+    }
+
+    if(router->rebalancing) {
+        // Keys of the new partition that may not have been moved yet: look them up where they were
+        // if the new partition didn't have them, and delete them from there too
+        unsigned long again = 0;
+        for(unsigned long i = 0; i < count; i++) {
+            router->statuses[i] = ops[i].status;
+            if(router->targets[i] == router->count
+                    && (ops[i].op == SERVER_OP_DELETE || (ops[i].op == SERVER_OP_LOOKUP && ops[i].status == SERVER_STATUS_NOT_FOUND))) {
+                router->targets[i] = cluster_partition(ops[i].key, ops[i].key_length, router->count);
+                again++;
+            }
+            else {
+                router->targets[i] = -1;
+            }
+        }
+        if(again) {
+            if(!_cluster_router_round(router, ops, router->targets, count, 0)) {
+                return 0;
+            }
+            for(unsigned long i = 0; i < count; i++) {
+                if(ops[i].op == SERVER_OP_DELETE && router->statuses[i] == SERVER_STATUS_OK) {
+                    ops[i].status = SERVER_STATUS_OK;
+                }
+            }
+        }
+
+        return _cluster_router_migrate(router);
+    }
+
+    return 1;
+}
+
+int
+cluster_router_add(
+    Cluster_router *router,
+    const char *path
+) {
+    DEBUG_PRINT("cluster_router_add(path = %s);\n", path);
+
+    if(!cluster_router_rebalance(router, 1) || router->count == CLUSTER_MAX) {
+        return 0;
+    }
+    if(!_cluster_link_open(&router->links[router->count], path)) {
+        return 0;
+    }
+    router->rebalancing = 1;
+    router->source = 0;
+    router->cursor = 0;
+    router->moved = 0;
+    return 1;
+}
+
+int
+cluster_router_rebalance(
+    Cluster_router *router,
+    int finish
+) {
+    do {
+        if(router->rebalancing && !_cluster_router_migrate(router)) {
+            return 0;
+        }
+    } while(finish && router->rebalancing);
+    return 1;
+}
+
+int
+cluster_router_rebalancing(
+    Cluster_router *router
+) {
+    return router->rebalancing;
+}
+
+void
+cluster_router_free(
+    Cluster_router *router
+) {
+    for(int p = 0; p < router->count + router->rebalancing; p++) {
+        _cluster_link_close(&router->links[p]);
+    }
+    if(router->targets) memory_free(router->targets);
+    if(router->statuses) memory_free(router->statuses);
+    if(router->order) memory_free(router->order);
+    if(router->scan) memory_free(router->scan);
+    if(router->moves) memory_free(router->moves);
+    memory_free(router);
+}
@@ -0,0 +1,150 @@
+/** @file  cluster.h
+ *  @brief Server processes on one host that each own a hash partition of the named keys, and a router that spreads requests over them
+ */
+
+/** @brief Maximum number of partitions in a cluster */
+#define CLUSTER_MAX 64
+
+/** @brief   Returns the partition, out of \a count, that \a key belongs to
+ *
+ * This is a jump consistent hash of hash_bytes(): going from \a count to \a count + 1 partitions
+ * moves a key into the new partition or leaves it where it was, and moves only one key in
+ * \a count + 1 on average.
+ */
+int
+cluster_partition(
+    unsigned char *key,       ///<[in] key bytes
+    unsigned long key_length, ///<[in] length of \a key in bytes
+    int count                 ///<[in] number of partitions
+    );
+
+/** @brief A set of server processes, one per partition
+ *
+ * Each is a fork of the calling process with a Record_database of its own, serving on the Unix
+ * domain socket at the cluster's prefix followed by "." and the partition.
+ */
+typedef struct cluster_context Context_cluster;
+
+/** @brief   Starts \a count servers, at \a prefix.0 up to \a prefix.<count - 1>
+ *  @returns A pointer to the cluster once every server is listening, or 0 on failure
+ *  @see     cluster_free()
+ */
+Context_cluster *
+cluster_create(
+    Context_main *ctx_main, ///<[in] main context
+    const char *prefix,     ///<[in] path the sockets are named after
+    int count               ///<[in] number of servers
+    );
+
+/** @brief   Starts one more server
+ *  @returns Its partition, or -1 on failure
+ *  @see     cluster_router_add()
+ */
+int
+cluster_add(
+    Context_cluster *cluster ///<[in] cluster
+    );
+
+/** @brief   Returns the number of servers in \a cluster */
+int
+cluster_count(
+    Context_cluster *cluster ///<[in] cluster
+    );
+
+/** @brief   Returns the path of the socket of \a partition */
+const char *
+cluster_path(
+    Context_cluster *cluster, ///<[in] cluster
+    int partition             ///<[in] partition
+    );
+
+/** @brief Stops every server, waits for them to exit, and frees \a cluster */
+void
+cluster_free(
+    Context_cluster *cluster ///<[in] cluster
+    );
+
+/** @brief A named op for cluster_router_execute() */
+typedef struct cluster_op {
+    unsigned char op;          ///<[in]  SERVER_OP_PUT, SERVER_OP_INSERT, SERVER_OP_LOOKUP or SERVER_OP_DELETE
+    unsigned char flags;       ///<[in]  kv_record flags of the value, or [out] of the value found by SERVER_OP_LOOKUP
+    unsigned char status;      ///<[out] One of server_status
+    unsigned char *key;        ///<[in]  key bytes
+    unsigned int key_length;   ///<[in]  length of \a key in bytes
+    unsigned char *value;      ///<[in]  the value to write, or [out] where SERVER_OP_LOOKUP copies the value to
+    unsigned int value_length; ///<[in]  length of \a value in bytes
+    unsigned int size;         ///<[out] full size of the value found by SERVER_OP_LOOKUP
+} Cluster_op;
+
+/** @brief A client's connection to every partition of a cluster. A router must only be used by one thread at a time.
+ *
+ * Keys are routed with cluster_partition(). Once cluster_router_add() is given a new partition, the
+ * keys that now belong to it are moved over a step at a time, while requests keep being served:
+ * until every old partition has been gone through, a key routed to the new partition is looked up
+ * in its old one when the new one doesn't have it yet, deleted from both, and only inserted if the
+ * old one doesn't have it either. A key is moved with
+ * SERVER_OP_INSERT, so it never overwrites a value written to the new partition meanwhile.
+ *
+ * Keys are only moved correctly if this router is the only client of the cluster while it does so.
+ */
+typedef struct cluster_router Cluster_router;
+
+/** @brief   Connects to the servers of \a count partitions at \a paths
+ *  @returns A pointer to the router on success, or 0 on failure
+ *  @see     cluster_router_free()
+ */
+Cluster_router *
+cluster_router_create(
+    Context_main *ctx_main, ///<[in] main context
+    const char **paths,     ///<[in] socket of every partition, in order
+    int count               ///<[in] number of partitions
+    );
+
+/** @brief Runs a batch of ops
+ *
+ * The batch is split by partition, the requests for every partition are written to it together,
+ * and the partitions work on them at the same time. Ops on the same key run in the order given.
+ * While keys are being moved, one step of that is taken afterwards.
+ *
+ * @returns 1 once every op has its \a status, 0 if a server couldn't be reached
+ */
+int
+cluster_router_execute(
+    Cluster_router *router, ///<[in] router
+    Cluster_op *ops,        ///<[in] ops
+    unsigned long count     ///<[in] number of ops
+    );
+
+/** @brief Adds a partition with its server at \a path, and starts moving keys into it
+ *
+ * Any keys still being moved into the previous partition added are finished first.
+ *
+ * @returns 1 on success, 0 on failure
+ * @see     cluster_router_rebalance()
+ */
+int
+cluster_router_add(
+    Cluster_router *router, ///<[in] router
+    const char *path        ///<[in] socket of the new partition
+    );
+
+/** @brief   Takes one step of moving keys into the partition added last, or every step left if \a finish is set
+ *  @returns 1 on success, 0 if a server couldn't be reached
+ */
+int
+cluster_router_rebalance(
+    Cluster_router *router, ///<[in] router
+    int finish              ///<[in] whether to keep going until every key has been moved
+    );
+
+/** @brief   Returns 1 while keys are being moved into the partition added last, 0 otherwise */
+int
+cluster_router_rebalancing(
+    Cluster_router *router ///<[in] router
+    );
+
+/** @brief Closes every connection and frees \a router */
+void
+cluster_router_free(
+    Cluster_router *router ///<[in] router
+    );
@@ -0,0 +1,1262 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "epoch.h"
+#include "cdc.h"
+#include "concurrent.h"
+
+#ifndef DEBUG_CONCURRENT
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+// One per possible bucket (a kv_record has six bits for it)
+#define CONCURRENT_BUCKETS 64
+
+// Number of failed attempts at a consistent read before a reader yields to the writer it's waiting on
+#define CONCURRENT_READ_SPINS 16
+
+typedef struct concurrent_bucket {
+    pthread_mutex_t usage_lock;  // Guards page_usage and used, and moving the pages
+    unsigned long moving;        // Odd while the pages are being copied to a bigger region
+    unsigned long used;          // Number of slots in use
+    unsigned long capacity;      // Number of slots m_offset has room for, published after m_offset
+} Concurrent_bucket;
+
+// A sequence counter on a cache line of its own. It is odd while a record of its stripe is changing.
+typedef struct concurrent_seq {
+    unsigned long value;
+    char pad[64 - sizeof(unsigned long)];
+} Concurrent_seq;
+
+// A value that record k had until valid_to, kept for snapshots taken before then. A size of 0 means
+// the record wasn't live.
+typedef struct concurrent_version {
+    struct concurrent_version *next; // Older, in the same chain
+    unsigned long k;
+    unsigned long valid_to;
+    Record_kv record;
+} Concurrent_version;
+
+// Chains are ordered by valid_to, newest first, since versions are added under the stripe's lock
+typedef struct concurrent_history {
+    unsigned long count;
+    Concurrent_version *chain[CONCURRENT_VERSION_CHAINS];
+} Concurrent_history;
+
+struct database_snapshot {
+    struct database_concurrent *dbc;
+    struct database_snapshot *next;  // In dbc->snapshots
+    struct database_snapshot *prev;
+    unsigned long timestamp;
+    unsigned long kv_record_count;   // Records at or past this didn't exist yet
+};
+
+// A thread's private stock of reserved slots and records, so that most allocations and frees
+// don't have to take the bucket's or the table's locks
+typedef struct concurrent_magazine {
+    struct database_concurrent *dbc;
+    struct concurrent_magazine *next;  // In dbc->magazines
+    struct concurrent_magazine *prev;
+
+    unsigned long record_count;
+    unsigned long record[CONCURRENT_MAGAZINE_SIZE];
+
+    struct {
+        unsigned long count;
+        unsigned long index[CONCURRENT_MAGAZINE_SIZE];
+    } slot[CONCURRENT_MAGAZINE_BUCKETS];
+} Concurrent_magazine;
+
+struct database_concurrent {
+    Record_database *rec_database;
+
+    pthread_mutex_t kv_lock;     // Guards growing kv_record_tbl, kv_record_count and the free list
+    unsigned long kv_capacity;   // Number of records kv_record_tbl has room for
+    unsigned long *kv_free;      // Stack of freed records that can be reused
+    unsigned long kv_free_count; // Records on it, which leaves kv_record_free_count to database_concurrent_record()
+    unsigned long kv_free_capacity;
+
+    pthread_rwlock_t stripe_lock[CONCURRENT_KV_STRIPES];  // Serializes the writers of a stripe
+    Concurrent_seq stripe_seq[CONCURRENT_KV_STRIPES];     // Lets readers check they weren't overtaken
+    Record_kv *stripe_tbl[CONCURRENT_KV_STRIPES]; // The kv_record_tbl that each stripe lives in
+
+    pthread_mutex_t ptbl_lock;   // Guards adding buckets to ptbl_record_tbl
+    signed char ptbl_index[CONCURRENT_BUCKETS];   // Index into ptbl_record_tbl of each bucket, or -1
+
+    Concurrent_bucket bucket[CONCURRENT_BUCKETS];
+
+    pthread_key_t magazine_key;      // Each thread's Concurrent_magazine
+    pthread_mutex_t magazine_lock;   // Guards magazines
+    Concurrent_magazine *magazines;  // Every thread's magazine, so they can be freed with the database
+
+    Epoch_domain *epoch;             // Holds back frees of slots, old tables and old pages from readers
+    Epoch_domain *pages_epoch;       // Holds back old pages from writers of values, apart from the readers'
+                                     // so that writers never hold up the frees of slots
+    int freeing;                     // Set once database_concurrent_free() starts taking the epochs down
+
+    unsigned long clock;             // Timestamp of the last write made while a snapshot was open
+    unsigned long snapshot_count;    // Writes only keep old versions while this isn't 0
+    pthread_mutex_t snapshot_lock;   // Guards snapshots
+    Database_snapshot *snapshots;
+    Concurrent_history history[CONCURRENT_KV_STRIPES]; // Old versions, guarded by the stripe's lock
+};
+
+static void _concurrent_magazine_release(void *arg);
+
+#define _STRIPE(k) ((k) % CONCURRENT_KV_STRIPES)
+#define _CHAIN(k) (((k) / CONCURRENT_KV_STRIPES) % CONCURRENT_VERSION_CHAINS)
+
+Database_concurrent *
+database_concurrent_create(
+    Context_main *ctx_main
+) {
+    DEBUG_PRINT("database_concurrent_create();\n");
+
+    RECORD_CREATE(Database_concurrent, dbc);
+    if(!dbc) {
+        return 0;
+    }
+
+    RECORD_ALLOC(Record_database, dbc->rec_database);
+    if(!dbc->rec_database) {
+        memory_free(dbc);
+        return 0;
+    }
+
+    // Room for every bucket, so that the table never has to move under a reader
+    dbc->rec_database->ptbl_record_tbl = (Record_ptbl *)memory_alloc(CONCURRENT_BUCKETS * sizeof(Record_ptbl));
+    dbc->rec_database->kv_record_tbl = (Record_kv *)memory_alloc(CONCURRENT_KV_INITIAL_CAPACITY * sizeof(Record_kv));
+    if(!dbc->rec_database->ptbl_record_tbl || !dbc->rec_database->kv_record_tbl) {
+        DEBUG_PRINT("\tERR failed to allocate tables\n");
+        memory_free(dbc->rec_database->ptbl_record_tbl);
+        memory_free(dbc->rec_database->kv_record_tbl);
+        memory_free(dbc->rec_database);
+        memory_free(dbc);
+        return 0;
+    }
+    dbc->kv_capacity = CONCURRENT_KV_INITIAL_CAPACITY;
+
+    pthread_mutex_init(&dbc->kv_lock, 0);
+    pthread_mutex_init(&dbc->ptbl_lock, 0);
+    for(int i = 0; i < CONCURRENT_KV_STRIPES; i++) {
+        pthread_rwlock_init(&dbc->stripe_lock[i], 0);
+        dbc->stripe_tbl[i] = dbc->rec_database->kv_record_tbl;
+    }
+    for(int i = 0; i < CONCURRENT_BUCKETS; i++) {
+        pthread_mutex_init(&dbc->bucket[i].usage_lock, 0);
+        dbc->ptbl_index[i] = -1;
+    }
+
+    pthread_mutex_init(&dbc->snapshot_lock, 0);
+    pthread_mutex_init(&dbc->magazine_lock, 0);
+    if(pthread_key_create(&dbc->magazine_key, _concurrent_magazine_release)) {
+        DEBUG_PRINT("\tERR failed to create magazine key\n");
+        pthread_mutex_destroy(&dbc->snapshot_lock);
+        pthread_mutex_destroy(&dbc->magazine_lock);
+        memory_free(dbc->rec_database->ptbl_record_tbl);
+        memory_free(dbc->rec_database->kv_record_tbl);
+        memory_free(dbc->rec_database);
+        memory_free(dbc);
+        return 0;
+    }
+
+    dbc->epoch = epoch_domain_create(ctx_main);
+    dbc->pages_epoch = dbc->epoch ? epoch_domain_create(ctx_main) : 0;
+    if(!dbc->pages_epoch) {
+        DEBUG_PRINT("\tERR failed to create epoch domain\n");
+        database_concurrent_free(ctx_main, dbc);
+        return 0;
+    }
+
+    return dbc;
+}
+
+void
+database_concurrent_free(
+    Context_main *ctx_main,
+    Database_concurrent *dbc
+) {
+    DEBUG_PRINT("database_concurrent_free();\n");
+
+    // Nobody is reading anymore, so every pending free can run. Freed slots may still go into the
+    // calling thread's magazine, so this has to come first.
+    dbc->freeing = 1;
+    if(dbc->pages_epoch) {
+        epoch_domain_free(ctx_main, dbc->pages_epoch);
+    }
+    if(dbc->epoch) {
+        epoch_domain_free(ctx_main, dbc->epoch);
+    }
+
+    // Deleting the key doesn't run the destructors, so threads that are still alive forget their
+    // magazines, and the slots in them go along with the buckets
+    pthread_key_delete(dbc->magazine_key);
+    while(dbc->magazines) {
+        Concurrent_magazine *magazine = dbc->magazines;
+        dbc->magazines = magazine->next;
+        memory_free(magazine);
+    }
+    pthread_mutex_destroy(&dbc->magazine_lock);
+
+    // The slots of old versions go along with the buckets
+    while(dbc->snapshots) {
+        Database_snapshot *snapshot = dbc->snapshots;
+        dbc->snapshots = snapshot->next;
+        memory_free(snapshot);
+    }
+    pthread_mutex_destroy(&dbc->snapshot_lock);
+    for(int i = 0; i < CONCURRENT_KV_STRIPES; i++) {
+        for(int j = 0; j < CONCURRENT_VERSION_CHAINS; j++) {
+            while(dbc->history[i].chain[j]) {
+                Concurrent_version *version = dbc->history[i].chain[j];
+                dbc->history[i].chain[j] = version->next;
+                memory_free(version);
+            }
+        }
+    }
+
+    for(int i = 0; i < CONCURRENT_KV_STRIPES; i++) {
+        pthread_rwlock_destroy(&dbc->stripe_lock[i]);
+    }
+    for(int i = 0; i < CONCURRENT_BUCKETS; i++) {
+        pthread_mutex_destroy(&dbc->bucket[i].usage_lock);
+    }
+    pthread_mutex_destroy(&dbc->kv_lock);
+    pthread_mutex_destroy(&dbc->ptbl_lock);
+
+    // database_ptbl_free() only frees kv_record_tbl along with ptbl_record_tbl
+    if(dbc->rec_database->ptbl_record_tbl) {
+        database_ptbl_free(ctx_main, dbc->rec_database);
+    }
+    else {
+        memory_free(dbc->rec_database->kv_record_tbl);
+    }
+
+    memory_free(dbc->kv_free);
+    memory_free(dbc->rec_database);
+    memory_free(dbc);
+}
+
+Record_database *
+database_concurrent_record(
+    Database_concurrent *dbc
+) {
+    // Records sit on the free stack, in magazines or in neither while they're moved between the
+    // two, so the single-threaded API's count of them is made up from the table itself
+    Record_database *rec_database = dbc->rec_database;
+    unsigned long live = 0;
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        live += (KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]) != 0);
+    }
+    rec_database->kv_record_free_count = rec_database->kv_record_count - live;
+
+    return rec_database;
+}
+
+// Returns the ptbl_record_tbl index of bucket, creating the bucket if it doesn't exist yet
+static char
+concurrent_ptbl_get(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int bucket
+) {
+    char ptbl_index = __atomic_load_n(&dbc->ptbl_index[bucket], __ATOMIC_ACQUIRE);
+    if(ptbl_index != -1) {
+        return ptbl_index;
+    }
+
+    pthread_mutex_lock(&dbc->ptbl_lock);
+    ptbl_index = dbc->ptbl_index[bucket];
+    if(ptbl_index == -1) {
+        Record_database *rec_database = dbc->rec_database;
+        unsigned long count = rec_database->ptbl_record_count;
+
+        // Nobody looks past ptbl_record_count, so the new record can be set up in place
+        if(database_ptbl_init(ctx_main, &rec_database->ptbl_record_tbl[count], 1, bucket)) {
+            ptbl_index = count;
+            dbc->bucket[bucket].capacity = PTBL_CALC_PAGE_USAGE_BITS(bucket);
+            __atomic_store_n(&rec_database->ptbl_record_count, count + 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&dbc->ptbl_index[bucket], ptbl_index, __ATOMIC_RELEASE);
+        }
+        else {
+            DEBUG_PRINT("\tERR failed to initialize bucket %d\n", bucket);
+        }
+    }
+    pthread_mutex_unlock(&dbc->ptbl_lock);
+
+    return ptbl_index;
+}
+
+// Frees a retired table (page_count is 0) or retired bucket pages
+static void
+_concurrent_region_free(
+    Context_main *ctx_main,
+    void *owner,
+    unsigned long region,
+    unsigned long page_count
+) {
+    if(page_count) memory_page_free(ctx_main, (void *)region, page_count);
+    else memory_free((void *)region);
+}
+
+// Frees region once no reader can still be using it. May be called with locks held.
+static void
+_concurrent_retire(
+    Database_concurrent *dbc,
+    void *region,
+    int page_count
+) {
+    if(!epoch_retire(dbc->epoch, _concurrent_region_free, dbc, (unsigned long)region, page_count)) {
+        // Leaking it is the only safe option left
+        DEBUG_PRINT("\tERR failed to retire %p\n", region);
+    }
+}
+
+// Hands old pages, that no writer of values can be using anymore, over to the readers' epoch
+static void
+_concurrent_pages_reclaim(
+    Context_main *ctx_main,
+    void *owner,
+    unsigned long region,
+    unsigned long page_count
+) {
+    _concurrent_retire((Database_concurrent *)owner, (void *)region, page_count);
+}
+
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+// Doubles the pages of bucket. Must be called with the bucket's usage_lock held.
+//
+// mremap() would unmap the old pages from under lock-free readers and writers, so the pages are
+// copied to a new region instead, and the old one is retired. moving is odd for as long as the
+// copy runs, for writers to tell that what they wrote may have been left behind.
+static int
+_concurrent_bucket_grow(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int bucket,
+    char ptbl_index
+) {
+    Record_database *rec_database = dbc->rec_database;
+    Concurrent_bucket *b = &dbc->bucket[bucket];
+    unsigned int page_count = PTBL_RECORD_GET_PAGE_COUNT(_PTBL), new_page_count = page_count * 2;
+    int unit = (bucket <= 8) ? 1 : (1 << (bucket - 8));
+
+    DEBUG_PRINT("_concurrent_bucket_grow(bucket = %d, new_page_count = %u);\n", bucket, new_page_count);
+
+    unsigned char *region = memory_page_alloc(ctx_main, new_page_count * unit);
+    if(!region) {
+        return 0;
+    }
+
+    unsigned int new_page_usage_length = PTBL_CALC_PAGE_USAGE_LENGTH(bucket, new_page_count);
+    if(new_page_usage_length > _PTBL.page_usage_length) {
+        unsigned char *new_page_usage = memory_realloc(_PTBL.page_usage, _PTBL.page_usage_length, new_page_usage_length);
+        if(!new_page_usage) {
+            memory_page_free(ctx_main, region, new_page_count * unit);
+            return 0;
+        }
+        _PTBL.page_usage = new_page_usage;
+        _PTBL.page_usage_length = new_page_usage_length;
+    }
+
+    // Pairs with the fence in _concurrent_value_write(): either the copy sees a value written, or
+    // its writer sees moving change
+    __atomic_store_n(&b->moving, b->moving + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned char *old_region = _PTBL.m_offset;
+    memcpy(region, old_region, page_count * unit * ctx_main->system_page_size);
+
+    // Readers load capacity before m_offset, so they never pair the new capacity with the old pages
+    PTBL_RECORD_SET_PAGE_COUNT(_PTBL, new_page_count);
+    PTBL_RECORD_SET_OFFSET(_PTBL, 0);
+    __atomic_store_n(&_PTBL.m_offset, region, __ATOMIC_RELEASE);
+    __atomic_store_n(&b->capacity, new_page_count * PTBL_CALC_PAGE_USAGE_BITS(bucket), __ATOMIC_RELEASE);
+    __atomic_store_n(&b->moving, b->moving + 1, __ATOMIC_RELEASE);
+
+    // Only once nothing can find the old pages anymore. Grows are few, so the old pages of earlier
+    // ones are only passed on to the readers' epoch from here.
+    if(!epoch_retire(dbc->pages_epoch, _concurrent_pages_reclaim, dbc, (unsigned long)old_region, page_count * unit)) {
+        // Leaking it is the only safe option left
+        DEBUG_PRINT("\tERR failed to retire the pages of bucket %d\n", bucket);
+    }
+    epoch_reclaim(ctx_main, dbc->pages_epoch);
+
+    return 1;
+}
+
+// Reserves up to count free slots of bucket, writing their indices to index
+static unsigned long
+_concurrent_slot_reserve(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int bucket,
+    unsigned long *index,
+    unsigned long count
+) {
+    Record_database *rec_database = dbc->rec_database;
+    Concurrent_bucket *b = &dbc->bucket[bucket];
+    unsigned long reserved = 0;
+
+    char ptbl_index = concurrent_ptbl_get(ctx_main, dbc, bucket);
+    if(ptbl_index == -1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&b->usage_lock);
+    for(; reserved < count; reserved++) {
+        // Only a full bucket has to grow, and only growing moves the pages
+        if(b->used == b->capacity) {
+            if(!_concurrent_bucket_grow(ctx_main, dbc, bucket, ptbl_index)) {
+                DEBUG_PRINT("\tERR failed to grow bucket %d\n", bucket);
+                break;
+            }
+        }
+        index[reserved] = _database_value_alloc(ctx_main, rec_database, 0, bucket);
+        if(index[reserved] == -1) {
+            DEBUG_PRINT("\tERR failed to allocate value in bucket %d\n", bucket);
+            break;
+        }
+        b->used++;
+    }
+    pthread_mutex_unlock(&b->usage_lock);
+
+    return reserved;
+}
+
+// Marks count slots of bucket as free again
+static void
+_concurrent_slot_release(
+    Database_concurrent *dbc,
+    int bucket,
+    unsigned long *index,
+    unsigned long count
+) {
+    Record_database *rec_database = dbc->rec_database;
+    Concurrent_bucket *b = &dbc->bucket[bucket];
+    char ptbl_index = dbc->ptbl_index[bucket];
+
+    pthread_mutex_lock(&b->usage_lock);
+    for(unsigned long i = 0; i < count; i++) {
+        PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, index[i]);
+    }
+    b->used -= count;
+    pthread_mutex_unlock(&b->usage_lock);
+}
+
+static void _concurrent_read_wait(int *spins);
+
+// Writes size bytes of buffer to the slot at index of bucket, or zeroes it if buffer is 0, without
+// locks. Must be called inside dbc's pages_epoch, which keeps the pages a grow retires around until
+// the write is done. A write that a grow may have copied the slot before is made again to the new pages.
+static void
+_concurrent_value_write(
+    Database_concurrent *dbc,
+    int bucket,
+    unsigned long index,
+    unsigned char *buffer,
+    unsigned long size
+) {
+    Record_database *rec_database = dbc->rec_database;
+    Concurrent_bucket *b = &dbc->bucket[bucket];
+    char ptbl_index = dbc->ptbl_index[bucket];
+    unsigned long word_size = PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+
+    for(int spins = 0; ; ) {
+        unsigned long moving = __atomic_load_n(&b->moving, __ATOMIC_ACQUIRE);
+        if(moving & 1) {
+            _concurrent_read_wait(&spins);
+            continue;
+        }
+        unsigned char *slot = __atomic_load_n(&_PTBL.m_offset, __ATOMIC_ACQUIRE) + index * word_size;
+        if(buffer) memcpy(slot, buffer, size);
+        else memset(slot, 0, word_size);
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&b->moving, __ATOMIC_RELAXED) == moving) {
+            return;
+        }
+    }
+}
+
+// Returns the calling thread's magazine for dbc, creating it on first use
+static Concurrent_magazine *
+_concurrent_magazine(
+    Database_concurrent *dbc
+) {
+    Concurrent_magazine *magazine = (Concurrent_magazine *)pthread_getspecific(dbc->magazine_key);
+    if(magazine) {
+        return magazine;
+    }
+
+    RECORD_ALLOC(Concurrent_magazine, magazine);
+    if(!magazine) {
+        return 0;
+    }
+    magazine->dbc = dbc;
+
+    pthread_mutex_lock(&dbc->magazine_lock);
+    magazine->next = dbc->magazines;
+    if(dbc->magazines) dbc->magazines->prev = magazine;
+    dbc->magazines = magazine;
+    pthread_mutex_unlock(&dbc->magazine_lock);
+
+    pthread_setspecific(dbc->magazine_key, magazine);
+
+    return magazine;
+}
+
+static void _concurrent_record_release(Database_concurrent *dbc, unsigned long *k, unsigned long count);
+
+// Runs when a thread exits: hands everything in its magazine back
+static void
+_concurrent_magazine_release(
+    void *arg
+) {
+    Concurrent_magazine *magazine = (Concurrent_magazine *)arg;
+    Database_concurrent *dbc = magazine->dbc;
+
+    for(int bucket = 0; bucket < CONCURRENT_MAGAZINE_BUCKETS; bucket++) {
+        if(magazine->slot[bucket].count) {
+            _concurrent_slot_release(dbc, bucket, magazine->slot[bucket].index, magazine->slot[bucket].count);
+        }
+    }
+    _concurrent_record_release(dbc, magazine->record, magazine->record_count);
+
+    pthread_mutex_lock(&dbc->magazine_lock);
+    if(magazine->prev) magazine->prev->next = magazine->next;
+    else dbc->magazines = magazine->next;
+    if(magazine->next) magazine->next->prev = magazine->prev;
+    pthread_mutex_unlock(&dbc->magazine_lock);
+
+    memory_free(magazine);
+}
+
+// Allocates a slot in bucket, and writes size bytes of buffer to it
+static unsigned long
+concurrent_value_alloc(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int bucket,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    Concurrent_magazine *magazine = (bucket < CONCURRENT_MAGAZINE_BUCKETS) ? _concurrent_magazine(dbc) : 0;
+    unsigned long index;
+
+    if(magazine) {
+        // Refill half way, so that alternating allocations and frees don't bounce off the bucket
+        if(!magazine->slot[bucket].count) {
+            magazine->slot[bucket].count = _concurrent_slot_reserve(ctx_main, dbc, bucket, magazine->slot[bucket].index, CONCURRENT_MAGAZINE_SIZE / 2);
+            if(!magazine->slot[bucket].count) {
+                return -1;
+            }
+        }
+        index = magazine->slot[bucket].index[--magazine->slot[bucket].count];
+    }
+    else if(!_concurrent_slot_reserve(ctx_main, dbc, bucket, &index, 1)) {
+        return -1;
+    }
+
+    // A magazine hit takes no lock at all: pages_epoch is all the value's write needs
+    if(!epoch_enter(dbc->pages_epoch)) {
+        _concurrent_slot_release(dbc, bucket, &index, 1);
+        return -1;
+    }
+    _concurrent_value_write(dbc, bucket, index, buffer, size);
+    epoch_exit(dbc->pages_epoch);
+
+    return index;
+}
+
+// Zeroes the slot at index of bucket, and marks it as free
+static void
+concurrent_value_free(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int bucket,
+    unsigned long index
+) {
+    Record_database *rec_database = dbc->rec_database;
+    Concurrent_bucket *b = &dbc->bucket[bucket];
+    char ptbl_index = dbc->ptbl_index[bucket];
+
+    // Deferred frees run on whichever thread reclaims them, which shouldn't get a magazine just for that
+    Concurrent_magazine *magazine = (bucket < CONCURRENT_MAGAZINE_BUCKETS) ? (Concurrent_magazine *)pthread_getspecific(dbc->magazine_key) : 0;
+
+    // pages_epoch can't be entered once database_concurrent_free() takes it down, and only the lock
+    // that keeps the pages where they are is left then
+    if(!dbc->freeing && epoch_enter(dbc->pages_epoch)) {
+        _concurrent_value_write(dbc, bucket, index, 0, 0);
+        epoch_exit(dbc->pages_epoch);
+    }
+    else {
+        pthread_mutex_lock(&b->usage_lock);
+        memset(_PTBL.m_offset + index * PTBL_CALC_BUCKET_WORD_SIZE(bucket), 0, PTBL_CALC_BUCKET_WORD_SIZE(bucket));
+        pthread_mutex_unlock(&b->usage_lock);
+    }
+
+    if(!magazine) {
+        _concurrent_slot_release(dbc, bucket, &index, 1);
+        return;
+    }
+
+    // Once the magazine is full, hand the older half back to the bucket
+    if(magazine->slot[bucket].count == CONCURRENT_MAGAZINE_SIZE) {
+        _concurrent_slot_release(dbc, bucket, magazine->slot[bucket].index, CONCURRENT_MAGAZINE_SIZE / 2);
+        memmove(magazine->slot[bucket].index, magazine->slot[bucket].index + CONCURRENT_MAGAZINE_SIZE / 2, (CONCURRENT_MAGAZINE_SIZE / 2) * sizeof(unsigned long));
+        magazine->slot[bucket].count -= CONCURRENT_MAGAZINE_SIZE / 2;
+    }
+    magazine->slot[bucket].index[magazine->slot[bucket].count++] = index;
+}
+
+static void
+_concurrent_value_reclaim(
+    Context_main *ctx_main,
+    void *owner,
+    unsigned long bucket,
+    unsigned long index
+) {
+    concurrent_value_free(ctx_main, (Database_concurrent *)owner, bucket, index);
+}
+
+// Frees the slot at index of bucket once no reader can still be holding a pointer to it, and runs
+// the frees that have become safe once enough have piled up. Must be called with no locks held.
+static void
+_concurrent_value_retire(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int bucket,
+    unsigned long index
+) {
+    unsigned long pending = epoch_retire(dbc->epoch, _concurrent_value_reclaim, dbc, bucket, index);
+    if(!pending) {
+        DEBUG_PRINT("\tERR failed to retire slot %lu of bucket %d\n", index, bucket);
+        return;
+    }
+    if(pending >= EPOCH_RECLAIM_THRESHOLD) {
+        epoch_reclaim(ctx_main, dbc->epoch);
+    }
+}
+
+// Doubles kv_record_tbl. Must be called with kv_lock held.
+static int
+concurrent_kv_grow(
+    Database_concurrent *dbc
+) {
+    Record_database *rec_database = dbc->rec_database;
+    unsigned long new_capacity = dbc->kv_capacity * 2;
+
+    DEBUG_PRINT("concurrent_kv_grow(new_capacity = %lu);\n", new_capacity);
+
+    Record_kv *old_tbl = rec_database->kv_record_tbl,
+              *new_tbl = (Record_kv *)memory_alloc(new_capacity * sizeof(Record_kv));
+    if(!new_tbl) {
+        DEBUG_PRINT("\tERR failed to allocate kv_record_tbl\n");
+        return 0;
+    }
+
+    // Move one stripe at a time: readers of the other stripes carry on in whichever table their
+    // stripe currently lives in
+    for(int s = 0; s < CONCURRENT_KV_STRIPES; s++) {
+        pthread_rwlock_wrlock(&dbc->stripe_lock[s]);
+        for(unsigned long k = s; k < rec_database->kv_record_count; k += CONCURRENT_KV_STRIPES) {
+            new_tbl[k] = old_tbl[k];
+        }
+        __atomic_store_n(&dbc->stripe_tbl[s], new_tbl, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&dbc->stripe_lock[s]);
+    }
+
+    // Every writer has moved on to the new table, but lock-free readers may still be in the old one
+    rec_database->kv_record_tbl = new_tbl;
+    dbc->kv_capacity = new_capacity;
+    _concurrent_retire(dbc, old_tbl, 0);
+
+    return 1;
+}
+
+// Claims up to count unused records: freed ones first, then new ones at the end of the table
+static unsigned long
+_concurrent_record_reserve(
+    Database_concurrent *dbc,
+    unsigned long *k,
+    unsigned long count
+) {
+    Record_database *rec_database = dbc->rec_database;
+    unsigned long reserved = 0;
+
+    pthread_mutex_lock(&dbc->kv_lock);
+    while(reserved < count && dbc->kv_free_count > 0) {
+        k[reserved++] = dbc->kv_free[--dbc->kv_free_count];
+    }
+    while(reserved < count) {
+        if(rec_database->kv_record_count == dbc->kv_capacity && !concurrent_kv_grow(dbc)) {
+            break;
+        }
+        k[reserved++] = rec_database->kv_record_count;
+        __atomic_store_n(&rec_database->kv_record_count, rec_database->kv_record_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dbc->kv_lock);
+
+    return reserved;
+}
+
+// Puts count unused records on the free list
+static void
+_concurrent_record_release(
+    Database_concurrent *dbc,
+    unsigned long *k,
+    unsigned long count
+) {
+    pthread_mutex_lock(&dbc->kv_lock);
+    if(dbc->kv_free_count + count > dbc->kv_free_capacity) {
+        unsigned long new_capacity = dbc->kv_free_capacity ? dbc->kv_free_capacity : 64;
+        while(new_capacity < dbc->kv_free_count + count) {
+            new_capacity *= 2;
+        }
+        unsigned long *new_free = (unsigned long *)memory_realloc(dbc->kv_free, dbc->kv_free_capacity * sizeof(unsigned long), new_capacity * sizeof(unsigned long));
+        if(!new_free) {
+            // The records stay unused either way, they just won't be reused
+            pthread_mutex_unlock(&dbc->kv_lock);
+            return;
+        }
+        dbc->kv_free = new_free;
+        dbc->kv_free_capacity = new_capacity;
+    }
+    memcpy(dbc->kv_free + dbc->kv_free_count, k, count * sizeof(unsigned long));
+    dbc->kv_free_count += count;
+    pthread_mutex_unlock(&dbc->kv_lock);
+}
+
+// Makes the sequence of k's stripe odd, so that readers of the stripe know to retry. Must be called
+// with the stripe's lock held, before changing a record.
+static inline void
+_concurrent_write_begin(
+    Database_concurrent *dbc,
+    unsigned long k
+) {
+    unsigned long *seq = &dbc->stripe_seq[_STRIPE(k)].value;
+    __atomic_store_n(seq, seq[0] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Makes the sequence of k's stripe even again, publishing the changed record
+static inline void
+_concurrent_write_end(
+    Database_concurrent *dbc,
+    unsigned long k
+) {
+    unsigned long *seq = &dbc->stripe_seq[_STRIPE(k)].value;
+    __atomic_store_n(seq, seq[0] + 1, __ATOMIC_RELEASE);
+}
+
+// Adds a change to the database's feed, if it has one. Called with the stripe's lock held, so that
+// the changes to a record are published in the order they're made.
+static inline void
+_concurrent_publish(
+    Database_concurrent *dbc,
+    unsigned char op,
+    unsigned long k,
+    unsigned long size
+) {
+    Cdc_feed *feed = __atomic_load_n(&dbc->rec_database->cdc, __ATOMIC_ACQUIRE);
+    if(feed) {
+        cdc_publish(feed, op, k, size);
+    }
+}
+
+#undef _REC_KV
+#define _REC_KV dbc->stripe_tbl[_STRIPE(k)][k]
+
+// Keeps the current version of record k if an open snapshot may need it. Must be called with the
+// stripe's lock held, before changing the record.
+//
+// Returns 1 if the version was kept (so its slot must not be freed), 0 if no snapshot needs it, or -1
+// if it couldn't be kept, in which case the write must not go ahead
+static int
+_concurrent_version_keep(
+    Database_concurrent *dbc,
+    unsigned long k
+) {
+    // A snapshot counts itself before it waits out the writers of every stripe, so a writer that
+    // sees no snapshot here finishes before any snapshot can look
+    if(!__atomic_load_n(&dbc->snapshot_count, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+
+    RECORD_CREATE(Concurrent_version, version);
+    if(!version) {
+        DEBUG_PRINT("\tERR failed to keep version of %lu\n", k);
+        return -1;
+    }
+    version->k = k;
+    version->valid_to = __atomic_add_fetch(&dbc->clock, 1, __ATOMIC_SEQ_CST);
+    version->record = _REC_KV;
+
+    Concurrent_history *history = &dbc->history[_STRIPE(k)];
+    version->next = history->chain[_CHAIN(k)];
+    history->chain[_CHAIN(k)] = version;
+    history->count++;
+
+    return 1;
+}
+
+unsigned long
+database_concurrent_kv_alloc(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_concurrent_kv_alloc(flags = %02x, size = %lu);\n", flags, size);
+
+    Record_database *rec_database = dbc->rec_database;
+    int bucket = database_calc_bucket(size);
+
+    unsigned long index = concurrent_value_alloc(ctx_main, dbc, bucket, size, buffer);
+    if(index == -1) {
+        return -1;
+    }
+
+    // Claim a record, from this thread's magazine if it has one
+    Concurrent_magazine *magazine = _concurrent_magazine(dbc);
+    unsigned long k;
+    if(magazine && !magazine->record_count) {
+        magazine->record_count = _concurrent_record_reserve(dbc, magazine->record, CONCURRENT_MAGAZINE_SIZE / 2);
+    }
+    if(magazine && magazine->record_count) {
+        k = magazine->record[--magazine->record_count];
+    }
+    else if(!_concurrent_record_reserve(dbc, &k, 1)) {
+        concurrent_value_free(ctx_main, dbc, bucket, index);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&dbc->stripe_lock[_STRIPE(k)]);
+
+    // Snapshots from before now must keep seeing the record as free
+    if(_concurrent_version_keep(dbc, k) == -1) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        concurrent_value_free(ctx_main, dbc, bucket, index);
+        _concurrent_record_release(dbc, &k, 1);
+        return -1;
+    }
+
+    _concurrent_write_begin(dbc, k);
+    KV_RECORD_SET_FLAGS(_REC_KV, flags);
+    KV_RECORD_SET_BUCKET(_REC_KV, bucket);
+    KV_RECORD_SET_INDEX(_REC_KV, index);
+    KV_RECORD_SET_SIZE(_REC_KV, size);
+    _concurrent_write_end(dbc, k);
+    _concurrent_publish(dbc, CDC_OP_ALLOC, k, size);
+
+    pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+
+    return k;
+}
+
+int
+database_concurrent_kv_free(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    unsigned long k
+) {
+    DEBUG_PRINT("database_concurrent_kv_free(k = %lu);\n", k);
+
+    Record_database *rec_database = dbc->rec_database;
+
+    pthread_rwlock_wrlock(&dbc->stripe_lock[_STRIPE(k)]);
+    if(k >= __atomic_load_n(&rec_database->kv_record_count, __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        DEBUG_PRINT("\tERR k is greater than kv_record_count\n");
+        return 0;
+    }
+    if(0 == KV_RECORD_GET_SIZE(_REC_KV)) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        DEBUG_PRINT("\tRecord already freed\n");
+        return 1;
+    }
+
+    int bucket = KV_RECORD_GET_BUCKET(_REC_KV);
+    unsigned long index = KV_RECORD_GET_INDEX(_REC_KV);
+    int kept = _concurrent_version_keep(dbc, k);
+    if(kept == -1) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        return 0;
+    }
+
+    _concurrent_write_begin(dbc, k);
+    _REC_KV.flags_and_size = 0;
+    _REC_KV.bucket_and_index = 0;
+    _concurrent_write_end(dbc, k);
+    _concurrent_publish(dbc, CDC_OP_FREE, k, 0);
+
+    pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+
+    // A reader may still be copying out of the slot, or holding a pointer to it. A kept version
+    // hangs on to it until no snapshot needs it anymore.
+    if(!kept) {
+        _concurrent_value_retire(ctx_main, dbc, bucket, index);
+    }
+
+    Concurrent_magazine *magazine = _concurrent_magazine(dbc);
+    if(!magazine) {
+        _concurrent_record_release(dbc, &k, 1);
+        return 1;
+    }
+    if(magazine->record_count == CONCURRENT_MAGAZINE_SIZE) {
+        _concurrent_record_release(dbc, magazine->record, CONCURRENT_MAGAZINE_SIZE / 2);
+        memmove(magazine->record, magazine->record + CONCURRENT_MAGAZINE_SIZE / 2, (CONCURRENT_MAGAZINE_SIZE / 2) * sizeof(unsigned long));
+        magazine->record_count -= CONCURRENT_MAGAZINE_SIZE / 2;
+    }
+    magazine->record[magazine->record_count++] = k;
+
+    return 1;
+}
+
+int
+database_concurrent_kv_set_value(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_concurrent_kv_set_value(k = %lu, length = %lu);\n", k, length);
+
+    Record_database *rec_database = dbc->rec_database;
+
+    pthread_rwlock_wrlock(&dbc->stripe_lock[_STRIPE(k)]);
+    if(k >= __atomic_load_n(&rec_database->kv_record_count, __ATOMIC_ACQUIRE) || 0 == KV_RECORD_GET_SIZE(_REC_KV)) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        DEBUG_PRINT("\tERR no such record\n");
+        return 0;
+    }
+
+    // Write the new value to a new slot, then point the record at it
+    int bucket = database_calc_bucket(length);
+    unsigned long index = concurrent_value_alloc(ctx_main, dbc, bucket, length, buffer);
+    if(index == -1) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        return 0;
+    }
+
+    int old_bucket = KV_RECORD_GET_BUCKET(_REC_KV);
+    unsigned long old_index = KV_RECORD_GET_INDEX(_REC_KV);
+    int kept = _concurrent_version_keep(dbc, k);
+    if(kept == -1) {
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        concurrent_value_free(ctx_main, dbc, bucket, index);
+        return 0;
+    }
+
+    _concurrent_write_begin(dbc, k);
+    KV_RECORD_SET_BUCKET(_REC_KV, bucket);
+    KV_RECORD_SET_INDEX(_REC_KV, index);
+    KV_RECORD_SET_SIZE(_REC_KV, length);
+    _concurrent_write_end(dbc, k);
+    _concurrent_publish(dbc, CDC_OP_SET_VALUE, k, length);
+
+    pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+
+    if(!kept) {
+        _concurrent_value_retire(ctx_main, dbc, old_bucket, old_index);
+    }
+
+    return 1;
+}
+
+static void
+_concurrent_read_wait(
+    int *spins
+) {
+    // On a busy (or single) core, the writer we're waiting on may need our time slice to finish
+    if(++spins[0] > CONCURRENT_READ_SPINS) {
+        sched_yield();
+    }
+}
+
+// Returns the value of record k, or 0 if it isn't live. Must be called inside dbc's epoch: the slot
+// then stays as it is until the epoch is left, even if the record is changed or freed in the meantime.
+static unsigned char *
+_concurrent_value_find(
+    Database_concurrent *dbc,
+    unsigned long k,
+    unsigned long *size,
+    unsigned char *flags
+) {
+    Record_database *rec_database = dbc->rec_database;
+    unsigned long *seq = &dbc->stripe_seq[_STRIPE(k)].value;
+    int spins = 0;
+
+    // Readers never write to shared memory: read the record, then check that no writer touched the
+    // stripe in the meantime, and start over if one did
+    while(1) {
+        unsigned long before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if(before & 1) {
+            _concurrent_read_wait(&spins);
+            continue;
+        }
+
+        if(k >= __atomic_load_n(&rec_database->kv_record_count, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+
+        Record_kv *tbl = __atomic_load_n(&dbc->stripe_tbl[_STRIPE(k)], __ATOMIC_ACQUIRE), record;
+        record.flags_and_size = __atomic_load_n(&tbl[k].flags_and_size, __ATOMIC_RELAXED);
+        record.bucket_and_index = __atomic_load_n(&tbl[k].bucket_and_index, __ATOMIC_RELAXED);
+
+        unsigned long value_size = KV_RECORD_GET_SIZE(record), index = KV_RECORD_GET_INDEX(record);
+        int bucket = KV_RECORD_GET_BUCKET(record);
+        unsigned char *value = 0;
+
+        // A record caught halfway through a write may point anywhere, so make sure it points inside
+        // the bucket
+        if(value_size && database_calc_bucket(value_size) == bucket) {
+            char ptbl_index = __atomic_load_n(&dbc->ptbl_index[bucket], __ATOMIC_ACQUIRE);
+            if(ptbl_index != -1 && index < __atomic_load_n(&dbc->bucket[bucket].capacity, __ATOMIC_ACQUIRE)) {
+                unsigned char *m_offset = __atomic_load_n(&rec_database->ptbl_record_tbl[ptbl_index].m_offset, __ATOMIC_ACQUIRE);
+                value = m_offset + index * PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+            if(value) {
+                if(size) size[0] = value_size;
+                if(flags) flags[0] = KV_RECORD_GET_FLAGS(record);
+            }
+            return value;
+        }
+        _concurrent_read_wait(&spins);
+    }
+}
+
+int
+database_concurrent_kv_get(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    unsigned long k,
+    unsigned char *buffer,
+    unsigned long length,
+    unsigned long *size,
+    unsigned char *flags
+) {
+    unsigned long value_size;
+
+    if(!epoch_enter(dbc->epoch)) {
+        return 0;
+    }
+    unsigned char *value = _concurrent_value_find(dbc, k, &value_size, flags);
+    if(value) {
+        memcpy(buffer, value, (value_size < length) ? value_size : length);
+        if(size) size[0] = value_size;
+    }
+    epoch_exit(dbc->epoch);
+
+    return value != 0;
+}
+
+int
+database_concurrent_read_begin(
+    Database_concurrent *dbc
+) {
+    return epoch_enter(dbc->epoch);
+}
+
+void
+database_concurrent_read_end(
+    Database_concurrent *dbc
+) {
+    epoch_exit(dbc->epoch);
+}
+
+unsigned char *
+database_concurrent_kv_get_value(
+    Database_concurrent *dbc,
+    unsigned long k,
+    unsigned long *size,
+    unsigned char *flags
+) {
+    return _concurrent_value_find(dbc, k, size, flags);
+}
+
+unsigned long
+database_concurrent_reclaim(
+    Context_main *ctx_main,
+    Database_concurrent *dbc
+) {
+    DEBUG_PRINT("database_concurrent_reclaim();\n");
+
+    epoch_reclaim(ctx_main, dbc->pages_epoch);
+    return epoch_reclaim(ctx_main, dbc->epoch);
+}
+
+Database_snapshot *
+database_concurrent_snapshot_begin(
+    Context_main *ctx_main,
+    Database_concurrent *dbc
+) {
+    DEBUG_PRINT("database_concurrent_snapshot_begin();\n");
+
+    RECORD_CREATE(Database_snapshot, snapshot);
+    if(!snapshot) {
+        return 0;
+    }
+    snapshot->dbc = dbc;
+
+    pthread_mutex_lock(&dbc->snapshot_lock);
+    __atomic_add_fetch(&dbc->snapshot_count, 1, __ATOMIC_SEQ_CST);
+
+    // Writers that started before the count went up are still holding their stripe's lock. Once
+    // they're through, every write keeps the version it replaces.
+    for(int i = 0; i < CONCURRENT_KV_STRIPES; i++) {
+        pthread_rwlock_wrlock(&dbc->stripe_lock[i]);
+        pthread_rwlock_unlock(&dbc->stripe_lock[i]);
+    }
+    snapshot->timestamp = __atomic_load_n(&dbc->clock, __ATOMIC_SEQ_CST);
+    snapshot->kv_record_count = __atomic_load_n(&dbc->rec_database->kv_record_count, __ATOMIC_ACQUIRE);
+
+    snapshot->next = dbc->snapshots;
+    if(dbc->snapshots) dbc->snapshots->prev = snapshot;
+    dbc->snapshots = snapshot;
+    pthread_mutex_unlock(&dbc->snapshot_lock);
+
+    DEBUG_PRINT("\ttimestamp = %lu\n", snapshot->timestamp);
+
+    return snapshot;
+}
+
+// Drops the versions of stripe that ended at or before horizon, which no snapshot can need anymore
+static void
+_concurrent_history_prune(
+    Context_main *ctx_main,
+    Database_concurrent *dbc,
+    int stripe,
+    unsigned long horizon
+) {
+    Concurrent_history *history = &dbc->history[stripe];
+    Concurrent_version *dead = 0;
+
+    pthread_rwlock_wrlock(&dbc->stripe_lock[stripe]);
+    for(int i = 0; i < CONCURRENT_VERSION_CHAINS; i++) {
+        Concurrent_version **link = &history->chain[i];
+        while(*link && (*link)->valid_to > horizon) {
+            link = &(*link)->next;
+        }
+        // Everything past this point is older still
+        while(*link) {
+            Concurrent_version *version = *link;
+            *link = version->next;
+            version->next = dead;
+            dead = version;
+            history->count--;
+        }
+    }
+    pthread_rwlock_unlock(&dbc->stripe_lock[stripe]);
+
+    while(dead) {
+        Concurrent_version *version = dead;
+        dead = version->next;
+        if(KV_RECORD_GET_SIZE(version->record)) {
+            _concurrent_value_retire(ctx_main, dbc, KV_RECORD_GET_BUCKET(version->record), KV_RECORD_GET_INDEX(version->record));
+        }
+        memory_free(version);
+    }
+}
+
+void
+database_concurrent_snapshot_end(
+    Context_main *ctx_main,
+    Database_snapshot *snapshot
+) {
+    DEBUG_PRINT("database_concurrent_snapshot_end(timestamp = %lu);\n", snapshot->timestamp);
+
+    Database_concurrent *dbc = snapshot->dbc;
+
+    // Snapshots that begin after this point see the clock as it is now or later, so they can't
+    // need anything that ended by now either
+    pthread_mutex_lock(&dbc->snapshot_lock);
+    if(snapshot->prev) snapshot->prev->next = snapshot->next;
+    else dbc->snapshots = snapshot->next;
+    if(snapshot->next) snapshot->next->prev = snapshot->prev;
+    __atomic_sub_fetch(&dbc->snapshot_count, 1, __ATOMIC_SEQ_CST);
+
+    unsigned long horizon = __atomic_load_n(&dbc->clock, __ATOMIC_SEQ_CST);
+    for(Database_snapshot *open = dbc->snapshots; open; open = open->next) {
+        if(open->timestamp < horizon) horizon = open->timestamp;
+    }
+    pthread_mutex_unlock(&dbc->snapshot_lock);
+
+    memory_free(snapshot);
+
+    for(int i = 0; i < CONCURRENT_KV_STRIPES; i++) {
+        if(__atomic_load_n(&dbc->history[i].count, __ATOMIC_RELAXED)) {
+            _concurrent_history_prune(ctx_main, dbc, i, horizon);
+        }
+    }
+}
+
+unsigned long
+database_concurrent_snapshot_key_count(
+    Database_snapshot *snapshot
+) {
+    return snapshot->kv_record_count;
+}
+
+int
+database_concurrent_snapshot_get(
+    Context_main *ctx_main,
+    Database_snapshot *snapshot,
+    unsigned long k,
+    unsigned char *buffer,
+    unsigned long length,
+    unsigned long *size,
+    unsigned char *flags
+) {
+    Database_concurrent *dbc = snapshot->dbc;
+    Record_database *rec_database = dbc->rec_database;
+
+    if(k >= snapshot->kv_record_count) {
+        return 0;
+    }
+
+    // Holding the stripe's lock keeps the record and its versions where they are
+    pthread_rwlock_rdlock(&dbc->stripe_lock[_STRIPE(k)]);
+    Record_kv record = _REC_KV;
+
+    // The version that ended first after the snapshot was taken is the one it saw
+    for(Concurrent_version *version = dbc->history[_STRIPE(k)].chain[_CHAIN(k)]; version && version->valid_to > snapshot->timestamp; version = version->next) {
+        if(version->k == k) {
+            record = version->record;
+        }
+    }
+
+    unsigned long value_size = KV_RECORD_GET_SIZE(record);
+    if(value_size && epoch_enter(dbc->epoch)) {
+        int bucket = KV_RECORD_GET_BUCKET(record);
+        unsigned char *m_offset = __atomic_load_n(&rec_database->ptbl_record_tbl[dbc->ptbl_index[bucket]].m_offset, __ATOMIC_ACQUIRE);
+        memcpy(buffer, m_offset + KV_RECORD_GET_INDEX(record) * PTBL_CALC_BUCKET_WORD_SIZE(bucket), (value_size < length) ? value_size : length);
+        epoch_exit(dbc->epoch);
+
+        if(size) size[0] = value_size;
+        if(flags) flags[0] = KV_RECORD_GET_FLAGS(record);
+        pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+        return 1;
+    }
+    pthread_rwlock_unlock(&dbc->stripe_lock[_STRIPE(k)]);
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+/** @file  concurrent.h
+ *  @brief A thread-safe wrapper around a Record_database, with fine-grained locks per bucket
+ */
+
+/** @brief Number of read-write locks that kv_records are striped over (record k uses stripe k % CONCURRENT_KV_STRIPES) */
+#define CONCURRENT_KV_STRIPES 64
+
+/** @brief Number of kv_records the table starts out with room for. It doubles whenever it fills up. */
+#define CONCURRENT_KV_INITIAL_CAPACITY 1024
+
+/** @brief Number of slot indices (and of records) a thread keeps in reserve per bucket
+ *  @see   Database_concurrent
+ */
+#define CONCURRENT_MAGAZINE_SIZE 32
+
+/** @brief Buckets below this one get magazines. Slots of larger buckets are whole pages, too big to hoard. */
+#define CONCURRENT_MAGAZINE_BUCKETS 8
+
+/** @brief Number of chains the old versions of each stripe are hashed into, by key */
+#define CONCURRENT_VERSION_CHAINS 64
+
+/** @brief A Record_database that may be used from any number of threads at once
+ *
+ * Locking is split three ways, so that threads only contend when they touch the same things:
+ *
+ * - Every kv_record belongs to one of CONCURRENT_KV_STRIPES stripes, each with a lock that writers of
+ *   its records hold, and a sequence counter that they make odd while they change a record.
+ * - Every bucket has a mutex for its page_usage bitmap, taken when slots are reserved and handed
+ *   back, and held while the pages move when the bucket has to grow. Values are written to the
+ *   pages without a lock, inside an epoch kept apart from the readers', and written again if a grow
+ *   may have copied the slot first: the grow keeps a sequence counter of the bucket's odd while it
+ *   copies.
+ * - kv_record_tbl grows by doubling, one stripe at a time. ptbl_record_tbl is sized for every bucket
+ *   up front and never moves.
+ *
+ * Readers take no locks and write no shared memory: they read the stripe's sequence, copy the record,
+ * and start over if the sequence was odd or has changed since.
+ *
+ * Reads happen inside an epoch (see Epoch_domain), and nothing a reader may be looking at is freed or
+ * reused until every reader that was inside at the time has left. That covers freed and overwritten
+ * slots, old kv_record_tbls, and old bucket pages: a bucket grows by doubling into a new region rather
+ * than by mremap(). A value is never changed in place either, database_concurrent_kv_set_value()
+ * writes a new slot, so a pointer from database_concurrent_kv_get_value() keeps pointing at the same
+ * bytes until database_concurrent_read_end().
+ *
+ * Allocating and freeing mostly stays off the shared locks: every thread keeps a magazine of up to
+ * CONCURRENT_MAGAZINE_SIZE reserved slots for each small bucket, and as many reserved records, and
+ * an allocation its magazine can serve takes no lock but its record's stripe. An empty magazine is
+ * refilled half way in one go under the bucket's lock, and a full one hands half of its contents
+ * back the same way. A thread's magazine is emptied back into the database when the
+ * thread exits.
+ *
+ * The underlying Record_database must not be used directly while other threads are using the
+ * Database_concurrent, but may be handed to the single-threaded API (a cursor, a scan, ...) while
+ * they aren't.
+ *
+ * Locks are always taken in this order: snapshot list, kv table, stripe, ptbl table, bucket page_usage.
+ */
+typedef struct database_concurrent Database_concurrent;
+
+/** @brief A consistent, read-only view of a Database_concurrent as it was at one point in time
+ *
+ * While any snapshot is open, every write keeps the version it replaces (the slot of the old value,
+ * or the fact that a record was free) along with the timestamp it was replaced at. A snapshot reads
+ * the newest version that was still current when it began. Versions that no open snapshot can need
+ * anymore are dropped, and their slots freed, whenever a snapshot ends.
+ *
+ * Writers don't wait for snapshots, and without open snapshots they keep nothing at all. Taking a
+ * snapshot waits for the writes in progress on every stripe to finish.
+ */
+typedef struct database_snapshot Database_snapshot;
+
+/** @brief   Creates an empty thread-safe database
+ *  @returns A pointer to the database on success, or 0 on failure
+ *  @see     database_concurrent_free()
+ */
+Database_concurrent *
+database_concurrent_create(
+    Context_main *ctx_main ///<[in] main context
+    );
+
+/** @brief Frees \a dbc, along with every bucket and record in it. No other thread may be using it. */
+void
+database_concurrent_free(
+    Context_main *ctx_main,  ///<[in] main context
+    Database_concurrent *dbc ///<[in] database
+    );
+
+/** @brief Returns the Record_database underneath \a dbc, for use while no other threads are using it
+ *
+ * Its kv_record_free_count, which \a dbc doesn't keep up to date, is counted anew on every call.
+ */
+Record_database *
+database_concurrent_record(
+    Database_concurrent *dbc ///<[in] database
+    );
+
+/** @brief   Thread-safe version of database_kv_alloc()
+ *  @returns The key of the new record on success, or -1 on failure
+ */
+unsigned long
+database_concurrent_kv_alloc(
+    Context_main *ctx_main,   ///<[in] main context
+    Database_concurrent *dbc, ///<[in] database
+    unsigned char flags,      ///<[in] flags of the new record
+    unsigned long size,       ///<[in] size of the value in bytes
+    unsigned char *buffer     ///<[in] \a size bytes to initialize the value with
+    );
+
+/** @brief   Thread-safe version of database_kv_free()
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_concurrent_kv_free(
+    Context_main *ctx_main,   ///<[in] main context
+    Database_concurrent *dbc, ///<[in] database
+    unsigned long k           ///<[in] key of the record to free
+    );
+
+/** @brief   Thread-safe version of database_kv_set_value()
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_concurrent_kv_set_value(
+    Context_main *ctx_main,   ///<[in] main context
+    Database_concurrent *dbc, ///<[in] database
+    unsigned long k,          ///<[in] key of the record to change
+    unsigned long length,     ///<[in] length of \a buffer in bytes
+    unsigned char *buffer     ///<[in] new value
+    );
+
+/** @brief Copies the value of record \a k into \a buffer
+ *
+ * At most \a length bytes are copied. The full size of the value is written to \a size, so a value
+ * that didn't fit can be fetched again with a bigger buffer.
+ *
+ * @returns 1 on success, 0 if \a k isn't a live record
+ */
+int
+database_concurrent_kv_get(
+    Context_main *ctx_main,   ///<[in]  main context
+    Database_concurrent *dbc, ///<[in]  database
+    unsigned long k,          ///<[in]  key of the record to read
+    unsigned char *buffer,    ///<[out] where to copy the value to
+    unsigned long length,     ///<[in]  length of \a buffer in bytes
+    unsigned long *size,      ///<[out] size of the value in bytes (optional)
+    unsigned char *flags      ///<[out] flags of the record (optional)
+    );
+
+/** @brief   Starts a read section, in which pointers from database_concurrent_kv_get_value() stay valid
+ *  @returns 1 on success, 0 on failure
+ *  @see     database_concurrent_read_end()
+ */
+int
+database_concurrent_read_begin(
+    Database_concurrent *dbc ///<[in] database
+    );
+
+/** @brief Ends the calling thread's read section. Pointers to values may be freed from now on. */
+void
+database_concurrent_read_end(
+    Database_concurrent *dbc ///<[in] database
+    );
+
+/** @brief Returns a pointer to the value of record \a k, without copying it
+ *
+ * Must be called between database_concurrent_read_begin() and database_concurrent_read_end(). The
+ * value stays as it was when it was found until then, even if the record is set or freed meanwhile.
+ * Holding a read section open holds up every free in the database, so keep it short.
+ *
+ * @returns A pointer to the value, or 0 if \a k isn't a live record
+ */
+unsigned char *
+database_concurrent_kv_get_value(
+    Database_concurrent *dbc, ///<[in]  database
+    unsigned long k,          ///<[in]  key of the record to read
+    unsigned long *size,      ///<[out] size of the value in bytes (optional)
+    unsigned char *flags      ///<[out] flags of the record (optional)
+    );
+
+/** @brief Runs every deferred free that no reader is holding up anymore
+ *
+ * Frees are otherwise only run once a thread has built up EPOCH_RECLAIM_THRESHOLD of them, and those
+ * of exited threads only when another thread reclaims.
+ *
+ * @returns The number of frees still pending on the calling thread
+ */
+unsigned long
+database_concurrent_reclaim(
+    Context_main *ctx_main,   ///<[in] main context
+    Database_concurrent *dbc  ///<[in] database
+    );
+
+/** @brief   Takes a snapshot of \a dbc
+ *  @returns A pointer to the snapshot on success, or 0 on failure
+ *  @see     database_concurrent_snapshot_end()
+ */
+Database_snapshot *
+database_concurrent_snapshot_begin(
+    Context_main *ctx_main,  ///<[in] main context
+    Database_concurrent *dbc ///<[in] database
+    );
+
+/** @brief Frees \a snapshot, along with every old version that only it still needed */
+void
+database_concurrent_snapshot_end(
+    Context_main *ctx_main,      ///<[in] main context
+    Database_snapshot *snapshot  ///<[in] snapshot
+    );
+
+/** @brief   Returns the number of kv_records \a snapshot covers. Keys from here on didn't exist yet. */
+unsigned long
+database_concurrent_snapshot_key_count(
+    Database_snapshot *snapshot ///<[in] snapshot
+    );
+
+/** @brief Copies the value record \a k had when \a snapshot was taken into \a buffer
+ *
+ * At most \a length bytes are copied. The full size of the value is written to \a size.
+ *
+ * @returns 1 on success, 0 if \a k wasn't a live record at the time
+ */
+int
+database_concurrent_snapshot_get(
+    Context_main *ctx_main,      ///<[in]  main context
+    Database_snapshot *snapshot, ///<[in]  snapshot
+    unsigned long k,             ///<[in]  key of the record to read
+    unsigned char *buffer,       ///<[out] where to copy the value to
+    unsigned long length,        ///<[in]  length of \a buffer in bytes
+    unsigned long *size,         ///<[out] size of the value in bytes (optional)
+    unsigned char *flags         ///<[out] flags of the record (optional)
+    );
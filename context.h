@@ -6,4 +6,5 @@
 typedef struct main_context {
     unsigned long system_page_size;       ///< The result of a call made to sysconf(_SC_PAGE_SIZE)
     unsigned long system_phys_page_count; ///< The result of a call made to sysconf(_SC_PHYS_PAGES)
+    unsigned long system_cpu_count;       ///< The result of a call made to sysconf(_SC_NPROCESSORS_ONLN)
 } Context_main;
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "cursor.h"
+
+#ifndef DEBUG_CURSOR
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+// How many slots ahead of the current value to prefetch
+#define CURSOR_PREFETCH_DISTANCE 4
+
+#define CURSOR_POSITION(bucket,index) (((unsigned long)(bucket) << KV_RECORD_BUCKET_SHIFT) | ((index) & ~KV_RECORD_BUCKET_BITMASK))
+#define CURSOR_POSITION_BUCKET(x) (((x) & KV_RECORD_BUCKET_BITMASK) >> KV_RECORD_BUCKET_SHIFT)
+#define CURSOR_POSITION_INDEX(x) ((x) & ~KV_RECORD_BUCKET_BITMASK)
+
+// Builds the slot -> key map of every bucket from first on for cursor, with one pass over kv_record_tbl
+static int
+_database_cursor_build(
+    Context_main *ctx_main,
+    Database_cursor *cursor,
+    int first
+) {
+    DEBUG_PRINT("_database_cursor_build(first = %d);\n", first);
+
+    Record_database *rec_database = cursor->rec_database;
+
+    unsigned long slot_count = 0;
+    for(int bucket = 0; bucket < 64; bucket++) {
+        cursor->slot_offset[bucket] = slot_count;
+        char ptbl_index = (bucket >= first) ? database_ptbl_get(ctx_main, rec_database, bucket) : -1;
+        if(ptbl_index != -1) {
+            slot_count += (unsigned long)PTBL_RECORD_GET_PAGE_COUNT(rec_database->ptbl_record_tbl[ptbl_index]) * PTBL_CALC_PAGE_USAGE_BITS(bucket);
+        }
+    }
+    cursor->slot_offset[64] = slot_count;
+
+    if(slot_count) {
+        // calloc() rather than memory_alloc(), as the map may hold more than an int's worth, and it
+        // fails rather than overflow
+        cursor->slot_key = (unsigned long *)calloc(slot_count, sizeof(unsigned long));
+        if(!cursor->slot_key) {
+            DEBUG_PRINT("\tERR failed to allocate slot_key\n");
+            return 0;
+        }
+    }
+    cursor->slot_count = slot_count;
+    cursor->slot_built = 1;
+
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+#define _REC_KV rec_database->kv_record_tbl[k]
+        if(!KV_RECORD_GET_SIZE(_REC_KV)) {
+            continue;
+        }
+        int bucket = KV_RECORD_GET_BUCKET(_REC_KV);
+        unsigned long index = KV_RECORD_GET_INDEX(_REC_KV);
+        if(index < cursor->slot_offset[bucket + 1] - cursor->slot_offset[bucket]) {
+            cursor->slot_key[cursor->slot_offset[bucket] + index] = k + 1;
+        }
+#undef _REC_KV
+    }
+
+    return 1;
+}
+
+int
+database_cursor_open(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    Database_cursor *cursor,
+    unsigned long token
+) {
+    DEBUG_PRINT("database_cursor_open(token = %016lx);\n", token);
+
+    if(!rec_database || !cursor) {
+        return 0;
+    }
+
+    memset(cursor, 0, sizeof(Database_cursor));
+    cursor->rec_database = rec_database;
+    cursor->position = token;
+
+    return 1;
+}
+
+int
+database_cursor_next(
+    Context_main *ctx_main,
+    Database_cursor *cursor,
+    unsigned long *k,
+    unsigned char **value,
+    unsigned long *size
+) {
+    Record_database *rec_database = cursor->rec_database;
+
+    while(cursor->position != DATABASE_CURSOR_END) {
+        int bucket = CURSOR_POSITION_BUCKET(cursor->position);
+        unsigned long index = CURSOR_POSITION_INDEX(cursor->position);
+
+        if(!cursor->slot_built && !_database_cursor_build(ctx_main, cursor, bucket)) {
+            return 0;
+        }
+
+        unsigned long *slot_key = cursor->slot_key + cursor->slot_offset[bucket],
+                      slot_count = cursor->slot_offset[bucket + 1] - cursor->slot_offset[bucket];
+        char ptbl_index = (slot_count > 0) ? database_ptbl_get(ctx_main, rec_database, bucket) : -1;
+
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+        // The bucket may have been freed and allocated again smaller since slot_key was built
+        while(ptbl_index != -1 && index < slot_count && index / 8 < _PTBL.page_usage_length) {
+            unsigned char usage = _PTBL.page_usage[index / 8];
+            if(!usage) {
+                // Skip the whole byte
+                index = (index | 7) + 1;
+                continue;
+            }
+
+            unsigned long key = slot_key[index];
+            if(!(usage & (1 << (index % 8))) || !key--) {
+                index++;
+                continue;
+            }
+
+#define _REC_KV rec_database->kv_record_tbl[key]
+
+            // The database may have changed since slot_key was built
+            if(key >= rec_database->kv_record_count ||
+                    !KV_RECORD_GET_SIZE(_REC_KV) ||
+                    KV_RECORD_GET_BUCKET(_REC_KV) != bucket ||
+                    KV_RECORD_GET_INDEX(_REC_KV) != index) {
+                index++;
+                continue;
+            }
+
+            unsigned long stride = PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+            unsigned char *region = _PTBL.m_offset + index * stride;
+            __builtin_prefetch(region + CURSOR_PREFETCH_DISTANCE * stride);
+
+            if(k) k[0] = key;
+            if(value) value[0] = region;
+            if(size) size[0] = KV_RECORD_GET_SIZE(_REC_KV);
+
+#undef _REC_KV
+
+            cursor->position = CURSOR_POSITION(bucket, index + 1);
+            return 1;
+        }
+
+#undef _PTBL
+
+        // Move on to the next bucket
+        cursor->position = (bucket >= (KV_RECORD_BUCKET_BITMASK >> KV_RECORD_BUCKET_SHIFT)) ?
+            DATABASE_CURSOR_END : CURSOR_POSITION(bucket + 1, 0);
+    }
+
+    database_cursor_close(cursor);
+
+    return 0;
+}
+
+unsigned long
+database_cursor_token(
+    Database_cursor *cursor
+) {
+    return cursor->position;
+}
+
+void
+database_cursor_close(
+    Database_cursor *cursor
+) {
+    free(cursor->slot_key);
+    cursor->slot_key = 0;
+    cursor->slot_count = 0;
+    cursor->slot_built = 0;
+}
@@ -0,0 +1,73 @@
+/** @file  cursor.h
+ *  @brief Cursors that walk the live values of a database in physical (memory) order
+ */
+
+/** @brief Token returned by database_cursor_token() once a cursor has visited every value */
+#define DATABASE_CURSOR_END ((unsigned long)-1)
+
+/** @brief State for a scan over every live value in a database_record
+ *
+ * Buckets are visited in ascending order, and the values inside a bucket in the order they are laid out
+ * in ptbl_record.m_offset, using ptbl_record.page_usage to skip over empty slots.
+ *
+ * Because a value slot does not know which key occupies it, the cursor builds \a slot_key for every
+ * bucket it has left to visit with one sequential pass over database_record.kv_record_tbl, on the first
+ * call to database_cursor_next().
+ *
+ * Every value is re-validated against its kv_record before being returned, so the database may be
+ * modified between calls to database_cursor_next(). Values that are added after that first call will
+ * not be seen.
+ */
+typedef struct database_cursor {
+    Record_database *rec_database; ///< The database being scanned
+    unsigned long position;        ///< The next slot to visit, encoded like kv_record.bucket_and_index
+    unsigned long *slot_key;       ///< (key + 1) of the kv_record occupying each slot of every bucket left, or 0
+    unsigned long slot_offset[65]; ///< Where the slots of each bucket start in \a slot_key, and where they end
+    unsigned long slot_count;      ///< Number of entries in \a slot_key
+    int slot_built;                ///< Whether \a slot_key has been built
+} Database_cursor;
+
+/** @brief Prepares \a cursor to scan \a rec_database starting from \a token
+ *
+ * Pass 0 as \a token to start at the very beginning, or a value previously returned by
+ * database_cursor_token() to resume a paused scan.
+ *
+ * @returns 1 on success, 0 on failure
+ * @see     database_cursor_close()
+ */
+int
+database_cursor_open(
+    Context_main *ctx_main,        ///<[in]  main context
+    Record_database *rec_database, ///<[in]  database record
+    Database_cursor *cursor,       ///<[out] cursor to initialize
+    unsigned long token            ///<[in]  where to start
+    );
+
+/** @brief Advances \a cursor to the next live value
+ *
+ * The pointer written to \a value has the same caveats as the one returned by database_kv_get_value().
+ *
+ * @returns 1 if a value was found, 0 once the scan is complete
+ */
+int
+database_cursor_next(
+    Context_main *ctx_main,  ///<[in]  main context
+    Database_cursor *cursor, ///<[in]  cursor
+    unsigned long *k,        ///<[out] key of the value
+    unsigned char **value,   ///<[out] pointer to the value in memory
+    unsigned long *size      ///<[out] size of the value in bytes
+    );
+
+/** @brief   Returns a token that database_cursor_open() can use to resume the scan from where \a cursor is
+ *  @returns A resume token, or DATABASE_CURSOR_END when the scan is complete
+ */
+unsigned long
+database_cursor_token(
+    Database_cursor *cursor ///<[in] cursor
+    );
+
+/** @brief Frees any memory held by \a cursor */
+void
+database_cursor_close(
+    Database_cursor *cursor ///<[in] cursor
+    );
@@ -5,6 +5,8 @@
 #include "records.h"
 #include "context.h"
 #include "memory.h"
+#include "database.h"
+#include "cdc.h"
 
 #ifndef DEBUG_DATABASE
     #undef DEBUG_PRINT
@@ -67,6 +69,67 @@ int database_ptbl_init(
     return 1;
 }
 
+int
+database_ptbl_grow(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    char ptbl_index,
+    int new_page_count
+) {
+    DEBUG_PRINT("database_ptbl_grow(ptbl_index = %d, new_page_count = %d);\n", ptbl_index, new_page_count);
+
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+    int bucket = PTBL_RECORD_GET_KEY(_PTBL);
+    unsigned char *offset;
+    int old_pages = ((bucket <= 8) ? PTBL_RECORD_GET_PAGE_COUNT(_PTBL) : (PTBL_RECORD_GET_PAGE_COUNT(_PTBL) << (bucket - 8))),
+        new_pages = ((bucket <= 8) ? new_page_count : (new_page_count << (bucket - 8)));
+
+    if(PTBL_RECORD_GET_OFFSET(_PTBL)) {
+        // The pages are mapped from a snapshot (see database_map()), and growing the mapping would
+        // map more of the file, so they're copied out instead
+        offset = memory_page_alloc(ctx_main, new_pages);
+        if(!offset) {
+            return 0;
+        }
+        memcpy(offset, _PTBL.m_offset, old_pages * ctx_main->system_page_size);
+        memory_page_free(ctx_main, _PTBL.m_offset, old_pages);
+        PTBL_RECORD_SET_OFFSET(_PTBL, 0);
+    }
+    else {
+        offset = memory_page_realloc(ctx_main, _PTBL.m_offset, old_pages, new_pages);
+        if(!offset) {
+            return 0;
+        }
+    }
+
+    // If the OS assigns us a new virtual address, we need to record that
+    _PTBL.m_offset = offset;
+
+    unsigned int new_page_usage_length = PTBL_CALC_PAGE_USAGE_LENGTH(bucket, new_page_count);
+
+    // Current method doesn't garbage collect the page-tables (yet),
+    // however we should avoid calling the realloc() function on
+    // page_usage if the new length is exactly the same as the old
+    // length (i.e. on any bucket >8 where multiple pages are
+    // represented in a single byte)
+    if(new_page_usage_length > _PTBL.page_usage_length) {
+        unsigned char *new_page_usage = memory_realloc(_PTBL.page_usage, sizeof(unsigned char) * _PTBL.page_usage_length, sizeof(unsigned char) * new_page_usage_length);
+        if(!new_page_usage) {
+            DEBUG_PRINT("\tERR failed to increase the size of page_usage\n");
+            return 0;
+        }
+        _PTBL.page_usage = new_page_usage;
+        _PTBL.page_usage_length = new_page_usage_length;
+        DEBUG_PRINT("\tIncreased size of page_usage: %d\n", _PTBL.page_usage_length);
+    }
+
+    PTBL_RECORD_SET_PAGE_COUNT(_PTBL, new_page_count);
+
+    return 1;
+}
+
 // x = bucket
 // max_value_len_inside_page = 2^(4+x)
 // i.e., bucket #0 is for <=16-byte values
@@ -151,6 +214,7 @@ database_ptbl_alloc(
         return _NEW_PTBL.m_offset;
     }
 
+#undef _PTBL
 #define _PTBL rec_database->ptbl_record_tbl[new_ptbl_index]
 
     if(!_PTBL.m_offset) {
@@ -287,45 +351,15 @@ database_ptbl_alloc(
         // Realloc (add) more pages
         int new_page_count = PTBL_RECORD_GET_PAGE_COUNT(_PTBL) + page_count - free_pages;
 
-        offset = memory_page_realloc(
-                ctx_main,
-                _PTBL.m_offset,
-                PTBL_RECORD_GET_PAGE_COUNT(_PTBL),
-                ((bucket <= 8) ? new_page_count : (new_page_count << (bucket - 8)))
-                );
-
-        if(!offset) {
+        if(!database_ptbl_grow(ctx_main, rec_database, new_ptbl_index, new_page_count)) {
             return 0;
         }
-
-        // If the OS assigns us a new virtual address, we need to record that
-        _PTBL.m_offset = offset;
-
-        unsigned int new_page_usage_length = PTBL_CALC_PAGE_USAGE_LENGTH(bucket, new_page_count);
-
-        // Current method doesn't garbage collect the page-tables (yet),
-        // however we should avoid calling the realloc() function on
-        // page_usage if the new length is exactly the same as the old
-        // length (i.e. on any bucket >8 where multiple pages are
-        // represented in a single byte)
-        if(new_page_usage_length > _PTBL.page_usage_length) {
-            unsigned char *new_page_usage = memory_realloc(_PTBL.page_usage, sizeof(unsigned char) * _PTBL.page_usage_length, sizeof(unsigned char) * new_page_usage_length);
-            if(!new_page_usage) {
-                DEBUG_PRINT("\tERR failed to increase the size of page_usage\n");
-                return 0;
-            }
-            _PTBL.page_usage = new_page_usage;
-            _PTBL.page_usage_length = new_page_usage_length;
-            DEBUG_PRINT("\tIncreased size of page_usage: %d\n", _PTBL.page_usage_length);
-        }
-
-        PTBL_RECORD_SET_PAGE_COUNT(_PTBL, new_page_count);
+        offset = _PTBL.m_offset;
 
         // This needs to be done AFTER setting _PTBL.m_offset to the right page base
-        // (for obvious reasons)
-        if(last_free_page != -1) {
-            offset += (new_page_count - page_count) * ctx_main->system_page_size * ((bucket <= 8) ? 1 : (1 << (bucket - 8)));
-        }
+        // (for obvious reasons). The allocated run is always the last page_count pages,
+        // whether or not it started with free pages at the end of the old region.
+        offset += (new_page_count - page_count) * ctx_main->system_page_size * ((bucket <= 8) ? 1 : (1 << (bucket - 8)));
     }
 
     if(ptbl_index) ptbl_index[0] = new_ptbl_index;
@@ -361,11 +395,16 @@ void database_ptbl_free(
                 _PTBL.page_usage = 0;
                 _PTBL.page_usage_length = 0;
 
+                memory_free(_PTBL.page_dirty);
+                _PTBL.page_dirty = 0;
+                _PTBL.page_dirty_length = 0;
+
                 if(_PTBL.m_offset) {
+                    int bucket = PTBL_RECORD_GET_KEY(_PTBL);
                     memory_page_free(
                             ctx_main,
                             _PTBL.m_offset,
-                            PTBL_RECORD_GET_PAGE_COUNT(_PTBL)
+                            ((bucket <= 8) ? PTBL_RECORD_GET_PAGE_COUNT(_PTBL) : (PTBL_RECORD_GET_PAGE_COUNT(_PTBL) << (bucket - 8)))
                             );
                 }
             }
@@ -382,7 +421,11 @@ void database_ptbl_free(
         }
         rec_database->kv_record_count = 0;
         rec_database->kv_record_tbl = 0;
+        rec_database->kv_record_free_count = 0;
     }
+    memory_free(rec_database->kv_dirty);
+    rec_database->kv_dirty = 0;
+    rec_database->kv_dirty_length = 0;
     DEBUG_PRINT("\tTotal in-use freed: %d bytes\n", total);
 }
 
@@ -430,6 +473,9 @@ database_kv_free(
 
     // Zero-out value
     memset(PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, _REC_KV), 0, bucket_wsz);
+    database_dirty_mark(ctx_main, rec_database, ptbl_index, PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, _REC_KV), bucket_wsz);
+    database_dirty_mark_kv(rec_database, k);
+    if(rec_database->cdc) cdc_publish(rec_database->cdc, CDC_OP_FREE, k, 0);
 
     // Mark value as freed in page_usage
     PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, kv_index);
@@ -437,6 +483,7 @@ database_kv_free(
     // Only decrement kv_record_count if the kv_record being free()d is the one at the very end of rec_database->kv_record_tbl
     // This is because we don't want to lose a record at the end of kv_record_tbl if a record is free()d in the middle.
     if(k == rec_database->kv_record_count - 1) rec_database->kv_record_count--;
+    else rec_database->kv_record_free_count++;
 
     // If this was the last record in the table, free() it to make sure it gets reinitialized
     if(rec_database->kv_record_count == 0) {
@@ -506,18 +553,32 @@ _database_value_alloc(
 
     // Identify the first unused "slot" that can hold a value of the appropriate size
     for(int i = 0; i < _PTBL.page_usage_length && free_index == -1; i++) {
+        unsigned long word;
+        if(!(i % 8) && i + 8 <= _PTBL.page_usage_length) {
+            // Skip eight fully occupied bytes at a time, since buckets tend to fill from the front
+            memcpy(&word, &_PTBL.page_usage[i], sizeof(word));
+            if(word == (unsigned long)-1) {
+                i += 7;
+                continue;
+            }
+        }
         unsigned char bits = _PTBL.page_usage[i];
+        if(bits == 0xFF) {
+            continue;
+        }
         int max = 8;
-        if(page_usage_bits < 8) {
+        if(page_usage_bits < 8 && i == _PTBL.page_usage_length - 1) {
             // Ensure that we don't try to read more bits than there are total
             if(!(max = ((page_count * page_usage_bits) % 8))) {
                 max = 8;
             }
         }
         for(int j = 0; j < max && free_index == -1; j++) {
-            // Mark value slot as used since we will occupy the empty slot
-            _PTBL.page_usage[i] |= (1 << j);
-            free_index = i * 8 + j;
+            if(!(bits & (1 << j))) {
+                // Mark value slot as used since we will occupy the empty slot
+                _PTBL.page_usage[i] |= (1 << j);
+                free_index = i * 8 + j;
+            }
         }
     }
 
@@ -525,13 +586,14 @@ _database_value_alloc(
         char new_new_ptbl_index;
 
         // No free slots exist in any of the pages, so we need to allocate a new page
-        if(!database_ptbl_alloc(ctx_main, rec_database, &new_new_ptbl_index, 1, bucket)) {
+        unsigned char *new_page = database_ptbl_alloc(ctx_main, rec_database, &new_new_ptbl_index, 1, bucket);
+        if(!new_page) {
             return -1;
         }
 
-        // Mark the first free value slot as not-free
-        free_index = (page_count - 1) * page_usage_bytes * 8;
-        rec_database->ptbl_record_tbl[new_new_ptbl_index].page_usage[free_index / 8] |= 1;
+        // Mark the first value slot of the new page as not-free
+        free_index = (new_page - rec_database->ptbl_record_tbl[new_new_ptbl_index].m_offset) / PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+        rec_database->ptbl_record_tbl[new_new_ptbl_index].page_usage[free_index / 8] |= (1 << (free_index % 8));
 
         new_ptbl_index = new_new_ptbl_index;
     }
@@ -541,48 +603,100 @@ _database_value_alloc(
     return free_index;
 }
 
-unsigned long
-database_kv_alloc(
+int
+_database_value_alloc_many(
     Context_main *ctx_main,
     Record_database *rec_database,
-    unsigned char flags,
-    unsigned long size,
-    unsigned char *buffer
+    char bucket,
+    unsigned long count,
+    unsigned long *index
 ) {
-    DEBUG_PRINT("database_alloc_kv(flags = %02x, size = %d, buffer = %p);\n", flags, size, buffer);
+    DEBUG_PRINT("_database_value_alloc_many(bucket = %d, count = %lu)\n", bucket, count);
 
-    // Allocate based on page-table mappings
-    // If no page table exists for records of
-    // a given size, create one.
+    unsigned long allocated = 0;
+    char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+    int i = 0;
 
-    unsigned char bucket = database_calc_bucket(size);
-    DEBUG_PRINT("\tbucket = %d\n", bucket);
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
 
-    char ptbl_index;
-    unsigned long free_index = _database_value_alloc(ctx_main, rec_database, &ptbl_index, bucket);
-    if(free_index == -1) {
-        DEBUG_PRINT("\tERR failed to allocate new value in bucket %d\n", bucket);
-        return -1;
+    while(allocated < count) {
+        if(ptbl_index != -1) {
+            unsigned int page_count = PTBL_RECORD_GET_PAGE_COUNT(_PTBL),
+                page_usage_bits = PTBL_CALC_PAGE_USAGE_BITS(bucket);
+
+            // Same search as _database_value_alloc(), but carrying on from where it left off
+            for(; i < _PTBL.page_usage_length && allocated < count; i++) {
+                unsigned long word;
+                if(!(i % 8) && i + 8 <= _PTBL.page_usage_length) {
+                    memcpy(&word, &_PTBL.page_usage[i], sizeof(word));
+                    if(word == (unsigned long)-1) {
+                        i += 7;
+                        continue;
+                    }
+                }
+                if(_PTBL.page_usage[i] == 0xFF) {
+                    continue;
+                }
+                int max = 8;
+                if(page_usage_bits < 8 && i == _PTBL.page_usage_length - 1) {
+                    if(!(max = ((page_count * page_usage_bits) % 8))) {
+                        max = 8;
+                    }
+                }
+                for(int j = 0; j < max && allocated < count; j++) {
+                    if(!(_PTBL.page_usage[i] & (1 << j))) {
+                        _PTBL.page_usage[i] |= (1 << j);
+                        index[allocated++] = i * 8 + j;
+                    }
+                }
+            }
+            if(allocated == count) {
+                break;
+            }
+        }
+
+        // Out of free slots: let _database_value_alloc() grow the bucket (or create it), then carry
+        // on through the new pages
+        unsigned long grown = _database_value_alloc(ctx_main, rec_database, &ptbl_index, bucket);
+        if(grown == -1) {
+            DEBUG_PRINT("\tERR failed to grow bucket %d\n", bucket);
+            while(allocated > 0) {
+                allocated--;
+                PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, index[allocated]);
+            }
+            return 0;
+        }
+        index[allocated++] = grown;
+        i = grown / 8;
     }
-    Record_ptbl *ptbl_entry = &rec_database->ptbl_record_tbl[ptbl_index];
 
-    unsigned long value_offset = free_index * PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+    return 1;
+}
 
+unsigned long
+database_kv_record_alloc(
+    Context_main *ctx_main,
+    Record_database *rec_database
+) {
     // We need to find a free spot in the kv_record table and occupy it
     unsigned long free_kv = 0;
     if(!rec_database->kv_record_tbl) {
         rec_database->kv_record_tbl = (Record_kv *)memory_alloc(sizeof(Record_kv));
         if(!rec_database->kv_record_tbl) {
-            DEBUG_PRINT("database_alloc_kv() Failed to allocate kv_record_tbl\n");
+            DEBUG_PRINT("database_kv_record_alloc() Failed to allocate kv_record_tbl\n");
             return -1;
         }
         rec_database->kv_record_count = 1;
     }
     else {
+        // Reuse the last free record, if there are any
         free_kv = -1;
-        for(int i = 0; i < rec_database->kv_record_count; i++) {
+        for(long i = rec_database->kv_record_count - 1; i >= 0 && rec_database->kv_record_free_count > 0; i--) {
             if(!KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[i])) {
                 free_kv = i;
+                rec_database->kv_record_free_count--;
+                break;
             }
         }
 
@@ -596,7 +710,7 @@ database_kv_alloc(
                     (rec_database->kv_record_count + 1) * sizeof(Record_kv)
                     );
             if(!new_kv_tbl) {
-                DEBUG_PRINT("database_alloc_kv(): Failed to increase the size of kv_record_tbl\n");
+                DEBUG_PRINT("database_kv_record_alloc(): Failed to increase the size of kv_record_tbl\n");
                 return -1;
             }
 
@@ -607,6 +721,42 @@ database_kv_alloc(
         }
     }
 
+    return free_kv;
+}
+
+unsigned long
+database_kv_alloc(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_alloc_kv(flags = %02x, size = %d, buffer = %p);\n", flags, size, buffer);
+
+    // Allocate based on page-table mappings
+    // If no page table exists for records of
+    // a given size, create one.
+
+    unsigned char bucket = database_calc_bucket(size);
+    DEBUG_PRINT("\tbucket = %d\n", bucket);
+
+    char ptbl_index;
+    unsigned long free_index = _database_value_alloc(ctx_main, rec_database, &ptbl_index, bucket);
+    if(free_index == -1) {
+        DEBUG_PRINT("\tERR failed to allocate new value in bucket %d\n", bucket);
+        return -1;
+    }
+    Record_ptbl *ptbl_entry = &rec_database->ptbl_record_tbl[ptbl_index];
+
+    unsigned long value_offset = free_index * PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+
+    unsigned long free_kv = database_kv_record_alloc(ctx_main, rec_database);
+    if(free_kv == -1) {
+        PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, free_index);
+        return -1;
+    }
+
     Record_kv *kv_rec = &rec_database->kv_record_tbl[free_kv];
     DEBUG_PRINT("KV_REC: %d, %p, %p\n", free_kv, kv_rec, rec_database->kv_record_tbl);
 
@@ -616,6 +766,9 @@ database_kv_alloc(
     KV_RECORD_SET_INDEX(kv_rec[0], free_index);
 
     memcpy((unsigned char *)(ptbl_entry->m_offset + value_offset), buffer, size);
+    database_dirty_mark(ctx_main, rec_database, ptbl_index, ptbl_entry->m_offset + value_offset, size);
+    database_dirty_mark_kv(rec_database, free_kv);
+    if(rec_database->cdc) cdc_publish(rec_database->cdc, CDC_OP_ALLOC, free_kv, size);
 
     return free_kv;
 }
@@ -709,9 +862,83 @@ database_kv_set_value(
     // Copy over buffer to the new value
     unsigned char *new_region = PTBL_RECORD_VALUE_PTR(rec_database, new_ptbl_index, _REC_KV);
     memcpy(new_region, buffer, length);
+    database_dirty_mark(ctx_main, rec_database, new_ptbl_index, new_region, length);
+    database_dirty_mark_kv(rec_database, k);
 
     // "Enable" record by setting size to new_index value length
     KV_RECORD_SET_SIZE(_REC_KV, length);
+    if(rec_database->cdc) cdc_publish(rec_database->cdc, CDC_OP_SET_VALUE, k, length);
 
     return 1;
 }
+
+void
+database_dirty_mark(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    char ptbl_index,
+    unsigned char *region,
+    unsigned long length
+) {
+    Record_ptbl *ptbl_entry = &rec_database->ptbl_record_tbl[ptbl_index];
+    if(!ptbl_entry->page_dirty || !length) {
+        return;
+    }
+
+    // Pages past the end of page_dirty were added since the last reset, and are dirty anyway
+    unsigned long page = (region - ptbl_entry->m_offset) / ctx_main->system_page_size,
+                  last = (region + length - 1 - ptbl_entry->m_offset) / ctx_main->system_page_size;
+    for(; page <= last && page / 8 < ptbl_entry->page_dirty_length; page++) {
+        ptbl_entry->page_dirty[page / 8] |= (1 << (page % 8));
+    }
+}
+
+void
+database_dirty_mark_kv(
+    Record_database *rec_database,
+    unsigned long k
+) {
+    unsigned long chunk = k / DATABASE_KV_DIRTY_CHUNK;
+    if(rec_database->kv_dirty && chunk / 8 < rec_database->kv_dirty_length) {
+        rec_database->kv_dirty[chunk / 8] |= (1 << (chunk % 8));
+    }
+}
+
+int
+database_dirty_reset(
+    Context_main *ctx_main,
+    Record_database *rec_database
+) {
+    DEBUG_PRINT("database_dirty_reset();\n");
+
+    // Both bitmaps get at least a byte, as a missing one means "all dirty"
+    unsigned long chunks = (rec_database->kv_record_count + DATABASE_KV_DIRTY_CHUNK - 1) / DATABASE_KV_DIRTY_CHUNK,
+                  length = (chunks + 7) / 8;
+    memory_free(rec_database->kv_dirty);
+    rec_database->kv_dirty_length = 0;
+    rec_database->kv_dirty = memory_alloc(length ? length : 1);
+    int ok = (rec_database->kv_dirty != 0);
+    if(ok) {
+        rec_database->kv_dirty_length = length ? length : 1;
+    }
+
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[i]
+
+        int bucket = PTBL_RECORD_GET_KEY(_PTBL);
+        unsigned long pages = ((bucket <= 8) ? PTBL_RECORD_GET_PAGE_COUNT(_PTBL) : (PTBL_RECORD_GET_PAGE_COUNT(_PTBL) << (bucket - 8)));
+        memory_free(_PTBL.page_dirty);
+        _PTBL.page_dirty_length = 0;
+        _PTBL.page_dirty = memory_alloc((pages + 7) / 8);
+        if(_PTBL.page_dirty) {
+            _PTBL.page_dirty_length = (pages + 7) / 8;
+        }
+        else {
+            ok = 0;
+        }
+    }
+
+    return ok;
+}
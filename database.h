@@ -2,6 +2,9 @@
  *  @brief Method definitions for working with the database and associated records
  */
 
+/** @brief Records of kv_record_tbl covered by each bit of database_record.kv_dirty */
+#define DATABASE_KV_DIRTY_CHUNK 256
+
 /** @brief   Returns an index into the database_record.ptbl_record_tbl for the corresponding \a bucket, or -1 if no such record exists yet.
  *  @returns Index into the record table on success, 0 on failure
  *  @see     ptbl_record
@@ -13,6 +16,21 @@ database_ptbl_get(
     int bucket                     ///< [in] Bucket number
     );
 
+/** @brief Initializes an empty \a ptbl_entry for \a bucket with \a page_count pages
+ *
+ *  This is an \b internal method, used by database_ptbl_alloc() and by anything else that manages
+ *  its own ptbl_record_tbl (see database_concurrent_create()).
+ *
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_ptbl_init(
+    Context_main *ctx_main,  ///<[in]  main context
+    Record_ptbl *ptbl_entry, ///<[out] ptbl_record to initialize
+    int page_count,          ///<[in]  number of pages to allocate
+    int bucket               ///<[in]  bucket number
+    );
+
 /** @brief Returns a pointer to the newly allocated region, of size main_context.system_page_size *
  *         \a bucket, on success, or 0 on failure.
  * 
@@ -35,6 +53,21 @@ database_ptbl_alloc(
     int bucket                     ///<[in]  bucket to allocate in
     );
 
+/** @brief Grows the pages of the ptbl_record at \a ptbl_index to \a new_page_count, along with its page_usage
+ *
+ *  This is an \b internal method, used by database_ptbl_alloc() and database_checkpoint_apply(). The
+ *  pages may move, and a bucket mapped by database_map() is copied out of the file.
+ *
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_ptbl_grow(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    char ptbl_index,               ///<[in] index of the ptbl_record to grow
+    int new_page_count             ///<[in] page count to grow it to
+    );
+
 /** @brief Frees all the structures nested within \a rec_database and it's sub-structures
  *  @see   database_ptbl_alloc()
  *  @see   ptbl_record
@@ -58,6 +91,17 @@ database_kv_free(
     unsigned long k                ///<[in] key of the kv_record to free
     );
 
+/** @brief   Claims a record of database_record.kv_record_tbl for a new key, reusing the last freed one if
+ *           there is one, and growing the table otherwise. The record's fields are left for the caller to set.
+ *  @returns The key of the record on success, or -1 on failure
+ *  @see     database_kv_alloc()
+ */
+unsigned long
+database_kv_record_alloc(
+    Context_main *ctx_main,       ///<[in] main context
+    Record_database *rec_database ///<[in] database record
+    );
+
 /** @brief   returns the key of a newly allocated record in rec_database database_record.kv_record_tbl 
  *           that has been initialized with \a size bytes from \a buffer on success, or 0 on failure.
  *  @returns The key of a new record in rec_database.kv_record_tbl on success, or -1 on failure.
@@ -100,6 +144,23 @@ _database_value_alloc(
     char bucket                    ///<[in]  bucket to allocate in
     );
 
+/** @brief Internal method used to allocate \a count values within a \a bucket in a single pass
+ *
+ *  This is an \b internal method, like _database_value_alloc(). Rather than searching page_usage from
+ *  the start once per value, it picks up where the last free slot was found, and only grows the bucket
+ *  once it has run out of free slots altogether.
+ *
+ *  @returns 1 if all \a count slots were allocated, or 0 on failure, in which case none are
+ */
+int
+_database_value_alloc_many(
+    Context_main *ctx_main,        ///<[in]  main context
+    Record_database *rec_database, ///<[in]  database record
+    char bucket,                   ///<[in]  bucket to allocate in
+    unsigned long count,           ///<[in]  number of values to allocate
+    unsigned long *index           ///<[out] where to write the \a count indices into the bucket
+    );
+
 /** @brief   Given an existing key \a k, sets the value of said key to a value of \a length bytes taken
  *           from buffer.
  *  @returns 1 on success, 0 on failure
@@ -142,3 +203,39 @@ database_kv_get_value(
 int database_calc_bucket(
     unsigned long length ///<[in] length of a value in bytes
     );
+
+/** @brief Marks the pages behind \a length bytes at \a region, inside the ptbl_record at \a ptbl_index, as dirty
+ *
+ *  Called by every write to a bucket's pages (database_kv_alloc(), database_kv_set_value(),
+ *  database_kv_free(), and the batch and log writes), so that database_checkpoint() can write only
+ *  what has changed. It does nothing until database_dirty_reset() has been called.
+ */
+void
+database_dirty_mark(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    char ptbl_index,               ///<[in] index of the ptbl_record \a region is in
+    unsigned char *region,         ///<[in] start of the bytes written
+    unsigned long length           ///<[in] number of bytes written
+    );
+
+/** @brief Marks the chunk of kv_record_tbl that holds record \a k as dirty, like database_dirty_mark() */
+void
+database_dirty_mark_kv(
+    Record_database *rec_database, ///<[in] database record
+    unsigned long k                ///<[in] key of the kv_record that changed
+    );
+
+/** @brief Starts tracking the changes made to \a rec_database from here on, with every page and record clean
+ *
+ *  Tracking costs one bit per page and one per DATABASE_KV_DIRTY_CHUNK records. Writes made to a
+ *  Database_concurrent aren't tracked.
+ *
+ *  @returns 1 on success, or 0 if the bitmaps couldn't be allocated, in which case everything counts as dirty
+ *  @see     database_checkpoint()
+ */
+int
+database_dirty_reset(
+    Context_main *ctx_main,       ///<[in] main context
+    Record_database *rec_database ///<[in] database record
+    );
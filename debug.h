@@ -5,6 +5,26 @@
 //#define DEBUG_DATABASE
 //#define DEBUG_MEMORY
 //#define DEBUG_TESTS
+//#define DEBUG_AGGREGATE
+//#define DEBUG_CURSOR
+//#define DEBUG_POOL
+//#define DEBUG_SCAN
+//#define DEBUG_HASH
+//#define DEBUG_BTREE
+//#define DEBUG_CONCURRENT
+//#define DEBUG_SHARD
+//#define DEBUG_EPOCH
+//#define DEBUG_BATCH
+//#define DEBUG_PERSIST
+//#define DEBUG_WAL
+//#define DEBUG_IO
+//#define DEBUG_PAGED
+//#define DEBUG_SHARED
+//#define DEBUG_SERVER
+//#define DEBUG_CLUSTER
+//#define DEBUG_REPLICA
+//#define DEBUG_CDC
+//#define DEBUG_ASYNC
 
 /** @brief A simple wrapper for fprintf(stderr, ...) */
 #define DEBUG_PRINT(...) \
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "epoch.h"
+
+#ifndef DEBUG_EPOCH
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define EPOCH_CACHE_LINE 64
+
+// Something retired in epoch, to be freed with fn(owner, a, b)
+typedef struct epoch_pending {
+    unsigned long epoch;
+    epoch_free_fn fn;
+    void *owner;
+    unsigned long a;
+    unsigned long b;
+} Epoch_pending;
+
+typedef struct epoch_list {
+    Epoch_pending *entry;
+    unsigned long count;
+    unsigned long capacity;
+} Epoch_list;
+
+typedef struct epoch_thread {
+    unsigned long state;           // (epoch << 1) | 1 while inside a critical section, 0 outside
+    char pad[EPOCH_CACHE_LINE - sizeof(unsigned long)];
+
+    struct epoch_domain *domain;
+    struct epoch_thread *next;     // In domain->threads
+    struct epoch_thread *prev;
+    int nesting;
+    Epoch_list pending;            // Only touched by the thread itself
+} Epoch_thread;
+
+struct epoch_domain {
+    unsigned long epoch;
+    char pad[EPOCH_CACHE_LINE - sizeof(unsigned long)];
+
+    pthread_key_t key;             // Each thread's Epoch_thread
+    pthread_mutex_t lock;          // Guards threads, orphans, and moving epoch on
+    Epoch_thread *threads;
+    Epoch_list orphans;            // Pending frees of threads that have exited
+};
+
+static void _epoch_thread_release(void *arg);
+
+Epoch_domain *
+epoch_domain_create(
+    Context_main *ctx_main
+) {
+    DEBUG_PRINT("epoch_domain_create();\n");
+
+    RECORD_CREATE(Epoch_domain, domain);
+    if(!domain) {
+        return 0;
+    }
+
+    // Start at 2, so that nothing retired can look older than it is
+    domain->epoch = 2;
+    pthread_mutex_init(&domain->lock, 0);
+    if(pthread_key_create(&domain->key, _epoch_thread_release)) {
+        DEBUG_PRINT("\tERR failed to create thread key\n");
+        pthread_mutex_destroy(&domain->lock);
+        memory_free(domain);
+        return 0;
+    }
+
+    return domain;
+}
+
+// Runs the frees in list that are older than two epochs before epoch (or all of them if force is
+// set), and keeps the rest
+static void
+_epoch_list_run(
+    Context_main *ctx_main,
+    Epoch_list *list,
+    unsigned long epoch,
+    int force
+) {
+    unsigned long kept = 0;
+    for(unsigned long i = 0; i < list->count; i++) {
+        Epoch_pending *pending = &list->entry[i];
+        if(force || pending->epoch + 2 <= epoch) {
+            pending->fn(ctx_main, pending->owner, pending->a, pending->b);
+        }
+        else {
+            list->entry[kept++] = *pending;
+        }
+    }
+    list->count = kept;
+}
+
+static int
+_epoch_list_append(
+    Epoch_list *list,
+    Epoch_pending *entry,
+    unsigned long count
+) {
+    if(list->count + count > list->capacity) {
+        unsigned long new_capacity = list->capacity ? list->capacity : EPOCH_RECLAIM_THRESHOLD;
+        while(new_capacity < list->count + count) {
+            new_capacity *= 2;
+        }
+        Epoch_pending *new_entry = (Epoch_pending *)memory_realloc(list->entry, list->capacity * sizeof(Epoch_pending), new_capacity * sizeof(Epoch_pending));
+        if(!new_entry) {
+            return 0;
+        }
+        list->entry = new_entry;
+        list->capacity = new_capacity;
+    }
+    memcpy(list->entry + list->count, entry, count * sizeof(Epoch_pending));
+    list->count += count;
+
+    return 1;
+}
+
+void
+epoch_domain_free(
+    Context_main *ctx_main,
+    Epoch_domain *domain
+) {
+    DEBUG_PRINT("epoch_domain_free();\n");
+
+    // Deleting the key doesn't run the destructors, so threads that are still alive forget their
+    // Epoch_thread, and their pending frees are run here
+    pthread_key_delete(domain->key);
+    while(domain->threads) {
+        Epoch_thread *thread = domain->threads;
+        domain->threads = thread->next;
+        _epoch_list_run(ctx_main, &thread->pending, 0, 1);
+        memory_free(thread->pending.entry);
+        memory_free(thread);
+    }
+    _epoch_list_run(ctx_main, &domain->orphans, 0, 1);
+    memory_free(domain->orphans.entry);
+
+    pthread_mutex_destroy(&domain->lock);
+    memory_free(domain);
+}
+
+// Returns the calling thread's Epoch_thread, joining the domain on first use
+static Epoch_thread *
+_epoch_thread(
+    Epoch_domain *domain
+) {
+    Epoch_thread *thread = (Epoch_thread *)pthread_getspecific(domain->key);
+    if(thread) {
+        return thread;
+    }
+
+    RECORD_ALLOC(Epoch_thread, thread);
+    if(!thread) {
+        return 0;
+    }
+    thread->domain = domain;
+
+    pthread_mutex_lock(&domain->lock);
+    thread->next = domain->threads;
+    if(domain->threads) domain->threads->prev = thread;
+    domain->threads = thread;
+    pthread_mutex_unlock(&domain->lock);
+
+    pthread_setspecific(domain->key, thread);
+
+    return thread;
+}
+
+// Runs when a thread exits: leaves its pending frees to the others
+static void
+_epoch_thread_release(
+    void *arg
+) {
+    Epoch_thread *thread = (Epoch_thread *)arg;
+    Epoch_domain *domain = thread->domain;
+
+    pthread_mutex_lock(&domain->lock);
+    if(!_epoch_list_append(&domain->orphans, thread->pending.entry, thread->pending.count)) {
+        DEBUG_PRINT("\tERR failed to hand over %lu pending frees\n", thread->pending.count);
+    }
+    if(thread->prev) thread->prev->next = thread->next;
+    else domain->threads = thread->next;
+    if(thread->next) thread->next->prev = thread->prev;
+    pthread_mutex_unlock(&domain->lock);
+
+    memory_free(thread->pending.entry);
+    memory_free(thread);
+}
+
+int
+epoch_enter(
+    Epoch_domain *domain
+) {
+    Epoch_thread *thread = _epoch_thread(domain);
+    if(!thread) {
+        return 0;
+    }
+
+    if(thread->nesting++ == 0) {
+        __atomic_store_n(&thread->state, (__atomic_load_n(&domain->epoch, __ATOMIC_SEQ_CST) << 1) | 1, __ATOMIC_RELAXED);
+        // The announcement has to be visible before anything shared is read
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+
+    return 1;
+}
+
+void
+epoch_exit(
+    Epoch_domain *domain
+) {
+    Epoch_thread *thread = (Epoch_thread *)pthread_getspecific(domain->key);
+
+    if(--thread->nesting == 0) {
+        __atomic_store_n(&thread->state, 0, __ATOMIC_RELEASE);
+    }
+}
+
+unsigned long
+epoch_retire(
+    Epoch_domain *domain,
+    epoch_free_fn fn,
+    void *owner,
+    unsigned long a,
+    unsigned long b
+) {
+    Epoch_thread *thread = _epoch_thread(domain);
+    if(!thread) {
+        return 0;
+    }
+
+    // The memory was unlinked before this, so any reader that can still see it entered no later
+    // than the epoch read here
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    Epoch_pending pending = { __atomic_load_n(&domain->epoch, __ATOMIC_SEQ_CST), fn, owner, a, b };
+    if(!_epoch_list_append(&thread->pending, &pending, 1)) {
+        DEBUG_PRINT("\tERR failed to retire\n");
+        return 0;
+    }
+
+    return thread->pending.count;
+}
+
+// Moves the global epoch on, unless a thread inside a critical section hasn't caught up with it yet
+static int
+_epoch_advance(
+    Epoch_domain *domain
+) {
+    int advanced = 1;
+
+    pthread_mutex_lock(&domain->lock);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_load_n(&domain->epoch, __ATOMIC_RELAXED);
+    for(Epoch_thread *thread = domain->threads; thread; thread = thread->next) {
+        unsigned long state = __atomic_load_n(&thread->state, __ATOMIC_ACQUIRE);
+        if((state & 1) && (state >> 1) != epoch) {
+            advanced = 0;
+            break;
+        }
+    }
+    if(advanced) {
+        __atomic_store_n(&domain->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&domain->lock);
+
+    return advanced;
+}
+
+unsigned long
+epoch_reclaim(
+    Context_main *ctx_main,
+    Epoch_domain *domain
+) {
+    Epoch_thread *thread = (Epoch_thread *)pthread_getspecific(domain->key);
+
+    // Two steps make everything retired before this call safe, if no reader is in the way
+    for(int i = 0; i < 2 && _epoch_advance(domain); i++);
+    unsigned long epoch = __atomic_load_n(&domain->epoch, __ATOMIC_ACQUIRE);
+
+    if(thread) {
+        _epoch_list_run(ctx_main, &thread->pending, epoch, 0);
+    }
+
+    // Frees may take locks that are held while retiring (and so while joining the domain), so the
+    // orphans are run outside of the domain's lock
+    if(__atomic_load_n(&domain->orphans.count, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&domain->lock);
+        Epoch_list orphans = domain->orphans;
+        memset(&domain->orphans, 0, sizeof(Epoch_list));
+        pthread_mutex_unlock(&domain->lock);
+
+        _epoch_list_run(ctx_main, &orphans, epoch, 0);
+
+        pthread_mutex_lock(&domain->lock);
+        if(!_epoch_list_append(&domain->orphans, orphans.entry, orphans.count)) {
+            DEBUG_PRINT("\tERR failed to keep %lu orphaned frees\n", orphans.count);
+        }
+        pthread_mutex_unlock(&domain->lock);
+        memory_free(orphans.entry);
+    }
+
+    return thread ? thread->pending.count : 0;
+}
@@ -0,0 +1,92 @@
+/** @file  epoch.h
+ *  @brief Epoch-based reclamation: frees memory only once no reader can still be using it
+ */
+
+/** @brief Number of frees a thread lets pile up before epoch_retire() asks for an epoch_reclaim() */
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+/** @brief A set of threads reading shared memory, and the frees they are holding up
+ *
+ * Readers wrap every access to shared memory in epoch_enter() and epoch_exit(). Writers unlink memory
+ * from wherever readers could find it, and then hand it to epoch_retire() instead of freeing it.
+ *
+ * The domain has a global epoch, and every thread announces the epoch it entered in. The global
+ * epoch only moves on once every thread inside a critical section has caught up with it, so anything
+ * retired in epoch e is out of every reader's reach by the time the global epoch reaches e + 2.
+ *
+ * Entering and leaving only write to the calling thread's own cache line. Retired memory is kept in
+ * a list per thread, and only ever freed by epoch_reclaim(), never from inside epoch_retire(), so
+ * that memory may be retired while holding locks the frees need.
+ */
+typedef struct epoch_domain Epoch_domain;
+
+/** @brief Frees something retired with epoch_retire(), once no reader can see it anymore. It must not retire anything itself. */
+typedef void (*epoch_free_fn)(
+    Context_main *ctx_main, ///<[in] main context
+    void *owner,            ///<[in] the owner passed to epoch_retire()
+    unsigned long a,        ///<[in] first argument passed to epoch_retire()
+    unsigned long b         ///<[in] second argument passed to epoch_retire()
+    );
+
+/** @brief   Creates a domain with no threads in it
+ *  @returns A pointer to the domain on success, or 0 on failure
+ *  @see     epoch_domain_free()
+ */
+Epoch_domain *
+epoch_domain_create(
+    Context_main *ctx_main ///<[in] main context
+    );
+
+/** @brief Runs every pending free of every thread, then frees \a domain. No thread may be inside it. */
+void
+epoch_domain_free(
+    Context_main *ctx_main, ///<[in] main context
+    Epoch_domain *domain    ///<[in] domain
+    );
+
+/** @brief Starts a read-side critical section for the calling thread
+ *
+ * Memory reached after this call stays valid until the matching epoch_exit(). Sections may be
+ * nested, only the outermost one counts.
+ *
+ * @returns 1 on success, 0 if the thread couldn't join \a domain
+ */
+int
+epoch_enter(
+    Epoch_domain *domain ///<[in] domain
+    );
+
+/** @brief Ends the calling thread's read-side critical section */
+void
+epoch_exit(
+    Epoch_domain *domain ///<[in] domain
+    );
+
+/** @brief Has \a fn called with \a owner, \a a and \a b once every reader that may still see the memory is gone
+ *
+ * The memory must already be unreachable for readers entering from now on.
+ *
+ * @returns The number of frees pending on the calling thread, which should call epoch_reclaim() once
+ *          it reaches EPOCH_RECLAIM_THRESHOLD, or 0 on failure, in which case the memory must be leaked
+ */
+unsigned long
+epoch_retire(
+    Epoch_domain *domain, ///<[in] domain
+    epoch_free_fn fn,     ///<[in] function that frees the memory
+    void *owner,          ///<[in] argument passed to \a fn
+    unsigned long a,      ///<[in] argument passed to \a fn
+    unsigned long b       ///<[in] argument passed to \a fn
+    );
+
+/** @brief Moves the global epoch on if it can, and runs the pending frees that have become safe
+ *
+ * Runs the frees of the calling thread, and those left behind by threads that have exited. Must not
+ * be called while holding a lock that the frees may need.
+ *
+ * @returns The number of frees still pending on the calling thread
+ */
+unsigned long
+epoch_reclaim(
+    Context_main *ctx_main, ///<[in] main context
+    Epoch_domain *domain    ///<[in] domain
+    );
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "hash.h"
+
+#ifndef DEBUG_HASH
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define HASH_H1(x) ((x) >> 7)
+#define HASH_H2(x) ((unsigned char)((x) & 0x7F))
+
+// A table is grown once more than 7/8ths of its slots are in use
+#define HASH_MAX_USED(x) (((x).group_count * HASH_GROUP_SIZE * 7) / 8)
+
+static inline unsigned long
+_hash_mix(
+    unsigned long x
+) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDUL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53UL;
+    x ^= x >> 33;
+    return x;
+}
+
+unsigned long
+hash_bytes(
+    unsigned char *key,
+    unsigned long length
+) {
+    unsigned long h = 0x9E3779B97F4A7C15UL ^ length, word;
+
+    for(; length >= sizeof(word); key += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, key, sizeof(word));
+        h = (h ^ _hash_mix(word)) * 0x9E3779B97F4A7C15UL;
+    }
+
+    if(length) {
+        word = 0;
+        memcpy(&word, key, length);
+        h = (h ^ _hash_mix(word)) * 0x9E3779B97F4A7C15UL;
+    }
+
+    return _hash_mix(h);
+}
+
+// Bit i is set if control byte i of the group equals byte
+static inline unsigned int
+_hash_group_match(
+    unsigned char *ctrl,
+    unsigned char byte
+) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    unsigned int mask = 0;
+    for(int i = 0; i < HASH_GROUP_SIZE; i++) {
+        if(ctrl[i] == byte) mask |= (1 << i);
+    }
+    return mask;
+#endif
+}
+
+// Bit i is set if slot i of the group is empty or deleted (both have the high bit set)
+static inline unsigned int
+_hash_group_match_free(
+    unsigned char *ctrl
+) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    unsigned int mask = 0;
+    for(int i = 0; i < HASH_GROUP_SIZE; i++) {
+        if(ctrl[i] & 0x80) mask |= (1 << i);
+    }
+    return mask;
+#endif
+}
+
+static int
+_hash_table_alloc(
+    Hash_table *table,
+    unsigned long group_count
+) {
+    table->ctrl = memory_alloc(group_count * HASH_GROUP_SIZE);
+    table->entries = (Hash_entry *)memory_alloc(group_count * HASH_GROUP_SIZE * sizeof(Hash_entry));
+    if(!table->ctrl || !table->entries) {
+        if(table->ctrl) memory_free(table->ctrl);
+        if(table->entries) memory_free(table->entries);
+        memset(table, 0, sizeof(Hash_table));
+        return 0;
+    }
+    memset(table->ctrl, HASH_CTRL_EMPTY, group_count * HASH_GROUP_SIZE);
+    table->group_count = group_count;
+    return 1;
+}
+
+static void
+_hash_table_free(
+    Hash_table *table
+) {
+    if(table->ctrl) memory_free(table->ctrl);
+    if(table->entries) memory_free(table->entries);
+    memset(table, 0, sizeof(Hash_table));
+}
+
+static int
+_hash_key_equals(
+    Context_main *ctx_main,
+    Index_hash *index,
+    Hash_entry *entry,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    Record_database *rec_database = index->rec_database;
+    if(entry->key_k >= rec_database->kv_record_count ||
+            KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[entry->key_k]) != key_length) {
+        return 0;
+    }
+    unsigned char *stored = database_kv_get_value(ctx_main, rec_database, 0, entry->key_k);
+    return stored && 0 == memcmp(stored, key, key_length);
+}
+
+// Returns the slot holding key in table, or -1
+static unsigned long
+_hash_table_find(
+    Context_main *ctx_main,
+    Index_hash *index,
+    Hash_table *table,
+    unsigned long hash,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    if(!table->group_count) {
+        return -1;
+    }
+
+    unsigned long mask = table->group_count - 1, group = HASH_H1(hash) & mask;
+
+    // Triangular probing visits every group when group_count is a power of two
+    for(unsigned long probe = 0; probe < table->group_count; probe++) {
+        unsigned char *ctrl = table->ctrl + group * HASH_GROUP_SIZE;
+
+        unsigned int match = _hash_group_match(ctrl, HASH_H2(hash));
+        while(match) {
+            unsigned long slot = group * HASH_GROUP_SIZE + __builtin_ctz(match);
+            match &= match - 1;
+            if(table->entries[slot].hash == hash && _hash_key_equals(ctx_main, index, &table->entries[slot], key, key_length)) {
+                return slot;
+            }
+        }
+
+        // A key is never placed past a group that still has an empty slot
+        if(_hash_group_match(ctrl, HASH_CTRL_EMPTY)) {
+            return -1;
+        }
+
+        group = (group + probe + 1) & mask;
+    }
+
+    return -1;
+}
+
+// Returns the first free slot on the probe sequence of hash. table must not be full.
+static unsigned long
+_hash_table_free_slot(
+    Hash_table *table,
+    unsigned long hash
+) {
+    unsigned long mask = table->group_count - 1, group = HASH_H1(hash) & mask;
+
+    for(unsigned long probe = 0; probe < table->group_count; probe++) {
+        unsigned int free = _hash_group_match_free(table->ctrl + group * HASH_GROUP_SIZE);
+        if(free) {
+            return group * HASH_GROUP_SIZE + __builtin_ctz(free);
+        }
+        group = (group + probe + 1) & mask;
+    }
+
+    return -1;
+}
+
+static void
+_hash_table_remove(
+    Hash_table *table,
+    unsigned long slot
+) {
+    unsigned char *group = table->ctrl + (slot / HASH_GROUP_SIZE) * HASH_GROUP_SIZE;
+
+    // If the group has an empty slot no probe sequence ever went past it, so there
+    // is no need to leave a tombstone behind
+    table->ctrl[slot] = _hash_group_match(group, HASH_CTRL_EMPTY) ? HASH_CTRL_EMPTY : HASH_CTRL_DELETED;
+}
+
+// Moves up to groups groups out of the old table
+static void
+_hash_index_migrate(
+    Index_hash *index,
+    unsigned long groups
+) {
+    for(; groups > 0 && index->migrate_group < index->old.group_count; groups--, index->migrate_group++) {
+        for(int i = 0; i < HASH_GROUP_SIZE; i++) {
+            unsigned long old_slot = index->migrate_group * HASH_GROUP_SIZE + i;
+            if(index->old.ctrl[old_slot] & 0x80) {
+                continue;
+            }
+
+            Hash_entry *entry = &index->old.entries[old_slot];
+            unsigned long slot = _hash_table_free_slot(&index->current, entry->hash);
+            if(index->current.ctrl[slot] == HASH_CTRL_EMPTY) {
+                index->used++;
+            }
+            index->current.ctrl[slot] = HASH_H2(entry->hash);
+            index->current.entries[slot] = *entry;
+            index->old.ctrl[old_slot] = HASH_CTRL_DELETED;
+        }
+    }
+
+    if(index->old.group_count && index->migrate_group >= index->old.group_count) {
+        DEBUG_PRINT("hash: finished migrating %lu groups\n", index->old.group_count);
+        _hash_table_free(&index->old);
+        index->migrate_group = 0;
+    }
+}
+
+// Makes sure current has room for one more key, starting a new migration if it doesn't
+static int
+_hash_index_reserve(
+    Index_hash *index
+) {
+    if(index->current.group_count && index->used + 1 <= HASH_MAX_USED(index->current)) {
+        return 1;
+    }
+
+    // The new table is always big enough for the old one to be drained long before it fills up,
+    // but make sure there is never more than one migration going on
+    _hash_index_migrate(index, index->old.group_count);
+
+    unsigned long group_count = index->current.group_count ? index->current.group_count : 1;
+
+    // Only grow if the table is full of live keys rather than tombstones
+    if((index->count + 1) * 2 > group_count * HASH_GROUP_SIZE) {
+        group_count *= 2;
+    }
+
+    DEBUG_PRINT("hash: resizing to %lu groups (%lu keys)\n", group_count, index->count);
+
+    Hash_table table;
+    if(!_hash_table_alloc(&table, group_count)) {
+        DEBUG_PRINT("\tERR failed to allocate table\n");
+        return 0;
+    }
+
+    index->old = index->current;
+    index->current = table;
+    index->migrate_group = 0;
+    index->used = 0;
+
+    if(!index->old.group_count) {
+        _hash_table_free(&index->old);
+    }
+
+    return 1;
+}
+
+Index_hash *
+hash_index_create(
+    Context_main *ctx_main,
+    Record_database *rec_database
+) {
+    DEBUG_PRINT("hash_index_create();\n");
+
+    RECORD_CREATE(Index_hash, index);
+    if(!index) {
+        return 0;
+    }
+    index->rec_database = rec_database;
+    return index;
+}
+
+int
+hash_index_put(
+    Context_main *ctx_main,
+    Index_hash *index,
+    unsigned char *key,
+    unsigned long key_length,
+    unsigned long value_k
+) {
+    DEBUG_PRINT("hash_index_put(key_length = %lu, value_k = %lu);\n", key_length, value_k);
+
+    if(!key_length) {
+        DEBUG_PRINT("\tERR empty key\n");
+        return 0;
+    }
+
+    unsigned long hash = hash_bytes(key, key_length);
+
+    unsigned long slot = _hash_table_find(ctx_main, index, &index->current, hash, key, key_length);
+    if(slot != -1) {
+        index->current.entries[slot].value_k = value_k;
+        return 1;
+    }
+
+    slot = _hash_table_find(ctx_main, index, &index->old, hash, key, key_length);
+    if(slot != -1) {
+        // It will be carried over when its group gets migrated
+        index->old.entries[slot].value_k = value_k;
+        _hash_index_migrate(index, HASH_MIGRATE_GROUPS);
+        return 1;
+    }
+
+    if(!_hash_index_reserve(index)) {
+        return 0;
+    }
+
+    unsigned long key_k = database_kv_alloc(ctx_main, index->rec_database, KV_RECORD_TYPE_RAW, key_length, key);
+    if(key_k == -1) {
+        DEBUG_PRINT("\tERR failed to store key\n");
+        return 0;
+    }
+
+    slot = _hash_table_free_slot(&index->current, hash);
+    if(index->current.ctrl[slot] == HASH_CTRL_EMPTY) {
+        index->used++;
+    }
+    index->current.ctrl[slot] = HASH_H2(hash);
+    index->current.entries[slot].hash = hash;
+    index->current.entries[slot].key_k = key_k;
+    index->current.entries[slot].value_k = value_k;
+    index->count++;
+
+    _hash_index_migrate(index, HASH_MIGRATE_GROUPS);
+
+    return 1;
+}
+
+unsigned long
+hash_index_get(
+    Context_main *ctx_main,
+    Index_hash *index,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    unsigned long hash = hash_bytes(key, key_length);
+
+    unsigned long slot = _hash_table_find(ctx_main, index, &index->current, hash, key, key_length);
+    if(slot != -1) {
+        return index->current.entries[slot].value_k;
+    }
+
+    slot = _hash_table_find(ctx_main, index, &index->old, hash, key, key_length);
+    if(slot != -1) {
+        return index->old.entries[slot].value_k;
+    }
+
+    return -1;
+}
+
+int
+hash_index_delete(
+    Context_main *ctx_main,
+    Index_hash *index,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    DEBUG_PRINT("hash_index_delete(key_length = %lu);\n", key_length);
+
+    unsigned long hash = hash_bytes(key, key_length);
+    Hash_table *table = &index->current;
+
+    unsigned long slot = _hash_table_find(ctx_main, index, table, hash, key, key_length);
+    if(slot == -1) {
+        table = &index->old;
+        slot = _hash_table_find(ctx_main, index, table, hash, key, key_length);
+    }
+    if(slot == -1) {
+        return 0;
+    }
+
+    database_kv_free(ctx_main, index->rec_database, table->entries[slot].key_k);
+
+    _hash_table_remove(table, slot);
+    if(table == &index->current && table->ctrl[slot] == HASH_CTRL_EMPTY) {
+        index->used--;
+    }
+    index->count--;
+
+    _hash_index_migrate(index, HASH_MIGRATE_GROUPS);
+
+    return 1;
+}
+
+int
+hash_index_next(
+    Index_hash *index,
+    unsigned long *cursor,
+    Hash_entry *entry
+) {
+    // The cursor counts the slots of old, then those of current
+    unsigned long old_slots = index->old.group_count * HASH_GROUP_SIZE,
+                  slots = old_slots + index->current.group_count * HASH_GROUP_SIZE;
+
+    for(; *cursor < slots; (*cursor)++) {
+        Hash_table *table = (*cursor < old_slots) ? &index->old : &index->current;
+        unsigned long slot = (*cursor < old_slots) ? *cursor : *cursor - old_slots;
+        if(!(table->ctrl[slot] & 0x80)) {
+            entry[0] = table->entries[slot];
+            (*cursor)++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void
+hash_index_free(
+    Context_main *ctx_main,
+    Index_hash *index
+) {
+    DEBUG_PRINT("hash_index_free();\n");
+
+    Hash_table *tables[2] = { &index->current, &index->old };
+    for(int t = 0; t < 2; t++) {
+        for(unsigned long slot = 0; slot < tables[t]->group_count * HASH_GROUP_SIZE; slot++) {
+            if(!(tables[t]->ctrl[slot] & 0x80)) {
+                database_kv_free(ctx_main, index->rec_database, tables[t]->entries[slot].key_k);
+            }
+        }
+        _hash_table_free(tables[t]);
+    }
+
+    memory_free(index);
+}
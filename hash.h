@@ -0,0 +1,131 @@
+/** @file  hash.h
+ *  @brief An open-addressing hash index from byte-string keys to kv_record keys
+ */
+
+/** @brief Number of slots in a group of a hash_table, matched at once using SSE2 */
+#define HASH_GROUP_SIZE 16
+
+/** @brief Maximum number of groups of the old table that are moved into the new one per write
+ *  @see   hash_index_put()
+ *  @see   hash_index_delete()
+ */
+#define HASH_MIGRATE_GROUPS 2
+
+/** @brief A slot of a hash_table */
+typedef struct hash_entry {
+    unsigned long hash;    ///< Full hash of the key bytes
+    unsigned long key_k;   ///< kv_record holding the key bytes
+    unsigned long value_k; ///< kv_record the key maps to
+} Hash_entry;
+
+/** @brief A SwissTable-style table: one control byte per slot, and slots arranged in groups of HASH_GROUP_SIZE
+ *
+ * A control byte is either HASH_CTRL_EMPTY, HASH_CTRL_DELETED or the lower seven bits of the slot's hash.
+ * Lookups compare all the control bytes of a group to those seven bits in one go, and only look at the
+ * slots that matched.
+ */
+typedef struct hash_table {
+    unsigned char *ctrl;       ///< group_count * HASH_GROUP_SIZE control bytes
+    Hash_entry *entries;       ///< group_count * HASH_GROUP_SIZE slots
+    unsigned long group_count; ///< Number of groups, always a power of two (or 0)
+} Hash_table;
+
+#define HASH_CTRL_EMPTY   0x80 ///< Control byte of a slot that has never been used
+#define HASH_CTRL_DELETED 0xFE ///< Control byte of a slot whose key has been deleted
+
+/** @brief Maps arbitrary byte-string keys to kv_record keys
+ *
+ * Key bytes are stored as KV_RECORD_TYPE_RAW values in \a rec_database itself.
+ *
+ * The table grows incrementally: once \a current gets too full it becomes \a old, and a table twice the
+ * size takes its place. Every write then moves up to HASH_MIGRATE_GROUPS groups from \a old over into
+ * \a current, and lookups consult both tables until \a old is empty.
+ */
+typedef struct hash_index {
+    Record_database *rec_database; ///< Database the key bytes are stored in
+    Hash_table current;            ///< The table new keys are inserted into
+    Hash_table old;                ///< The table being migrated out of (group_count is 0 if none)
+    unsigned long migrate_group;   ///< Next group of \a old to migrate
+    unsigned long count;           ///< Number of keys in the index
+    unsigned long used;            ///< Number of non-empty slots (including deleted) in \a current
+} Index_hash;
+
+/** @brief   Creates an empty hash index that stores its key bytes in \a rec_database
+ *  @returns A pointer to the index on success, or 0 on failure
+ *  @see     hash_index_free()
+ */
+Index_hash *
+hash_index_create(
+    Context_main *ctx_main,       ///<[in] main context
+    Record_database *rec_database ///<[in] database record
+    );
+
+/** @brief Maps \a key to \a value_k, replacing any previous mapping of \a key
+ *
+ * Note that replacing a mapping does not free the kv_record it used to map to.
+ *
+ * @returns 1 on success, 0 on failure
+ */
+int
+hash_index_put(
+    Context_main *ctx_main,   ///<[in] main context
+    Index_hash *index,        ///<[in] index
+    unsigned char *key,       ///<[in] key bytes
+    unsigned long key_length, ///<[in] length of \a key in bytes
+    unsigned long value_k     ///<[in] kv_record to map \a key to
+    );
+
+/** @brief   Looks up \a key
+ *  @returns The kv_record key that \a key maps to, or -1 if there is none
+ */
+unsigned long
+hash_index_get(
+    Context_main *ctx_main,  ///<[in] main context
+    Index_hash *index,       ///<[in] index
+    unsigned char *key,      ///<[in] key bytes
+    unsigned long key_length ///<[in] length of \a key in bytes
+    );
+
+/** @brief Removes the mapping of \a key, freeing the copy of its bytes
+ *
+ * The kv_record that \a key mapped to is \b not freed.
+ *
+ * @returns 1 if \a key was removed, 0 if it wasn't in the index
+ */
+int
+hash_index_delete(
+    Context_main *ctx_main,  ///<[in] main context
+    Index_hash *index,       ///<[in] index
+    unsigned char *key,      ///<[in] key bytes
+    unsigned long key_length ///<[in] length of \a key in bytes
+    );
+
+/** @brief Steps through the keys of \a index, one per call
+ *
+ * Start with \a cursor at 0. Writing to the index between calls may move keys from one of its
+ * tables into the other, and a key moved across the cursor is then missed or seen twice.
+ *
+ * @returns 1 with the next key's slot in \a entry, or 0 once every key has been seen
+ */
+int
+hash_index_next(
+    Index_hash *index,     ///<[in]     index
+    unsigned long *cursor, ///<[in,out] position in the index
+    Hash_entry *entry      ///<[out]    the key's slot
+    );
+
+/** @brief Frees \a index along with the copies of its key bytes */
+void
+hash_index_free(
+    Context_main *ctx_main, ///<[in] main context
+    Index_hash *index       ///<[in] index
+    );
+
+/** @brief   Hashes \a length bytes of \a key
+ *  @returns A 64-bit hash
+ */
+unsigned long
+hash_bytes(
+    unsigned char *key,  ///<[in] bytes to hash
+    unsigned long length ///<[in] number of bytes
+    );
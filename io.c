@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "pool.h"
+#include "io.h"
+
+#ifndef DEBUG_IO
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+enum {
+    IO_OP_WRITE,
+    IO_OP_FSYNC,
+    IO_OP_FDATASYNC
+};
+
+typedef struct io_request {
+    struct io_context *io;
+    int type;
+    int fd;
+    int region;
+    const unsigned char *buffer;
+    unsigned long length;
+    unsigned long offset;
+} Io_request;
+
+struct io_context {
+    int engine;
+    unsigned int depth;
+    Io_request *request;      // depth slots
+    unsigned int *free_slot;  // Slots not in flight, free_slot[0 .. free_count)
+    unsigned int free_count;
+    int failed;               // Something since the last io_wait() failed
+
+    // IO_ENGINE_URING
+    int ring_fd;
+    unsigned char *sq_ring;
+    unsigned char *cq_ring;
+    unsigned long sq_ring_length;
+    unsigned long cq_ring_length;
+    struct io_uring_sqe *sqes;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int pending;     // Queued on the ring, not yet submitted
+    int registered;           // Number of regions registered
+
+    // IO_ENGINE_THREADS
+    Context_pool *pool;
+};
+
+static int
+_io_uring_setup(
+    Context_io *io
+) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring_fd = syscall(__NR_io_uring_setup, io->depth, &p);
+    if(io->ring_fd < 0) {
+        DEBUG_PRINT("\tio_uring_setup() failed: %s\n", strerror(errno));
+        return 0;
+    }
+    // The kernel rounds the depth up to a power of two, and the completion ring is at least as deep
+    io->depth = p.sq_entries;
+
+    io->sq_ring_length = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    io->cq_ring_length = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(io->cq_ring_length > io->sq_ring_length) io->sq_ring_length = io->cq_ring_length;
+        io->cq_ring_length = io->sq_ring_length;
+    }
+    io->sq_ring = mmap(0, io->sq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    if(io->sq_ring == MAP_FAILED) {
+        io->sq_ring = 0;
+        return 0;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        io->cq_ring = io->sq_ring;
+    }
+    else {
+        io->cq_ring = mmap(0, io->cq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+        if(io->cq_ring == MAP_FAILED) {
+            io->cq_ring = 0;
+            return 0;
+        }
+    }
+    io->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if(io->sqes == MAP_FAILED) {
+        io->sqes = 0;
+        return 0;
+    }
+
+    io->sq_head = (unsigned int *)(io->sq_ring + p.sq_off.head);
+    io->sq_tail = (unsigned int *)(io->sq_ring + p.sq_off.tail);
+    io->sq_mask = (unsigned int *)(io->sq_ring + p.sq_off.ring_mask);
+    io->sq_array = (unsigned int *)(io->sq_ring + p.sq_off.array);
+    io->cq_head = (unsigned int *)(io->cq_ring + p.cq_off.head);
+    io->cq_tail = (unsigned int *)(io->cq_ring + p.cq_off.tail);
+    io->cq_mask = (unsigned int *)(io->cq_ring + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(io->cq_ring + p.cq_off.cqes);
+
+    return 1;
+}
+
+Context_io *
+io_create(
+    Context_main *ctx_main,
+    int engine,
+    unsigned int depth
+) {
+    DEBUG_PRINT("io_create(engine = %d, depth = %u);\n", engine, depth);
+
+    RECORD_CREATE(Context_io, io);
+    if(!io) {
+        return 0;
+    }
+    io->ring_fd = -1;
+    io->depth = depth ? depth : IO_DEPTH;
+
+    if(engine == IO_ENGINE_AUTO || engine == IO_ENGINE_URING) {
+        if(_io_uring_setup(io)) {
+            io->engine = IO_ENGINE_URING;
+        }
+        else if(engine == IO_ENGINE_URING) {
+            io_free(io);
+            return 0;
+        }
+        else {
+            // Not this kernel, or not allowed to, so threads it is
+            io_free(io);
+            return io_create(ctx_main, IO_ENGINE_THREADS, depth);
+        }
+    }
+    else {
+        io->engine = IO_ENGINE_THREADS;
+        io->pool = pool_create(ctx_main, IO_THREAD_COUNT);
+        if(!io->pool) {
+            io_free(io);
+            return 0;
+        }
+    }
+
+    io->request = (Io_request *)memory_alloc(io->depth * sizeof(Io_request));
+    io->free_slot = (unsigned int *)memory_alloc(io->depth * sizeof(unsigned int));
+    if(!io->request || !io->free_slot) {
+        io_free(io);
+        return 0;
+    }
+    for(unsigned int i = 0; i < io->depth; i++) {
+        io->free_slot[i] = io->depth - 1 - i;
+    }
+    io->free_count = io->depth;
+
+    return io;
+}
+
+int
+io_engine(
+    Context_io *io
+) {
+    return io->engine;
+}
+
+int
+io_register(
+    Context_io *io,
+    unsigned char **region,
+    unsigned long *length,
+    int count
+) {
+    DEBUG_PRINT("io_register(count = %d);\n", count);
+
+    if(io->engine != IO_ENGINE_URING) {
+        // Workers write from anywhere anyway
+        return 1;
+    }
+
+    // Registering while writes are in flight would pull their regions out from under them
+    io_wait(io);
+    if(io->registered) {
+        syscall(__NR_io_uring_register, io->ring_fd, IORING_UNREGISTER_BUFFERS, 0, 0);
+        io->registered = 0;
+    }
+    if(!count) {
+        return 1;
+    }
+
+    struct iovec *iov = (struct iovec *)memory_alloc(count * sizeof(struct iovec));
+    if(!iov) {
+        return 0;
+    }
+    int ok = 1;
+    for(int i = 0; i < count; i++) {
+        iov[i].iov_base = region[i];
+        iov[i].iov_len = length[i];
+        if(length[i] > IO_REGION_MAX) ok = 0;
+    }
+    ok = ok && (syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iov, count) == 0);
+    if(ok) {
+        io->registered = count;
+    }
+    else {
+        DEBUG_PRINT("\tERR failed to register %d regions: %s\n", count, strerror(errno));
+    }
+    memory_free(iov);
+
+    return ok;
+}
+
+// Puts request slot on the submission queue. There's always room, as the queue is as deep as
+// there are slots.
+static void
+_io_uring_push(
+    Context_io *io,
+    unsigned int slot
+) {
+    Io_request *request = &io->request[slot];
+    unsigned int tail = *io->sq_tail,
+                 index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = request->fd;
+    sqe->user_data = slot;
+    if(request->type == IO_OP_WRITE) {
+        sqe->addr = (unsigned long)request->buffer;
+        sqe->len = request->length;
+        sqe->off = request->offset;
+        if(request->region >= 0 && request->region < io->registered) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = request->region;
+        }
+        else {
+            sqe->opcode = IORING_OP_WRITE;
+        }
+    }
+    else {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = (request->type == IO_OP_FDATASYNC) ? IORING_FSYNC_DATASYNC : 0;
+        // Only once everything queued before it is done
+        sqe->flags = IOSQE_IO_DRAIN;
+    }
+    io->sq_array[index] = index;
+
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->pending++;
+}
+
+// Writes what's left of a write request with pwrite()
+static int
+_io_pwrite(
+    Io_request *request
+) {
+    while(request->length > 0) {
+        ssize_t written = pwrite(request->fd, request->buffer, request->length, request->offset);
+        if(written <= 0) {
+            if(written < 0 && errno == EINTR) continue;
+            return 0;
+        }
+        request->buffer += written;
+        request->offset += written;
+        request->length -= written;
+    }
+    return 1;
+}
+
+// Submits everything pending and waits for at least min_complete completions, then handles every
+// completion there is. Returns 0 if the ring itself failed.
+static int
+_io_uring_reap(
+    Context_io *io,
+    unsigned int min_complete
+) {
+    int r = syscall(__NR_io_uring_enter, io->ring_fd, io->pending, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    if(r < 0) {
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return 1;
+        }
+        DEBUG_PRINT("\tERR io_uring_enter() failed: %s\n", strerror(errno));
+        return 0;
+    }
+    io->pending -= r;
+
+    unsigned int head = *io->cq_head,
+                 tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        unsigned int slot = cqe->user_data;
+        Io_request *request = &io->request[slot];
+
+        if(request->type == IO_OP_WRITE && (cqe->res == -EINTR || cqe->res == -EAGAIN || (cqe->res > 0 && cqe->res < request->length))) {
+            // A sync queued behind the write may run as soon as this completion is posted, so the
+            // rest isn't queued after it: it's written here, and synced too, in case the sync ran
+            // first. Every completion after this one comes after that.
+            if(cqe->res > 0) {
+                request->buffer += cqe->res;
+                request->offset += cqe->res;
+                request->length -= cqe->res;
+            }
+            if(!_io_pwrite(request) || fsync(request->fd) != 0) {
+                DEBUG_PRINT("\tERR the rest of a write failed: %s\n", strerror(errno));
+                io->failed = 1;
+            }
+        }
+        else if(cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            _io_uring_push(io, slot);
+            continue;
+        }
+        else if(cqe->res < 0 || (request->type == IO_OP_WRITE && cqe->res == 0)) {
+            DEBUG_PRINT("\tERR request failed: %s\n", strerror(-cqe->res));
+            io->failed = 1;
+        }
+        io->free_slot[io->free_count++] = slot;
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static void
+_io_thread_task(
+    void *arg,
+    int worker
+) {
+    Io_request *request = (Io_request *)arg;
+    int ok = 1;
+
+    if(request->type == IO_OP_WRITE) {
+        ok = _io_pwrite(request);
+    }
+    else {
+        ok = (((request->type == IO_OP_FDATASYNC) ? fdatasync(request->fd) : fsync(request->fd)) == 0);
+    }
+
+    if(!ok) {
+        DEBUG_PRINT("\tERR request failed: %s\n", strerror(errno));
+        __atomic_store_n(&request->io->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns a free request slot, waiting for some to finish if there are none
+static int
+_io_slot(
+    Context_io *io,
+    unsigned int *slot
+) {
+    while(!io->free_count) {
+        if(io->engine == IO_ENGINE_URING) {
+            if(!_io_uring_reap(io, 1)) {
+                return 0;
+            }
+        }
+        else {
+            pool_wait(io->pool);
+            for(unsigned int i = 0; i < io->depth; i++) {
+                io->free_slot[i] = i;
+            }
+            io->free_count = io->depth;
+        }
+    }
+    *slot = io->free_slot[--io->free_count];
+
+    return 1;
+}
+
+// Hands a filled in request slot to the engine
+static int
+_io_queue(
+    Context_io *io,
+    unsigned int slot
+) {
+    if(io->engine == IO_ENGINE_URING) {
+        _io_uring_push(io, slot);
+        return 1;
+    }
+
+    if(!pool_submit(io->pool, _io_thread_task, &io->request[slot])) {
+        io->free_slot[io->free_count++] = slot;
+        return 0;
+    }
+
+    return 1;
+}
+
+int
+io_write(
+    Context_io *io,
+    int fd,
+    const unsigned char *buffer,
+    unsigned long length,
+    unsigned long offset,
+    int region
+) {
+    DEBUG_PRINT("io_write(fd = %d, length = %lu, offset = %lu, region = %d);\n", fd, length, offset, region);
+
+    while(length > 0) {
+        unsigned int slot;
+        if(!_io_slot(io, &slot)) {
+            return 0;
+        }
+
+        Io_request *request = &io->request[slot];
+        request->io = io;
+        request->type = IO_OP_WRITE;
+        request->fd = fd;
+        request->region = region;
+        request->buffer = buffer;
+        request->length = (length > IO_CHUNK) ? IO_CHUNK : length;
+        request->offset = offset;
+        if(!_io_queue(io, slot)) {
+            return 0;
+        }
+
+        buffer += request->length;
+        offset += request->length;
+        length -= request->length;
+    }
+
+    return 1;
+}
+
+int
+io_fsync(
+    Context_io *io,
+    int fd,
+    int datasync
+) {
+    DEBUG_PRINT("io_fsync(fd = %d, datasync = %d);\n", fd, datasync);
+
+    if(io->engine == IO_ENGINE_THREADS) {
+        // Workers take tasks in any order, so the writes have to be done before the sync is queued
+        pool_wait(io->pool);
+        for(unsigned int i = 0; i < io->depth; i++) {
+            io->free_slot[i] = i;
+        }
+        io->free_count = io->depth;
+    }
+
+    unsigned int slot;
+    if(!_io_slot(io, &slot)) {
+        return 0;
+    }
+    Io_request *request = &io->request[slot];
+    request->io = io;
+    request->type = datasync ? IO_OP_FDATASYNC : IO_OP_FSYNC;
+    request->fd = fd;
+    request->region = -1;
+
+    return _io_queue(io, slot);
+}
+
+int
+io_wait(
+    Context_io *io
+) {
+    DEBUG_PRINT("io_wait();\n");
+
+    if(io->engine == IO_ENGINE_URING) {
+        while(io->free_count < io->depth) {
+            if(!_io_uring_reap(io, 1)) {
+                // The ring is broken, so whatever is still in it is lost
+                io->failed = 1;
+                break;
+            }
+        }
+    }
+    else if(io->pool) {
+        pool_wait(io->pool);
+        for(unsigned int i = 0; i < io->depth; i++) {
+            io->free_slot[i] = i;
+        }
+        io->free_count = io->depth;
+    }
+
+    int ok = !__atomic_load_n(&io->failed, __ATOMIC_RELAXED);
+    io->failed = 0;
+
+    return ok;
+}
+
+void
+io_free(
+    Context_io *io
+) {
+    DEBUG_PRINT("io_free();\n");
+
+    if(io->request) {
+        io_wait(io);
+    }
+    if(io->pool) {
+        pool_free(io->pool);
+    }
+    if(io->sqes) {
+        munmap(io->sqes, io->depth * sizeof(struct io_uring_sqe));
+    }
+    if(io->cq_ring && io->cq_ring != io->sq_ring) {
+        munmap(io->cq_ring, io->cq_ring_length);
+    }
+    if(io->sq_ring) {
+        munmap(io->sq_ring, io->sq_ring_length);
+    }
+    if(io->ring_fd >= 0) {
+        close(io->ring_fd);
+    }
+    memory_free(io->request);
+    memory_free(io->free_slot);
+    memory_free(io);
+}
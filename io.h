@@ -0,0 +1,114 @@
+/** @file  io.h
+ *  @brief Asynchronous file writes, on io_uring where the kernel has it and on a thread pool otherwise
+ */
+
+/** @brief Number of writes an io context keeps in flight by default */
+#define IO_DEPTH 64
+
+/** @brief Largest single write queued, longer ones are split so that their pieces run side by side */
+#define IO_CHUNK (1 << 20)
+
+/** @brief Largest region io_register() can take, a limit of io_uring */
+#define IO_REGION_MAX (1UL << 30)
+
+/** @brief Workers started by the IO_ENGINE_THREADS engine */
+#define IO_THREAD_COUNT 4
+
+/** @brief How an io context gets its writes to the kernel */
+enum io_engine {
+    /** io_uring if the kernel allows it, IO_ENGINE_THREADS otherwise */
+    IO_ENGINE_AUTO,
+    /** Writes are queued on an io_uring, and submitted in batches with a single system call. Writes
+     *  from registered regions are made with IORING_OP_WRITE_FIXED, so their pages aren't pinned
+     *  again for every write. */
+    IO_ENGINE_URING,
+    /** Every write is a pwrite() run by a worker of a Context_pool */
+    IO_ENGINE_THREADS
+};
+
+/** @brief A queue of writes and syncs in flight
+ *
+ * Writes are queued with io_write() and io_fsync(), and only known to be done once io_wait() returns,
+ * so the memory they're written from has to stay put until then. An io context may be used by one
+ * thread at a time.
+ */
+typedef struct io_context Context_io;
+
+/** @brief Starts an io context on \a engine that keeps up to \a depth writes in flight
+ *
+ * A \a depth of 0 means IO_DEPTH.
+ *
+ * @returns A pointer to the io context on success, or 0 on failure, including when \a engine is
+ *          IO_ENGINE_URING and the kernel doesn't allow it
+ * @see     io_free()
+ */
+Context_io *
+io_create(
+    Context_main *ctx_main, ///<[in] main context
+    int engine,             ///<[in] one of io_engine
+    unsigned int depth      ///<[in] writes to keep in flight
+    );
+
+/** @brief   Returns the io_engine \a io runs on, never IO_ENGINE_AUTO */
+int
+io_engine(
+    Context_io *io ///<[in] io context
+    );
+
+/** @brief Registers \a count regions of memory that io_write() will be writing from, replacing any registered before
+ *
+ * With IO_ENGINE_URING the regions' pages are pinned once here, rather than on every write. Regions
+ * backed by a file (see memory_page_map()), or longer than IO_REGION_MAX, can't be registered.
+ * Registering only pays off when most of a region gets written, like the pages of a bucket by
+ * database_save(). Pinning memory that a fork()ed process still shares copy-on-write copies it.
+ *
+ * @returns 1 on success, 0 on failure, in which case io_write() carries on without registered regions
+ */
+int
+io_register(
+    Context_io *io,         ///<[in] io context
+    unsigned char **region, ///<[in] start of every region
+    unsigned long *length,  ///<[in] length of every region in bytes
+    int count               ///<[in] number of regions
+    );
+
+/** @brief Queues a write of \a length bytes from \a buffer to \a fd at \a offset
+ *
+ * If \a region is the index of a region passed to io_register() that holds all of \a buffer, the
+ * write is made from the registered region, otherwise \a region should be -1.
+ *
+ * @returns 1 if the write was queued, 0 on failure. Whether it worked is only known from io_wait().
+ */
+int
+io_write(
+    Context_io *io,              ///<[in] io context
+    int fd,                      ///<[in] file to write to
+    const unsigned char *buffer, ///<[in] bytes to write, which must stay valid until io_wait()
+    unsigned long length,        ///<[in] number of bytes to write
+    unsigned long offset,        ///<[in] where in the file to write them
+    int region                   ///<[in] registered region \a buffer is in, or -1
+    );
+
+/** @brief Queues an fsync() of \a fd, or an fdatasync() if \a datasync is set, that runs after every write queued before it
+ *  @returns 1 if the sync was queued, 0 on failure
+ */
+int
+io_fsync(
+    Context_io *io, ///<[in] io context
+    int fd,         ///<[in] file to sync
+    int datasync    ///<[in] only sync the data
+    );
+
+/** @brief   Submits everything queued, and waits for all of it to finish
+ *  @returns 1 if every write and sync queued since the last io_wait() worked, 0 otherwise
+ */
+int
+io_wait(
+    Context_io *io ///<[in] io context
+    );
+
+/** @brief Waits for everything queued on \a io, then frees it */
+void
+io_free(
+    Context_io *io ///<[in] io context
+    );
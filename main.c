@@ -15,6 +15,7 @@ struct main_context *main_create_context(void) {
     if(main_context) {
         main_context->system_page_size = sysconf(_SC_PAGE_SIZE);
         main_context->system_phys_page_count = sysconf(_SC_PHYS_PAGES);
+        main_context->system_cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
         return main_context;
     }
     else {
@@ -46,6 +46,58 @@ memory_page_alloc(
     return NULL;
 }
 
+unsigned char *
+memory_page_map(
+    struct main_context *main_context,
+    int fd,
+    unsigned long page_offset,
+    int page_count
+) {
+    DEBUG_PRINT("memory_page_map(fd = %d, page_offset = %lu, page_count = %d);\n", fd, page_offset, page_count);
+    if(page_count > 0) {
+        unsigned char *region =
+            mmap(NULL,
+                page_count * main_context->system_page_size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE,
+                fd,
+                page_offset * main_context->system_page_size);
+        if(region == MAP_FAILED) {
+            DEBUG_PRINT("memory_page_map() failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        return region;
+    }
+
+    return NULL;
+}
+
+unsigned char *
+memory_page_map_shared(
+    struct main_context *main_context,
+    int fd,
+    unsigned long page_offset,
+    int page_count
+) {
+    DEBUG_PRINT("memory_page_map_shared(fd = %d, page_offset = %lu, page_count = %d);\n", fd, page_offset, page_count);
+    if(page_count > 0) {
+        unsigned char *region =
+            mmap(NULL,
+                page_count * main_context->system_page_size,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED,
+                fd,
+                page_offset * main_context->system_page_size);
+        if(region == MAP_FAILED) {
+            DEBUG_PRINT("memory_page_map_shared() failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        return region;
+    }
+
+    return NULL;
+}
+
 unsigned char *
 memory_page_realloc(
     struct main_context *main_context,
@@ -16,6 +16,39 @@ memory_page_alloc(
     int page_count                     ///<[in] The number of pages to allocate
     );
 
+/** @brief Map a number of system pages of a file, copy-on-write
+ *
+ * The region reads as the file's contents, faulted in on first access. Writes to it stay private to
+ * the process, so the file itself is never changed. The file may be closed once this returns.
+ *
+ * The region may be passed to memory_page_free() like any other, but not grown with
+ * memory_page_realloc(), which would map more of the file.
+ *
+ * @returns A pointer to the mapped region on success, or 0 on failure
+ */
+unsigned char *
+memory_page_map(
+    struct main_context *main_context, ///<[in] The main context
+    int fd,                            ///<[in] An open file descriptor of the file to map
+    unsigned long page_offset,         ///<[in] The page of the file that the region starts at
+    int page_count                     ///<[in] The number of pages to map
+    );
+
+/** @brief Map a number of system pages of a file, shared
+ *
+ * Unlike memory_page_map(), writes to the region go to the file, and are seen by every other
+ * process that maps it. The region is passed to memory_page_free() like any other.
+ *
+ * @returns A pointer to the mapped region on success, or 0 on failure
+ */
+unsigned char *
+memory_page_map_shared(
+    struct main_context *main_context, ///<[in] The main context
+    int fd,                            ///<[in] An open file descriptor of the file to map
+    unsigned long page_offset,         ///<[in] The page of the file that the region starts at
+    int page_count                     ///<[in] The number of pages to map
+    );
+
 /** @brief Reallocate a region allocated by memory_page_alloc()
  *
  * Uses mremap() on non-BSD/Apple systems, otherwise just munmap() and mmap().
@@ -32,7 +65,7 @@ memory_page_realloc(
     int page_count                     ///<[in] The new page count
     );
 
-/** @brief Free a region allocated by memory_page_alloc()
+/** @brief Free a region allocated by memory_page_alloc() or memory_page_map()
  *
  * Uses munmap()
  *
@@ -0,0 +1,770 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "io.h"
+#include "paged.h"
+
+#ifndef DEBUG_PAGED
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+/** Pages in a unit of bucket x: one page's worth of values up to bucket 8, one value past it */
+#define _PAGED_UNIT_PAGES(x) (((x) <= 8) ? 1UL : (1UL << ((x) - 8)))
+
+/** Key of unit y of bucket x in the frame map */
+#define _PAGED_KEY(x,y) (((unsigned long)(x) << 56) | (y))
+
+/** Frames the pool starts out with room for, before growing */
+#define _PAGED_FRAME_START 64
+
+typedef struct paged_frame {
+    unsigned char *data;      // The unit's pages, or 0 if the frame is unused
+    unsigned long key;        // _PAGED_KEY() of the unit
+    unsigned long pages;
+    unsigned int pin_count;
+    unsigned char referenced; // Cleared by the CLOCK hand, set on every pin
+    unsigned char dirty;      // Changed since it was last written to the data file
+} Paged_frame;
+
+struct database_paged {
+    // kv_record_tbl, and per bucket a ptbl_record whose page_count is its number of units. m_offset
+    // stays 0, so database_ptbl_free() frees it all.
+    Record_database *rec_database;
+
+    int fd;
+    char *path;
+    unsigned long file_pages;      // Pages of the data file handed out to units so far
+
+    unsigned long *unit_page[64];  // Page of the data file that each unit of a bucket lives at
+    unsigned long unit_length[64]; // Length of unit_page[] in units
+    unsigned long first_free[64];  // No byte of a bucket's page_usage before this one has a free slot
+
+    Paged_frame *frame;
+    unsigned long frame_count;
+    long *free_frame;              // Stack of unused frames
+    unsigned long free_count;
+    unsigned long hand;            // Where the CLOCK hand is in frame
+
+    long *map;                     // _PAGED_KEY() -> frame, open addressing, -1 for an empty slot
+    unsigned int map_bits;
+
+    Paged_stats stats;
+};
+
+static unsigned long
+_paged_map_slot(
+    Database_paged *dbp,
+    unsigned long key
+) {
+    return (key * 0x9E3779B97F4A7C15UL) >> (64 - dbp->map_bits);
+}
+
+static long
+_paged_map_get(
+    Database_paged *dbp,
+    unsigned long key
+) {
+    unsigned long mask = (1UL << dbp->map_bits) - 1;
+    for(unsigned long i = _paged_map_slot(dbp, key); dbp->map[i] != -1; i = (i + 1) & mask) {
+        if(dbp->frame[dbp->map[i]].key == key) {
+            return dbp->map[i];
+        }
+    }
+    return -1;
+}
+
+static void
+_paged_map_put(
+    Database_paged *dbp,
+    long f
+) {
+    unsigned long mask = (1UL << dbp->map_bits) - 1,
+        i = _paged_map_slot(dbp, dbp->frame[f].key);
+    while(dbp->map[i] != -1) {
+        i = (i + 1) & mask;
+    }
+    dbp->map[i] = f;
+}
+
+// Backward-shift deletion, so that lookups never need tombstones
+static void
+_paged_map_delete(
+    Database_paged *dbp,
+    unsigned long key
+) {
+    unsigned long mask = (1UL << dbp->map_bits) - 1,
+        i = _paged_map_slot(dbp, key);
+    while(dbp->map[i] != -1 && dbp->frame[dbp->map[i]].key != key) {
+        i = (i + 1) & mask;
+    }
+    if(dbp->map[i] == -1) {
+        return;
+    }
+
+    for(unsigned long j = (i + 1) & mask; dbp->map[j] != -1; j = (j + 1) & mask) {
+        unsigned long home = _paged_map_slot(dbp, dbp->frame[dbp->map[j]].key);
+        // Move the entry at j into the hole at i, unless its home slot lies cyclically in (i, j]
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            dbp->map[i] = dbp->map[j];
+            i = j;
+        }
+    }
+    dbp->map[i] = -1;
+}
+
+// Doubles the number of frames, which must all be in use, and rebuilds the map to match
+static int
+_paged_frame_grow(
+    Database_paged *dbp
+) {
+    unsigned long count = dbp->frame_count ? dbp->frame_count * 2 : _PAGED_FRAME_START;
+    unsigned int bits = dbp->map_bits;
+    while((1UL << bits) < count * 2) {
+        bits++;
+    }
+
+    Paged_frame *frame = (Paged_frame *)memory_realloc(dbp->frame, dbp->frame_count * sizeof(Paged_frame), count * sizeof(Paged_frame));
+    if(!frame) {
+        return 0;
+    }
+    dbp->frame = frame;
+
+    long *free_frame = (long *)memory_realloc(dbp->free_frame, dbp->frame_count * sizeof(long), count * sizeof(long));
+    if(!free_frame) {
+        return 0;
+    }
+    dbp->free_frame = free_frame;
+
+    if(bits != dbp->map_bits) {
+        long *map = (long *)memory_alloc(sizeof(long) << bits);
+        if(!map) {
+            return 0;
+        }
+        memset(map, 0xFF, sizeof(long) << bits);
+        memory_free(dbp->map);
+        dbp->map = map;
+        dbp->map_bits = bits;
+        for(long f = 0; f < dbp->frame_count; f++) {
+            if(dbp->frame[f].data) {
+                _paged_map_put(dbp, f);
+            }
+        }
+    }
+
+    // Hand the new frames out lowest first
+    for(long f = count - 1; f >= (long)dbp->frame_count; f--) {
+        dbp->free_frame[dbp->free_count++] = f;
+    }
+    dbp->frame_count = count;
+
+    return 1;
+}
+
+static int
+_paged_io(
+    Database_paged *dbp,
+    unsigned char *buffer,
+    unsigned long length,
+    unsigned long offset,
+    int write
+) {
+    while(length > 0) {
+        ssize_t done = write ? pwrite(dbp->fd, buffer, length, offset) : pread(dbp->fd, buffer, length, offset);
+        if(done < 0 && errno == EINTR) {
+            continue;
+        }
+        if(done <= 0) {
+            DEBUG_PRINT("\tERR %s failed: %s\n", write ? "write" : "read", done ? strerror(errno) : "end of file");
+            return 0;
+        }
+        buffer += done;
+        offset += done;
+        length -= done;
+    }
+
+    return 1;
+}
+
+static unsigned long
+_paged_frame_offset(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    Paged_frame *frame
+) {
+    unsigned char bucket = frame->key >> 56;
+    return dbp->unit_page[bucket][frame->key & ((1UL << 56) - 1)] * ctx_main->system_page_size;
+}
+
+// Moves the CLOCK hand to the first frame that's neither pinned nor referenced, clearing the
+// referenced bit of every frame it passes. Twice round is enough to clear them all.
+static long
+_paged_victim(
+    Database_paged *dbp
+) {
+    for(unsigned long step = 0; step < dbp->frame_count * 2; step++) {
+        long f = dbp->hand;
+        dbp->hand = (dbp->hand + 1) % dbp->frame_count;
+
+        if(!dbp->frame[f].data || dbp->frame[f].pin_count) {
+            continue;
+        }
+        if(dbp->frame[f].referenced) {
+            dbp->frame[f].referenced = 0;
+            continue;
+        }
+        return f;
+    }
+
+    return -1;
+}
+
+// Returns the frame holding unit of bucket, pinned. A unit that's created is given zeroed pages and
+// marked dirty, instead of being read.
+static long
+_paged_pin(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned char bucket,
+    unsigned long unit,
+    int create
+) {
+    unsigned long key = _PAGED_KEY(bucket, unit);
+    long f = _paged_map_get(dbp, key);
+    if(f != -1) {
+        dbp->frame[f].pin_count++;
+        dbp->frame[f].referenced = 1;
+        dbp->stats.hits++;
+        return f;
+    }
+
+    unsigned long pages = _PAGED_UNIT_PAGES(bucket),
+        length = pages * ctx_main->system_page_size;
+    if(pages > dbp->stats.capacity_pages) {
+        DEBUG_PRINT("\tERR a unit of bucket %d is larger than the pool\n", bucket);
+        return -1;
+    }
+
+    // Make room, keeping the pages of a victim the same size as the unit to load it into
+    unsigned char *data = 0;
+    while(dbp->stats.resident_pages + pages > dbp->stats.capacity_pages) {
+        long victim = _paged_victim(dbp);
+        if(victim == -1) {
+            DEBUG_PRINT("\tERR every frame is pinned\n");
+            goto fail;
+        }
+
+#define _VICTIM dbp->frame[victim]
+
+        if(_VICTIM.dirty) {
+            if(!_paged_io(dbp, _VICTIM.data, _VICTIM.pages * ctx_main->system_page_size, _paged_frame_offset(ctx_main, dbp, &_VICTIM), 1)) {
+                goto fail;
+            }
+            dbp->stats.writes++;
+        }
+
+        _paged_map_delete(dbp, _VICTIM.key);
+        if(!data && _VICTIM.pages == pages) {
+            data = _VICTIM.data;
+        }
+        else {
+            memory_page_free(ctx_main, _VICTIM.data, _VICTIM.pages);
+        }
+        dbp->stats.resident_pages -= _VICTIM.pages;
+        dbp->stats.evictions++;
+        _VICTIM.data = 0;
+        dbp->free_frame[dbp->free_count++] = victim;
+
+#undef _VICTIM
+
+    }
+
+    if(!dbp->free_count && !_paged_frame_grow(dbp)) {
+        goto fail;
+    }
+
+    if(!data) {
+        data = memory_page_alloc(ctx_main, pages);
+        if(!data) {
+            return -1;
+        }
+    }
+    else if(create) {
+        memset(data, 0, length);
+    }
+
+    f = dbp->free_frame[dbp->free_count - 1];
+    dbp->frame[f].key = key;
+    if(!create && !_paged_io(dbp, data, length, _paged_frame_offset(ctx_main, dbp, &dbp->frame[f]), 0)) {
+        goto fail;
+    }
+    dbp->free_count--;
+
+    dbp->frame[f].data = data;
+    dbp->frame[f].pages = pages;
+    dbp->frame[f].pin_count = 1;
+    dbp->frame[f].referenced = 1;
+    dbp->frame[f].dirty = create;
+    _paged_map_put(dbp, f);
+
+    dbp->stats.resident_pages += pages;
+    dbp->stats.misses++;
+
+    return f;
+
+fail:
+    if(data) {
+        memory_page_free(ctx_main, data, pages);
+    }
+    return -1;
+}
+
+// Gives bucket one more unit at the end of the data file, and returns the ptbl_record's index
+static char
+_paged_unit_add(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned char bucket
+) {
+    Record_database *rec_database = dbp->rec_database;
+
+    char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+    if(ptbl_index == -1) {
+        Record_ptbl *ptbl = (Record_ptbl *)memory_realloc(
+                rec_database->ptbl_record_tbl,
+                rec_database->ptbl_record_count * sizeof(Record_ptbl),
+                (rec_database->ptbl_record_count + 1) * sizeof(Record_ptbl)
+                );
+        if(!ptbl) {
+            return -1;
+        }
+        rec_database->ptbl_record_tbl = ptbl;
+        ptbl_index = rec_database->ptbl_record_count++;
+        PTBL_RECORD_SET_KEY(ptbl[ptbl_index], bucket);
+    }
+
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+    unsigned long units = PTBL_RECORD_GET_PAGE_COUNT(_PTBL);
+    if(units + 1 >= (1UL << 29)) {
+        DEBUG_PRINT("\tERR bucket %d is full\n", bucket);
+        return -1;
+    }
+
+    if(units == dbp->unit_length[bucket]) {
+        unsigned long length = units ? units * 2 : 16;
+        unsigned long *unit_page = (unsigned long *)memory_realloc(dbp->unit_page[bucket], units * sizeof(unsigned long), length * sizeof(unsigned long));
+        if(!unit_page) {
+            return -1;
+        }
+        dbp->unit_page[bucket] = unit_page;
+        dbp->unit_length[bucket] = length;
+    }
+
+    unsigned int page_usage_length = PTBL_CALC_PAGE_USAGE_LENGTH(bucket, units + 1);
+    if(page_usage_length > _PTBL.page_usage_length) {
+        unsigned char *page_usage = memory_realloc(_PTBL.page_usage, _PTBL.page_usage_length, page_usage_length);
+        if(!page_usage) {
+            return -1;
+        }
+        _PTBL.page_usage = page_usage;
+        _PTBL.page_usage_length = page_usage_length;
+    }
+
+    dbp->unit_page[bucket][units] = dbp->file_pages;
+    dbp->file_pages += _PAGED_UNIT_PAGES(bucket);
+    PTBL_RECORD_SET_PAGE_COUNT(_PTBL, units + 1);
+
+#undef _PTBL
+
+    return ptbl_index;
+}
+
+// The same search as _database_value_alloc(), starting from first_free, and growing the bucket by
+// a unit when it's full. Returns the slot, marked as used.
+static unsigned long
+_paged_value_alloc(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned char bucket
+) {
+    Record_database *rec_database = dbp->rec_database;
+    char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+    if(ptbl_index != -1) {
+        unsigned long slots = PTBL_RECORD_GET_PAGE_COUNT(_PTBL) * PTBL_CALC_PAGE_USAGE_BITS(bucket);
+
+        for(unsigned long i = dbp->first_free[bucket]; i < _PTBL.page_usage_length; i++) {
+            unsigned long word;
+            if(!(i % 8) && i + 8 <= _PTBL.page_usage_length) {
+                memcpy(&word, &_PTBL.page_usage[i], sizeof(word));
+                if(word == (unsigned long)-1) {
+                    i += 7;
+                    continue;
+                }
+            }
+            if(_PTBL.page_usage[i] == 0xFF) {
+                continue;
+            }
+            for(int j = 0; j < 8 && i * 8 + j < slots; j++) {
+                if(!(_PTBL.page_usage[i] & (1 << j))) {
+                    _PTBL.page_usage[i] |= (1 << j);
+                    dbp->first_free[bucket] = i;
+                    return i * 8 + j;
+                }
+            }
+        }
+    }
+
+    ptbl_index = _paged_unit_add(ctx_main, dbp, bucket);
+    if(ptbl_index == -1) {
+        return -1;
+    }
+
+    unsigned long units = PTBL_RECORD_GET_PAGE_COUNT(_PTBL),
+        slot = (units - 1) * PTBL_CALC_PAGE_USAGE_BITS(bucket);
+
+    // Nothing has been written to the unit yet, so it's created in the pool rather than read
+    long f = _paged_pin(ctx_main, dbp, bucket, units - 1, 1);
+    if(f == -1) {
+        PTBL_RECORD_SET_PAGE_COUNT(_PTBL, units - 1);
+        dbp->file_pages -= _PAGED_UNIT_PAGES(bucket);
+        return -1;
+    }
+    dbp->frame[f].pin_count--;
+
+    _PTBL.page_usage[slot / 8] |= (1 << (slot % 8));
+    dbp->first_free[bucket] = slot / 8;
+
+#undef _PTBL
+
+    return slot;
+}
+
+static void
+_paged_value_free(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned char bucket,
+    unsigned long slot
+) {
+    char ptbl_index = database_ptbl_get(ctx_main, dbp->rec_database, bucket);
+    PTBL_RECORD_PAGE_USAGE_FREE(dbp->rec_database, ptbl_index, slot);
+    if(slot / 8 < dbp->first_free[bucket]) {
+        dbp->first_free[bucket] = slot / 8;
+    }
+}
+
+// Copies length bytes of buffer into slot of bucket, through the pool
+static int
+_paged_value_write(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned char bucket,
+    unsigned long slot,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    unsigned long slots = PTBL_CALC_PAGE_USAGE_BITS(bucket);
+    long f = _paged_pin(ctx_main, dbp, bucket, slot / slots, 0);
+    if(f == -1) {
+        return 0;
+    }
+
+    memcpy(dbp->frame[f].data + (slot % slots) * PTBL_CALC_BUCKET_WORD_SIZE(bucket), buffer, length);
+    dbp->frame[f].dirty = 1;
+    dbp->frame[f].pin_count--;
+
+    return 1;
+}
+
+Database_paged *
+database_paged_open(
+    Context_main *ctx_main,
+    const char *path,
+    unsigned long capacity_pages
+) {
+    DEBUG_PRINT("database_paged_open(path = %s, capacity_pages = %lu);\n", path, capacity_pages);
+
+    RECORD_CREATE(Database_paged, dbp);
+    if(!dbp) {
+        return 0;
+    }
+    dbp->fd = -1;
+
+    RECORD_ALLOC(Record_database, dbp->rec_database);
+    dbp->path = (char *)memory_alloc(strlen(path) + 1);
+    if(!dbp->rec_database || !dbp->path) {
+        goto fail;
+    }
+    strcpy(dbp->path, path);
+
+    dbp->stats.capacity_pages = capacity_pages ? capacity_pages : ctx_main->system_phys_page_count / 4;
+    if(!dbp->stats.capacity_pages || !_paged_frame_grow(dbp)) {
+        goto fail;
+    }
+
+    dbp->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(dbp->fd < 0) {
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    return dbp;
+
+fail:
+    database_paged_close(ctx_main, dbp);
+    return 0;
+}
+
+void
+database_paged_close(
+    Context_main *ctx_main,
+    Database_paged *dbp
+) {
+    if(!dbp) {
+        return;
+    }
+
+    for(unsigned long f = 0; f < dbp->frame_count; f++) {
+        if(dbp->frame[f].data) {
+            memory_page_free(ctx_main, dbp->frame[f].data, dbp->frame[f].pages);
+        }
+    }
+    memory_free(dbp->frame);
+    memory_free(dbp->free_frame);
+    memory_free(dbp->map);
+
+    for(int i = 0; i < 64; i++) {
+        memory_free(dbp->unit_page[i]);
+    }
+
+    if(dbp->rec_database) {
+        database_ptbl_free(ctx_main, dbp->rec_database);
+        memory_free(dbp->rec_database);
+    }
+
+    if(dbp->fd >= 0) {
+        close(dbp->fd);
+        unlink(dbp->path);
+    }
+    memory_free(dbp->path);
+    memory_free(dbp);
+}
+
+unsigned long
+database_paged_kv_alloc(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_paged_kv_alloc(flags = %02x, size = %lu);\n", flags, size);
+
+    unsigned char bucket = database_calc_bucket(size);
+    unsigned long slot = _paged_value_alloc(ctx_main, dbp, bucket);
+    if(slot == -1) {
+        DEBUG_PRINT("\tERR failed to allocate new value in bucket %d\n", bucket);
+        return -1;
+    }
+
+    unsigned long k = -1;
+    if(!_paged_value_write(ctx_main, dbp, bucket, slot, size, buffer)
+            || (k = database_kv_record_alloc(ctx_main, dbp->rec_database)) == -1) {
+        _paged_value_free(ctx_main, dbp, bucket, slot);
+        return -1;
+    }
+
+    Record_kv *kv_rec = &dbp->rec_database->kv_record_tbl[k];
+    KV_RECORD_SET_FLAGS(kv_rec[0], flags);
+    KV_RECORD_SET_SIZE(kv_rec[0], size);
+    KV_RECORD_SET_BUCKET(kv_rec[0], bucket);
+    KV_RECORD_SET_INDEX(kv_rec[0], slot);
+
+    return k;
+}
+
+int
+database_paged_kv_set_value(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_paged_kv_set_value(k = %lu, length = %lu);\n", k, length);
+
+    Record_database *rec_database = dbp->rec_database;
+    if(k >= rec_database->kv_record_count) {
+        DEBUG_PRINT("\tERR k is greater than kv_record_count\n");
+        return 0;
+    }
+
+#define _REC_KV rec_database->kv_record_tbl[k]
+
+    if(0 == KV_RECORD_GET_SIZE(_REC_KV)) {
+        DEBUG_PRINT("\tERR size of record is 0\n");
+        return 0;
+    }
+
+    // As with database_kv_set_value(), the new value goes into a new slot, which is then swapped in
+    unsigned char bucket = database_calc_bucket(length);
+    unsigned long slot = _paged_value_alloc(ctx_main, dbp, bucket);
+    if(slot == -1) {
+        return 0;
+    }
+    if(!_paged_value_write(ctx_main, dbp, bucket, slot, length, buffer)) {
+        _paged_value_free(ctx_main, dbp, bucket, slot);
+        return 0;
+    }
+
+    _paged_value_free(ctx_main, dbp, KV_RECORD_GET_BUCKET(_REC_KV), KV_RECORD_GET_INDEX(_REC_KV));
+
+    KV_RECORD_SET_BUCKET(_REC_KV, bucket);
+    KV_RECORD_SET_INDEX(_REC_KV, slot);
+    KV_RECORD_SET_SIZE(_REC_KV, length);
+
+#undef _REC_KV
+
+    return 1;
+}
+
+int
+database_paged_kv_free(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned long k
+) {
+    DEBUG_PRINT("database_paged_kv_free(k = %lu);\n", k);
+
+    Record_database *rec_database = dbp->rec_database;
+    if(k >= rec_database->kv_record_count) {
+        DEBUG_PRINT("\tERR k is greater than kv_record_count\n");
+        return 0;
+    }
+
+#define _REC_KV rec_database->kv_record_tbl[k]
+
+    if(0 == KV_RECORD_GET_SIZE(_REC_KV)) {
+        return 1;
+    }
+
+    KV_RECORD_SET_SIZE(_REC_KV, 0);
+    _paged_value_free(ctx_main, dbp, KV_RECORD_GET_BUCKET(_REC_KV), KV_RECORD_GET_INDEX(_REC_KV));
+
+#undef _REC_KV
+
+    // Same bookkeeping as database_kv_free()
+    if(k == rec_database->kv_record_count - 1) rec_database->kv_record_count--;
+    else rec_database->kv_record_free_count++;
+
+    if(rec_database->kv_record_count == 0) {
+        memory_free(rec_database->kv_record_tbl);
+        rec_database->kv_record_tbl = 0;
+    }
+
+    return 1;
+}
+
+unsigned char *
+database_paged_kv_get_value(
+    Context_main *ctx_main,
+    Database_paged *dbp,
+    unsigned long *pin,
+    unsigned long k
+) {
+    DEBUG_PRINT("database_paged_kv_get_value(k = %lu);\n", k);
+
+    Record_database *rec_database = dbp->rec_database;
+    if(k >= rec_database->kv_record_count || 0 == KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) {
+        DEBUG_PRINT("\tERR no such record\n");
+        return 0;
+    }
+
+    unsigned char bucket = KV_RECORD_GET_BUCKET(rec_database->kv_record_tbl[k]);
+    unsigned long slot = KV_RECORD_GET_INDEX(rec_database->kv_record_tbl[k]),
+        slots = PTBL_CALC_PAGE_USAGE_BITS(bucket);
+
+    long f = _paged_pin(ctx_main, dbp, bucket, slot / slots, 0);
+    if(f == -1) {
+        return 0;
+    }
+
+    pin[0] = f;
+    return dbp->frame[f].data + (slot % slots) * PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+}
+
+void
+database_paged_unpin(
+    Database_paged *dbp,
+    unsigned long pin
+) {
+    if(pin < dbp->frame_count && dbp->frame[pin].pin_count > 0) {
+        dbp->frame[pin].pin_count--;
+    }
+}
+
+int
+database_paged_flush(
+    Context_main *ctx_main,
+    Database_paged *dbp
+) {
+    DEBUG_PRINT("database_paged_flush();\n");
+
+    Context_io *io = io_create(ctx_main, IO_ENGINE_AUTO, 0);
+    if(!io) {
+        return 0;
+    }
+
+    unsigned long writes = 0;
+    int ok = 1;
+    for(unsigned long f = 0; f < dbp->frame_count && ok; f++) {
+        if(dbp->frame[f].data && dbp->frame[f].dirty) {
+            ok = io_write(io, dbp->fd, dbp->frame[f].data, dbp->frame[f].pages * ctx_main->system_page_size,
+                    _paged_frame_offset(ctx_main, dbp, &dbp->frame[f]), -1);
+            writes++;
+        }
+    }
+    ok = io_wait(io) && ok;
+    io_free(io);
+
+    // Frames only count as clean once every write is known to have worked
+    if(ok) {
+        for(unsigned long f = 0; f < dbp->frame_count; f++) {
+            dbp->frame[f].dirty = 0;
+        }
+        dbp->stats.writes += writes;
+    }
+
+    return ok;
+}
+
+void
+database_paged_stats(
+    Database_paged *dbp,
+    Paged_stats *stats
+) {
+    stats[0] = dbp->stats;
+}
+
+Record_database *
+database_paged_record(
+    Database_paged *dbp
+) {
+    return dbp->rec_database;
+}
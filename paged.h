@@ -0,0 +1,138 @@
+/** @file  paged.h
+ *  @brief A database whose bucket pages live in a data file, and are cached in a fixed-size buffer pool
+ */
+
+/** @brief Counters kept by a Database_paged */
+typedef struct paged_stats {
+    unsigned long hits;           ///< Pins of a unit that was in the pool
+    unsigned long misses;         ///< Pins of a unit that had to be read in, or created
+    unsigned long evictions;      ///< Units dropped from the pool to make room
+    unsigned long writes;         ///< Dirty units written back to the data file
+    unsigned long resident_pages; ///< Pages the pool holds right now
+    unsigned long capacity_pages; ///< Pages the pool may hold at most
+} Paged_stats;
+
+/** @brief A database that can be larger than memory
+ *
+ * kv_record_tbl and every bucket's page_usage are kept in memory as in a Record_database, but the
+ * values are not: every bucket is made of units, of one page for buckets up to 8 and of one value
+ * for larger ones, and each unit has its own place in a data file. Units are read into frames of a
+ * buffer pool of a fixed number of pages when they're needed, and the CLOCK algorithm picks which
+ * frame to drop when the pool is full, writing it back first if it has changed.
+ *
+ * A value is only in memory while its unit is pinned, so database_paged_kv_get_value() pins it
+ * until database_paged_unpin() is called. The memory used stays bounded however large the database
+ * grows, as long as the values pinned at once fit in the pool.
+ *
+ * The data file is scratch space: it's emptied when opened and removed when closed. A
+ * Database_paged may only be used by one thread at a time.
+ */
+typedef struct database_paged Database_paged;
+
+/** @brief Creates an empty database backed by the data file at \a path, with a pool of \a capacity_pages pages
+ *
+ * A \a capacity_pages of 0 sizes the pool to a quarter of main_context.system_phys_page_count.
+ *
+ * @returns A pointer to the database on success, or 0 on failure
+ * @see     database_paged_close()
+ */
+Database_paged *
+database_paged_open(
+    Context_main *ctx_main,      ///<[in] main context
+    const char *path,            ///<[in] data file
+    unsigned long capacity_pages ///<[in] size of the buffer pool in pages
+    );
+
+/** @brief Frees \a dbp and its pool, and removes its data file. Every pin must have been released. */
+void
+database_paged_close(
+    Context_main *ctx_main, ///<[in] main context
+    Database_paged *dbp     ///<[in] database
+    );
+
+/** @brief   database_kv_alloc(), for a Database_paged
+ *  @returns The key of the new record on success, or -1 on failure
+ */
+unsigned long
+database_paged_kv_alloc(
+    Context_main *ctx_main, ///<[in] main context
+    Database_paged *dbp,    ///<[in] database
+    unsigned char flags,    ///<[in] flags of the new record
+    unsigned long size,     ///<[in] size of the value in bytes
+    unsigned char *buffer   ///<[in] \a size bytes to initialize the value with
+    );
+
+/** @brief   database_kv_set_value(), for a Database_paged
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_paged_kv_set_value(
+    Context_main *ctx_main, ///<[in] main context
+    Database_paged *dbp,    ///<[in] database
+    unsigned long k,        ///<[in] key of the record to change
+    unsigned long length,   ///<[in] length of \a buffer in bytes
+    unsigned char *buffer   ///<[in] new value
+    );
+
+/** @brief database_kv_free(), for a Database_paged
+ *
+ * Unlike database_kv_free(), the value's bytes are left as they are, so that freeing never has to
+ * read its unit in.
+ *
+ * @returns 1 on success, 0 on failure
+ */
+int
+database_paged_kv_free(
+    Context_main *ctx_main, ///<[in] main context
+    Database_paged *dbp,    ///<[in] database
+    unsigned long k         ///<[in] key of the record to free
+    );
+
+/** @brief Pins the unit that holds the value of \a k in the pool, and returns a pointer to the value
+ *
+ * The pointer stays valid until the pin written to \a pin is given to database_paged_unpin(). Like
+ * database_kv_get_value(), the value must not be written to through it.
+ *
+ * @returns A pointer to the value on success, or 0 if there's no such record, the unit couldn't be
+ *          read, or every frame of the pool is pinned
+ */
+unsigned char *
+database_paged_kv_get_value(
+    Context_main *ctx_main, ///<[in]  main context
+    Database_paged *dbp,    ///<[in]  database
+    unsigned long *pin,     ///<[out] the pin to release
+    unsigned long k         ///<[in]  key of the record
+    );
+
+/** @brief Releases a pin taken by database_paged_kv_get_value() */
+void
+database_paged_unpin(
+    Database_paged *dbp, ///<[in] database
+    unsigned long pin    ///<[in] the pin to release
+    );
+
+/** @brief   Writes every dirty unit in the pool back to the data file, so that dropping them later is free
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_paged_flush(
+    Context_main *ctx_main, ///<[in] main context
+    Database_paged *dbp     ///<[in] database
+    );
+
+/** @brief Fills in \a stats for \a dbp */
+void
+database_paged_stats(
+    Database_paged *dbp, ///<[in]  database
+    Paged_stats *stats   ///<[out] counters
+    );
+
+/** @brief Returns the database_record behind \a dbp, which holds its kv_record_tbl and every bucket's page_usage
+ *
+ * None of its ptbl_record have pages in memory (m_offset is always 0), so it may only be read, and
+ * only by something that doesn't read values, like database_kv_get_value() would.
+ */
+Record_database *
+database_paged_record(
+    Database_paged *dbp ///<[in] database
+    );
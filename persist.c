@@ -0,0 +1,968 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "io.h"
+#include "persist.h"
+
+#ifndef DEBUG_PERSIST
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define _PERSIST_ROUND_UP(x,y) ((((x) + (y) - 1) / (y)) * (y))
+
+// Pages of memory behind a ptbl_record, see database_ptbl_init()
+#define _PERSIST_BUCKET_PAGES(bucket, page_count) (((bucket) <= 8) ? (unsigned long)(page_count) : ((unsigned long)(page_count) << ((bucket) - 8)))
+
+// Whether bit i of a page_dirty or kv_dirty bitmap counts as dirty, see ptbl_record.page_dirty
+#define _PERSIST_DIRTY(bitmap, length, i) (!(bitmap) || (i) / 8 >= (length) || ((bitmap)[(i) / 8] & (1 << ((i) % 8))))
+
+// Reads length bytes at offset into buffer, PERSIST_CHUNK at a time
+static int
+_persist_read(
+    int fd,
+    unsigned char *buffer,
+    unsigned long length,
+    unsigned long offset
+) {
+    while(length > 0) {
+        ssize_t got = pread(fd, buffer, (length > PERSIST_CHUNK) ? PERSIST_CHUNK : length, offset);
+        if(got <= 0) {
+            if(got < 0 && errno == EINTR) continue;
+            DEBUG_PRINT("\tERR read failed: %s\n", got ? strerror(errno) : "unexpected end of file");
+            return 0;
+        }
+        buffer += got;
+        offset += got;
+        length -= got;
+    }
+
+    return 1;
+}
+
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[i]
+
+// Registers the pages of every bucket that can be with io, and writes the region each one got, or
+// -1, to region
+static void
+_persist_io_register(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    Context_io *io,
+    int *region
+) {
+    unsigned char *start[64];
+    unsigned long length[64];
+    int count = 0;
+
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        unsigned long pages = _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL));
+        region[i] = -1;
+        // Pages mapped from a snapshot are backed by a file, which io_uring won't register
+        if(!PTBL_RECORD_GET_OFFSET(_PTBL) && pages * ctx_main->system_page_size <= IO_REGION_MAX) {
+            start[count] = _PTBL.m_offset;
+            length[count] = pages * ctx_main->system_page_size;
+            region[i] = count++;
+        }
+    }
+    if(!io_register(io, start, length, count)) {
+        for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+            region[i] = -1;
+        }
+    }
+}
+
+// Moves tmp_path over path, and syncs the directory holding path so that the rename survives a crash
+static int
+_persist_rename(
+    const char *tmp_path,
+    const char *path
+) {
+    if(rename(tmp_path, path) != 0) {
+        return 0;
+    }
+
+    const char *slash = strrchr(path, '/');
+    unsigned long length = !slash ? 0 : (slash == path) ? 1 : slash - path;
+    char *dir = (char *)memory_alloc(length + 2);
+    if(!dir) {
+        return 0;
+    }
+    if(length) memcpy(dir, path, length);
+    else dir[0] = '.';
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+        ok = (fd >= 0 && fsync(fd) == 0);
+    if(fd >= 0) close(fd);
+    memory_free(dir);
+
+    return ok;
+}
+
+// Writes rec_database to a snapshot at path, registering the buckets' pages with io_uring if pin is
+// set. Pinning them in a database_bgsave() child would copy every page it still shares with the parent.
+static int
+_persist_save(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path,
+    int pin
+) {
+    unsigned long page_size = ctx_main->system_page_size,
+                  header_length = sizeof(Persist_header) + rec_database->ptbl_record_count * sizeof(Persist_ptbl);
+    if(rec_database->ptbl_record_count > 64) {
+        DEBUG_PRINT("\tERR %lu ptbl records, at most 64 buckets exist\n", rec_database->ptbl_record_count);
+        return 0;
+    }
+
+    unsigned char *header = memory_alloc(header_length);
+    unsigned long path_length = strlen(path);
+    char *tmp_path = (char *)memory_alloc(path_length + 5);
+    if(!header || !tmp_path) {
+        DEBUG_PRINT("\tERR failed to allocate header\n");
+        memory_free(header);
+        memory_free(tmp_path);
+        return 0;
+    }
+    memcpy(tmp_path, path, path_length);
+    memcpy(tmp_path + path_length, ".tmp", 4);
+
+    // Lay the file out: header and ptbl records, kv_record_tbl, page_usage, then every bucket's pages
+    Persist_header *h = (Persist_header *)header;
+    Persist_ptbl *p = (Persist_ptbl *)(header + sizeof(Persist_header));
+    memcpy(h->magic, PERSIST_MAGIC, sizeof(h->magic));
+    h->version = PERSIST_VERSION;
+    h->byte_order = PERSIST_BYTE_ORDER;
+    h->page_size = page_size;
+    h->ptbl_record_count = rec_database->ptbl_record_count;
+    h->kv_record_count = rec_database->kv_record_count;
+    h->kv_record_free_count = rec_database->kv_record_free_count;
+    h->kv_offset = _PERSIST_ROUND_UP(header_length, page_size);
+
+    unsigned long end = h->kv_offset + rec_database->kv_record_count * sizeof(Record_kv);
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        p[i].page_usage_length = _PTBL.page_usage_length;
+        p[i].page_usage_offset = end;
+        end += _PTBL.page_usage_length;
+    }
+    unsigned long page = _PERSIST_ROUND_UP(end, page_size) / page_size;
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        unsigned long pages = _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL));
+        if(page + pages > 0x1fffffff) { // offset is 29 bits
+            DEBUG_PRINT("\tERR bucket %d doesn't fit in the offset field\n", PTBL_RECORD_GET_KEY(_PTBL));
+            memory_free(header);
+            memory_free(tmp_path);
+            return 0;
+        }
+        p[i].key_high_and_page_count = _PTBL.key_high_and_page_count;
+        p[i].key_low_and_offset = _PTBL.key_low_and_offset;
+        PTBL_RECORD_SET_OFFSET(p[i], page);
+        page += pages;
+    }
+    h->file_length = page * page_size;
+
+    Context_io *io = io_create(ctx_main, IO_ENGINE_AUTO, IO_DEPTH);
+    int fd = io ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if(fd < 0) {
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", tmp_path, strerror(errno));
+        if(io) io_free(io);
+        memory_free(header);
+        memory_free(tmp_path);
+        return 0;
+    }
+
+    // Every bucket's pages go to the file straight from m_offset, IO_DEPTH writes at a time
+    int region[64];
+    if(pin) {
+        _persist_io_register(ctx_main, rec_database, io, region);
+    }
+    else {
+        memset(region, -1, sizeof(region));
+    }
+
+    // Sizing the file up front leaves the padding between regions as holes
+    int ok = (ftruncate(fd, h->file_length) == 0)
+          && io_write(io, fd, header, header_length, 0, -1)
+          && io_write(io, fd, (unsigned char *)rec_database->kv_record_tbl, rec_database->kv_record_count * sizeof(Record_kv), h->kv_offset, -1);
+    for(int i = 0; ok && i < rec_database->ptbl_record_count; i++) {
+        ok = io_write(io, fd, _PTBL.page_usage, _PTBL.page_usage_length, p[i].page_usage_offset, -1);
+    }
+    for(int i = 0; ok && i < rec_database->ptbl_record_count; i++) {
+        ok = io_write(io, fd, _PTBL.m_offset,
+                _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL)) * page_size,
+                PTBL_RECORD_GET_OFFSET(p[i]) * page_size, region[i]);
+    }
+    ok = ok && io_fsync(io, fd, 0);
+    // Whatever happened, nothing may still be writing from header once it's freed
+    ok = io_wait(io) && ok;
+    io_free(io);
+    if(close(fd) != 0) ok = 0;
+
+    if(!ok || !_persist_rename(tmp_path, path)) {
+        DEBUG_PRINT("\tERR failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        memory_free(header);
+        memory_free(tmp_path);
+        return 0;
+    }
+
+    DEBUG_PRINT("\twrote %lu bytes\n", h->file_length);
+
+    memory_free(header);
+    memory_free(tmp_path);
+
+    return 1;
+}
+
+int
+database_save(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path
+) {
+    DEBUG_PRINT("database_save(path = %s);\n", path);
+
+    return _persist_save(ctx_main, rec_database, path, 1);
+}
+
+// Reads the snapshot at path into rec_database, either copying every bucket's pages (map == 0),
+// or mapping them from the file (map == 1)
+static int
+_persist_open(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path,
+    int map
+) {
+    if(rec_database->ptbl_record_tbl || rec_database->kv_record_tbl) {
+        DEBUG_PRINT("\tERR database isn't empty\n");
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if(!map) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    Persist_header h;
+    Persist_ptbl p[64];
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !_persist_read(fd, (unsigned char *)&h, sizeof(h), 0)) {
+        close(fd);
+        return 0;
+    }
+    if(memcmp(h.magic, PERSIST_MAGIC, sizeof(h.magic)) != 0
+        || h.version != PERSIST_VERSION
+        || h.byte_order != PERSIST_BYTE_ORDER
+        || h.page_size != ctx_main->system_page_size
+        || h.file_length != st.st_size
+        || h.ptbl_record_count > 64
+        // kv_record_tbl is sized through memory_alloc()'s int
+        || h.kv_record_count > INT_MAX / sizeof(Record_kv)
+        || (h.kv_record_count && !h.ptbl_record_count)
+        || h.kv_record_free_count > h.kv_record_count
+        || h.kv_offset + h.kv_record_count * sizeof(Record_kv) > h.file_length) {
+        DEBUG_PRINT("\tERR %s isn't a snapshot this build can load\n", path);
+        close(fd);
+        return 0;
+    }
+    if(!_persist_read(fd, (unsigned char *)p, h.ptbl_record_count * sizeof(Persist_ptbl), sizeof(h))) {
+        close(fd);
+        return 0;
+    }
+
+    // Everything is hung off rec_database as soon as it's allocated, so database_ptbl_free() can undo
+    // a partial load
+    if(h.ptbl_record_count) {
+        rec_database->ptbl_record_tbl = (Record_ptbl *)memory_alloc(h.ptbl_record_count * sizeof(Record_ptbl));
+        if(!rec_database->ptbl_record_tbl) {
+            close(fd);
+            return 0;
+        }
+        rec_database->ptbl_record_count = h.ptbl_record_count;
+    }
+    if(h.kv_record_count) {
+        rec_database->kv_record_tbl = (Record_kv *)memory_alloc(h.kv_record_count * sizeof(Record_kv));
+        if(!rec_database->kv_record_tbl || !_persist_read(fd, (unsigned char *)rec_database->kv_record_tbl, h.kv_record_count * sizeof(Record_kv), h.kv_offset)) {
+            goto fail;
+        }
+        rec_database->kv_record_count = h.kv_record_count;
+        rec_database->kv_record_free_count = h.kv_record_free_count;
+    }
+
+    unsigned long capacity[64] = { 0 };
+    for(int i = 0; i < h.ptbl_record_count; i++) {
+        int bucket = PTBL_RECORD_GET_KEY(p[i]),
+            page_count = PTBL_RECORD_GET_PAGE_COUNT(p[i]);
+        unsigned long pages = _PERSIST_BUCKET_PAGES(bucket, page_count);
+        if(bucket >= 64 || capacity[bucket]
+            || p[i].page_usage_length != PTBL_CALC_PAGE_USAGE_LENGTH(bucket, page_count)
+            || p[i].page_usage_offset + p[i].page_usage_length > h.file_length
+            || (PTBL_RECORD_GET_OFFSET(p[i]) + pages) * h.page_size > h.file_length) {
+            DEBUG_PRINT("\tERR ptbl record %d is corrupt\n", i);
+            goto fail;
+        }
+        capacity[bucket] = pages * h.page_size / PTBL_CALC_BUCKET_WORD_SIZE(bucket);
+
+        _PTBL.key_high_and_page_count = p[i].key_high_and_page_count;
+        _PTBL.key_low_and_offset = p[i].key_low_and_offset;
+        if(!map) {
+            // Only a bucket that's still mapped from the file keeps its offset
+            PTBL_RECORD_SET_OFFSET(_PTBL, 0);
+        }
+        _PTBL.page_usage = memory_alloc(p[i].page_usage_length);
+        if(!_PTBL.page_usage) {
+            goto fail;
+        }
+        _PTBL.page_usage_length = p[i].page_usage_length;
+        if(!_persist_read(fd, _PTBL.page_usage, p[i].page_usage_length, p[i].page_usage_offset)) {
+            goto fail;
+        }
+
+        if(map) {
+            _PTBL.m_offset = memory_page_map(ctx_main, fd, PTBL_RECORD_GET_OFFSET(p[i]), pages);
+            if(!_PTBL.m_offset) {
+                goto fail;
+            }
+        }
+        else {
+            _PTBL.m_offset = memory_page_alloc(ctx_main, pages);
+            if(!_PTBL.m_offset || !_persist_read(fd, _PTBL.m_offset, pages * h.page_size, PTBL_RECORD_GET_OFFSET(p[i]) * h.page_size)) {
+                goto fail;
+            }
+        }
+    }
+
+    // Every live record has to point inside a bucket that was loaded
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        Record_kv *kv = &rec_database->kv_record_tbl[k];
+        if(KV_RECORD_GET_SIZE(kv[0]) && KV_RECORD_GET_INDEX(kv[0]) >= capacity[KV_RECORD_GET_BUCKET(kv[0])]) {
+            DEBUG_PRINT("\tERR kv record %lu is corrupt\n", k);
+            goto fail;
+        }
+    }
+
+    close(fd);
+
+    // Changes are tracked from the snapshot on, for database_checkpoint()
+    database_dirty_reset(ctx_main, rec_database);
+
+    return 1;
+
+fail:
+    close(fd);
+    if(!rec_database->ptbl_record_tbl) {
+        memory_free(rec_database->kv_record_tbl);
+        rec_database->kv_record_tbl = 0;
+        rec_database->kv_record_count = 0;
+        rec_database->kv_record_free_count = 0;
+    }
+    database_ptbl_free(ctx_main, rec_database);
+
+    return 0;
+}
+
+int
+database_load(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path
+) {
+    DEBUG_PRINT("database_load(path = %s);\n", path);
+
+    return _persist_open(ctx_main, rec_database, path, 0);
+}
+
+int
+database_map(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path
+) {
+    DEBUG_PRINT("database_map(path = %s);\n", path);
+
+    return _persist_open(ctx_main, rec_database, path, 1);
+}
+
+int
+database_checkpoint(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path,
+    unsigned long sequence
+) {
+    DEBUG_PRINT("database_checkpoint(path = %s, sequence = %lu);\n", path, sequence);
+
+    if(!sequence) {
+        if(!database_save(ctx_main, rec_database, path)) {
+            return 0;
+        }
+        // Without the bitmaps the next checkpoint writes everything, which is still right
+        database_dirty_reset(ctx_main, rec_database);
+        return 1;
+    }
+
+    if(rec_database->ptbl_record_count > 64) {
+        DEBUG_PRINT("\tERR %lu ptbl records, at most 64 buckets exist\n", rec_database->ptbl_record_count);
+        return 0;
+    }
+
+    unsigned long page_size = ctx_main->system_page_size,
+                  chunk_length = DATABASE_KV_DIRTY_CHUNK * sizeof(Record_kv),
+                  chunks = (rec_database->kv_record_count + DATABASE_KV_DIRTY_CHUNK - 1) / DATABASE_KV_DIRTY_CHUNK,
+                  kv_chunk_count = 0, dirty_pages = 0,
+                  manifest_length = sizeof(Persist_delta) + rec_database->ptbl_record_count * sizeof(Persist_delta_ptbl);
+
+    // Count what's dirty first, to size the manifest
+    for(unsigned long c = 0; c < chunks; c++) {
+        if(_PERSIST_DIRTY(rec_database->kv_dirty, rec_database->kv_dirty_length, c)) kv_chunk_count++;
+    }
+    manifest_length += kv_chunk_count * sizeof(unsigned int);
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        unsigned long pages = _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL));
+        for(unsigned long page = 0; page < pages; page++) {
+            if(_PERSIST_DIRTY(_PTBL.page_dirty, _PTBL.page_dirty_length, page)) dirty_pages++;
+        }
+        manifest_length += _PTBL.page_usage_length;
+    }
+    manifest_length += dirty_pages * sizeof(unsigned int);
+
+    unsigned char *manifest = memory_alloc(manifest_length);
+    unsigned long path_length = strlen(path);
+    char *tmp_path = (char *)memory_alloc(path_length + 5);
+    if(!manifest || !tmp_path) {
+        DEBUG_PRINT("\tERR failed to allocate manifest\n");
+        memory_free(manifest);
+        memory_free(tmp_path);
+        return 0;
+    }
+    memcpy(tmp_path, path, path_length);
+    memcpy(tmp_path + path_length, ".tmp", 4);
+
+    Persist_delta *h = (Persist_delta *)manifest;
+    Persist_delta_ptbl *p = (Persist_delta_ptbl *)(manifest + sizeof(Persist_delta));
+    memcpy(h->magic, PERSIST_DELTA_MAGIC, sizeof(h->magic));
+    h->version = PERSIST_VERSION;
+    h->byte_order = PERSIST_BYTE_ORDER;
+    h->page_size = page_size;
+    h->sequence = sequence;
+    h->ptbl_record_count = rec_database->ptbl_record_count;
+    h->kv_record_count = rec_database->kv_record_count;
+    h->kv_record_free_count = rec_database->kv_record_free_count;
+    h->kv_chunk_count = kv_chunk_count;
+    h->kv_offset = _PERSIST_ROUND_UP(manifest_length, page_size);
+    h->page_offset = _PERSIST_ROUND_UP(h->kv_offset + kv_chunk_count * chunk_length, page_size);
+    h->file_length = h->page_offset + dirty_pages * page_size;
+
+    unsigned char *cursor = (unsigned char *)(p + rec_database->ptbl_record_count);
+    for(unsigned int c = 0; c < chunks; c++) {
+        if(_PERSIST_DIRTY(rec_database->kv_dirty, rec_database->kv_dirty_length, c)) {
+            memcpy(cursor, &c, sizeof(c));
+            cursor += sizeof(c);
+        }
+    }
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        unsigned int pages = _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL));
+        p[i].key_high_and_page_count = _PTBL.key_high_and_page_count;
+        p[i].key_low_and_offset = _PTBL.key_low_and_offset;
+        PTBL_RECORD_SET_OFFSET(p[i], 0);
+        p[i].page_usage_length = _PTBL.page_usage_length;
+        memcpy(cursor, _PTBL.page_usage, _PTBL.page_usage_length);
+        cursor += _PTBL.page_usage_length;
+        for(unsigned int page = 0; page < pages; page++) {
+            if(_PERSIST_DIRTY(_PTBL.page_dirty, _PTBL.page_dirty_length, page)) {
+                memcpy(cursor, &page, sizeof(page));
+                cursor += sizeof(page);
+                p[i].dirty_page_count++;
+            }
+        }
+    }
+
+    Context_io *io = io_create(ctx_main, IO_ENGINE_AUTO, IO_DEPTH);
+    int fd = io ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if(fd < 0) {
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", tmp_path, strerror(errno));
+        if(io) io_free(io);
+        memory_free(manifest);
+        memory_free(tmp_path);
+        return 0;
+    }
+
+    int ok = (ftruncate(fd, h->file_length) == 0)
+          && io_write(io, fd, manifest, manifest_length, 0, -1);
+
+    // Runs of consecutive chunks and pages are next to each other in memory and in the file, so each
+    // run is a single write
+    unsigned long at = h->kv_offset, kv_length = rec_database->kv_record_count * sizeof(Record_kv);
+    for(unsigned long c = 0; ok && c < chunks; ) {
+        if(!_PERSIST_DIRTY(rec_database->kv_dirty, rec_database->kv_dirty_length, c)) {
+            c++;
+            continue;
+        }
+        unsigned long run = 1;
+        while(c + run < chunks && _PERSIST_DIRTY(rec_database->kv_dirty, rec_database->kv_dirty_length, c + run)) run++;
+        unsigned long length = run * chunk_length;
+        if(c * chunk_length + length > kv_length) length = kv_length - c * chunk_length;
+        ok = io_write(io, fd, (unsigned char *)rec_database->kv_record_tbl + c * chunk_length, length, at, -1);
+        at += run * chunk_length;
+        c += run;
+    }
+    at = h->page_offset;
+    for(int i = 0; ok && i < rec_database->ptbl_record_count; i++) {
+        unsigned long pages = _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL));
+        for(unsigned long page = 0; ok && page < pages; ) {
+            if(!_PERSIST_DIRTY(_PTBL.page_dirty, _PTBL.page_dirty_length, page)) {
+                page++;
+                continue;
+            }
+            unsigned long run = 1;
+            while(page + run < pages && _PERSIST_DIRTY(_PTBL.page_dirty, _PTBL.page_dirty_length, page + run)) run++;
+            // Few of a bucket's pages are written, so pinning all of them with io_register() wouldn't pay
+            ok = io_write(io, fd, _PTBL.m_offset + page * page_size, run * page_size, at, -1);
+            at += run * page_size;
+            page += run;
+        }
+    }
+    ok = ok && io_fsync(io, fd, 0);
+    ok = io_wait(io) && ok;
+    io_free(io);
+    if(close(fd) != 0) ok = 0;
+
+    if(!ok || !_persist_rename(tmp_path, path)) {
+        DEBUG_PRINT("\tERR failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        memory_free(manifest);
+        memory_free(tmp_path);
+        return 0;
+    }
+
+    DEBUG_PRINT("\twrote %lu chunks and %lu pages, %lu bytes\n", kv_chunk_count, dirty_pages, h->file_length);
+
+    memory_free(manifest);
+    memory_free(tmp_path);
+
+    database_dirty_reset(ctx_main, rec_database);
+
+    return 1;
+}
+
+int
+database_checkpoint_apply(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path,
+    unsigned long sequence
+) {
+    DEBUG_PRINT("database_checkpoint_apply(path = %s, sequence = %lu);\n", path, sequence);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    Persist_delta h;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !_persist_read(fd, (unsigned char *)&h, sizeof(h), 0)) {
+        close(fd);
+        return 0;
+    }
+    unsigned long page_size = ctx_main->system_page_size,
+                  chunk_length = DATABASE_KV_DIRTY_CHUNK * sizeof(Record_kv),
+                  chunks = (h.kv_record_count + DATABASE_KV_DIRTY_CHUNK - 1) / DATABASE_KV_DIRTY_CHUNK;
+    if(memcmp(h.magic, PERSIST_DELTA_MAGIC, sizeof(h.magic)) != 0
+        || h.version != PERSIST_VERSION
+        || h.byte_order != PERSIST_BYTE_ORDER
+        || h.page_size != page_size
+        || !sequence || h.sequence != sequence
+        || h.file_length != st.st_size
+        || h.ptbl_record_count > 64
+        || chunks * DATABASE_KV_DIRTY_CHUNK > INT_MAX / sizeof(Record_kv)
+        || (h.kv_record_count && !h.ptbl_record_count)
+        || h.kv_record_free_count > h.kv_record_count
+        || h.kv_chunk_count > chunks
+        || h.kv_offset < sizeof(h) + h.ptbl_record_count * sizeof(Persist_delta_ptbl) + h.kv_chunk_count * sizeof(unsigned int)
+        || h.page_offset < h.kv_offset + h.kv_chunk_count * chunk_length
+        || h.page_offset > h.file_length
+        || (h.file_length - h.page_offset) % page_size) {
+        DEBUG_PRINT("\tERR %s isn't checkpoint %lu, or this build can't apply it\n", path, sequence);
+        close(fd);
+        return 0;
+    }
+
+    unsigned char *manifest = memory_alloc(h.kv_offset);
+    if(!manifest || !_persist_read(fd, manifest, h.kv_offset, 0)) {
+        memory_free(manifest);
+        close(fd);
+        return 0;
+    }
+    Persist_delta_ptbl *p = (Persist_delta_ptbl *)(manifest + sizeof(Persist_delta));
+    unsigned char *kv_index = (unsigned char *)(p + h.ptbl_record_count),
+                  *page_usage[64], *page_index[64];
+    unsigned int index, last;
+
+    // Check the whole manifest before changing anything
+    int ok = 1;
+    for(unsigned long j = 0; ok && j < h.kv_chunk_count; j++) {
+        memcpy(&index, kv_index + j * sizeof(index), sizeof(index));
+        ok = (index < chunks && (j == 0 || index > last));
+        last = index;
+    }
+    unsigned char *cursor = kv_index + h.kv_chunk_count * sizeof(unsigned int);
+    unsigned long seen[64] = { 0 }, bucket_pages[64] = { 0 }, known = 0, dirty_pages = 0;
+    for(int i = 0; ok && i < h.ptbl_record_count; i++) {
+        int bucket = PTBL_RECORD_GET_KEY(p[i]),
+            page_count = PTBL_RECORD_GET_PAGE_COUNT(p[i]);
+        unsigned long pages = _PERSIST_BUCKET_PAGES(bucket, page_count);
+        char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+        page_usage[i] = cursor;
+        page_index[i] = cursor + p[i].page_usage_length;
+        cursor = page_index[i] + p[i].dirty_page_count * sizeof(unsigned int);
+        if(bucket >= 64 || seen[bucket] || !page_count
+            || p[i].page_usage_length != PTBL_CALC_PAGE_USAGE_LENGTH(bucket, page_count)
+            || p[i].dirty_page_count > pages
+            || cursor > manifest + h.kv_offset
+            // Buckets never shrink
+            || (ptbl_index != -1 && PTBL_RECORD_GET_PAGE_COUNT(rec_database->ptbl_record_tbl[ptbl_index]) > page_count)) {
+            ok = 0;
+            break;
+        }
+        seen[bucket] = 1;
+        bucket_pages[bucket] = pages;
+        known += (ptbl_index != -1);
+        dirty_pages += p[i].dirty_page_count;
+        for(unsigned long j = 0; ok && j < p[i].dirty_page_count; j++) {
+            memcpy(&index, page_index[i] + j * sizeof(index), sizeof(index));
+            ok = (index < pages && (j == 0 || index > last));
+            last = index;
+        }
+    }
+    if(!ok || known != rec_database->ptbl_record_count || h.page_offset + dirty_pages * page_size != h.file_length) {
+        DEBUG_PRINT("\tERR %s doesn't fit the database\n", path);
+        memory_free(manifest);
+        close(fd);
+        return 0;
+    }
+
+    // The chunks are read in whole, as every live record they leave in kv_record_tbl has to point
+    // inside a bucket, as after database_load(), and that's checked before anything is changed
+    unsigned long kv_length = h.kv_record_count * sizeof(Record_kv);
+    unsigned char *kv_chunks = h.kv_chunk_count ? memory_alloc(h.kv_chunk_count * chunk_length) : 0;
+    if(h.kv_chunk_count && (!kv_chunks || !_persist_read(fd, kv_chunks, h.kv_chunk_count * chunk_length, h.kv_offset))) {
+        memory_free(kv_chunks);
+        memory_free(manifest);
+        close(fd);
+        return 0;
+    }
+    for(unsigned long k = 0, j = 0; ok && k < h.kv_record_count; k++) {
+        unsigned long c = k / DATABASE_KV_DIRTY_CHUNK;
+        if(j < h.kv_chunk_count) {
+            memcpy(&index, kv_index + j * sizeof(index), sizeof(index));
+            if(index < c && ++j < h.kv_chunk_count) {
+                memcpy(&index, kv_index + j * sizeof(index), sizeof(index));
+            }
+        }
+        Record_kv *kv;
+        if(j < h.kv_chunk_count && index == c) {
+            kv = (Record_kv *)(kv_chunks + j * chunk_length) + (k - c * DATABASE_KV_DIRTY_CHUNK);
+        }
+        else if(k < rec_database->kv_record_count) {
+            kv = &rec_database->kv_record_tbl[k];
+        }
+        else {
+            // Grown into, and zeroed
+            continue;
+        }
+        if(!KV_RECORD_GET_SIZE(kv[0])) {
+            continue;
+        }
+        int bucket = KV_RECORD_GET_BUCKET(kv[0]);
+        if(KV_RECORD_GET_INDEX(kv[0]) >= bucket_pages[bucket] * page_size / PTBL_CALC_BUCKET_WORD_SIZE(bucket)) {
+            DEBUG_PRINT("\tERR kv record %lu is corrupt\n", k);
+            ok = 0;
+        }
+    }
+    if(!ok) {
+        memory_free(kv_chunks);
+        memory_free(manifest);
+        close(fd);
+        return 0;
+    }
+
+    // kv_record_tbl, then buckets, then whatever was written to either, so that running out of
+    // memory for the table leaves the database as it was
+    if(h.kv_record_count != rec_database->kv_record_count) {
+        if(!h.kv_record_count) {
+            memory_free(rec_database->kv_record_tbl);
+            rec_database->kv_record_tbl = 0;
+        }
+        else {
+            Record_kv *new_kv_tbl = (Record_kv *)memory_realloc(rec_database->kv_record_tbl, rec_database->kv_record_count * sizeof(Record_kv), kv_length);
+            ok = (new_kv_tbl != 0);
+            if(ok) rec_database->kv_record_tbl = new_kv_tbl;
+        }
+        if(ok) rec_database->kv_record_count = h.kv_record_count;
+    }
+
+    unsigned long at = h.page_offset;
+    for(int i = 0; ok && i < h.ptbl_record_count; i++) {
+        int bucket = PTBL_RECORD_GET_KEY(p[i]),
+            page_count = PTBL_RECORD_GET_PAGE_COUNT(p[i]);
+        char ptbl_index = database_ptbl_get(ctx_main, rec_database, bucket);
+        if(ptbl_index == -1) {
+            ok = (database_ptbl_alloc(ctx_main, rec_database, &ptbl_index, page_count, bucket) != 0);
+        }
+        else if(PTBL_RECORD_GET_PAGE_COUNT(rec_database->ptbl_record_tbl[ptbl_index]) < page_count) {
+            ok = database_ptbl_grow(ctx_main, rec_database, ptbl_index, page_count);
+        }
+        if(!ok) {
+            break;
+        }
+
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[ptbl_index]
+
+        memcpy(_PTBL.page_usage, page_usage[i], p[i].page_usage_length);
+        for(unsigned long j = 0; ok && j < p[i].dirty_page_count; ) {
+            unsigned int run = 1;
+            memcpy(&index, page_index[i] + j * sizeof(index), sizeof(index));
+            while(j + run < p[i].dirty_page_count) {
+                memcpy(&last, page_index[i] + (j + run) * sizeof(last), sizeof(last));
+                if(last != index + run) break;
+                run++;
+            }
+            ok = _persist_read(fd, _PTBL.m_offset + (unsigned long)index * page_size, run * page_size, at);
+            at += run * page_size;
+            j += run;
+        }
+    }
+
+    if(ok) {
+        rec_database->kv_record_free_count = h.kv_record_free_count;
+        for(unsigned long j = 0; j < h.kv_chunk_count; j++) {
+            memcpy(&index, kv_index + j * sizeof(index), sizeof(index));
+            unsigned long length = chunk_length;
+            if(index * chunk_length + length > kv_length) length = kv_length - index * chunk_length;
+            memcpy((unsigned char *)rec_database->kv_record_tbl + index * chunk_length, kv_chunks + j * chunk_length, length);
+        }
+    }
+
+    memory_free(kv_chunks);
+    memory_free(manifest);
+    close(fd);
+    if(!ok) {
+        return 0;
+    }
+
+    database_dirty_reset(ctx_main, rec_database);
+
+    return 1;
+}
+
+#undef _PTBL
+#define _PTBL rec_database->ptbl_record_tbl[i]
+
+typedef struct persist_prefetch {
+    unsigned long count;
+    struct {
+        unsigned char *region;
+        unsigned long length;
+        double density;   // Live values per page
+    } bucket[64];
+} Persist_prefetch;
+
+// Hints every bucket in turn, a chunk at a time, so that the hottest one is read in first
+static void *
+_persist_prefetch_thread(
+    void *arg
+) {
+    Persist_prefetch *prefetch = (Persist_prefetch *)arg;
+
+    for(unsigned long i = 0; i < prefetch->count; i++) {
+        for(unsigned long done = 0; done < prefetch->bucket[i].length; done += PERSIST_CHUNK) {
+            unsigned long length = prefetch->bucket[i].length - done;
+            // A bucket that has since grown or been freed was moved, and hinting its old address is harmless
+            madvise(prefetch->bucket[i].region + done, (length > PERSIST_CHUNK) ? PERSIST_CHUNK : length, MADV_WILLNEED);
+        }
+    }
+
+    memory_free(prefetch);
+
+    return 0;
+}
+
+int
+database_map_prefetch(
+    Context_main *ctx_main,
+    Record_database *rec_database
+) {
+    DEBUG_PRINT("database_map_prefetch();\n");
+
+    RECORD_CREATE(Persist_prefetch, prefetch);
+    if(!prefetch) {
+        return 0;
+    }
+
+    unsigned long live[64] = { 0 };
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        if(KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) {
+            live[KV_RECORD_GET_BUCKET(rec_database->kv_record_tbl[k])]++;
+        }
+    }
+
+    // Densest bucket first, as that's where a page read serves the most values
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        unsigned long pages = _PERSIST_BUCKET_PAGES(PTBL_RECORD_GET_KEY(_PTBL), PTBL_RECORD_GET_PAGE_COUNT(_PTBL));
+        double density = (double)live[PTBL_RECORD_GET_KEY(_PTBL)] / pages;
+        unsigned long j = prefetch->count++;
+        for(; j > 0 && prefetch->bucket[j - 1].density < density; j--) {
+            prefetch->bucket[j] = prefetch->bucket[j - 1];
+        }
+        prefetch->bucket[j].region = _PTBL.m_offset;
+        prefetch->bucket[j].length = pages * ctx_main->system_page_size;
+        prefetch->bucket[j].density = density;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, 0, _persist_prefetch_thread, prefetch)) {
+        DEBUG_PRINT("\tERR failed to start prefetch thread\n");
+        memory_free(prefetch);
+        return 0;
+    }
+    pthread_detach(thread);
+
+    return 1;
+}
+
+// What a database_bgsave() child writes to its pipe before exiting
+typedef struct persist_report {
+    int ok;
+    double seconds;
+    unsigned long cow_bytes;
+} Persist_report;
+
+// Returns the calling process's private dirty memory in bytes, or 0 if it can't be read
+static unsigned long
+_persist_private_dirty(void) {
+    unsigned long kb = 0;
+    char line[128];
+
+    FILE *smaps = fopen("/proc/self/smaps_rollup", "r");
+    if(!smaps) {
+        return 0;
+    }
+    while(fgets(line, sizeof(line), smaps)) {
+        if(sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(smaps);
+
+    return kb << 10;
+}
+
+int
+database_bgsave(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path,
+    Persist_bgsave *bgsave
+) {
+    DEBUG_PRINT("database_bgsave(path = %s);\n", path);
+
+    int fds[2];
+    if(pipe(fds) != 0) {
+        DEBUG_PRINT("\tERR failed to create pipe: %s\n", strerror(errno));
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        DEBUG_PRINT("\tERR failed to fork: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if(pid == 0) {
+        // Right after the fork every page is shared, so whatever becomes private from here on is
+        // either the child's own, which is little, or a page the parent wrote to and had copied
+        struct timespec start, end;
+        close(fds[0]);
+        unsigned long dirty = _persist_private_dirty();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        Persist_report report = { 0 };
+        report.ok = _persist_save(ctx_main, rec_database, path, 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        report.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        unsigned long now = _persist_private_dirty();
+        report.cow_bytes = (now > dirty) ? now - dirty : 0;
+
+        ssize_t written = write(fds[1], &report, sizeof(report));
+        _exit((report.ok && written == sizeof(report)) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    memset(bgsave, 0, sizeof(Persist_bgsave));
+    bgsave->pid = pid;
+    bgsave->pipe = fds[0];
+
+    return 1;
+}
+
+int
+database_bgsave_wait(
+    Context_main *ctx_main,
+    Persist_bgsave *bgsave,
+    int block
+) {
+    DEBUG_PRINT("database_bgsave_wait(pid = %d, block = %d);\n", bgsave->pid, block);
+
+    if(!bgsave->pid) {
+        return 0;
+    }
+
+    int status;
+    pid_t pid;
+    do {
+        pid = waitpid(bgsave->pid, &status, block ? 0 : WNOHANG);
+    } while(pid < 0 && errno == EINTR);
+    if(pid == 0) {
+        return -1;
+    }
+
+    Persist_report report = { 0 };
+    int ok = (pid == bgsave->pid && WIFEXITED(status) && WEXITSTATUS(status) == 0
+           && read(bgsave->pipe, &report, sizeof(report)) == sizeof(report) && report.ok);
+    close(bgsave->pipe);
+    bgsave->pid = 0;
+    bgsave->seconds = report.seconds;
+    bgsave->cow_bytes = report.cow_bytes;
+
+    DEBUG_PRINT("\tok = %d, %.3fs, %lu bytes copied\n", ok, report.seconds, report.cow_bytes);
+
+    return ok;
+}
@@ -0,0 +1,234 @@
+/** @file  persist.h
+ *  @brief Saving a Record_database to a snapshot file, and loading it back
+ */
+
+/** @brief The first eight bytes of every snapshot file */
+#define PERSIST_MAGIC "BKEYSNAP"
+
+/** @brief Version of the snapshot format written by database_save(). Files of any other version are rejected. */
+#define PERSIST_VERSION 1
+
+/** @brief Written as a 32-bit integer in the header, so that a file from a machine of the other byte order is rejected */
+#define PERSIST_BYTE_ORDER 0x01020304
+
+/** @brief Largest single read() made while loading a snapshot, and largest madvise() made while prefetching one */
+#define PERSIST_CHUNK (8 << 20)
+
+/** @brief The header at the start of a snapshot file
+ *
+ * A snapshot is laid out as follows, in the byte order of the machine that wrote it:
+ *
+ * | Offset                                | Contents                                          |
+ * | ------------------------------------- | ------------------------------------------------- |
+ * | 0                                     | persist_header                                    |
+ * | sizeof(persist_header)                | one persist_ptbl per bucket (ptbl_record_count)   |
+ * | \a kv_offset (page-aligned)           | kv_record_tbl, \a kv_record_count records         |
+ * | after kv_record_tbl                   | every bucket's page_usage, back to back           |
+ * | PTBL_RECORD_GET_OFFSET() of a bucket  | the bucket's pages, in units of \a page_size      |
+ *
+ * Every bucket's pages start on a page boundary, at the page number kept in the \a offset of its
+ * ptbl_record, so they can be read (or mapped) straight into place.
+ */
+typedef struct persist_header {
+    char magic[8];                      ///< PERSIST_MAGIC
+    unsigned int version;               ///< PERSIST_VERSION
+    unsigned int byte_order;            ///< PERSIST_BYTE_ORDER
+    unsigned long page_size;            ///< Page size of the machine that wrote the file, which pages are counted in
+    unsigned long ptbl_record_count;    ///< Number of persist_ptbl after the header
+    unsigned long kv_record_count;      ///< Number of records in kv_record_tbl
+    unsigned long kv_record_free_count; ///< Number of freed records in kv_record_tbl
+    unsigned long kv_offset;            ///< Byte offset of kv_record_tbl
+    unsigned long file_length;          ///< Length of the whole file in bytes, to catch truncated files
+} Persist_header;
+
+/** @brief A ptbl_record as stored in a snapshot */
+typedef struct persist_ptbl {
+    unsigned int key_high_and_page_count; ///< As in ptbl_record
+    unsigned int key_low_and_offset;      ///< As in ptbl_record, with \a offset being the page the bucket's pages start at
+    unsigned int page_usage_length;       ///< Length of page_usage in bytes
+    unsigned int reserved;
+    unsigned long page_usage_offset;      ///< Byte offset of page_usage
+} Persist_ptbl;
+
+/** @brief Writes \a rec_database to a snapshot at \a path
+ *
+ * The snapshot is written to a temporary file next to \a path, synced, and then renamed over
+ * \a path, so an existing snapshot is only ever replaced by a complete one.
+ *
+ * @returns 1 on success, 0 on failure
+ * @see     database_load()
+ */
+int
+database_save(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path               ///<[in] file to write
+    );
+
+/** @brief Reads the snapshot at \a path into \a rec_database, which must be empty
+ *  @returns 1 on success, 0 on failure, in which case \a rec_database is left empty
+ *  @see     database_save()
+ *  @see     database_map()
+ */
+int
+database_load(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path               ///<[in] file to read
+    );
+
+/** @brief Opens the snapshot at \a path in \a rec_database, which must be empty, without reading the values
+ *
+ * Only the tables are read. Every bucket's pages are mapped copy-on-write from the file with
+ * memory_page_map(), and read in from the page cache or the disk as they are first touched, so the
+ * database is usable in about the time it takes to read kv_record_tbl.
+ *
+ * Every ptbl_record keeps the \a offset its pages have in the file, which marks them as mapped.
+ * The database is otherwise an ordinary one: changes to it never reach the file, and a bucket that
+ * grows is copied into anonymous memory, and its \a offset cleared. The snapshot must not be changed in place while mapped,
+ * which database_save() never does.
+ *
+ * @returns 1 on success, 0 on failure, in which case \a rec_database is left empty
+ * @see     database_map_prefetch()
+ */
+int
+database_map(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path               ///<[in] file to map
+    );
+
+/** @brief Starts reading every bucket of a database_map()'d database in, in the background
+ *
+ * A detached thread asks for each bucket with madvise(MADV_WILLNEED), the bucket with the most live
+ * values per page first. It only ever gives hints, so the database may be used, changed and freed
+ * while it runs.
+ *
+ * @returns 1 if the thread was started, 0 on failure
+ */
+int
+database_map_prefetch(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database  ///<[in] database record
+    );
+
+/** @brief A snapshot being written in the background by database_bgsave() */
+typedef struct persist_bgsave {
+    int pid;                 ///< Process writing the snapshot, or 0 once it has been waited for
+    int pipe;                ///< Read end of the pipe it reports back on
+    double seconds;          ///< How long writing the snapshot took, once it's done
+    unsigned long cow_bytes; ///< Memory that writes made meanwhile had copied, once it's done
+} Persist_bgsave;
+
+/** @brief Starts writing \a rec_database to a snapshot at \a path in a fork()ed process
+ *
+ * The child writes with database_save() from its copy-on-write view of memory, so it sees the
+ * database exactly as it was when this was called, and the caller can carry on changing it straight
+ * away. Every page the caller writes to while the child runs is copied once by the kernel, which
+ * database_bgsave_wait() reports as \a cow_bytes, so at worst the database takes twice its memory.
+ *
+ * No other thread may be changing \a rec_database while this is called.
+ *
+ * @returns 1 if the child was started, 0 on failure
+ * @see     database_bgsave_wait()
+ */
+int
+database_bgsave(
+    Context_main *ctx_main,        ///<[in]  main context
+    Record_database *rec_database, ///<[in]  database record
+    const char *path,              ///<[in]  file to write
+    Persist_bgsave *bgsave         ///<[out] where to keep track of the child
+    );
+
+/** @brief Waits for a database_bgsave() to finish, filling in \a seconds and \a cow_bytes
+ *  @returns 1 if the snapshot was written, 0 if it wasn't, or -1 if it's still being written and
+ *           \a block isn't set
+ */
+int
+database_bgsave_wait(
+    Context_main *ctx_main, ///<[in] main context
+    Persist_bgsave *bgsave, ///<[in] the snapshot being written
+    int block               ///<[in] wait for it to finish if set, otherwise only check
+    );
+
+/** @brief The first eight bytes of every incremental checkpoint file */
+#define PERSIST_DELTA_MAGIC "BKEYDELT"
+
+/** @brief The header at the start of an incremental checkpoint written by database_checkpoint()
+ *
+ * A checkpoint holds everything that changed since the one before it, laid out as follows:
+ *
+ * | Offset                         | Contents                                                        |
+ * | ------------------------------ | --------------------------------------------------------------- |
+ * | 0                              | persist_delta                                                   |
+ * | sizeof(persist_delta)          | one persist_delta_ptbl per bucket (ptbl_record_count)           |
+ * | after those                    | the index of every chunk of kv_record_tbl written (32 bits each) |
+ * | after those                    | per bucket: its whole page_usage, then the index of every page written (32 bits each) |
+ * | \a kv_offset (page-aligned)    | the chunks of kv_record_tbl, DATABASE_KV_DIRTY_CHUNK records each |
+ * | \a page_offset (page-aligned)  | the pages written, bucket by bucket, in units of \a page_size   |
+ *
+ * Everything up to \a kv_offset is the manifest.
+ */
+typedef struct persist_delta {
+    char magic[8];                      ///< PERSIST_DELTA_MAGIC
+    unsigned int version;               ///< PERSIST_VERSION
+    unsigned int byte_order;            ///< PERSIST_BYTE_ORDER
+    unsigned long page_size;            ///< Page size of the machine that wrote the file
+    unsigned long sequence;             ///< Position in the chain of checkpoints, from 1
+    unsigned long ptbl_record_count;    ///< Number of persist_delta_ptbl after the header
+    unsigned long kv_record_count;      ///< Number of records in kv_record_tbl
+    unsigned long kv_record_free_count; ///< Number of freed records in kv_record_tbl
+    unsigned long kv_chunk_count;       ///< Number of chunks of kv_record_tbl written
+    unsigned long kv_offset;            ///< Byte offset of the chunks of kv_record_tbl
+    unsigned long page_offset;          ///< Byte offset of the pages
+    unsigned long file_length;          ///< Length of the whole file in bytes, to catch truncated files
+} Persist_delta;
+
+/** @brief A ptbl_record as stored in an incremental checkpoint */
+typedef struct persist_delta_ptbl {
+    unsigned int key_high_and_page_count; ///< As in ptbl_record
+    unsigned int key_low_and_offset;      ///< As in ptbl_record, with an \a offset of 0
+    unsigned int page_usage_length;       ///< Length of page_usage in bytes
+    unsigned int dirty_page_count;        ///< Number of pages of the bucket written
+} Persist_delta_ptbl;
+
+/** @brief Writes a checkpoint of \a rec_database to \a path, and starts tracking changes anew
+ *
+ * A \a sequence of 0 writes a full snapshot with database_save(). Any other \a sequence writes an
+ * incremental checkpoint of only the pages and chunks of kv_record_tbl marked by
+ * database_dirty_mark() since the last checkpoint, along with every bucket's page_usage. Checkpoints
+ * are numbered 1, 2, ... after the snapshot they build on. Changes made before the first
+ * checkpoint, or to a database that wasn't database_load()ed or database_map()ped, are all written,
+ * as nothing tracked them.
+ *
+ * No other thread may be changing \a rec_database while this is called.
+ *
+ * @returns 1 on success, 0 on failure, in which case the changes are kept for the next checkpoint
+ * @see     database_checkpoint_apply()
+ */
+int
+database_checkpoint(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path,              ///<[in] file to write
+    unsigned long sequence         ///<[in] 0 for a full snapshot, otherwise the checkpoint's place in the chain
+    );
+
+/** @brief Applies the incremental checkpoint at \a path to \a rec_database
+ *
+ * Restoring is database_load() or database_map() of the snapshot, then applying checkpoints 1, 2,
+ * ... in order. A checkpoint whose \a sequence isn't the one asked for, whose buckets don't match
+ * \a rec_database, or that would leave a kv record pointing outside its bucket, is rejected before
+ * anything is changed. Change tracking starts anew afterwards, so the restored database can carry
+ * on the chain.
+ *
+ * @returns 1 on success, 0 on failure. If growing a bucket or reading its pages fails partway
+ *          through, \a rec_database is left half-applied and should be freed.
+ */
+int
+database_checkpoint_apply(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path,              ///<[in] file to read
+    unsigned long sequence         ///<[in] the checkpoint's expected place in the chain
+    );
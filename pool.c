@@ -0,0 +1,275 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "context.h"
+#include "memory.h"
+#include "pool.h"
+
+#ifndef DEBUG_POOL
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+#define POOL_DEQUE_INITIAL_CAPACITY 64
+
+typedef struct pool_task {
+    pool_task_fn fn;
+    void *arg;
+} Pool_task;
+
+// A worker and its deque. Tasks live in tasks[head .. tail) modulo capacity, the owner
+// works from the tail (bottom) and thieves take from the head (top).
+typedef struct pool_worker {
+    pthread_mutex_t lock;
+    Pool_task *tasks;
+    unsigned long capacity;
+    unsigned long head;
+    unsigned long tail;
+    pthread_t thread;
+    int index;
+    struct pool_context *pool;
+} Pool_worker;
+
+struct pool_context {
+    int thread_count;
+    Pool_worker *workers;
+
+    pthread_mutex_t lock;    // Guards sleeping, waking and shutdown
+    pthread_cond_t work;     // Signalled when tasks are queued or the pool shuts down
+    pthread_cond_t idle;     // Signalled when pending drops to 0
+
+    atomic_long queued;      // Tasks sitting in deques
+    atomic_long pending;     // Tasks submitted but not yet finished
+    atomic_ulong next;       // Round-robin cursor for pool_submit()
+    int shutdown;
+};
+
+static int
+_pool_deque_push(
+    Pool_worker *worker,
+    Pool_task task
+) {
+    pthread_mutex_lock(&worker->lock);
+
+    if(worker->tail - worker->head == worker->capacity) {
+        unsigned long new_capacity = worker->capacity ? worker->capacity * 2 : POOL_DEQUE_INITIAL_CAPACITY;
+        Pool_task *new_tasks = (Pool_task *)memory_alloc(new_capacity * sizeof(Pool_task));
+        if(!new_tasks) {
+            pthread_mutex_unlock(&worker->lock);
+            return 0;
+        }
+        for(unsigned long i = worker->head; i < worker->tail; i++) {
+            new_tasks[i - worker->head] = worker->tasks[i % worker->capacity];
+        }
+        if(worker->tasks) memory_free(worker->tasks);
+        worker->tasks = new_tasks;
+        worker->tail -= worker->head;
+        worker->head = 0;
+        worker->capacity = new_capacity;
+    }
+
+    worker->tasks[worker->tail++ % worker->capacity] = task;
+
+    pthread_mutex_unlock(&worker->lock);
+    return 1;
+}
+
+static int
+_pool_deque_pop(
+    Pool_worker *worker,
+    Pool_task *task,
+    int steal
+) {
+    int found = 0;
+    pthread_mutex_lock(&worker->lock);
+    if(worker->tail > worker->head) {
+        task[0] = steal ?
+            worker->tasks[worker->head++ % worker->capacity] :
+            worker->tasks[--worker->tail % worker->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+static int
+_pool_take(
+    Pool_worker *worker,
+    Pool_task *task
+) {
+    struct pool_context *pool = worker->pool;
+
+    if(_pool_deque_pop(worker, task, 0)) {
+        return 1;
+    }
+
+    for(int i = 1; i < pool->thread_count; i++) {
+        if(_pool_deque_pop(&pool->workers[(worker->index + i) % pool->thread_count], task, 1)) {
+            DEBUG_PRINT("pool: worker %d stole from %d\n", worker->index, (worker->index + i) % pool->thread_count);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void *
+_pool_worker_main(
+    void *arg
+) {
+    Pool_worker *worker = (Pool_worker *)arg;
+    struct pool_context *pool = worker->pool;
+    Pool_task task;
+
+    while(1) {
+        if(_pool_take(worker, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+
+            task.fn(task.arg, worker->index);
+
+            if(atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->lock);
+                pthread_cond_broadcast(&pool->idle);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while(atomic_load(&pool->queued) <= 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        int done = pool->shutdown && atomic_load(&pool->queued) <= 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(done) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+Context_pool *
+pool_create(
+    Context_main *ctx_main,
+    int thread_count
+) {
+    if(thread_count <= 0) {
+        thread_count = (ctx_main->system_cpu_count > 0) ? ctx_main->system_cpu_count : 1;
+    }
+
+    DEBUG_PRINT("pool_create(thread_count = %d);\n", thread_count);
+
+    struct pool_context *pool = (struct pool_context *)memory_alloc(sizeof(struct pool_context));
+    if(!pool) {
+        return 0;
+    }
+
+    pool->workers = (Pool_worker *)memory_alloc(thread_count * sizeof(Pool_worker));
+    if(!pool->workers) {
+        memory_free(pool);
+        return 0;
+    }
+
+    pthread_mutex_init(&pool->lock, 0);
+    pthread_cond_init(&pool->work, 0);
+    pthread_cond_init(&pool->idle, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next, 0);
+
+    for(int i = 0; i < thread_count; i++) {
+        pthread_mutex_init(&pool->workers[i].lock, 0);
+        pool->workers[i].index = i;
+        pool->workers[i].pool = pool;
+    }
+
+    for(int i = 0; i < thread_count; i++) {
+        if(pthread_create(&pool->workers[i].thread, 0, _pool_worker_main, &pool->workers[i])) {
+            DEBUG_PRINT("\tERR failed to start worker %d\n", i);
+            pool->thread_count = i;
+            pool_free(pool);
+            return 0;
+        }
+        pool->thread_count = i + 1;
+    }
+
+    return pool;
+}
+
+int
+pool_submit(
+    Context_pool *pool,
+    pool_task_fn fn,
+    void *arg
+) {
+    Pool_task task = { fn, arg };
+    int worker = atomic_fetch_add(&pool->next, 1) % pool->thread_count;
+
+    atomic_fetch_add(&pool->pending, 1);
+    if(!_pool_deque_push(&pool->workers[worker], task)) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return 0;
+    }
+
+    // queued must be bumped before taking the lock so that a worker checking it under the
+    // lock can't miss this task and go to sleep
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 1;
+}
+
+void
+pool_wait(
+    Context_pool *pool
+) {
+    pthread_mutex_lock(&pool->lock);
+    while(atomic_load(&pool->pending) > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int
+pool_thread_count(
+    Context_pool *pool
+) {
+    return pool->thread_count;
+}
+
+void
+pool_free(
+    Context_pool *pool
+) {
+    DEBUG_PRINT("pool_free();\n");
+
+    pool_wait(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->workers[i].thread, 0);
+    }
+
+    for(int i = 0; i < pool->thread_count; i++) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        if(pool->workers[i].tasks) memory_free(pool->workers[i].tasks);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+
+    memory_free(pool->workers);
+    memory_free(pool);
+}
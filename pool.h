@@ -0,0 +1,58 @@
+/** @file  pool.h
+ *  @brief A work-stealing thread pool
+ */
+
+/** @brief A pool of worker threads, each of which owns a deque of tasks
+ *
+ * Workers pop tasks from the bottom of their own deque and, when it runs dry, steal from the top of
+ * the other workers' deques. Tasks submitted from outside the pool are spread over the deques
+ * round-robin.
+ */
+typedef struct pool_context Context_pool;
+
+/** @brief A task run by a worker of a Context_pool */
+typedef void (*pool_task_fn)(
+    void *arg, ///<[in] The argument the task was submitted with
+    int worker ///<[in] Index of the worker running the task, \f$0 \leq worker < pool\_thread\_count()\f$
+    );
+
+/** @brief Starts a pool with \a thread_count workers
+ *
+ * If \a thread_count is <= 0, one worker is started for every core in main_context.system_cpu_count.
+ *
+ * @returns A pointer to the pool on success, or 0 on failure
+ * @see     pool_free()
+ */
+Context_pool *
+pool_create(
+    Context_main *ctx_main, ///<[in] main context
+    int thread_count        ///<[in] number of workers
+    );
+
+/** @brief   Queues \a fn to be run with \a arg by one of the workers of \a pool
+ *  @returns 1 on success, 0 on failure
+ */
+int
+pool_submit(
+    Context_pool *pool, ///<[in] pool
+    pool_task_fn fn,    ///<[in] task
+    void *arg           ///<[in] argument to pass to \a fn
+    );
+
+/** @brief Blocks until every task submitted to \a pool has finished running */
+void
+pool_wait(
+    Context_pool *pool ///<[in] pool
+    );
+
+/** @brief   Returns the number of workers in \a pool */
+int
+pool_thread_count(
+    Context_pool *pool ///<[in] pool
+    );
+
+/** @brief Waits for all tasks to finish, then stops the workers of \a pool and frees it */
+void
+pool_free(
+    Context_pool *pool ///<[in] pool
+    );
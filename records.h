@@ -12,7 +12,8 @@
  * The composed values are:
  * - \a key - bucket
  * - \a page_count - Number of pages currently allocated
- * - \a offset - (\b disk-only) An offset to the start of the page region
+ * - \a offset - The page that the page region starts at in a snapshot file (see persist.h). In memory,
+ *                it is only set while the region is still mapped from that file by database_map()
  */
 typedef struct ptbl_record {
     /** @brief Holds the uppermost three bits of \a key and all bits of \a page_count
@@ -56,6 +57,17 @@ typedef struct ptbl_record {
      *  @see   PTBL_RECORD_PAGE_USAGE_FREE()
      */
     unsigned char *page_usage;
+
+    /** @brief One bit per page of memory behind this ptbl_record, set when the page is written to
+     *
+     *  Only kept from the first database_dirty_reset() on. A page is clean only while its bit exists
+     *  and is 0, so a bucket without \a page_dirty, or pages it has grown by since, count as dirty.
+     *
+     *  @see database_dirty_mark()
+     *  @see database_checkpoint()
+     */
+    unsigned char *page_dirty;
+    unsigned int page_dirty_length; ///< The length of \a page_dirty in bytes
 } Record_ptbl;
 
 /** @brief Calculate bytes used by multiple pages bookkeeping
@@ -69,9 +81,9 @@ typedef struct ptbl_record {
  * @see       PTBL_CALC_PAGE_USAGE_BITS()
  * @see       ptbl_record
  */
-#define PTBL_CALC_PAGE_USAGE_LENGTH(x,y) ((x <= 5) ?\
-        (PTBL_CALC_PAGE_USAGE_BYTES(x) * y) :\
-        (((PTBL_CALC_PAGE_USAGE_BITS(x) * y) / 8) + (((PTBL_CALC_PAGE_USAGE_BITS(x) * y) % 8) > 0 ? 1 : 0)))
+#define PTBL_CALC_PAGE_USAGE_LENGTH(x,y) (((x) <= 5) ?\
+        (PTBL_CALC_PAGE_USAGE_BYTES(x) * (y)) :\
+        (((PTBL_CALC_PAGE_USAGE_BITS(x) * (y)) / 8) + (((PTBL_CALC_PAGE_USAGE_BITS(x) * (y)) % 8) > 0 ? 1 : 0)))
 
 /** @brief Calculate bytes used by one pages bookkeeping
  *
@@ -92,7 +104,7 @@ typedef struct ptbl_record {
  * @see       PTBL_CALC_PAGE_USAGE_BITS()
  * @see       ptbl_record
  */
-#define PTBL_CALC_PAGE_USAGE_BYTES(x) ((x < 5) ? (32 >> x) : 1)
+#define PTBL_CALC_PAGE_USAGE_BYTES(x) (((x) < 5) ? (32 >> (x)) : 1)
 
 /** @brief Calculate bits used by one page's bookkeeping
  *
@@ -113,7 +125,7 @@ typedef struct ptbl_record {
  * @see     PTBL_CALC_PAGE_USAGE_BYTES()
  * @see     ptbl_record
  */
-#define PTBL_CALC_PAGE_USAGE_BITS(x) ((x < 8) ? (256 >> x) : 1)
+#define PTBL_CALC_PAGE_USAGE_BITS(x) (((x) < 8) ? (256 >> (x)) : 1)
 
 /** @brief Calculate max value size for bucket \a x
  *
@@ -335,12 +347,40 @@ typedef struct kv_record {
     x.flags_and_size &= ~KV_RECORD_FLAGS_BITMASK; \
     x.flags_and_size |= ((unsigned long)(y & (KV_RECORD_FLAGS_BITMASK >> KV_RECORD_FLAGS_SHIFT)) << KV_RECORD_FLAGS_SHIFT);
 
+/** @brief Data types that may be stored in the \a flags of a kv_record
+ *
+ * Typed values are stored in native byte order at the very start of their value slot, which lets
+ * typed operations (see database_aggregate()) read them directly out of a bucket.
+ *
+ * @see KV_RECORD_GET_FLAGS()
+ * @see KV_RECORD_SET_FLAGS()
+ */
+enum kv_record_type {
+    KV_RECORD_TYPE_RAW    = 0x00, ///< Opaque bytes
+    KV_RECORD_TYPE_INT32  = 0x10, ///< Signed 32-bit integer
+    KV_RECORD_TYPE_INT64  = 0x11, ///< Signed 64-bit integer
+    KV_RECORD_TYPE_DOUBLE = 0x12  ///< IEEE-754 double
+};
+
 /** @brief Holds the global state of the database */
 typedef struct database_record {
     unsigned long int ptbl_record_count; ///< Total number of records in \a ptbl_record_tbl
     struct ptbl_record *ptbl_record_tbl; ///< All records for this database
     unsigned long int kv_record_count; ///< Total number of records in \a kv_record_tbl
     struct kv_record *kv_record_tbl; ///< All records for this database
+    unsigned long int kv_record_free_count; ///< Number of freed records in \a kv_record_tbl that can be reused
+
+    /** @brief One bit per DATABASE_KV_DIRTY_CHUNK records of \a kv_record_tbl, set when any of them
+     *         changes, kept like ptbl_record.page_dirty
+     *  @see   database_dirty_mark_kv()
+     */
+    unsigned char *kv_dirty;
+    unsigned long int kv_dirty_length; ///< The length of \a kv_dirty in bytes
+
+    /** @brief Feed every change to a record is published to, 0 unless one was started
+     *  @see   cdc_feed_create()
+     */
+    struct cdc_feed *cdc;
 } Record_database;
 
 /** @brief Helper to instantiate a new record type
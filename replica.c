@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "persist.h"
+#include "wal.h"
+#include "replica.h"
+
+#ifndef DEBUG_REPLICA
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+struct database_replica {
+    Context_main *ctx_main;
+    Record_database *rec_database;
+    int fd;
+    int stop_fd;               // Written to by database_replica_close() to wake the thread up
+    pthread_t thread;
+
+    pthread_rwlock_t rwlock;   // Readers share it, a batch being applied takes it
+
+    unsigned char *batch;      // The batch being read, from realloc() as it may hold more than an int's worth
+    size_t capacity;
+
+    pthread_mutex_t lock;      // Guards everything below
+    pthread_cond_t applied;    // Signalled after every batch, and once the log ends
+    Replica_stats stats;
+    int ended;
+    int failed;
+};
+
+static unsigned long
+_replica_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Reads length bytes, unless the log ends or the replica is closed first
+static int
+_replica_read(
+    Database_replica *replica,
+    unsigned char *buffer,
+    unsigned long length
+) {
+    struct pollfd fds[2] = { { replica->fd, POLLIN }, { replica->stop_fd, POLLIN } };
+
+    while(length > 0) {
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            return 0;
+        }
+        if(fds[1].revents) {
+            return 0;
+        }
+        ssize_t got = read(replica->fd, buffer, length);
+        if(got < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if(got <= 0) {
+            DEBUG_PRINT("\tlog ended\n");
+            return 0;
+        }
+        buffer += got;
+        length -= got;
+    }
+
+    return 1;
+}
+
+static void *
+_replica_thread(
+    void *arg
+) {
+    Database_replica *replica = (Database_replica *)arg;
+    Wal_header header;
+    Wal_frame frame;
+    int failed = 0;
+
+    if(!_replica_read(replica, (unsigned char *)&header, sizeof(header))) {
+        goto end;
+    }
+    if(memcmp(header.magic, WAL_MAGIC, sizeof(header.magic)) != 0
+        || header.version != WAL_VERSION
+        || header.byte_order != PERSIST_BYTE_ORDER) {
+        DEBUG_PRINT("\tERR not a log this build can read\n");
+        failed = 1;
+        goto end;
+    }
+
+    while(_replica_read(replica, (unsigned char *)&frame, sizeof(frame))) {
+        if(frame.length > REPLICA_BATCH_MAX) {
+            DEBUG_PRINT("\tERR batch of %lu bytes\n", frame.length);
+            failed = 1;
+            break;
+        }
+        if(frame.length > replica->capacity) {
+            size_t new_capacity = replica->capacity ? replica->capacity : WAL_BUFFER_INITIAL_CAPACITY;
+            while(new_capacity < frame.length) {
+                new_capacity *= 2;
+            }
+            unsigned char *new_batch = realloc(replica->batch, new_capacity);
+            if(!new_batch) {
+                failed = 1;
+                break;
+            }
+            replica->batch = new_batch;
+            replica->capacity = new_capacity;
+        }
+        if(!_replica_read(replica, replica->batch, frame.length)) {
+            break;
+        }
+
+        // A batch holds whole records only, so all of it has to apply
+        unsigned long end;
+        pthread_rwlock_wrlock(&replica->rwlock);
+        long count = database_wal_apply(replica->ctx_main, replica->rec_database, replica->batch, frame.length, &end);
+        pthread_rwlock_unlock(&replica->rwlock);
+        if(count == -1 || end != frame.length) {
+            DEBUG_PRINT("\tERR batch ending at LSN %lu didn't apply\n", frame.end);
+            failed = 1;
+            break;
+        }
+
+        double delay = (_replica_now_ns() - frame.shipped_ns) / 1e9;
+        pthread_mutex_lock(&replica->lock);
+        Replica_stats *stats = &replica->stats;
+        if(frame.end > stats->applied) stats->applied = frame.end;
+        if(frame.appended > stats->primary) stats->primary = frame.appended;
+        stats->lag = (stats->primary > stats->applied) ? stats->primary - stats->applied : 0;
+        stats->records += count;
+        stats->delay = delay;
+        if(stats->batches++ > 0 && delay > stats->delay_max) stats->delay_max = delay;
+        pthread_cond_broadcast(&replica->applied);
+        pthread_mutex_unlock(&replica->lock);
+    }
+
+end:
+    pthread_mutex_lock(&replica->lock);
+    replica->ended = 1;
+    replica->failed = failed;
+    pthread_cond_broadcast(&replica->applied);
+    pthread_mutex_unlock(&replica->lock);
+
+    return 0;
+}
+
+Database_replica *
+database_replica_open(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    int fd
+) {
+    DEBUG_PRINT("database_replica_open(fd = %d);\n", fd);
+
+    RECORD_CREATE(Database_replica, replica);
+    if(!replica) {
+        return 0;
+    }
+    replica->ctx_main = ctx_main;
+    replica->rec_database = rec_database;
+    replica->fd = fd;
+    replica->stop_fd = eventfd(0, EFD_CLOEXEC);
+    pthread_rwlock_init(&replica->rwlock, 0);
+    pthread_mutex_init(&replica->lock, 0);
+    pthread_cond_init(&replica->applied, 0);
+
+    if(replica->stop_fd < 0 || pthread_create(&replica->thread, 0, _replica_thread, replica) != 0) {
+        DEBUG_PRINT("\tERR failed to start the replica's thread\n");
+        if(replica->stop_fd >= 0) close(replica->stop_fd);
+        pthread_rwlock_destroy(&replica->rwlock);
+        pthread_mutex_destroy(&replica->lock);
+        pthread_cond_destroy(&replica->applied);
+        memory_free(replica);
+        return 0;
+    }
+
+    return replica;
+}
+
+int
+database_replica_close(
+    Database_replica *replica
+) {
+    DEBUG_PRINT("database_replica_close();\n");
+
+    unsigned long stop = 1;
+    if(write(replica->stop_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+        // Can't fail short of the counter overflowing
+    }
+    pthread_join(replica->thread, 0);
+
+    int ok = !replica->failed;
+    close(replica->fd);
+    close(replica->stop_fd);
+    pthread_rwlock_destroy(&replica->rwlock);
+    pthread_mutex_destroy(&replica->lock);
+    pthread_cond_destroy(&replica->applied);
+    free(replica->batch);
+    memory_free(replica);
+
+    return ok;
+}
+
+int
+database_replica_wait(
+    Database_replica *replica,
+    unsigned long lsn,
+    unsigned long timeout_ms
+) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if(until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&replica->lock);
+    // Nothing counts as applied before the first batch, which is the whole database
+    while((!replica->stats.batches || replica->stats.applied < lsn) && !replica->ended) {
+        if(pthread_cond_timedwait(&replica->applied, &replica->lock, &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int ok = replica->stats.batches && replica->stats.applied >= lsn;
+    pthread_mutex_unlock(&replica->lock);
+
+    return ok;
+}
+
+void
+database_replica_read_begin(
+    Database_replica *replica
+) {
+    pthread_rwlock_rdlock(&replica->rwlock);
+}
+
+void
+database_replica_read_end(
+    Database_replica *replica
+) {
+    pthread_rwlock_unlock(&replica->rwlock);
+}
+
+void
+database_replica_stats(
+    Database_replica *replica,
+    Replica_stats *stats
+) {
+    pthread_mutex_lock(&replica->lock);
+    stats[0] = replica->stats;
+    pthread_mutex_unlock(&replica->lock);
+}
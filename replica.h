@@ -0,0 +1,77 @@
+/** @file  replica.h
+ *  @brief A read replica: a Record_database kept up to date from the log a primary ships with database_wal_ship()
+ */
+
+/** @brief Most bytes of records a batch may hold, the first one included. A longer one is taken for a corrupt log. */
+#define REPLICA_BATCH_MAX (16UL << 30)
+
+/** @brief How far behind its primary a replica is */
+typedef struct replica_stats {
+    unsigned long applied;  ///< LSN just past the last record applied
+    unsigned long primary;  ///< LSN the primary's log had reached when it shipped the last batch applied
+    unsigned long lag;      ///< \a primary - \a applied: bytes of records written on the primary, as of the last batch, not yet applied here
+    unsigned long batches;  ///< Batches applied, the first being the whole database
+    unsigned long records;  ///< Records applied
+    double delay;           ///< Seconds from the last batch being shipped to it being applied
+    double delay_max;       ///< Most seconds any batch but the first took
+} Replica_stats;
+
+/** @brief A follower of a primary's Database_wal, applying every batch of records it ships
+ *
+ * A thread of the replica's own reads the batches and applies each of them whole, with the same
+ * code database_wal_replay() recovers with. Readers of the database see it between batches: they
+ * go through database_replica_read_begin() and database_replica_read_end(), which keep batches
+ * from being applied in between.
+ */
+typedef struct database_replica Database_replica;
+
+/** @brief Starts following the log shipped to \a fd, into \a rec_database, which should be empty
+ *
+ * \a fd belongs to the replica from then on.
+ *
+ * @returns A pointer to the replica on success, or 0 on failure
+ * @see     database_replica_close()
+ */
+Database_replica *
+database_replica_open(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    int fd                         ///<[in] pipe or socket the log is shipped to
+    );
+
+/** @brief Stops following the log, and frees \a replica. The database is left as it was.
+ *  @returns 1 if every batch received was applied, 0 if the log was corrupt or couldn't be applied
+ */
+int
+database_replica_close(
+    Database_replica *replica ///<[in] replica
+    );
+
+/** @brief   Waits for the records up to \a lsn to be applied, as from database_wal_lsn() on the primary
+ *  @returns 1 once they are, 0 if \a timeout_ms went by first, or the log ended
+ */
+int
+database_replica_wait(
+    Database_replica *replica, ///<[in] replica
+    unsigned long lsn,         ///<[in] LSN to wait for
+    unsigned long timeout_ms   ///<[in] how long to wait for, in milliseconds
+    );
+
+/** @brief Starts reading the database, which no batch is applied to until database_replica_read_end() */
+void
+database_replica_read_begin(
+    Database_replica *replica ///<[in] replica
+    );
+
+/** @brief Stops reading the database */
+void
+database_replica_read_end(
+    Database_replica *replica ///<[in] replica
+    );
+
+/** @brief Fills in \a stats */
+void
+database_replica_stats(
+    Database_replica *replica, ///<[in]  replica
+    Replica_stats *stats       ///<[out] how far behind the replica is
+    );
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "pool.h"
+#include "scan.h"
+
+#ifndef DEBUG_SCAN
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+// Bucket memory covered by one morsel
+#define SCAN_MORSEL_BYTES (256 * 1024)
+
+// kv_records covered by one morsel of the slot -> key pass
+#define SCAN_KV_MORSEL 65536
+
+#define SCAN_BUCKET_COUNT ((KV_RECORD_BUCKET_BITMASK >> KV_RECORD_BUCKET_SHIFT) + 1)
+
+typedef struct scan_bucket {
+    char ptbl_index;
+    unsigned long slot_count;
+    unsigned long *slot_key;
+} Scan_bucket;
+
+typedef struct scan_state {
+    Record_database *rec_database;
+    Database_scan *scan;
+    unsigned char *partials;
+    Scan_bucket buckets[SCAN_BUCKET_COUNT];
+} Scan_state;
+
+typedef struct scan_morsel {
+    Scan_state *state;
+    int bucket;
+    unsigned long begin;
+    unsigned long end;
+} Scan_morsel;
+
+static void
+_scan_index_task(
+    void *arg,
+    int worker
+) {
+    Scan_morsel *morsel = (Scan_morsel *)arg;
+    Record_database *rec_database = morsel->state->rec_database;
+
+    for(unsigned long k = morsel->begin; k < morsel->end; k++) {
+#define _REC_KV rec_database->kv_record_tbl[k]
+        if(!KV_RECORD_GET_SIZE(_REC_KV)) {
+            continue;
+        }
+        Scan_bucket *bucket = &morsel->state->buckets[KV_RECORD_GET_BUCKET(_REC_KV)];
+        unsigned long index = KV_RECORD_GET_INDEX(_REC_KV);
+        if(index < bucket->slot_count) {
+            // Every slot is owned by at most one key, so morsels never write the same entry
+            bucket->slot_key[index] = k + 1;
+        }
+#undef _REC_KV
+    }
+}
+
+static void
+_scan_value_task(
+    void *arg,
+    int worker
+) {
+    Scan_morsel *morsel = (Scan_morsel *)arg;
+    Scan_state *state = morsel->state;
+    Database_scan *scan = state->scan;
+    Record_database *rec_database = state->rec_database;
+    Scan_bucket *bucket = &state->buckets[morsel->bucket];
+    void *partial = state->partials + worker * scan->partial_size;
+
+#define _PTBL rec_database->ptbl_record_tbl[bucket->ptbl_index]
+
+    unsigned long stride = PTBL_CALC_BUCKET_WORD_SIZE(morsel->bucket);
+
+    for(unsigned long index = morsel->begin; index < morsel->end; index++) {
+        unsigned char usage = _PTBL.page_usage[index / 8];
+        if(!usage) {
+            index |= 7;
+            continue;
+        }
+
+        unsigned long key = bucket->slot_key[index];
+        if(!(usage & (1 << (index % 8))) || !key--) {
+            continue;
+        }
+
+        scan->map(
+            partial,
+            key,
+            _PTBL.m_offset + index * stride,
+            KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[key]),
+            scan->arg);
+    }
+
+#undef _PTBL
+}
+
+int
+database_scan(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    Context_pool *pool,
+    Database_scan *scan,
+    void *result
+) {
+    DEBUG_PRINT("database_scan();\n");
+
+    int ret = 0, threads = pool_thread_count(pool);
+    unsigned long index_morsel_count = 0, value_morsel_count = 0;
+    Scan_morsel *index_morsels = 0, *value_morsels = 0;
+
+    Scan_state *state = (Scan_state *)memory_alloc(sizeof(Scan_state));
+    if(!state) {
+        return 0;
+    }
+    state->rec_database = rec_database;
+    state->scan = scan;
+
+    state->partials = memory_alloc(threads * scan->partial_size);
+    if(!state->partials) {
+        goto done;
+    }
+    if(scan->init) {
+        for(int i = 0; i < threads; i++) {
+            scan->init(state->partials + i * scan->partial_size, scan->arg);
+        }
+    }
+
+    // Size the slot -> key maps and count the morsels each bucket splits into
+    for(int b = 0; b < SCAN_BUCKET_COUNT; b++) {
+        Scan_bucket *bucket = &state->buckets[b];
+        bucket->ptbl_index = database_ptbl_get(ctx_main, rec_database, b);
+        if(bucket->ptbl_index == -1) {
+            continue;
+        }
+        bucket->slot_count =
+            (unsigned long)PTBL_RECORD_GET_PAGE_COUNT(rec_database->ptbl_record_tbl[bucket->ptbl_index]) * PTBL_CALC_PAGE_USAGE_BITS(b);
+        if(!bucket->slot_count) {
+            continue;
+        }
+        // calloc() rather than memory_alloc(), as the map may hold more than an int's worth, and it
+        // fails rather than overflow
+        bucket->slot_key = (unsigned long *)calloc(bucket->slot_count, sizeof(unsigned long));
+        if(!bucket->slot_key) {
+            DEBUG_PRINT("\tERR failed to allocate slot_key for bucket %d\n", b);
+            goto done;
+        }
+    }
+
+    // Pass 1: build every bucket's slot -> key map in parallel
+    index_morsel_count = (rec_database->kv_record_count + SCAN_KV_MORSEL - 1) / SCAN_KV_MORSEL;
+    if(index_morsel_count) {
+        index_morsels = (Scan_morsel *)memory_alloc(index_morsel_count * sizeof(Scan_morsel));
+        if(!index_morsels) {
+            goto done;
+        }
+        for(unsigned long i = 0; i < index_morsel_count; i++) {
+            index_morsels[i].state = state;
+            index_morsels[i].begin = i * SCAN_KV_MORSEL;
+            index_morsels[i].end = (i + 1) * SCAN_KV_MORSEL;
+            if(index_morsels[i].end > rec_database->kv_record_count) {
+                index_morsels[i].end = rec_database->kv_record_count;
+            }
+            if(!pool_submit(pool, _scan_index_task, &index_morsels[i])) {
+                pool_wait(pool);
+                goto done;
+            }
+        }
+        pool_wait(pool);
+    }
+
+    // Pass 2: split every bucket into morsels of slots and map their values
+    for(int b = 0; b < SCAN_BUCKET_COUNT; b++) {
+        unsigned long morsel_slots = SCAN_MORSEL_BYTES / PTBL_CALC_BUCKET_WORD_SIZE(b);
+        morsel_slots = (morsel_slots < 8) ? 8 : (morsel_slots & ~7UL);
+        value_morsel_count += (state->buckets[b].slot_count + morsel_slots - 1) / morsel_slots;
+    }
+    if(value_morsel_count) {
+        value_morsels = (Scan_morsel *)memory_alloc(value_morsel_count * sizeof(Scan_morsel));
+        if(!value_morsels) {
+            goto done;
+        }
+        unsigned long m = 0;
+        for(int b = 0; b < SCAN_BUCKET_COUNT; b++) {
+            unsigned long morsel_slots = SCAN_MORSEL_BYTES / PTBL_CALC_BUCKET_WORD_SIZE(b);
+            morsel_slots = (morsel_slots < 8) ? 8 : (morsel_slots & ~7UL);
+            for(unsigned long begin = 0; begin < state->buckets[b].slot_count; begin += morsel_slots, m++) {
+                value_morsels[m].state = state;
+                value_morsels[m].bucket = b;
+                value_morsels[m].begin = begin;
+                value_morsels[m].end = begin + morsel_slots;
+                if(value_morsels[m].end > state->buckets[b].slot_count) {
+                    value_morsels[m].end = state->buckets[b].slot_count;
+                }
+                if(!pool_submit(pool, _scan_value_task, &value_morsels[m])) {
+                    pool_wait(pool);
+                    goto done;
+                }
+            }
+        }
+        pool_wait(pool);
+    }
+
+    DEBUG_PRINT("\t%lu index morsels, %lu value morsels on %d workers\n", index_morsel_count, value_morsel_count, threads);
+
+    for(int i = 0; i < threads; i++) {
+        scan->merge(result, state->partials + i * scan->partial_size, scan->arg);
+    }
+
+    ret = 1;
+
+done:
+    for(int b = 0; b < SCAN_BUCKET_COUNT; b++) {
+        free(state->buckets[b].slot_key);
+    }
+    if(index_morsels) memory_free(index_morsels);
+    if(value_morsels) memory_free(value_morsels);
+    if(state->partials) memory_free(state->partials);
+    memory_free(state);
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+/** @file  scan.h
+ *  @brief Parallel scans over every live value of a database
+ */
+
+/** @brief Describes a parallel map/merge over every live value of a database
+ *
+ * Every worker of the pool gets its own \a partial_size byte partial result, which is prepared by
+ * \a init, fed by \a map and finally folded into the caller's result by \a merge. \a map and \a init are
+ * called concurrently from different workers, but never on the same partial at the same time.
+ * \a merge is only ever called from the thread that called database_scan().
+ */
+typedef struct database_scan {
+    unsigned long partial_size; ///< Size of one partial result in bytes
+
+    /** @brief Prepares \a partial (which starts zeroed) before any values are mapped into it */
+    void (*init)(void *partial, void *arg);
+
+    /** @brief Folds the value of key \a k, \a size bytes at \a value, into \a partial */
+    void (*map)(void *partial, unsigned long k, unsigned char *value, unsigned long size, void *arg);
+
+    /** @brief Folds \a partial into \a result */
+    void (*merge)(void *result, void *partial, void *arg);
+
+    void *arg; ///< Passed through to \a init, \a map and \a merge
+} Database_scan;
+
+/** @brief Runs \a scan over every live value in \a rec_database using the workers of \a pool
+ *
+ * The scan is split into morsels: ranges of slots within a single bucket that cover roughly
+ * SCAN_MORSEL_BYTES of bucket memory. Morsels are spread over the workers of \a pool, which steal
+ * from each other once they run out, and values are visited in physical order within a morsel.
+ *
+ * Before the morsels run, a slot -> key map is built for every bucket with a parallel pass over
+ * database_record.kv_record_tbl (see database_cursor for why).
+ *
+ * \a rec_database must not be modified while the scan runs.
+ *
+ * @returns 1 on success, 0 on failure
+ */
+int
+database_scan(
+    Context_main *ctx_main,        ///<[in]     main context
+    Record_database *rec_database, ///<[in]     database record
+    Context_pool *pool,            ///<[in]     pool to run the scan on
+    Database_scan *scan,           ///<[in]     what to do with each value
+    void *result                   ///<[in,out] where partial results get merged into
+    );
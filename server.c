@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "hash.h"
+#include "server.h"
+
+#ifndef DEBUG_SERVER
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+typedef struct server_connection {
+    int fd;
+    unsigned int events;       // What it's registered with epoll for
+    int closing;               // Close once out has been written
+
+    unsigned char *in;         // Requests read, not yet answered
+    unsigned long in_length;
+    unsigned long in_capacity;
+
+    unsigned char *out;        // Responses from out_start on, not yet written
+    unsigned long out_start;
+    unsigned long out_length;
+    unsigned long out_capacity;
+
+    struct server_connection *prev, *next;
+} Server_connection;
+
+struct server_context {
+    Context_main *ctx_main;
+    Record_database *rec_database;
+    Record_database *named;    // Named keys and their values, which raw ops can't reach
+    Index_hash *index;         // Named keys, in named
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int listen_fd;
+    int wake_fd;
+    int epoll_fd;
+    Server_connection *connections;
+};
+
+static int
+_server_buffer_reserve(
+    unsigned char **buffer,
+    unsigned long *capacity,
+    unsigned long needed
+) {
+    if(needed <= *capacity) {
+        return 1;
+    }
+    unsigned long new_capacity = *capacity ? *capacity : SERVER_READ_CHUNK;
+    while(new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    unsigned char *new_buffer = memory_realloc(*buffer, *capacity, new_capacity);
+    if(!new_buffer) {
+        return 0;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return 1;
+}
+
+// Appends a response and room for length bytes of value after it, which it returns, or 0 on failure
+static unsigned char *
+_server_respond(
+    Server_connection *c,
+    Server_request *request,
+    unsigned char status,
+    unsigned char flags,
+    unsigned long k,
+    unsigned int length
+) {
+    if(c->out_start > 0 && c->out_start >= c->out_capacity / 2) {
+        // Most of the buffer has been written, so move what's left down rather than grow it
+        memmove(c->out, c->out + c->out_start, c->out_length - c->out_start);
+        c->out_length -= c->out_start;
+        c->out_start = 0;
+    }
+    if(!_server_buffer_reserve(&c->out, &c->out_capacity, c->out_length + sizeof(Server_response) + length)) {
+        return 0;
+    }
+
+    Server_response response = { length, status, flags, 0, request->id, 0, k };
+    memcpy(c->out + c->out_length, &response, sizeof(response));
+    c->out_length += sizeof(response) + length;
+
+    return c->out + c->out_length - length;
+}
+
+// Whether record k holds a value
+static int
+_server_live(
+    Record_database *rec_database,
+    unsigned long k
+) {
+    return k < rec_database->kv_record_count && KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]);
+}
+
+// Answers SERVER_OP_SCAN with the entries from cursor request->k on
+static int
+_server_scan(
+    Context_server *srv,
+    Server_connection *c,
+    Server_request *request
+) {
+    Record_database *rec_database = srv->named;
+    unsigned long cursor = request->k, length = 0;
+    Hash_entry entry;
+
+    // Size the response first, then fill it in from the same cursor
+    while(length < SERVER_SCAN_BYTES && hash_index_next(srv->index, &cursor, &entry)) {
+        if(_server_live(rec_database, entry.key_k) && _server_live(rec_database, entry.value_k)) {
+            length += sizeof(Server_entry) + KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[entry.key_k])
+                    + KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[entry.value_k]);
+        }
+    }
+    unsigned long peek = cursor,
+                  next = hash_index_next(srv->index, &peek, &entry) ? cursor : 0;
+
+    unsigned char *out = _server_respond(c, request, SERVER_STATUS_OK, 0, next, length);
+    if(!out) {
+        return 0;
+    }
+    for(cursor = request->k; length > 0; ) {
+        hash_index_next(srv->index, &cursor, &entry);
+        if(!_server_live(rec_database, entry.key_k) || !_server_live(rec_database, entry.value_k)) {
+            continue;
+        }
+        Server_entry header = {
+            KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[entry.key_k]),
+            KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[entry.value_k]),
+            KV_RECORD_GET_FLAGS(rec_database->kv_record_tbl[entry.value_k])
+        };
+        memcpy(out, &header, sizeof(header));
+        memcpy(out + sizeof(header), database_kv_get_value(srv->ctx_main, rec_database, 0, entry.key_k), header.key_length);
+        memcpy(out + sizeof(header) + header.key_length, database_kv_get_value(srv->ctx_main, rec_database, 0, entry.value_k), header.value_length);
+        out += sizeof(header) + header.key_length + header.value_length;
+        length -= sizeof(header) + header.key_length + header.value_length;
+    }
+    return 1;
+}
+
+// Runs a named op, whose request carries key_length bytes of key and then the value
+static int
+_server_execute_named(
+    Context_server *srv,
+    Server_connection *c,
+    Server_request *request,
+    unsigned char *key
+) {
+    Record_database *rec_database = srv->named;
+    unsigned long key_length = request->k,
+                  value_length = request->length - key_length;
+    unsigned char *value = key + key_length,
+                  status = SERVER_STATUS_OK;
+
+    // Empty values are refused, as for SERVER_OP_ALLOC
+    if(key_length == 0 || key_length > request->length
+            || ((request->op == SERVER_OP_PUT || request->op == SERVER_OP_INSERT) && !value_length)) {
+        return _server_respond(c, request, SERVER_STATUS_BAD_REQUEST, 0, request->k, 0) != 0;
+    }
+    unsigned long k = hash_index_get(srv->ctx_main, srv->index, key, key_length);
+
+    switch(request->op) {
+        case SERVER_OP_PUT:
+            if(k != -1) {
+                if(!database_kv_set_value(srv->ctx_main, rec_database, k, value_length, value)) {
+                    status = SERVER_STATUS_FAILED;
+                }
+                break;
+            }
+            // Fall through, as it's new
+        case SERVER_OP_INSERT:
+            if(k != -1) {
+                status = SERVER_STATUS_EXISTS;
+                break;
+            }
+            k = database_kv_alloc(srv->ctx_main, rec_database, request->flags, value_length, value);
+            if(k == -1) {
+                status = SERVER_STATUS_FAILED;
+            }
+            else if(!hash_index_put(srv->ctx_main, srv->index, key, key_length, k)) {
+                database_kv_free(srv->ctx_main, rec_database, k);
+                status = SERVER_STATUS_FAILED;
+            }
+            break;
+
+        case SERVER_OP_LOOKUP: {
+            if(k == -1 || !_server_live(rec_database, k)) {
+                status = SERVER_STATUS_NOT_FOUND;
+                break;
+            }
+            unsigned int length = KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]);
+            unsigned char *out = _server_respond(c, request, SERVER_STATUS_OK, KV_RECORD_GET_FLAGS(rec_database->kv_record_tbl[k]), request->k, length);
+            if(!out) {
+                return 0;
+            }
+            memcpy(out, database_kv_get_value(srv->ctx_main, rec_database, 0, k), length);
+            return 1;
+        }
+
+        case SERVER_OP_DELETE:
+            if(k == -1) {
+                status = SERVER_STATUS_NOT_FOUND;
+            }
+            else if(!hash_index_delete(srv->ctx_main, srv->index, key, key_length)
+                    || !database_kv_free(srv->ctx_main, rec_database, k)) {
+                status = SERVER_STATUS_FAILED;
+            }
+            break;
+    }
+
+    return _server_respond(c, request, status, 0, request->k, 0) != 0;
+}
+
+static int
+_server_execute(
+    Context_server *srv,
+    Server_connection *c,
+    Server_request *request,
+    unsigned char *value
+) {
+    Record_database *rec_database = srv->rec_database;
+    unsigned long k = request->k;
+    unsigned char status = SERVER_STATUS_OK;
+
+    switch(request->op) {
+        case SERVER_OP_PING:
+            break;
+
+        case SERVER_OP_ALLOC:
+            // An empty value would look like a freed record, and its slot would be lost
+            if(!request->length) {
+                status = SERVER_STATUS_BAD_REQUEST;
+                break;
+            }
+            k = database_kv_alloc(srv->ctx_main, rec_database, request->flags, request->length, value);
+            if(k == -1) {
+                status = SERVER_STATUS_FAILED;
+            }
+            break;
+
+        case SERVER_OP_GET: {
+            unsigned char *found = database_kv_get_value(srv->ctx_main, rec_database, 0, k);
+            if(!found) {
+                status = SERVER_STATUS_NOT_FOUND;
+                break;
+            }
+            unsigned int length = KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]);
+            unsigned char *out = _server_respond(c, request, SERVER_STATUS_OK, KV_RECORD_GET_FLAGS(rec_database->kv_record_tbl[k]), k, length);
+            if(!out) {
+                return 0;
+            }
+            memcpy(out, found, length);
+            return 1;
+        }
+
+        case SERVER_OP_SET_VALUE:
+            if(!request->length) {
+                status = SERVER_STATUS_BAD_REQUEST;
+            }
+            else if(k >= rec_database->kv_record_count || !KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) {
+                status = SERVER_STATUS_NOT_FOUND;
+            }
+            else if(!database_kv_set_value(srv->ctx_main, rec_database, k, request->length, value)) {
+                status = SERVER_STATUS_FAILED;
+            }
+            break;
+
+        case SERVER_OP_FREE:
+            if(k >= rec_database->kv_record_count || !KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) {
+                status = SERVER_STATUS_NOT_FOUND;
+            }
+            else if(!database_kv_free(srv->ctx_main, rec_database, k)) {
+                status = SERVER_STATUS_FAILED;
+            }
+            break;
+
+        case SERVER_OP_PUT:
+        case SERVER_OP_INSERT:
+        case SERVER_OP_LOOKUP:
+        case SERVER_OP_DELETE:
+            return _server_execute_named(srv, c, request, value);
+
+        case SERVER_OP_SCAN:
+            return _server_scan(srv, c, request);
+
+        default:
+            status = SERVER_STATUS_BAD_REQUEST;
+    }
+
+    return _server_respond(c, request, status, 0, k, 0) != 0;
+}
+
+// Answers every whole request in c->in, or as many as fit under SERVER_BACKLOG_MAX. Returns 1 if
+// some were left for lack of room, 0 otherwise, and -1 on failure.
+static int
+_server_process(
+    Context_server *srv,
+    Server_connection *c
+) {
+    unsigned long at = 0;
+    int stalled = 0;
+
+    while(c->in_length - at >= sizeof(Server_request) && !c->closing) {
+        if(c->out_length - c->out_start >= SERVER_BACKLOG_MAX) {
+            stalled = 1;
+            break;
+        }
+
+        Server_request request;
+        memcpy(&request, c->in + at, sizeof(request));
+        if(request.length > SERVER_VALUE_MAX) {
+            // There's no telling where the next request starts
+            DEBUG_PRINT("\tERR request of %u bytes\n", request.length);
+            if(!_server_respond(c, &request, SERVER_STATUS_BAD_REQUEST, 0, request.k, 0)) {
+                return -1;
+            }
+            c->closing = 1;
+            at = c->in_length;
+            break;
+        }
+        if(c->in_length - at < sizeof(request) + request.length) {
+            break;
+        }
+
+        if(!_server_execute(srv, c, &request, c->in + at + sizeof(request))) {
+            return -1;
+        }
+        at += sizeof(request) + request.length;
+    }
+
+    memmove(c->in, c->in + at, c->in_length - at);
+    c->in_length -= at;
+
+    return stalled;
+}
+
+static void
+_server_close(
+    Context_server *srv,
+    Server_connection *c
+) {
+    DEBUG_PRINT("_server_close(fd = %d);\n", c->fd);
+
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, 0);
+    close(c->fd);
+    if(c->prev) c->prev->next = c->next;
+    else srv->connections = c->next;
+    if(c->next) c->next->prev = c->prev;
+    memory_free(c->in);
+    memory_free(c->out);
+    memory_free(c);
+}
+
+// Writes what it can of c->out, answering more requests as room frees up, then registers c for
+// whatever it's waiting on. Returns 0 if c was closed.
+static int
+_server_flush(
+    Context_server *srv,
+    Server_connection *c,
+    int stalled
+) {
+    for(;;) {
+        while(c->out_start < c->out_length) {
+            ssize_t written = send(c->fd, c->out + c->out_start, c->out_length - c->out_start, MSG_NOSIGNAL);
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                _server_close(srv, c);
+                return 0;
+            }
+            c->out_start += written;
+        }
+        if(c->out_start == c->out_length) {
+            c->out_start = c->out_length = 0;
+        }
+
+        if(!stalled || c->out_length - c->out_start >= SERVER_BACKLOG_MAX) {
+            break;
+        }
+        if((stalled = _server_process(srv, c)) == -1) {
+            _server_close(srv, c);
+            return 0;
+        }
+    }
+
+    int pending = (c->out_start < c->out_length);
+    if(c->closing && !pending) {
+        _server_close(srv, c);
+        return 0;
+    }
+
+    unsigned int events = (pending ? EPOLLOUT : 0) | ((c->out_length - c->out_start < SERVER_BACKLOG_MAX && !c->closing) ? EPOLLIN : 0);
+    if(events != c->events) {
+        struct epoll_event event = { .events = events, .data.ptr = c };
+        epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+        c->events = events;
+    }
+
+    return 1;
+}
+
+static void
+_server_read(
+    Context_server *srv,
+    Server_connection *c
+) {
+    if(!_server_buffer_reserve(&c->in, &c->in_capacity, c->in_length + SERVER_READ_CHUNK)) {
+        _server_close(srv, c);
+        return;
+    }
+
+    ssize_t length = recv(c->fd, c->in + c->in_length, c->in_capacity - c->in_length, 0);
+    if(length < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if(length <= 0) {
+        _server_close(srv, c);
+        return;
+    }
+    c->in_length += length;
+
+    int stalled = _server_process(srv, c);
+    if(stalled == -1) {
+        _server_close(srv, c);
+        return;
+    }
+    _server_flush(srv, c, stalled);
+}
+
+static void
+_server_accept(
+    Context_server *srv
+) {
+    for(;;) {
+        int fd = accept4(srv->listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EINTR) continue;
+            return;
+        }
+
+        RECORD_CREATE(Server_connection, c);
+        if(!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->events = EPOLLIN;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = c };
+        if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            memory_free(c);
+            continue;
+        }
+        c->next = srv->connections;
+        if(c->next) c->next->prev = c;
+        srv->connections = c;
+        DEBUG_PRINT("_server_accept(): fd = %d\n", fd);
+    }
+}
+
+Context_server *
+server_create(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path
+) {
+    DEBUG_PRINT("server_create(path = %s);\n", path);
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        return 0;
+    }
+    strcpy(address.sun_path, path);
+
+    RECORD_CREATE(Context_server, srv);
+    if(!srv) {
+        return 0;
+    }
+    srv->ctx_main = ctx_main;
+    srv->rec_database = rec_database;
+    srv->named = (Record_database *)memory_alloc(sizeof(Record_database));
+    srv->index = srv->named ? hash_index_create(ctx_main, srv->named) : 0;
+    strcpy(srv->path, path);
+    srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    unlink(path);
+    struct epoll_event listen_event = { .events = EPOLLIN, .data.ptr = &srv->listen_fd },
+                       wake_event = { .events = EPOLLIN, .data.ptr = &srv->wake_fd };
+    if(!srv->index || srv->wake_fd < 0 || srv->epoll_fd < 0 || srv->listen_fd < 0
+            || bind(srv->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0
+            || listen(srv->listen_fd, SOMAXCONN) != 0
+            || epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &listen_event) != 0
+            || epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->wake_fd, &wake_event) != 0) {
+        DEBUG_PRINT("\tERR failed to listen on %s: %s\n", path, strerror(errno));
+        server_free(srv);
+        return 0;
+    }
+
+    return srv;
+}
+
+int
+server_run(
+    Context_server *srv
+) {
+    struct epoll_event events[SERVER_EVENT_COUNT];
+
+    for(;;) {
+        int count = epoll_wait(srv->epoll_fd, events, SERVER_EVENT_COUNT, -1);
+        if(count < 0) {
+            if(errno == EINTR) continue;
+            return 0;
+        }
+
+        for(int i = 0; i < count; i++) {
+            if(events[i].data.ptr == &srv->wake_fd) {
+                unsigned long wakes;
+                if(read(srv->wake_fd, &wakes, sizeof(wakes)) == sizeof(wakes)) {
+                    return 1;
+                }
+            }
+            else if(events[i].data.ptr == &srv->listen_fd) {
+                _server_accept(srv);
+            }
+            else {
+                Server_connection *c = (Server_connection *)events[i].data.ptr;
+                if(events[i].events & EPOLLOUT) {
+                    if(!_server_flush(srv, c, 1)) {
+                        continue;
+                    }
+                }
+                if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    _server_read(srv, c);
+                }
+            }
+        }
+    }
+}
+
+void
+server_stop(
+    Context_server *srv
+) {
+    unsigned long wake = 1;
+    if(write(srv->wake_fd, &wake, sizeof(wake)) != sizeof(wake)) {
+        // Only fails if the counter is about to overflow, in which case it's already set
+    }
+}
+
+void
+server_free(
+    Context_server *srv
+) {
+    if(!srv) {
+        return;
+    }
+    while(srv->connections) {
+        _server_close(srv, srv->connections);
+    }
+    if(srv->listen_fd >= 0) {
+        close(srv->listen_fd);
+        unlink(srv->path);
+    }
+    if(srv->epoll_fd >= 0) close(srv->epoll_fd);
+    if(srv->wake_fd >= 0) close(srv->wake_fd);
+    if(srv->index) hash_index_free(srv->ctx_main, srv->index);
+    if(srv->named) {
+        database_ptbl_free(srv->ctx_main, srv->named);
+        memory_free(srv->named);
+    }
+    memory_free(srv);
+}
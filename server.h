@@ -0,0 +1,125 @@
+/** @file  server.h
+ *  @brief Serving a Record_database to other processes on the host, over a Unix domain socket
+ */
+
+/** @brief Largest value a request may carry. A request claiming a longer one closes the connection. */
+#define SERVER_VALUE_MAX (16 << 20)
+
+/** @brief Most bytes taken from a connection with one read() */
+#define SERVER_READ_CHUNK (64 << 10)
+
+/** @brief Responses a connection may have waiting to be written before the server stops reading its requests */
+#define SERVER_BACKLOG_MAX (4 << 20)
+
+/** @brief Events taken from epoll_wait() at once */
+#define SERVER_EVENT_COUNT 64
+
+/** @brief Most bytes of entries a response to SERVER_OP_SCAN carries, give or take one entry */
+#define SERVER_SCAN_BYTES (64 << 10)
+
+/** @brief What a request asks for
+ *
+ * The named ops address values by a byte-string key rather than by kv_record key: their request
+ * carries the key's bytes followed by the value, with the length of the key in \a k.
+ */
+enum server_op {
+    SERVER_OP_PING = 0,      ///< Nothing, answered with SERVER_STATUS_OK
+    SERVER_OP_ALLOC = 1,     ///< database_kv_alloc() of the value, with \a flags. The response carries the new key in \a k.
+    SERVER_OP_GET = 2,       ///< database_kv_get_value() of \a k. The response carries the value, and its \a flags.
+    SERVER_OP_SET_VALUE = 3, ///< database_kv_set_value() of \a k to the value
+    SERVER_OP_FREE = 4,      ///< database_kv_free() of \a k
+    SERVER_OP_PUT = 5,       ///< Named: sets the value of the key, adding it if it's new
+    SERVER_OP_INSERT = 6,    ///< Named: adds the key with the value, or answers SERVER_STATUS_EXISTS
+    SERVER_OP_LOOKUP = 7,    ///< Named: the response carries the value of the key, and its \a flags
+    SERVER_OP_DELETE = 8,    ///< Named: removes the key
+    SERVER_OP_SCAN = 9       ///< Server_entry after Server_entry of named keys from cursor \a k, 0 to start.
+                             ///< The response's \a k is the cursor to continue from, or 0 once there are no more.
+};
+
+/** @brief How a request went */
+enum server_status {
+    SERVER_STATUS_OK = 0,
+    SERVER_STATUS_NOT_FOUND = 1,   ///< \a k isn't a record, or has been freed
+    SERVER_STATUS_FAILED = 2,      ///< The database couldn't do it, e.g. out of memory
+    SERVER_STATUS_BAD_REQUEST = 3, ///< Unknown \a op, a value too long, or an empty value to store
+    SERVER_STATUS_EXISTS = 4       ///< SERVER_OP_INSERT of a key that's already there
+};
+
+/** @brief A named key in a response to SERVER_OP_SCAN, followed by \a key_length bytes of key then \a value_length bytes of value */
+typedef struct server_entry {
+    unsigned int key_length;
+    unsigned int value_length;
+    unsigned char flags;    ///< kv_record flags of the value
+    unsigned char reserved[7];
+} Server_entry;
+
+/** @brief A request, followed by \a length bytes of value
+ *
+ * Everything is in the byte order of the host, as the socket never leaves it. A client may write
+ * any number of requests without waiting for responses: they're answered one for one, in order.
+ * Every request that arrives with one read() is answered before anything is written, so the
+ * responses to a batch of requests go out with as few writes as the socket allows.
+ */
+typedef struct server_request {
+    unsigned int length;    ///< Bytes of value after the request
+    unsigned char op;       ///< One of server_op
+    unsigned char flags;    ///< kv_record flags, for SERVER_OP_ALLOC
+    unsigned short reserved;
+    unsigned int id;        ///< Anything, echoed back in the response
+    unsigned int reserved2;
+    unsigned long k;        ///< Key, for every op but SERVER_OP_ALLOC and SERVER_OP_PING
+} Server_request;
+
+/** @brief A response, followed by \a length bytes of value */
+typedef struct server_response {
+    unsigned int length;    ///< Bytes of value after the response
+    unsigned char status;   ///< One of server_status
+    unsigned char flags;    ///< kv_record flags of the value, for SERVER_OP_GET
+    unsigned short reserved;
+    unsigned int id;        ///< The request's \a id
+    unsigned int reserved2;
+    unsigned long k;        ///< The request's \a k, or the new key for SERVER_OP_ALLOC
+} Server_response;
+
+/** @brief A server, listening on a Unix domain socket
+ *
+ * One thread runs server_run(), an epoll loop that serves every connection, and is the only thread
+ * touching the database meanwhile.
+ *
+ * Named keys and their values are kept apart from the database being served, in a Record_database
+ * and an Index_hash of the server's own: the raw ops can't reach them, and they outlive neither the
+ * server nor a snapshot of its database.
+ */
+typedef struct server_context Context_server;
+
+/** @brief Starts listening on a Unix domain socket at \a path, replacing any socket already there
+ *  @returns A pointer to the server on success, or 0 on failure
+ *  @see     server_run()
+ *  @see     server_free()
+ */
+Context_server *
+server_create(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database to serve
+    const char *path               ///<[in] path of the socket
+    );
+
+/** @brief   Serves connections until server_stop() is called
+ *  @returns 1 once stopped, 0 if epoll failed
+ */
+int
+server_run(
+    Context_server *srv ///<[in] server
+    );
+
+/** @brief Makes server_run() return. May be called from any thread, or a signal handler. */
+void
+server_stop(
+    Context_server *srv ///<[in] server
+    );
+
+/** @brief Closes every connection and the socket, removes its path, and frees \a srv */
+void
+server_free(
+    Context_server *srv ///<[in] server
+    );
@@ -0,0 +1,249 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "server.h"
+
+// A load generator for out/server: every connection runs on its own thread, and keeps depth
+// requests in flight, sending a new one for every response
+
+typedef struct client_connection {
+    const char *path;
+    int depth;
+    unsigned long ops;
+    unsigned int value_length;
+    int get_percent;
+    unsigned long *keys;
+    unsigned long key_count;
+    unsigned long seed;
+    double *latency;       // Seconds, one per op
+    int ok;
+} Client_connection;
+
+static double
+_client_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+_client_connect(
+    const char *path
+) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+_client_write(
+    int fd,
+    const unsigned char *buffer,
+    unsigned long length
+) {
+    while(length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return 0;
+        buffer += written;
+        length -= written;
+    }
+    return 1;
+}
+
+// Appends a request to buffer at *length
+static void
+_client_request(
+    unsigned char *buffer,
+    unsigned long *length,
+    unsigned char op,
+    unsigned int id,
+    unsigned long k,
+    unsigned int value_length,
+    unsigned char fill
+) {
+    Server_request request = { value_length, op, KV_RECORD_TYPE_RAW, 0, id, 0, k };
+    memcpy(buffer + *length, &request, sizeof(request));
+    memset(buffer + *length + sizeof(request), fill, value_length);
+    *length += sizeof(request) + value_length;
+}
+
+static void *
+_client_run(
+    void *arg
+) {
+    Client_connection *c = (Client_connection *)arg;
+    int fd = _client_connect(c->path);
+    unsigned long out_capacity = c->depth * (sizeof(Server_request) + c->value_length),
+                  in_capacity = SERVER_READ_CHUNK + c->depth * (sizeof(Server_response) + c->value_length),
+                  in_length = 0, issued = 0, done = 0;
+    unsigned char *out = malloc(out_capacity), *in = malloc(in_capacity);
+    double *sent = malloc(c->depth * sizeof(double));
+    if(fd < 0 || !out || !in || !sent) {
+        goto out;
+    }
+
+    while(done < c->ops) {
+        // Top the window up, and send the new requests with one write
+        unsigned long out_length = 0;
+        double now = _client_now();
+        while(issued - done < c->depth && issued < c->ops) {
+            c->seed = c->seed * 6364136223846793005UL + 1442695040888963407UL;
+            unsigned long k = c->keys[(c->seed >> 33) % c->key_count];
+            int get = ((c->seed >> 20) % 100) < c->get_percent;
+            _client_request(out, &out_length, get ? SERVER_OP_GET : SERVER_OP_SET_VALUE, issued, k, get ? 0 : c->value_length, (unsigned char)issued);
+            sent[issued % c->depth] = now;
+            issued++;
+        }
+        if(out_length && !_client_write(fd, out, out_length)) {
+            goto out;
+        }
+
+        ssize_t length = read(fd, in + in_length, in_capacity - in_length);
+        if(length < 0 && errno == EINTR) continue;
+        if(length <= 0) {
+            goto out;
+        }
+        in_length += length;
+
+        now = _client_now();
+        unsigned long at = 0;
+        Server_response response;
+        while(in_length - at >= sizeof(response)) {
+            memcpy(&response, in + at, sizeof(response));
+            if(in_length - at < sizeof(response) + response.length) {
+                break;
+            }
+            if(response.status != SERVER_STATUS_OK || response.id != done) {
+                fprintf(stderr, "response %u: status %d, expected %lu\n", response.id, response.status, done);
+                goto out;
+            }
+            c->latency[done] = now - sent[response.id % c->depth];
+            done++;
+            at += sizeof(response) + response.length;
+        }
+        memmove(in, in + at, in_length - at);
+        in_length -= at;
+    }
+    c->ok = 1;
+
+out:
+    if(fd >= 0) close(fd);
+    free(out);
+    free(in);
+    free(sent);
+    return 0;
+}
+
+static int
+_client_compare(
+    const void *a,
+    const void *b
+) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s socket [connections] [depth] [ops] [value bytes] [get %%] [keys]\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[1];
+    int connections = (argc > 2) ? atoi(argv[2]) : 4,
+        depth = (argc > 3) ? atoi(argv[3]) : 32,
+        get_percent = (argc > 6) ? atoi(argv[6]) : 90;
+    unsigned long ops = (argc > 4) ? strtoul(argv[4], 0, 10) : 1000000,
+                  key_count = (argc > 7) ? strtoul(argv[7], 0, 10) : 100000;
+    unsigned int value_length = (argc > 5) ? atoi(argv[5]) : 100;
+    if(connections < 1 || depth < 1 || !ops || !key_count || value_length > SERVER_VALUE_MAX) {
+        return 1;
+    }
+
+    // Fill the database, a window of allocations at a time
+    unsigned long *keys = malloc(key_count * sizeof(unsigned long));
+    unsigned char *buffer = malloc(1024 * (sizeof(Server_request) + value_length));
+    int fd = _client_connect(path);
+    if(!keys || !buffer || fd < 0) {
+        fprintf(stderr, "failed to connect to %s\n", path);
+        return 1;
+    }
+    double start = _client_now();
+    for(unsigned long i = 0; i < key_count; ) {
+        unsigned long length = 0, batch = (key_count - i < 1024) ? key_count - i : 1024;
+        for(unsigned long j = 0; j < batch; j++) {
+            _client_request(buffer, &length, SERVER_OP_ALLOC, i + j, 0, value_length, 1);
+        }
+        if(!_client_write(fd, buffer, length)) {
+            return 1;
+        }
+        for(unsigned long j = 0; j < batch; j++) {
+            Server_response response;
+            for(unsigned long got = 0; got < sizeof(response); ) {
+                ssize_t n = read(fd, (unsigned char *)&response + got, sizeof(response) - got);
+                if(n <= 0) return 1;
+                got += n;
+            }
+            if(response.status != SERVER_STATUS_OK) {
+                fprintf(stderr, "SERVER_OP_ALLOC failed\n");
+                return 1;
+            }
+            keys[i + j] = response.k;
+        }
+        i += batch;
+    }
+    close(fd);
+    double seconds = _client_now() - start;
+    printf("%lu keys of %u bytes allocated in %.3f s (%.0f ops/s)\n", key_count, value_length, seconds, key_count / seconds);
+
+    Client_connection *c = calloc(connections, sizeof(Client_connection));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    double *latency = malloc(ops * connections * sizeof(double));
+    if(!c || !threads || !latency) {
+        return 1;
+    }
+    start = _client_now();
+    for(int i = 0; i < connections; i++) {
+        c[i] = (Client_connection){ path, depth, ops, value_length, get_percent, keys, key_count, i + 1, latency + i * ops, 0 };
+        pthread_create(&threads[i], 0, _client_run, &c[i]);
+    }
+    int ok = 1;
+    for(int i = 0; i < connections; i++) {
+        pthread_join(threads[i], 0);
+        ok = ok && c[i].ok;
+    }
+    seconds = _client_now() - start;
+    if(!ok) {
+        fprintf(stderr, "a connection failed\n");
+        return 1;
+    }
+
+    unsigned long total = ops * connections;
+    qsort(latency, total, sizeof(double), _client_compare);
+    printf("%d connections, %d in flight each, %d%% gets: %lu ops in %.3f s, %.0f ops/s\n",
+            connections, depth, get_percent, total, seconds, total / seconds);
+    printf("latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+            latency[total / 2] * 1e6, latency[total * 99 / 100] * 1e6, latency[total * 999 / 1000] * 1e6, latency[total - 1] * 1e6);
+
+    free(latency);
+    free(threads);
+    free(c);
+    free(buffer);
+    free(keys);
+    return 0;
+}
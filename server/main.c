@@ -0,0 +1,72 @@
+#include <unistd.h>
+#include <signal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "persist.h"
+#include "server.h"
+
+static Context_server *server;
+
+static void
+_main_signal(
+    int signal
+) {
+    server_stop(server);
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s socket [snapshot]\n"
+                "Serves a database on the Unix domain socket at socket. If snapshot is given, the database\n"
+                "is loaded from it if it exists, and saved to it on SIGINT or SIGTERM.\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[1],
+          *snapshot = (argc > 2) ? argv[2] : 0;
+
+    RECORD_CREATE(struct main_context, main_context);
+    RECORD_CREATE(Record_database, rec_database);
+    if(!main_context || !rec_database) {
+        return 1;
+    }
+    main_context->system_page_size = sysconf(_SC_PAGE_SIZE);
+    main_context->system_phys_page_count = sysconf(_SC_PHYS_PAGES);
+    main_context->system_cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(snapshot && access(snapshot, F_OK) == 0 && !database_load(main_context, rec_database, snapshot)) {
+        fprintf(stderr, "failed to load %s\n", snapshot);
+        return 1;
+    }
+
+    server = server_create(main_context, rec_database, path);
+    if(!server) {
+        fprintf(stderr, "failed to listen on %s\n", path);
+        return 1;
+    }
+
+    struct sigaction action = { .sa_handler = _main_signal };
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+
+    fprintf(stderr, "serving %lu keys on %s\n", rec_database->kv_record_count, path);
+    int ok = server_run(server);
+    server_free(server);
+
+    if(snapshot && !database_save(main_context, rec_database, snapshot)) {
+        fprintf(stderr, "failed to save %s\n", snapshot);
+        ok = 0;
+    }
+
+    database_ptbl_free(main_context, rec_database);
+    memory_free(rec_database);
+    memory_free(main_context);
+
+    return ok ? 0 : 1;
+}
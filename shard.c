@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "hash.h"
+#include "shard.h"
+
+#ifndef DEBUG_SHARD
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+// Number of empty polls before a shard's thread goes to sleep
+#define SHARD_IDLE_SPINS 256
+
+// How long a sleeping shard waits before polling again, in case a wakeup was missed
+#define SHARD_IDLE_SLEEP_NS 1000000
+
+#define SHARD_CACHE_LINE 64
+
+enum {
+    SHARD_OP_ALLOC,
+    SHARD_OP_FREE,
+    SHARD_OP_SET_VALUE,
+    SHARD_OP_GET,
+    SHARD_OP_TASK
+};
+
+// Written by the shard, then published by setting done
+typedef struct shard_reply {
+    atomic_int done;
+    unsigned long result;
+    unsigned long size;
+} Shard_reply;
+
+typedef struct shard_request {
+    int op;
+    unsigned char flags;
+    unsigned long k;
+    unsigned long length;
+    unsigned char *buffer;
+    shard_task_fn fn;
+    void *arg;
+    Shard_reply *reply; // 0 for tasks, which nobody waits on
+} Shard_request;
+
+// Single producer (a client), single consumer (a shard). The indices only ever grow; each is written
+// by one side only, and sits on its own cache line.
+typedef struct shard_queue {
+    atomic_ulong head;
+    char pad_head[SHARD_CACHE_LINE - sizeof(atomic_ulong)];
+    atomic_ulong tail;
+    char pad_tail[SHARD_CACHE_LINE - sizeof(atomic_ulong)];
+    Shard_request entries[SHARD_QUEUE_CAPACITY];
+} Shard_queue;
+
+typedef struct shard {
+    Record_database *rec_database;
+    Shard_queue *queues;        // One per client, indexed by client id
+    pthread_t thread;
+    int index;
+    struct shard_runtime *runtime;
+    struct shard_client *self;  // The client that tasks running on this shard use
+
+    Shard_request *deferred;    // Tasks picked up while the shard was busy waiting, run later
+    unsigned long deferred_count;
+    unsigned long deferred_capacity;
+
+    atomic_int sleeping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} Shard;
+
+struct shard_client {
+    struct shard_runtime *runtime;
+    int id;    // Index of this client's queue in every shard
+    int home;  // Shard whose thread this client belongs to, or -1
+};
+
+struct shard_runtime {
+    Context_main *ctx_main;
+    int shard_count;
+    int queue_count;           // shard_count + the maximum number of attached clients
+    atomic_int client_count;   // Queues handed out so far
+    Shard *shards;
+
+    atomic_int stop;
+    atomic_long pending;       // Tasks submitted but not yet finished
+    pthread_mutex_t lock;
+    pthread_cond_t idle;       // Signalled when pending drops to 0
+};
+
+static int
+_shard_queue_push(
+    Shard_queue *queue,
+    Shard_request *request
+) {
+    unsigned long tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&queue->head, memory_order_acquire) == SHARD_QUEUE_CAPACITY) {
+        return 0;
+    }
+    queue->entries[tail % SHARD_QUEUE_CAPACITY] = request[0];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_seq_cst);
+    return 1;
+}
+
+static int
+_shard_queue_pop(
+    Shard_queue *queue,
+    Shard_request *request
+) {
+    unsigned long head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if(head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        return 0;
+    }
+    request[0] = queue->entries[head % SHARD_QUEUE_CAPACITY];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// Runs a key/value request against shard's own database
+static unsigned long
+_shard_execute(
+    Context_main *ctx_main,
+    Shard *shard,
+    Shard_request *request,
+    unsigned long *size
+) {
+    Record_database *rec_database = shard->rec_database;
+    unsigned char *value;
+
+    switch(request->op) {
+    case SHARD_OP_ALLOC:
+        return database_kv_alloc(ctx_main, rec_database, request->flags, request->length, request->buffer);
+    case SHARD_OP_FREE:
+        return database_kv_free(ctx_main, rec_database, request->k);
+    case SHARD_OP_SET_VALUE:
+        return database_kv_set_value(ctx_main, rec_database, request->k, request->length, request->buffer);
+    case SHARD_OP_GET:
+        value = database_kv_get_value(ctx_main, rec_database, 0, request->k);
+        if(!value) {
+            return 0;
+        }
+        size[0] = KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[request->k]);
+        memcpy(request->buffer, value, (size[0] < request->length) ? size[0] : request->length);
+        return 1;
+    }
+    return 0;
+}
+
+static void
+_shard_task_done(
+    struct shard_runtime *runtime
+) {
+    if(atomic_fetch_sub(&runtime->pending, 1) == 1) {
+        pthread_mutex_lock(&runtime->lock);
+        pthread_cond_broadcast(&runtime->idle);
+        pthread_mutex_unlock(&runtime->lock);
+    }
+}
+
+// Parks a task to run once the shard's thread is back in _shard_main()
+static int
+_shard_defer(
+    Shard *shard,
+    Shard_request *request
+) {
+    if(shard->deferred_count == shard->deferred_capacity) {
+        unsigned long new_capacity = shard->deferred_capacity ? shard->deferred_capacity * 2 : SHARD_QUEUE_CAPACITY;
+        Shard_request *new_deferred = (Shard_request *)memory_realloc(shard->deferred, shard->deferred_capacity * sizeof(Shard_request), new_capacity * sizeof(Shard_request));
+        if(!new_deferred) {
+            return 0;
+        }
+        shard->deferred = new_deferred;
+        shard->deferred_capacity = new_capacity;
+    }
+    shard->deferred[shard->deferred_count++] = request[0];
+    return 1;
+}
+
+// Serves every queue of shard once. When run_tasks is 0, which is the case while the shard's own
+// thread is waiting on another shard, tasks are deferred rather than run: the shard keeps answering
+// requests, so that two shards waiting on each other can't deadlock, without starting new tasks
+// inside the current one.
+static int
+_shard_poll(
+    Shard *shard,
+    int run_tasks
+) {
+    struct shard_runtime *runtime = shard->runtime;
+    int served = 0, queue_count = atomic_load(&runtime->client_count);
+    Shard_request request;
+    if(queue_count > runtime->queue_count) {
+        queue_count = runtime->queue_count;
+    }
+
+    for(int i = 0; i < queue_count; i++) {
+        Shard_queue *queue = &shard->queues[i];
+
+        while(1) {
+            // Peek first, so that a task which can't be deferred stays queued
+            unsigned long head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+            if(head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+                break;
+            }
+            if(queue->entries[head % SHARD_QUEUE_CAPACITY].op == SHARD_OP_TASK && !run_tasks) {
+                if(!_shard_defer(shard, &queue->entries[head % SHARD_QUEUE_CAPACITY])) {
+                    break;
+                }
+                atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+                served++;
+                continue;
+            }
+            _shard_queue_pop(queue, &request);
+            served++;
+
+            if(request.op == SHARD_OP_TASK) {
+                request.fn(runtime->ctx_main, shard->self, request.arg);
+                _shard_task_done(runtime);
+                continue;
+            }
+
+            unsigned long size = 0;
+            request.reply->result = _shard_execute(runtime->ctx_main, shard, &request, &size);
+            request.reply->size = size;
+            atomic_store_explicit(&request.reply->done, 1, memory_order_release);
+        }
+    }
+
+    return served;
+}
+
+static void
+_shard_wake(
+    Shard *shard
+) {
+    if(atomic_load(&shard->sleeping)) {
+        pthread_mutex_lock(&shard->lock);
+        pthread_cond_signal(&shard->wake);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Called by a client that is waiting on a shard: lets the shard run if we share its core, and keeps
+// our own shard responsive if we are one
+static void
+_shard_client_yield(
+    Shard_client *client,
+    int *spins
+) {
+    if(client->home != -1 && _shard_poll(&client->runtime->shards[client->home], 0)) {
+        return;
+    }
+    if(++spins[0] > 64) {
+        sched_yield();
+    }
+}
+
+static void *
+_shard_main(
+    void *arg
+) {
+    Shard *shard = (Shard *)arg;
+    struct shard_runtime *runtime = shard->runtime;
+    int idle = 0;
+
+    while(!atomic_load(&runtime->stop)) {
+        if(shard->deferred_count > 0) {
+            Shard_request request = shard->deferred[--shard->deferred_count];
+            request.fn(runtime->ctx_main, shard->self, request.arg);
+            _shard_task_done(runtime);
+            continue;
+        }
+        if(_shard_poll(shard, 1)) {
+            idle = 0;
+            continue;
+        }
+        if(++idle < SHARD_IDLE_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        // Announce that we're going to sleep, then look once more, so that a client that pushed a
+        // request in between either sees the flag or has its request picked up here
+        atomic_store(&shard->sleeping, 1);
+        if(!_shard_poll(shard, 1) && !atomic_load(&runtime->stop)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += SHARD_IDLE_SLEEP_NS;
+            if(deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&shard->lock);
+            pthread_cond_timedwait(&shard->wake, &shard->lock, &deadline);
+            pthread_mutex_unlock(&shard->lock);
+        }
+        atomic_store(&shard->sleeping, 0);
+        idle = 0;
+    }
+
+    return 0;
+}
+
+Context_shard *
+shard_runtime_create(
+    Context_main *ctx_main,
+    int shard_count,
+    int client_count
+) {
+    if(shard_count <= 0) {
+        shard_count = (ctx_main->system_cpu_count > 0) ? ctx_main->system_cpu_count : 1;
+    }
+    if(shard_count > SHARD_MAX) {
+        shard_count = SHARD_MAX;
+    }
+
+    DEBUG_PRINT("shard_runtime_create(shard_count = %d, client_count = %d);\n", shard_count, client_count);
+
+    RECORD_CREATE(struct shard_runtime, runtime);
+    if(!runtime) {
+        return 0;
+    }
+    runtime->ctx_main = ctx_main;
+    runtime->shard_count = shard_count;
+    runtime->queue_count = shard_count + ((client_count > 0) ? client_count : 0);
+    runtime->shards = (Shard *)memory_alloc(shard_count * sizeof(Shard));
+    if(!runtime->shards) {
+        memory_free(runtime);
+        return 0;
+    }
+    atomic_init(&runtime->stop, 0);
+    atomic_init(&runtime->pending, 0);
+    pthread_mutex_init(&runtime->lock, 0);
+    pthread_cond_init(&runtime->idle, 0);
+
+    // Every shard's own client takes the queue with the same index as the shard
+    atomic_init(&runtime->client_count, shard_count);
+
+    for(int i = 0; i < shard_count; i++) {
+        Shard *shard = &runtime->shards[i];
+        shard->index = i;
+        shard->runtime = runtime;
+        atomic_init(&shard->sleeping, 0);
+        pthread_mutex_init(&shard->lock, 0);
+        pthread_cond_init(&shard->wake, 0);
+
+        RECORD_ALLOC(Record_database, shard->rec_database);
+        shard->queues = (Shard_queue *)memory_alloc(runtime->queue_count * sizeof(Shard_queue));
+        RECORD_ALLOC(Shard_client, shard->self);
+        if(!shard->rec_database || !shard->queues || !shard->self) {
+            DEBUG_PRINT("\tERR failed to allocate shard %d\n", i);
+            runtime->shard_count = i + 1;
+            shard_runtime_free(runtime);
+            return 0;
+        }
+        shard->self->runtime = runtime;
+        shard->self->id = i;
+        shard->self->home = i;
+    }
+
+    for(int i = 0; i < shard_count; i++) {
+        Shard *shard = &runtime->shards[i];
+        if(pthread_create(&shard->thread, 0, _shard_main, shard)) {
+            DEBUG_PRINT("\tERR failed to start shard %d\n", i);
+            // Every shard is freed, and only the ones started are joined
+            shard->thread = 0;
+            shard_runtime_free(runtime);
+            return 0;
+        }
+
+        // Pinning is only an optimization, so failing to do it isn't an error
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(i % ((ctx_main->system_cpu_count > 0) ? ctx_main->system_cpu_count : 1), &cpus);
+        pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus);
+    }
+
+    return runtime;
+}
+
+void
+shard_runtime_free(
+    Context_shard *runtime
+) {
+    DEBUG_PRINT("shard_runtime_free();\n");
+
+    shard_wait(runtime);
+
+    atomic_store(&runtime->stop, 1);
+    for(int i = 0; i < runtime->shard_count; i++) {
+        Shard *shard = &runtime->shards[i];
+        if(shard->thread) {
+            pthread_mutex_lock(&shard->lock);
+            pthread_cond_signal(&shard->wake);
+            pthread_mutex_unlock(&shard->lock);
+            pthread_join(shard->thread, 0);
+        }
+        pthread_mutex_destroy(&shard->lock);
+        pthread_cond_destroy(&shard->wake);
+        if(shard->rec_database) {
+            database_ptbl_free(runtime->ctx_main, shard->rec_database);
+            memory_free(shard->rec_database);
+        }
+        if(shard->queues) memory_free(shard->queues);
+        if(shard->deferred) memory_free(shard->deferred);
+        if(shard->self) memory_free(shard->self);
+    }
+
+    pthread_mutex_destroy(&runtime->lock);
+    pthread_cond_destroy(&runtime->idle);
+    memory_free(runtime->shards);
+    memory_free(runtime);
+}
+
+int
+shard_count(
+    Context_shard *runtime
+) {
+    return runtime->shard_count;
+}
+
+int
+shard_route(
+    Context_shard *runtime,
+    unsigned char *key,
+    unsigned long key_length
+) {
+    return hash_bytes(key, key_length) % runtime->shard_count;
+}
+
+Record_database *
+shard_database(
+    Context_shard *runtime,
+    int shard
+) {
+    return runtime->shards[shard].rec_database;
+}
+
+Shard_client *
+shard_client_attach(
+    Context_shard *runtime
+) {
+    // Never past queue_count, as the shards poll every queue handed out
+    int id = atomic_load(&runtime->client_count);
+    do {
+        if(id >= runtime->queue_count) {
+            DEBUG_PRINT("shard_client_attach(): ERR no more room for clients\n");
+            return 0;
+        }
+    } while(!atomic_compare_exchange_weak(&runtime->client_count, &id, id + 1));
+
+    RECORD_CREATE(Shard_client, client);
+    if(!client) {
+        return 0;
+    }
+    client->runtime = runtime;
+    client->id = id;
+    client->home = -1;
+
+    return client;
+}
+
+void
+shard_client_detach(
+    Shard_client *client
+) {
+    // Its queues stay behind, empty, since other clients' indices depend on them
+    memory_free(client);
+}
+
+static void
+_shard_send(
+    Shard_client *client,
+    int shard_index,
+    Shard_request *request
+) {
+    Shard *shard = &client->runtime->shards[shard_index];
+    int spins = 0;
+
+    while(!_shard_queue_push(&shard->queues[client->id], request)) {
+        _shard_wake(shard);
+        _shard_client_yield(client, &spins);
+    }
+    _shard_wake(shard);
+}
+
+// Runs request on shard_index: inline if that's our own shard, otherwise through its queue
+static unsigned long
+_shard_call(
+    Shard_client *client,
+    int shard_index,
+    Shard_request *request,
+    unsigned long *size
+) {
+    struct shard_runtime *runtime = client->runtime;
+
+    if(shard_index < 0 || shard_index >= runtime->shard_count) {
+        return 0;
+    }
+    if(shard_index == client->home) {
+        return _shard_execute(runtime->ctx_main, &runtime->shards[shard_index], request, size);
+    }
+
+    Shard_reply reply;
+    int spins = 0;
+    atomic_init(&reply.done, 0);
+    request->reply = &reply;
+
+    _shard_send(client, shard_index, request);
+    while(!atomic_load_explicit(&reply.done, memory_order_acquire)) {
+        _shard_client_yield(client, &spins);
+    }
+
+    size[0] = reply.size;
+    return reply.result;
+}
+
+int
+shard_submit(
+    Shard_client *client,
+    int shard,
+    shard_task_fn fn,
+    void *arg
+) {
+    struct shard_runtime *runtime = client->runtime;
+    if(shard < 0 || shard >= runtime->shard_count) {
+        return 0;
+    }
+
+    Shard_request request = { SHARD_OP_TASK, 0, 0, 0, 0, fn, arg, 0 };
+    atomic_fetch_add(&runtime->pending, 1);
+    _shard_send(client, shard, &request);
+
+    return 1;
+}
+
+void
+shard_wait(
+    Context_shard *runtime
+) {
+    pthread_mutex_lock(&runtime->lock);
+    while(atomic_load(&runtime->pending) > 0) {
+        pthread_cond_wait(&runtime->idle, &runtime->lock);
+    }
+    pthread_mutex_unlock(&runtime->lock);
+}
+
+Shard_handle
+shard_kv_alloc(
+    Context_main *ctx_main,
+    Shard_client *client,
+    int shard,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    Shard_request request = { SHARD_OP_ALLOC, flags, 0, size, buffer, 0, 0, 0 };
+    unsigned long value_size, k = -1;
+
+    if(shard >= 0 && shard < client->runtime->shard_count) {
+        k = _shard_call(client, shard, &request, &value_size);
+    }
+    if(k == -1) {
+        return -1;
+    }
+
+    return SHARD_HANDLE(shard, k);
+}
+
+int
+shard_kv_free(
+    Context_main *ctx_main,
+    Shard_client *client,
+    Shard_handle handle
+) {
+    Shard_request request = { SHARD_OP_FREE, 0, SHARD_HANDLE_GET_KEY(handle), 0, 0, 0, 0, 0 };
+    unsigned long size;
+    return _shard_call(client, SHARD_HANDLE_GET_SHARD(handle), &request, &size);
+}
+
+int
+shard_kv_set_value(
+    Context_main *ctx_main,
+    Shard_client *client,
+    Shard_handle handle,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    Shard_request request = { SHARD_OP_SET_VALUE, 0, SHARD_HANDLE_GET_KEY(handle), length, buffer, 0, 0, 0 };
+    unsigned long size;
+    return _shard_call(client, SHARD_HANDLE_GET_SHARD(handle), &request, &size);
+}
+
+int
+shard_kv_get(
+    Context_main *ctx_main,
+    Shard_client *client,
+    Shard_handle handle,
+    unsigned char *buffer,
+    unsigned long length,
+    unsigned long *size
+) {
+    Shard_request request = { SHARD_OP_GET, 0, SHARD_HANDLE_GET_KEY(handle), length, buffer, 0, 0, 0 };
+    unsigned long value_size = 0;
+    int found = _shard_call(client, SHARD_HANDLE_GET_SHARD(handle), &request, &value_size);
+    if(found && size) size[0] = value_size;
+    return found;
+}
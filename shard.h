@@ -0,0 +1,179 @@
+/** @file  shard.h
+ *  @brief A shared-nothing runtime: one Record_database per core, each owned by a single pinned thread
+ */
+
+/** @brief Maximum number of shards in a runtime. A Shard_handle has eight bits for the shard. */
+#define SHARD_MAX 256
+
+/** @brief Number of requests each single-producer single-consumer queue holds */
+#define SHARD_QUEUE_CAPACITY 64
+
+/** @brief Amount to shift a Shard_handle right by to extract the shard */
+#define SHARD_HANDLE_SHIFT 56
+
+/** @brief A record in a sharded database: the shard it lives in and its key within that shard's database
+ *  @see   SHARD_HANDLE()
+ */
+typedef unsigned long Shard_handle;
+
+/** @brief   Builds a Shard_handle from shard \a x and key \a y */
+#define SHARD_HANDLE(x,y) (((unsigned long)(x) << SHARD_HANDLE_SHIFT) | ((y) & ((1UL << SHARD_HANDLE_SHIFT) - 1)))
+
+/** @brief   Get the shard of Shard_handle \a x */
+#define SHARD_HANDLE_GET_SHARD(x) ((int)((x) >> SHARD_HANDLE_SHIFT))
+
+/** @brief   Get the key, within its shard's Record_database, of Shard_handle \a x */
+#define SHARD_HANDLE_GET_KEY(x) ((x) & ((1UL << SHARD_HANDLE_SHIFT) - 1))
+
+/** @brief A set of shards, each with its own Record_database and a thread pinned to one core
+ *
+ * Only a shard's own thread ever touches its database, so the databases need no locks at all. Every
+ * other thread reaches a shard through a client: each client has one lock-free single-producer
+ * single-consumer queue into every shard, which the shard's thread polls.
+ *
+ * Work that mostly touches one partition of the data is best submitted to that partition's shard with
+ * shard_submit(): requests it makes to its own shard run inline, and only the cross-shard ones go
+ * through a queue.
+ */
+typedef struct shard_runtime Context_shard;
+
+/** @brief A thread's connection to every shard of a Context_shard. A client must only be used by one thread at a time. */
+typedef struct shard_client Shard_client;
+
+/** @brief A task run on a shard's thread
+ *  @see   shard_submit()
+ */
+typedef void (*shard_task_fn)(
+    Context_main *ctx_main, ///<[in] main context
+    Shard_client *self,     ///<[in] the client of the shard running the task
+    void *arg               ///<[in] the argument the task was submitted with
+    );
+
+/** @brief Starts a runtime with \a shard_count shards
+ *
+ * If \a shard_count is <= 0, one shard is started for every core in main_context.system_cpu_count.
+ * Shard i is pinned to core i modulo the number of cores.
+ *
+ * @returns A pointer to the runtime on success, or 0 on failure
+ * @see     shard_runtime_free()
+ */
+Context_shard *
+shard_runtime_create(
+    Context_main *ctx_main, ///<[in] main context
+    int shard_count,        ///<[in] number of shards
+    int client_count        ///<[in] maximum number of clients that may be attached by other threads
+    );
+
+/** @brief Waits for every submitted task to finish, stops the shards, and frees their databases */
+void
+shard_runtime_free(
+    Context_shard *runtime ///<[in] runtime
+    );
+
+/** @brief   Returns the number of shards in \a runtime */
+int
+shard_count(
+    Context_shard *runtime ///<[in] runtime
+    );
+
+/** @brief   Returns the shard that \a key belongs to */
+int
+shard_route(
+    Context_shard *runtime,  ///<[in] runtime
+    unsigned char *key,      ///<[in] key bytes
+    unsigned long key_length ///<[in] length of \a key in bytes
+    );
+
+/** @brief Returns the database of \a shard
+ *
+ * Only to be used while no tasks are running and no client is making requests.
+ */
+Record_database *
+shard_database(
+    Context_shard *runtime, ///<[in] runtime
+    int shard               ///<[in] shard
+    );
+
+/** @brief   Attaches a new client for the calling thread
+ *  @returns A pointer to the client on success, or 0 if \a runtime has no room for more clients
+ *  @see     shard_client_detach()
+ */
+Shard_client *
+shard_client_attach(
+    Context_shard *runtime ///<[in] runtime
+    );
+
+/** @brief Detaches and frees \a client. It must have no requests outstanding. */
+void
+shard_client_detach(
+    Shard_client *client ///<[in] client
+    );
+
+/** @brief   Queues \a fn to be run with \a arg on the thread of \a shard
+ *  @returns 1 on success, 0 on failure
+ *  @see     shard_wait()
+ */
+int
+shard_submit(
+    Shard_client *client, ///<[in] client to send the task through
+    int shard,            ///<[in] shard to run the task on
+    shard_task_fn fn,     ///<[in] task
+    void *arg             ///<[in] argument to pass to \a fn
+    );
+
+/** @brief Blocks until every task submitted to \a runtime has finished running */
+void
+shard_wait(
+    Context_shard *runtime ///<[in] runtime
+    );
+
+/** @brief   database_kv_alloc() on \a shard
+ *  @returns The handle of the new record on success, or -1 on failure
+ */
+Shard_handle
+shard_kv_alloc(
+    Context_main *ctx_main, ///<[in] main context
+    Shard_client *client,   ///<[in] client
+    int shard,              ///<[in] shard to allocate in, usually from shard_route()
+    unsigned char flags,    ///<[in] flags of the new record
+    unsigned long size,     ///<[in] size of the value in bytes
+    unsigned char *buffer   ///<[in] \a size bytes to initialize the value with
+    );
+
+/** @brief   database_kv_free() on the shard of \a handle
+ *  @returns 1 on success, 0 on failure
+ */
+int
+shard_kv_free(
+    Context_main *ctx_main, ///<[in] main context
+    Shard_client *client,   ///<[in] client
+    Shard_handle handle     ///<[in] record to free
+    );
+
+/** @brief   database_kv_set_value() on the shard of \a handle
+ *  @returns 1 on success, 0 on failure
+ */
+int
+shard_kv_set_value(
+    Context_main *ctx_main, ///<[in] main context
+    Shard_client *client,   ///<[in] client
+    Shard_handle handle,    ///<[in] record to change
+    unsigned long length,   ///<[in] length of \a buffer in bytes
+    unsigned char *buffer   ///<[in] new value
+    );
+
+/** @brief Copies at most \a length bytes of the value of \a handle into \a buffer
+ *
+ * The full size of the value is written to \a size.
+ *
+ * @returns 1 on success, 0 if \a handle isn't a live record
+ */
+int
+shard_kv_get(
+    Context_main *ctx_main, ///<[in]  main context
+    Shard_client *client,   ///<[in]  client
+    Shard_handle handle,    ///<[in]  record to read
+    unsigned char *buffer,  ///<[out] where to copy the value to
+    unsigned long length,   ///<[in]  length of \a buffer in bytes
+    unsigned long *size     ///<[out] size of the value in bytes (optional)
+    );
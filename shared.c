@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "shared.h"
+
+#ifndef DEBUG_SHARED
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+/** Pages in a unit of bucket x, as in paged.c */
+#define _SHARED_UNIT_PAGES(x) (((x) <= 8) ? 1UL : (1UL << ((x) - 8)))
+
+/** Largest bucket, as PTBL_CALC_BUCKET_WORD_SIZE() of any larger one overflows an int */
+#define _SHARED_BUCKET_MAX 26
+
+/** Block sizes, in pages, run from 1 to 1 << (_SHARED_ORDERS - 1) */
+#define _SHARED_ORDERS 48
+
+// Every offset is from the start of the segment, and 0 means none, as the header is there
+typedef struct shared_bucket {
+    unsigned long unit_count;
+    unsigned long unit_capacity;
+    unsigned long directory;           // Offset of unit_capacity offsets, one per unit
+    unsigned long page_usage;          // Offset of page_usage, as in ptbl_record
+    unsigned long page_usage_length;   // PTBL_CALC_PAGE_USAGE_LENGTH() of unit_count
+    unsigned long page_usage_capacity;
+    unsigned long first_free;          // No byte of page_usage before this one has a free slot
+} Shared_bucket;
+
+typedef struct shared_header {
+    char magic[8];                  // SHARED_MAGIC
+    unsigned int version;           // SHARED_VERSION
+    unsigned int broken;            // Set once a writer died while holding lock
+    unsigned long page_size;
+    unsigned long length;           // Of the whole segment in bytes
+    unsigned long sequence;         // Odd while a writer is changing anything
+    pthread_mutex_t lock;           // Robust and process-shared, held by writers
+    unsigned long top;              // Bytes of the segment handed out as blocks so far
+    unsigned long free_block[_SHARED_ORDERS]; // Freed blocks of 1 << order pages, linked through their first 8 bytes
+
+    unsigned long kv_record_count;
+    unsigned long kv_record_free_count;
+    unsigned long kv_record_capacity;
+    unsigned long kv_record_tbl;    // Offset of kv_record_capacity Record_kv
+    Shared_bucket bucket[64];
+} Shared_header;
+
+struct database_shared {
+    unsigned char *base;
+    Shared_header *header;
+    int fd;
+    unsigned long page_count;
+};
+
+// The address of length bytes at offset, or 0 if they're not all within the segment. Readers may
+// come across stale offsets, so everything they follow goes through here.
+static unsigned char *
+_shared_at(
+    Database_shared *dbs,
+    unsigned long offset,
+    unsigned long length
+) {
+    unsigned long segment = dbs->page_count * dbs->header->page_size;
+    if(!offset || offset > segment || length > segment - offset) {
+        return 0;
+    }
+    return dbs->base + offset;
+}
+
+static int
+_shared_order(
+    Database_shared *dbs,
+    unsigned long length
+) {
+    unsigned long pages = (length + dbs->header->page_size - 1) / dbs->header->page_size;
+    int order = 0;
+    while((1UL << order) < pages) {
+        order++;
+    }
+    return order;
+}
+
+// Returns the offset of a zeroed block of at least length bytes, or 0 if the segment is full
+static unsigned long
+_shared_block_alloc(
+    Database_shared *dbs,
+    unsigned long length
+) {
+    Shared_header *header = dbs->header;
+    int order = _shared_order(dbs, length);
+    if(order >= _SHARED_ORDERS) {
+        return 0;
+    }
+    unsigned long size = header->page_size << order,
+        offset = header->free_block[order];
+
+    if(offset) {
+        memcpy(&header->free_block[order], dbs->base + offset, sizeof(unsigned long));
+        memset(dbs->base + offset, 0, size);
+        return offset;
+    }
+
+    // Never handed out before, so still zero
+    if(size > header->length - header->top) {
+        DEBUG_PRINT("\tERR segment full\n");
+        return 0;
+    }
+    offset = header->top;
+    header->top += size;
+    return offset;
+}
+
+static void
+_shared_block_free(
+    Database_shared *dbs,
+    unsigned long offset,
+    unsigned long length
+) {
+    if(!offset) {
+        return;
+    }
+    int order = _shared_order(dbs, length);
+    memcpy(dbs->base + offset, &dbs->header->free_block[order], sizeof(unsigned long));
+    dbs->header->free_block[order] = offset;
+}
+
+// Moves the length bytes at offset into a new block of new_length, which it returns, or 0 on failure
+static unsigned long
+_shared_block_realloc(
+    Database_shared *dbs,
+    unsigned long offset,
+    unsigned long length,
+    unsigned long new_length
+) {
+    unsigned long new_offset = _shared_block_alloc(dbs, new_length);
+    if(!new_offset) {
+        return 0;
+    }
+    if(offset) {
+        memcpy(dbs->base + new_offset, dbs->base + offset, length);
+        _shared_block_free(dbs, offset, length);
+    }
+    return new_offset;
+}
+
+static int
+_shared_write_begin(
+    Database_shared *dbs
+) {
+    Shared_header *header = dbs->header;
+    int ret = pthread_mutex_lock(&header->lock);
+    if(ret == EOWNERDEAD) {
+        // Whatever it was changing is half done, and there's no telling what
+        DEBUG_PRINT("\tERR a writer died holding the lock\n");
+        __atomic_store_n(&header->broken, 1, __ATOMIC_RELEASE);
+        pthread_mutex_consistent(&header->lock);
+    }
+    else if(ret) {
+        return 0;
+    }
+    if(__atomic_load_n(&header->broken, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&header->lock);
+        return 0;
+    }
+
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static void
+_shared_write_end(
+    Database_shared *dbs
+) {
+    __atomic_store_n(&dbs->header->sequence, dbs->header->sequence + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dbs->header->lock);
+}
+
+// Gives bucket one more unit
+static int
+_shared_unit_add(
+    Database_shared *dbs,
+    unsigned char bucket
+) {
+    Shared_bucket *b = &dbs->header->bucket[bucket];
+
+    if(b->unit_count == b->unit_capacity) {
+        unsigned long capacity = b->unit_capacity ? b->unit_capacity * 2 : 16,
+            directory = _shared_block_realloc(dbs, b->directory, b->unit_capacity * sizeof(unsigned long), capacity * sizeof(unsigned long));
+        if(!directory) {
+            return 0;
+        }
+        b->directory = directory;
+        b->unit_capacity = capacity;
+    }
+
+    unsigned long units = b->unit_count + 1,
+        page_usage_length = PTBL_CALC_PAGE_USAGE_LENGTH(bucket, units);
+    if(page_usage_length > b->page_usage_capacity) {
+        unsigned long capacity = (b->page_usage_capacity * 2 > page_usage_length) ? b->page_usage_capacity * 2 : page_usage_length,
+            page_usage = _shared_block_realloc(dbs, b->page_usage, b->page_usage_capacity, capacity);
+        if(!page_usage) {
+            return 0;
+        }
+        b->page_usage = page_usage;
+        b->page_usage_capacity = dbs->header->page_size << _shared_order(dbs, capacity);
+    }
+
+    unsigned long unit = _shared_block_alloc(dbs, _SHARED_UNIT_PAGES(bucket) * dbs->header->page_size);
+    if(!unit) {
+        return 0;
+    }
+
+    ((unsigned long *)(dbs->base + b->directory))[b->unit_count] = unit;
+    b->page_usage_length = page_usage_length;
+    b->unit_count = units;
+
+    return 1;
+}
+
+// The same search as _database_value_alloc(), starting from first_free. Returns the slot, marked
+// as used, or -1 on failure.
+static unsigned long
+_shared_value_alloc(
+    Database_shared *dbs,
+    unsigned char bucket
+) {
+    Shared_bucket *b = &dbs->header->bucket[bucket];
+    unsigned char *page_usage = dbs->base + b->page_usage;
+    unsigned long slots = b->unit_count * PTBL_CALC_PAGE_USAGE_BITS(bucket);
+
+    for(unsigned long i = b->first_free; i < b->page_usage_length; i++) {
+        unsigned long word;
+        if(!(i % 8) && i + 8 <= b->page_usage_length) {
+            memcpy(&word, &page_usage[i], sizeof(word));
+            if(word == (unsigned long)-1) {
+                i += 7;
+                continue;
+            }
+        }
+        if(page_usage[i] == 0xFF) {
+            continue;
+        }
+        for(int j = 0; j < 8 && i * 8 + j < slots; j++) {
+            if(!(page_usage[i] & (1 << j))) {
+                page_usage[i] |= (1 << j);
+                b->first_free = i;
+                return i * 8 + j;
+            }
+        }
+    }
+
+    if(!_shared_unit_add(dbs, bucket)) {
+        return -1;
+    }
+
+    unsigned long slot = (b->unit_count - 1) * PTBL_CALC_PAGE_USAGE_BITS(bucket);
+    page_usage = dbs->base + b->page_usage;
+    page_usage[slot / 8] |= (1 << (slot % 8));
+    b->first_free = slot / 8;
+
+    return slot;
+}
+
+static void
+_shared_value_free(
+    Database_shared *dbs,
+    unsigned char bucket,
+    unsigned long slot
+) {
+    Shared_bucket *b = &dbs->header->bucket[bucket];
+    dbs->base[b->page_usage + slot / 8] &= ~((unsigned char)1 << (slot % 8));
+    if(slot / 8 < b->first_free) {
+        b->first_free = slot / 8;
+    }
+}
+
+static unsigned char *
+_shared_value(
+    Database_shared *dbs,
+    unsigned char bucket,
+    unsigned long slot
+) {
+    Shared_bucket *b = &dbs->header->bucket[bucket];
+    unsigned long slots = PTBL_CALC_PAGE_USAGE_BITS(bucket),
+        unit = slot / slots,
+        unit_count = __atomic_load_n(&b->unit_count, __ATOMIC_RELAXED);
+    if(unit >= unit_count) {
+        return 0;
+    }
+
+    unsigned long *directory = (unsigned long *)_shared_at(dbs, __atomic_load_n(&b->directory, __ATOMIC_RELAXED), unit_count * sizeof(unsigned long));
+    if(!directory) {
+        return 0;
+    }
+    return _shared_at(dbs, directory[unit] + (slot % slots) * PTBL_CALC_BUCKET_WORD_SIZE(bucket), PTBL_CALC_BUCKET_WORD_SIZE(bucket));
+}
+
+// Claims a record of kv_record_tbl as database_kv_record_alloc() does, but growing it by doubling
+static unsigned long
+_shared_kv_record_alloc(
+    Database_shared *dbs
+) {
+    Shared_header *header = dbs->header;
+    Record_kv *kv_record_tbl = (Record_kv *)(dbs->base + header->kv_record_tbl);
+
+    for(long i = header->kv_record_count - 1; i >= 0 && header->kv_record_free_count > 0; i--) {
+        if(!KV_RECORD_GET_SIZE(kv_record_tbl[i])) {
+            header->kv_record_free_count--;
+            return i;
+        }
+    }
+
+    if(header->kv_record_count == header->kv_record_capacity) {
+        unsigned long capacity = header->kv_record_capacity ? header->kv_record_capacity * 2 : 256,
+            offset = _shared_block_realloc(dbs, header->kv_record_tbl, header->kv_record_capacity * sizeof(Record_kv), capacity * sizeof(Record_kv));
+        if(!offset) {
+            return -1;
+        }
+        header->kv_record_tbl = offset;
+        header->kv_record_capacity = capacity;
+    }
+
+    return header->kv_record_count++;
+}
+
+static Database_shared *
+_shared_map(
+    Context_main *ctx_main,
+    int fd,
+    unsigned long length
+) {
+    RECORD_CREATE(Database_shared, dbs);
+    if(!dbs) {
+        return 0;
+    }
+    dbs->fd = fd;
+    dbs->page_count = length / ctx_main->system_page_size;
+    dbs->base = memory_page_map_shared(ctx_main, fd, 0, dbs->page_count);
+    if(!dbs->base) {
+        memory_free(dbs);
+        return 0;
+    }
+    dbs->header = (Shared_header *)dbs->base;
+
+    return dbs;
+}
+
+Database_shared *
+database_shared_create(
+    Context_main *ctx_main,
+    const char *path,
+    unsigned long length
+) {
+    DEBUG_PRINT("database_shared_create(path = %s, length = %lu);\n", path ? path : "(memfd)", length);
+
+    length -= length % ctx_main->system_page_size;
+    if(length <= sizeof(Shared_header) || length / ctx_main->system_page_size > 0x7FFFFFFF) {
+        return 0;
+    }
+
+    int fd = path ? open(path, O_RDWR | O_CREAT | O_EXCL, 0600) : memfd_create("b-key", 0);
+    if(fd < 0) {
+        DEBUG_PRINT("\tERR failed to create the segment: %s\n", strerror(errno));
+        return 0;
+    }
+    Database_shared *dbs = 0;
+    if(ftruncate(fd, length) != 0 || !(dbs = _shared_map(ctx_main, fd, length))) {
+        close(fd);
+        return 0;
+    }
+
+    Shared_header *header = dbs->header;
+    header->version = SHARED_VERSION;
+    header->page_size = ctx_main->system_page_size;
+    header->length = length;
+    header->top = ((sizeof(Shared_header) + header->page_size - 1) / header->page_size) * header->page_size;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int ret = pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if(ret) {
+        database_shared_detach(ctx_main, dbs);
+        return 0;
+    }
+
+    // Only a complete header has the magic, so nothing attaches to a segment still being set up
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+
+    return dbs;
+}
+
+Database_shared *
+database_shared_attach(
+    Context_main *ctx_main,
+    int fd
+) {
+    DEBUG_PRINT("database_shared_attach(fd = %d);\n", fd);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= sizeof(Shared_header) || st.st_size % ctx_main->system_page_size) {
+        return 0;
+    }
+
+    int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(own_fd < 0) {
+        return 0;
+    }
+    Database_shared *dbs = _shared_map(ctx_main, own_fd, st.st_size);
+    if(!dbs) {
+        close(own_fd);
+        return 0;
+    }
+
+    Shared_header *header = dbs->header;
+    if(memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SHARED_VERSION
+            || header->page_size != ctx_main->system_page_size
+            || header->length != st.st_size) {
+        DEBUG_PRINT("\tERR not a segment of this version and page size\n");
+        database_shared_detach(ctx_main, dbs);
+        return 0;
+    }
+
+    return dbs;
+}
+
+int
+database_shared_fd(
+    Database_shared *dbs
+) {
+    return dbs->fd;
+}
+
+void
+database_shared_detach(
+    Context_main *ctx_main,
+    Database_shared *dbs
+) {
+    if(!dbs) {
+        return;
+    }
+    memory_page_free(ctx_main, dbs->base, dbs->page_count);
+    close(dbs->fd);
+    memory_free(dbs);
+}
+
+unsigned long
+database_shared_kv_alloc(
+    Context_main *ctx_main,
+    Database_shared *dbs,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_shared_kv_alloc(flags = %02x, size = %lu);\n", flags, size);
+
+    if(!_shared_write_begin(dbs)) {
+        return -1;
+    }
+
+    unsigned char bucket = database_calc_bucket(size);
+    unsigned long slot = (bucket <= _SHARED_BUCKET_MAX) ? _shared_value_alloc(dbs, bucket) : -1, k = -1;
+    if(slot != -1) {
+        k = _shared_kv_record_alloc(dbs);
+        if(k == -1) {
+            _shared_value_free(dbs, bucket, slot);
+        }
+    }
+
+    if(k != -1) {
+        memcpy(_shared_value(dbs, bucket, slot), buffer, size);
+
+        Record_kv *kv_rec = &((Record_kv *)(dbs->base + dbs->header->kv_record_tbl))[k];
+        KV_RECORD_SET_FLAGS(kv_rec[0], flags);
+        KV_RECORD_SET_BUCKET(kv_rec[0], bucket);
+        KV_RECORD_SET_INDEX(kv_rec[0], slot);
+        KV_RECORD_SET_SIZE(kv_rec[0], size);
+    }
+
+    _shared_write_end(dbs);
+
+    return k;
+}
+
+int
+database_shared_kv_set_value(
+    Context_main *ctx_main,
+    Database_shared *dbs,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_shared_kv_set_value(k = %lu, length = %lu);\n", k, length);
+
+    if(!_shared_write_begin(dbs)) {
+        return 0;
+    }
+
+    int ret = 0;
+    Record_kv *kv_rec = &((Record_kv *)(dbs->base + dbs->header->kv_record_tbl))[k];
+    if(k < dbs->header->kv_record_count && KV_RECORD_GET_SIZE(kv_rec[0]) && database_calc_bucket(length) <= _SHARED_BUCKET_MAX) {
+        // As with database_kv_set_value(), the new value goes into a new slot, which is then swapped in
+        unsigned char bucket = database_calc_bucket(length);
+        unsigned long slot = _shared_value_alloc(dbs, bucket);
+        if(slot != -1) {
+            // Growing kv_record_tbl never happens here, but page_usage may have moved
+            memcpy(_shared_value(dbs, bucket, slot), buffer, length);
+            _shared_value_free(dbs, KV_RECORD_GET_BUCKET(kv_rec[0]), KV_RECORD_GET_INDEX(kv_rec[0]));
+
+            KV_RECORD_SET_BUCKET(kv_rec[0], bucket);
+            KV_RECORD_SET_INDEX(kv_rec[0], slot);
+            KV_RECORD_SET_SIZE(kv_rec[0], length);
+            ret = 1;
+        }
+    }
+
+    _shared_write_end(dbs);
+
+    return ret;
+}
+
+int
+database_shared_kv_free(
+    Context_main *ctx_main,
+    Database_shared *dbs,
+    unsigned long k
+) {
+    DEBUG_PRINT("database_shared_kv_free(k = %lu);\n", k);
+
+    if(!_shared_write_begin(dbs)) {
+        return 0;
+    }
+
+    Shared_header *header = dbs->header;
+    int ret = 0;
+    if(k < header->kv_record_count) {
+        Record_kv *kv_rec = &((Record_kv *)(dbs->base + header->kv_record_tbl))[k];
+        if(KV_RECORD_GET_SIZE(kv_rec[0])) {
+            unsigned char bucket = KV_RECORD_GET_BUCKET(kv_rec[0]);
+            memset(_shared_value(dbs, bucket, KV_RECORD_GET_INDEX(kv_rec[0])), 0, PTBL_CALC_BUCKET_WORD_SIZE(bucket));
+            _shared_value_free(dbs, bucket, KV_RECORD_GET_INDEX(kv_rec[0]));
+            KV_RECORD_SET_SIZE(kv_rec[0], 0);
+
+            // Same bookkeeping as database_kv_free(), except that kv_record_tbl is kept
+            if(k == header->kv_record_count - 1) header->kv_record_count--;
+            else header->kv_record_free_count++;
+        }
+        ret = 1;
+    }
+
+    _shared_write_end(dbs);
+
+    return ret;
+}
+
+int
+database_shared_read_begin(
+    Database_shared *dbs,
+    unsigned long *sequence
+) {
+    unsigned long s;
+    while((s = __atomic_load_n(&dbs->header->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        if(__atomic_load_n(&dbs->header->broken, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        sched_yield();
+    }
+    sequence[0] = s;
+
+    return !__atomic_load_n(&dbs->header->broken, __ATOMIC_ACQUIRE);
+}
+
+int
+database_shared_read_end(
+    Database_shared *dbs,
+    unsigned long sequence
+) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&dbs->header->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+unsigned char *
+database_shared_kv_get_value(
+    Database_shared *dbs,
+    unsigned long k,
+    unsigned long *size
+) {
+    Shared_header *header = dbs->header;
+    if(k >= __atomic_load_n(&header->kv_record_count, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    Record_kv *kv_rec = (Record_kv *)_shared_at(dbs, __atomic_load_n(&header->kv_record_tbl, __ATOMIC_RELAXED) + k * sizeof(Record_kv), sizeof(Record_kv));
+    if(!kv_rec) {
+        return 0;
+    }
+    Record_kv kv = kv_rec[0];
+    unsigned char bucket = KV_RECORD_GET_BUCKET(kv);
+    if(!KV_RECORD_GET_SIZE(kv) || bucket > _SHARED_BUCKET_MAX || KV_RECORD_GET_SIZE(kv) > PTBL_CALC_BUCKET_WORD_SIZE(bucket)) {
+        return 0;
+    }
+
+    if(size) size[0] = KV_RECORD_GET_SIZE(kv);
+    return _shared_value(dbs, bucket, KV_RECORD_GET_INDEX(kv));
+}
+
+unsigned long
+database_shared_kv_count(
+    Database_shared *dbs
+) {
+    return __atomic_load_n(&dbs->header->kv_record_count, __ATOMIC_RELAXED);
+}
+
+unsigned long
+database_shared_used(
+    Database_shared *dbs
+) {
+    return __atomic_load_n(&dbs->header->top, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,155 @@
+/** @file  shared.h
+ *  @brief A database in a shared memory segment, that every process which maps it reads in place
+ */
+
+/** @brief The first eight bytes of every shared segment */
+#define SHARED_MAGIC "BKEYSHRD"
+
+/** @brief Version of the segment layout. Segments of any other version are rejected. */
+#define SHARED_VERSION 1
+
+/** @brief A database that lives entirely in one shared memory segment
+ *
+ * The segment holds everything a Record_database does, kv_record_tbl and every bucket's
+ * page_usage included, but every reference inside it is an offset from the start of the segment
+ * rather than an address. So every process can map it wherever it likes, and read values straight
+ * out of it. A bucket is a directory of units, like in a Database_paged: one page of values for
+ * buckets up to 8, one value for larger ones. Units, directories and tables are carved out of the
+ * segment in blocks of a power of two pages, and freed blocks are kept on a list per size for reuse.
+ *
+ * Writers take turns on a robust process-shared mutex. Readers take no lock at all: a sequence
+ * number that writers make odd while they change anything tells a reader to retry, as with
+ * database_shared_read_begin() and database_shared_read_end(). A writer that dies partway
+ * through leaves the segment marked as broken, and every call on it fails from then on.
+ *
+ * The segment has a fixed length, chosen when it's created. It takes memory only for the pages in
+ * use.
+ */
+typedef struct database_shared Database_shared;
+
+/** @brief Creates an empty segment of \a length bytes, and maps it
+ *
+ * A \a path of 0 creates the segment with memfd_create(), otherwise it's a new file at \a path,
+ * which should be on a tmpfs like /dev/shm, and is left for the caller to unlink().
+ *
+ * @returns A pointer to the database on success, or 0 on failure
+ * @see     database_shared_attach()
+ * @see     database_shared_detach()
+ */
+Database_shared *
+database_shared_create(
+    Context_main *ctx_main, ///<[in] main context
+    const char *path,       ///<[in] file to create, or 0
+    unsigned long length    ///<[in] length of the segment in bytes
+    );
+
+/** @brief Maps the segment open as \a fd, which another process created
+ *
+ * \a fd may be inherited across fork(), opened from /proc/<pid>/fd/ or from the segment's path, or
+ * passed over a unix socket. It's duplicated, so the caller may close its own.
+ *
+ * @returns A pointer to the database on success, or 0 if \a fd isn't a segment of this
+ *          SHARED_VERSION and page size
+ */
+Database_shared *
+database_shared_attach(
+    Context_main *ctx_main, ///<[in] main context
+    int fd                  ///<[in] the segment
+    );
+
+/** @brief Returns the file descriptor of the segment \a dbs maps, to hand to database_shared_attach() */
+int
+database_shared_fd(
+    Database_shared *dbs ///<[in] database
+    );
+
+/** @brief Unmaps the segment and frees \a dbs. The segment itself lasts until nothing has it open or mapped. */
+void
+database_shared_detach(
+    Context_main *ctx_main, ///<[in] main context
+    Database_shared *dbs    ///<[in] database
+    );
+
+/** @brief   database_kv_alloc(), for a Database_shared
+ *  @returns The key of the new record on success, or -1 on failure, including when the segment is full
+ */
+unsigned long
+database_shared_kv_alloc(
+    Context_main *ctx_main, ///<[in] main context
+    Database_shared *dbs,   ///<[in] database
+    unsigned char flags,    ///<[in] flags of the new record
+    unsigned long size,     ///<[in] size of the value in bytes
+    unsigned char *buffer   ///<[in] \a size bytes to initialize the value with
+    );
+
+/** @brief   database_kv_set_value(), for a Database_shared
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_shared_kv_set_value(
+    Context_main *ctx_main, ///<[in] main context
+    Database_shared *dbs,   ///<[in] database
+    unsigned long k,        ///<[in] key of the record to change
+    unsigned long length,   ///<[in] length of \a buffer in bytes
+    unsigned char *buffer   ///<[in] new value
+    );
+
+/** @brief   database_kv_free(), for a Database_shared
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_shared_kv_free(
+    Context_main *ctx_main, ///<[in] main context
+    Database_shared *dbs,   ///<[in] database
+    unsigned long k         ///<[in] key of the record to free
+    );
+
+/** @brief Starts a read of \a dbs, waiting out any write in progress
+ *
+ * Reads are made with database_shared_kv_get_value(), and only to be trusted if
+ * database_shared_read_end() says so afterwards. Otherwise a writer got in the way, and the read
+ * should start over.
+ *
+ * @returns 1 on success, 0 if the segment is broken
+ */
+int
+database_shared_read_begin(
+    Database_shared *dbs,   ///<[in]  database
+    unsigned long *sequence ///<[out] what to give database_shared_read_end()
+    );
+
+/** @brief   Ends a read started by database_shared_read_begin()
+ *  @returns 1 if nothing was written since, so everything read in between is consistent, 0 otherwise
+ */
+int
+database_shared_read_end(
+    Database_shared *dbs,  ///<[in] database
+    unsigned long sequence ///<[in] from database_shared_read_begin()
+    );
+
+/** @brief Returns a pointer to the value of \a k in the segment, and its size
+ *
+ * Only to be called between database_shared_read_begin() and database_shared_read_end(), or by the
+ * only writer. The pointer, and the bytes behind it, may be stale if a writer got in the way, but
+ * always stay within the segment.
+ *
+ * @returns A pointer to the value on success, or 0 if there's no such record
+ */
+unsigned char *
+database_shared_kv_get_value(
+    Database_shared *dbs, ///<[in]  database
+    unsigned long k,      ///<[in]  key of the record
+    unsigned long *size   ///<[out] size of the value in bytes
+    );
+
+/** @brief Returns the number of records in kv_record_tbl, freed ones included, for iterating over it during a read */
+unsigned long
+database_shared_kv_count(
+    Database_shared *dbs ///<[in] database
+    );
+
+/** @brief Returns how many bytes of the segment have been handed out, which is about the memory it takes */
+unsigned long
+database_shared_used(
+    Database_shared *dbs ///<[in] database
+    );
@@ -1,16 +1,42 @@
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "context.h"
 #include "records.h"
 #include "memory.h"
 #include "database.h"
+#include "aggregate.h"
+#include "cursor.h"
+#include "pool.h"
+#include "scan.h"
+#include "hash.h"
+#include "btree.h"
+#include "epoch.h"
+#include "batch.h"
+#include "persist.h"
+#include "wal.h"
+#include "io.h"
+#include "paged.h"
+#include "shared.h"
+#include "server.h"
+#include "cluster.h"
+#include "replica.h"
+#include "cdc.h"
+#include "async.h"
+#include "concurrent.h"
+#include "shard.h"
 #include "debug.h"
 
 #ifndef DEBUG_TESTS
@@ -38,6 +64,28 @@ typedef struct test_context {
     Context_main *main;
 } Test_context;
 
+void test_aggregate(Test_context *ctx);
+void test_cursor(Test_context *ctx);
+void test_scan(Test_context *ctx);
+void test_hash(Test_context *ctx);
+void test_btree(Test_context *ctx);
+void test_concurrent(Test_context *ctx);
+void test_shard(Test_context *ctx);
+void test_epoch(Test_context *ctx);
+void test_snapshot(Test_context *ctx);
+void test_batch(Test_context *ctx);
+void test_persist(Test_context *ctx);
+void test_wal(Test_context *ctx);
+void test_checkpoint(Test_context *ctx);
+void test_io(Test_context *ctx);
+void test_paged(Test_context *ctx);
+void test_shared(Test_context *ctx);
+void test_server(Test_context *ctx);
+void test_cluster(Test_context *ctx);
+void test_replica(Test_context *ctx);
+void test_cdc(Test_context *ctx);
+void test_async(Test_context *ctx);
+
 int test_page_alloc(struct main_context * main_context, int pages) {
     DEBUG_PRINT("Mapping %d pages (%.2fGB)...", pages, (((float)pages * main_context->system_page_size) / 1000000000));
     unsigned char * region = memory_page_alloc(main_context, pages);
@@ -152,6 +200,7 @@ int run_tests(struct main_context * main_context) {
     // TODO: Migrate to server initialization
     ASSERT(0x1000 == main_context->system_page_size, "Standard system page size");
     ASSERT(0x80 <= main_context->system_phys_page_count, "System physical memory >=512MB");
+    ASSERT(1 <= main_context->system_cpu_count, "At least one CPU");
 
     int i = 0;
     /*for(; (1 << i) < main_context->system_phys_page_count; i++) {
@@ -421,8 +470,2297 @@ int run_tests(struct main_context * main_context) {
     memory_page_free(main_context, buffer, pages_count);
 
     database_ptbl_free(main_context, ctx->db);
+
+    test_aggregate(ctx);
+    test_cursor(ctx);
+    test_scan(ctx);
+    test_hash(ctx);
+    test_btree(ctx);
+    test_concurrent(ctx);
+    test_shard(ctx);
+    test_epoch(ctx);
+    test_snapshot(ctx);
+    test_batch(ctx);
+    test_persist(ctx);
+    test_wal(ctx);
+    test_checkpoint(ctx);
+    test_io(ctx);
+    test_paged(ctx);
+    test_shared(ctx);
+    test_server(ctx);
+    test_cluster(ctx);
+    test_replica(ctx);
+    test_cdc(ctx);
+    test_async(ctx);
+
     memory_free(ctx->db);
     memory_free(ctx);
 
     return 1;
 }
+
+
+void test_aggregate(Test_context *ctx) {
+    long sum64 = 0, min64 = 0, max64 = 0, sum32 = 0;
+    double sumd = 0;
+    unsigned long count64 = 0, count32 = 0, countd = 0;
+
+    for(int i = 0; i < 2000; i++) {
+        unsigned long k;
+        // The first 640 values fill whole 64-slot runs so that the vector kernels get exercised
+        if(i < 640 || i % 3 == 0) {
+            long v = (long)i * 3 - 700;
+            k = database_kv_alloc(ctx->main, ctx->db, KV_RECORD_TYPE_INT64, sizeof(v), (unsigned char *)&v);
+            ASSERT(-1 != k, "database_kv_alloc() INT64");
+            if(i % 7 == 0) {
+                ASSERT(database_kv_free(ctx->main, ctx->db, k), "database_kv_free() INT64");
+                continue;
+            }
+            if(!count64 || v < min64) min64 = v;
+            if(!count64 || v > max64) max64 = v;
+            sum64 += v;
+            count64++;
+        }
+        else if(i % 3 == 1) {
+            int v = 1000 - i;
+            k = database_kv_alloc(ctx->main, ctx->db, KV_RECORD_TYPE_INT32, sizeof(v), (unsigned char *)&v);
+            ASSERT(-1 != k, "database_kv_alloc() INT32");
+            sum32 += v;
+            count32++;
+        }
+        else {
+            double v = i * 0.5;
+            k = database_kv_alloc(ctx->main, ctx->db, KV_RECORD_TYPE_DOUBLE, sizeof(v), (unsigned char *)&v);
+            ASSERT(-1 != k, "database_kv_alloc() DOUBLE");
+            sumd += v;
+            countd++;
+        }
+    }
+
+    Database_aggregate result;
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_INT64, DATABASE_AGGREGATE_COUNT, &result), "database_aggregate() COUNT");
+    ASSERT(result.count == count64, "database_aggregate() COUNT correct");
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_INT64, DATABASE_AGGREGATE_SUM, &result), "database_aggregate() SUM");
+    ASSERT(result.count == count64 && result.value.i == sum64, "database_aggregate() INT64 SUM correct");
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_INT64, DATABASE_AGGREGATE_MIN, &result), "database_aggregate() MIN");
+    ASSERT(result.value.i == min64, "database_aggregate() INT64 MIN correct");
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_INT64, DATABASE_AGGREGATE_MAX, &result), "database_aggregate() MAX");
+    ASSERT(result.value.i == max64, "database_aggregate() INT64 MAX correct");
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_INT32, DATABASE_AGGREGATE_SUM, &result), "database_aggregate() INT32 SUM");
+    ASSERT(result.count == count32 && result.value.i == sum32, "database_aggregate() INT32 SUM correct");
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_DOUBLE, DATABASE_AGGREGATE_SUM, &result), "database_aggregate() DOUBLE SUM");
+    ASSERT(result.count == countd && result.value.d == sumd, "database_aggregate() DOUBLE SUM correct");
+
+    ASSERT(database_aggregate(ctx->main, ctx->db, 5, KV_RECORD_TYPE_DOUBLE, DATABASE_AGGREGATE_SUM, &result), "database_aggregate() empty bucket");
+    ASSERT(result.count == 0, "database_aggregate() empty bucket has no values");
+
+    ASSERT(!database_aggregate(ctx->main, ctx->db, 0, KV_RECORD_TYPE_RAW, DATABASE_AGGREGATE_SUM, &result), "database_aggregate() rejects RAW");
+
+    database_ptbl_free(ctx->main, ctx->db);
+}
+
+void test_cursor(Test_context *ctx) {
+    unsigned char value[100];
+    unsigned long live = 0;
+
+    // Spread values over buckets 0 - 2 and leave holes behind
+    for(int i = 0; i < 600; i++) {
+        unsigned long length = 10 + (i % 3) * 20;
+        memset(value, i & 0xFF, length);
+        unsigned long k = database_kv_alloc(ctx->main, ctx->db, KV_RECORD_TYPE_RAW, length, value);
+        ASSERT(-1 != k, "database_kv_alloc()");
+        live++;
+    }
+    for(unsigned long k = 0; k < ctx->db->kv_record_count; k += 5) {
+        ASSERT(database_kv_free(ctx->main, ctx->db, k), "database_kv_free()");
+        live--;
+    }
+
+    unsigned char *seen = memory_alloc(ctx->db->kv_record_count);
+    unsigned long visited = 0, k, size, token = 0, last_bucket = 0;
+    unsigned char *region, *last_region = 0;
+    Database_cursor cursor;
+
+    // Pause the scan every 97 values and resume it from the token
+    do {
+        ASSERT(database_cursor_open(ctx->main, ctx->db, &cursor, token), "database_cursor_open()");
+        for(int n = 0; n < 97 && database_cursor_next(ctx->main, &cursor, &k, &region, &size); n++) {
+            ASSERT(k < ctx->db->kv_record_count && !seen[k], "database_cursor_next() visits each key once");
+            seen[k] = 1;
+            visited++;
+
+            ASSERT(region == database_kv_get_value(ctx->main, ctx->db, 0, k), "database_cursor_next() value pointer");
+            ASSERT(size == KV_RECORD_GET_SIZE(ctx->db->kv_record_tbl[k]), "database_cursor_next() value size");
+
+            unsigned long bucket = KV_RECORD_GET_BUCKET(ctx->db->kv_record_tbl[k]);
+            ASSERT(bucket > last_bucket || (bucket == last_bucket && region > last_region), "database_cursor_next() physical order");
+            last_bucket = bucket;
+            last_region = region;
+        }
+        token = database_cursor_token(&cursor);
+        database_cursor_close(&cursor);
+    } while(token != DATABASE_CURSOR_END);
+
+    ASSERT(visited == live, "database_cursor_next() visits every live value");
+
+    memory_free(seen);
+    database_ptbl_free(ctx->main, ctx->db);
+}
+
+static void test_pool_task(void *arg, int worker) {
+    atomic_fetch_add((atomic_long *)arg, 1);
+}
+
+static void test_scan_map(void *partial, unsigned long k, unsigned char *value, unsigned long size, void *arg) {
+    long v;
+    memcpy(&v, value, sizeof(v));
+    ((long *)partial)[0] += v;
+    ((long *)partial)[1]++;
+}
+
+static void test_scan_merge(void *result, void *partial, void *arg) {
+    ((long *)result)[0] += ((long *)partial)[0];
+    ((long *)result)[1] += ((long *)partial)[1];
+}
+
+void test_scan(Test_context *ctx) {
+    Context_pool *pool = pool_create(ctx->main, 4);
+    ASSERT(pool != 0, "pool_create()");
+    ASSERT(pool_thread_count(pool) == 4, "pool_thread_count()");
+
+    atomic_long counter;
+    atomic_init(&counter, 0);
+    for(int i = 0; i < 10000; i++) {
+        pool_submit(pool, test_pool_task, &counter);
+    }
+    pool_wait(pool);
+    ASSERT(atomic_load(&counter) == 10000, "pool_wait() waits for every task");
+
+    long expected[2] = { 0, 0 };
+    unsigned char value[300];
+    memset(value, 0, sizeof(value));
+
+    // Enough values to split bucket 0 into several morsels, plus a few larger buckets
+    for(long i = 0; i < 20000; i++) {
+        unsigned long length = (i % 10 == 0) ? 16 << (i % 4) : sizeof(long);
+        memcpy(value, &i, sizeof(i));
+        unsigned long k = database_kv_alloc(ctx->main, ctx->db, KV_RECORD_TYPE_INT64, length, value);
+        if(k == -1) {
+            ASSERT(k != -1, "database_kv_alloc()");
+        }
+        if(i % 11 == 0) {
+            database_kv_free(ctx->main, ctx->db, k);
+            continue;
+        }
+        expected[0] += i;
+        expected[1]++;
+    }
+
+    long result[2] = { 0, 0 };
+    Database_scan scan = { sizeof(result), 0, test_scan_map, test_scan_merge, 0 };
+    ASSERT(database_scan(ctx->main, ctx->db, pool, &scan, result), "database_scan()");
+    ASSERT(result[1] == expected[1], "database_scan() visits every live value");
+    ASSERT(result[0] == expected[0], "database_scan() merges partial results");
+
+    pool_free(pool);
+    database_ptbl_free(ctx->main, ctx->db);
+}
+
+void test_hash(Test_context *ctx) {
+    char key[32];
+    int length;
+
+    Index_hash *index = hash_index_create(ctx->main, ctx->db);
+    ASSERT(index != 0, "hash_index_create()");
+
+    ASSERT(hash_bytes((unsigned char *)"b-key", 5) == hash_bytes((unsigned char *)"b-key", 5), "hash_bytes() is stable");
+    ASSERT(hash_bytes((unsigned char *)"b-key", 5) != hash_bytes((unsigned char *)"b-kez", 5), "hash_bytes() differs");
+
+    // Enough keys to go through several incremental resizes
+    for(int i = 0; i < 5000; i++) {
+        length = sprintf(key, "key-%d", i);
+        ASSERT(hash_index_put(ctx->main, index, (unsigned char *)key, length, i), "hash_index_put()");
+        if(i % 500 == 0) {
+            // Lookups must work while a migration is in progress
+            for(int j = 0; j <= i; j += 37) {
+                length = sprintf(key, "key-%d", j);
+                ASSERT(hash_index_get(ctx->main, index, (unsigned char *)key, length) == j, "hash_index_get() during resize");
+            }
+        }
+    }
+    ASSERT(index->count == 5000, "hash_index count");
+
+    for(int i = 0; i < 5000; i += 2) {
+        length = sprintf(key, "key-%d", i);
+        ASSERT(hash_index_put(ctx->main, index, (unsigned char *)key, length, i * 10), "hash_index_put() replaces");
+    }
+    for(int i = 0; i < 5000; i += 3) {
+        length = sprintf(key, "key-%d", i);
+        ASSERT(hash_index_delete(ctx->main, index, (unsigned char *)key, length), "hash_index_delete()");
+    }
+    ASSERT(!hash_index_delete(ctx->main, index, (unsigned char *)"missing", 7), "hash_index_delete() missing key");
+
+    for(int i = 0; i < 5000; i++) {
+        length = sprintf(key, "key-%d", i);
+        unsigned long expected = (i % 3 == 0) ? -1 : (i % 2 == 0) ? i * 10 : i;
+        ASSERT(hash_index_get(ctx->main, index, (unsigned char *)key, length) == expected, "hash_index_get()");
+    }
+    ASSERT(hash_index_get(ctx->main, index, (unsigned char *)"key-", 4) == -1, "hash_index_get() missing key");
+
+    hash_index_free(ctx->main, index);
+    unsigned long live = 0;
+    for(unsigned long k = 0; k < ctx->db->kv_record_count; k++) {
+        if(KV_RECORD_GET_SIZE(ctx->db->kv_record_tbl[k])) live++;
+    }
+    ASSERT(live == 0, "hash_index_free() frees key bytes");
+
+    database_ptbl_free(ctx->main, ctx->db);
+}
+
+static int test_btree_visit(unsigned char *key, unsigned long key_length, unsigned long value_k, void *arg) {
+    unsigned long *state = (unsigned long *)arg;
+    // state[0] counts keys, state[1] checks that values arrive in ascending order
+    if(state[0] > 0 && value_k <= state[1]) {
+        state[2] = 1;
+    }
+    state[0]++;
+    state[1] = value_k;
+    return 1;
+}
+
+void test_btree(Test_context *ctx) {
+    char key[32];
+    int length;
+
+    Index_btree *index = btree_index_create(ctx->main, ctx->db);
+    ASSERT(index != 0, "btree_index_create()");
+
+    // Zero-padded keys sort in the same order as their numbers. Insert them out of order.
+    for(int i = 0; i < 20000; i++) {
+        int n = (i * 7919) % 20000;
+        length = sprintf(key, "user:%08d", n);
+        ASSERT(btree_index_put(ctx->main, index, (unsigned char *)key, length, n), "btree_index_put()");
+    }
+    ASSERT(index->count == 20000 && index->height > 1, "btree_index_put() splits nodes");
+
+    // Keys that share their first eight bytes, or are prefixes of each other
+    ASSERT(btree_index_put(ctx->main, index, (unsigned char *)"user:", 5, 100000), "btree_index_put() prefix key");
+    ASSERT(btree_index_get(ctx->main, index, (unsigned char *)"user:", 5) == 100000, "btree_index_get() prefix key");
+    ASSERT(btree_index_delete(ctx->main, index, (unsigned char *)"user:", 5), "btree_index_delete() prefix key");
+
+    for(int n = 0; n < 20000; n += 13) {
+        length = sprintf(key, "user:%08d", n);
+        ASSERT(btree_index_get(ctx->main, index, (unsigned char *)key, length) == n, "btree_index_get()");
+    }
+    ASSERT(btree_index_get(ctx->main, index, (unsigned char *)"user:00020000", 13) == -1, "btree_index_get() missing key");
+
+    // Ordered iteration
+    Btree_cursor cursor;
+    unsigned char *found;
+    unsigned long found_length, value_k, expected = 0;
+    btree_index_seek(ctx->main, index, &cursor, 0, 0);
+    while(btree_index_next(ctx->main, &cursor, &found, &found_length, &value_k)) {
+        if(value_k != expected) break;
+        expected++;
+    }
+    ASSERT(expected == 20000, "btree_index_next() iterates in order");
+
+    // Range and prefix scans
+    unsigned long state[3] = { 0, 0, 0 };
+    ASSERT(btree_index_range(ctx->main, index, (unsigned char *)"user:00000100", 13, (unsigned char *)"user:00000200", 13, test_btree_visit, state) == 100, "btree_index_range()");
+    ASSERT(state[0] == 100 && state[2] == 0, "btree_index_range() visits in order");
+
+    memset(state, 0, sizeof(state));
+    ASSERT(btree_index_prefix(ctx->main, index, (unsigned char *)"user:0001", 9, test_btree_visit, state) == 10000, "btree_index_prefix()");
+    ASSERT(state[2] == 0, "btree_index_prefix() visits in order");
+
+    for(int n = 0; n < 20000; n += 2) {
+        length = sprintf(key, "user:%08d", n);
+        ASSERT(btree_index_delete(ctx->main, index, (unsigned char *)key, length), "btree_index_delete()");
+    }
+    ASSERT(!btree_index_delete(ctx->main, index, (unsigned char *)"user:00000000", 13), "btree_index_delete() missing key");
+    ASSERT(btree_index_range(ctx->main, index, 0, 0, 0, 0, test_btree_visit, memset(state, 0, sizeof(state))) == 10000, "btree_index_range() after deletes");
+
+    btree_index_free(ctx->main, index);
+
+    // Bulk load from sorted input
+    unsigned long count = 5000;
+    unsigned char **keys = (unsigned char **)memory_alloc(count * sizeof(unsigned char *));
+    unsigned long *lengths = (unsigned long *)memory_alloc(count * sizeof(unsigned long));
+    unsigned long *values = (unsigned long *)memory_alloc(count * sizeof(unsigned long));
+    for(unsigned long i = 0; i < count; i++) {
+        keys[i] = memory_alloc(16);
+        lengths[i] = sprintf((char *)keys[i], "k%06lu", i);
+        values[i] = i;
+    }
+
+    index = btree_index_create(ctx->main, ctx->db);
+    ASSERT(btree_index_bulk_load(ctx->main, index, keys, lengths, values, count), "btree_index_bulk_load()");
+    ASSERT(index->count == count, "btree_index_bulk_load() count");
+    for(unsigned long i = 0; i < count; i += 7) {
+        ASSERT(btree_index_get(ctx->main, index, keys[i], lengths[i]) == i, "btree_index_get() after bulk load");
+    }
+    memset(state, 0, sizeof(state));
+    ASSERT(btree_index_range(ctx->main, index, 0, 0, 0, 0, test_btree_visit, state) == count && state[2] == 0, "btree_index_range() after bulk load");
+    ASSERT(btree_index_put(ctx->main, index, (unsigned char *)"k0000005", 8, 1), "btree_index_put() after bulk load");
+    ASSERT(btree_index_get(ctx->main, index, (unsigned char *)"k0000005", 8) == 1, "btree_index_get() after put");
+    btree_index_free(ctx->main, index);
+
+    // Out of order input is rejected
+    index = btree_index_create(ctx->main, ctx->db);
+    unsigned char *swap = keys[10];
+    keys[10] = keys[11];
+    keys[11] = swap;
+    ASSERT(!btree_index_bulk_load(ctx->main, index, keys, lengths, values, count), "btree_index_bulk_load() rejects unsorted input");
+    btree_index_free(ctx->main, index);
+
+    for(unsigned long i = 0; i < count; i++) {
+        memory_free(keys[i]);
+    }
+    memory_free(keys);
+    memory_free(lengths);
+    memory_free(values);
+
+    database_ptbl_free(ctx->main, ctx->db);
+}
+
+#define TEST_CONCURRENT_THREADS 4
+#define TEST_CONCURRENT_KEYS 256
+#define TEST_CONCURRENT_OPS 4000
+
+typedef struct test_concurrent_worker {
+    Context_main *main;
+    Database_concurrent *dbc;
+    atomic_ulong *shared;                    // Keys of every worker, for the others to read
+    unsigned long keys[TEST_CONCURRENT_KEYS];
+    unsigned char fill[TEST_CONCURRENT_KEYS];
+    unsigned long length[TEST_CONCURRENT_KEYS];
+    int index;
+    int errors;
+} Test_concurrent_worker;
+
+// Every value is one byte repeated, so any torn read shows up as a mix of bytes
+static void *test_concurrent_run(void *arg) {
+    Test_concurrent_worker *w = (Test_concurrent_worker *)arg;
+    unsigned char value[600], read[600];
+    unsigned long size, seed = w->index + 1;
+
+    for(int i = 0; i < TEST_CONCURRENT_OPS; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        int slot = (seed >> 33) % TEST_CONCURRENT_KEYS, op = (seed >> 20) % 8;
+        unsigned char fill = (seed >> 40) | 1;
+        unsigned long length = 8 + (seed >> 48) % 500;
+        memset(value, fill, length);
+
+        if(w->keys[slot] == -1) {
+            w->keys[slot] = database_concurrent_kv_alloc(w->main, w->dbc, KV_RECORD_TYPE_RAW, length, value);
+            if(w->keys[slot] == -1) w->errors++;
+            w->fill[slot] = fill;
+            w->length[slot] = length;
+            atomic_store(&w->shared[w->index * TEST_CONCURRENT_KEYS + slot], w->keys[slot]);
+        }
+        else if(op == 0) {
+            atomic_store(&w->shared[w->index * TEST_CONCURRENT_KEYS + slot], -1);
+            if(!database_concurrent_kv_free(w->main, w->dbc, w->keys[slot])) w->errors++;
+            w->keys[slot] = -1;
+        }
+        else if(op == 1) {
+            if(!database_concurrent_kv_set_value(w->main, w->dbc, w->keys[slot], length, value)) w->errors++;
+            w->fill[slot] = fill;
+            w->length[slot] = length;
+        }
+        else if(op == 2) {
+            // Our own keys must read back exactly
+            if(!database_concurrent_kv_get(w->main, w->dbc, w->keys[slot], read, sizeof(read), &size, 0) ||
+                    size != w->length[slot] || read[0] != w->fill[slot] || read[size - 1] != w->fill[slot]) {
+                w->errors++;
+            }
+        }
+        else {
+            // Somebody else's key may be freed or even reused under us, but must never be torn
+            unsigned long k = atomic_load(&w->shared[(seed >> 24) % (TEST_CONCURRENT_THREADS * TEST_CONCURRENT_KEYS)]);
+            if(k != -1 && database_concurrent_kv_get(w->main, w->dbc, k, read, sizeof(read), &size, 0)) {
+                for(unsigned long j = 1; j < size; j++) {
+                    if(read[j] != read[0]) {
+                        w->errors++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+#define TEST_CONCURRENT_READERS 3
+#define TEST_CONCURRENT_GROWTH 20000
+
+typedef struct test_concurrent_reader {
+    Context_main *main;
+    Database_concurrent *dbc;
+    unsigned long *keys;
+    atomic_int *done;
+    unsigned long reads;
+    int errors;
+} Test_concurrent_reader;
+
+// A value's size is tied to its byte, so a read mixing two versions shows up either way
+#define TEST_CONCURRENT_READ_LENGTH(fill) (8 + (fill) * 2)
+
+static void *test_concurrent_read(void *arg) {
+    Test_concurrent_reader *r = (Test_concurrent_reader *)arg;
+    unsigned char read[600];
+    unsigned long size;
+
+    for(unsigned long i = 0; !atomic_load(r->done) || i < TEST_CONCURRENT_KEYS; i++) {
+        unsigned long k = r->keys[i % TEST_CONCURRENT_KEYS];
+        if(!database_concurrent_kv_get(r->main, r->dbc, k, read, sizeof(read), &size, 0) || size != TEST_CONCURRENT_READ_LENGTH(read[0])) {
+            r->errors++;
+            continue;
+        }
+        for(unsigned long j = 1; j < size; j++) {
+            if(read[j] != read[0]) {
+                r->errors++;
+                break;
+            }
+        }
+        r->reads++;
+    }
+
+    return 0;
+}
+
+// Lock-free readers against a writer that keeps changing their values, while the kv table and the
+// buckets grow (and move) under them
+static void test_concurrent_readers(Test_context *ctx) {
+    Database_concurrent *dbc = database_concurrent_create(ctx->main);
+    unsigned long keys[TEST_CONCURRENT_KEYS];
+    unsigned char value[600];
+    Test_concurrent_reader readers[TEST_CONCURRENT_READERS];
+    pthread_t threads[TEST_CONCURRENT_READERS];
+    atomic_int done;
+
+    atomic_init(&done, 0);
+    for(int i = 0; i < TEST_CONCURRENT_KEYS; i++) {
+        memset(value, i, TEST_CONCURRENT_READ_LENGTH(i));
+        keys[i] = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, TEST_CONCURRENT_READ_LENGTH(i), value);
+    }
+    for(int i = 0; i < TEST_CONCURRENT_READERS; i++) {
+        readers[i] = (Test_concurrent_reader){ ctx->main, dbc, keys, &done, 0, 0 };
+        pthread_create(&threads[i], 0, test_concurrent_read, &readers[i]);
+    }
+
+    int errors = 0;
+    for(unsigned long i = 0; i < TEST_CONCURRENT_GROWTH; i++) {
+        unsigned char fill = (i * 7) & 0xFF;
+        memset(value, fill, TEST_CONCURRENT_READ_LENGTH(fill));
+        if(!database_concurrent_kv_set_value(ctx->main, dbc, keys[i % TEST_CONCURRENT_KEYS], TEST_CONCURRENT_READ_LENGTH(fill), value)) errors++;
+        if(database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 8 + i % 64, value) == -1) errors++;
+        if((i % 1000) == 0) sched_yield();
+    }
+    atomic_store(&done, 1);
+
+    unsigned long reads = 0;
+    for(int i = 0; i < TEST_CONCURRENT_READERS; i++) {
+        pthread_join(threads[i], 0);
+        errors += readers[i].errors;
+        reads += readers[i].reads;
+    }
+    ASSERT(errors == 0, "lock-free reads during set_value and growth");
+    ASSERT(reads >= TEST_CONCURRENT_READERS * TEST_CONCURRENT_KEYS, "lock-free readers made progress");
+
+    database_concurrent_free(ctx->main, dbc);
+}
+
+void test_concurrent(Test_context *ctx) {
+    Database_concurrent *dbc = database_concurrent_create(ctx->main);
+    ASSERT(dbc != 0, "database_concurrent_create()");
+
+    atomic_ulong *shared = (atomic_ulong *)memory_alloc(TEST_CONCURRENT_THREADS * TEST_CONCURRENT_KEYS * sizeof(atomic_ulong));
+    Test_concurrent_worker *workers = (Test_concurrent_worker *)memory_alloc(TEST_CONCURRENT_THREADS * sizeof(Test_concurrent_worker));
+    pthread_t threads[TEST_CONCURRENT_THREADS];
+
+    for(int i = 0; i < TEST_CONCURRENT_THREADS * TEST_CONCURRENT_KEYS; i++) {
+        atomic_init(&shared[i], -1);
+    }
+    for(int i = 0; i < TEST_CONCURRENT_THREADS; i++) {
+        workers[i].main = ctx->main;
+        workers[i].dbc = dbc;
+        workers[i].shared = shared;
+        workers[i].index = i;
+        memset(workers[i].keys, 0xFF, sizeof(workers[i].keys));
+        pthread_create(&threads[i], 0, test_concurrent_run, &workers[i]);
+    }
+
+    int errors = 0;
+    unsigned long live = 0;
+    for(int i = 0; i < TEST_CONCURRENT_THREADS; i++) {
+        pthread_join(threads[i], 0);
+        errors += workers[i].errors;
+        for(int j = 0; j < TEST_CONCURRENT_KEYS; j++) {
+            if(workers[i].keys[j] != -1) live++;
+        }
+    }
+    ASSERT(errors == 0, "concurrent alloc/set/get/free");
+
+    // Once the threads are done, the plain API sees the same records
+    Record_database *rec_database = database_concurrent_record(dbc);
+    unsigned long found = 0;
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        if(KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) found++;
+    }
+    ASSERT(found == live, "database_concurrent_record() holds every live record");
+
+    // The workers have exited, so their magazines must have handed every reserved slot back, and
+    // the slots they freed can be reclaimed now that nobody is reading
+    database_concurrent_reclaim(ctx->main, dbc);
+    unsigned long used = 0;
+    for(unsigned long i = 0; i < rec_database->ptbl_record_count; i++) {
+        for(unsigned long j = 0; j < rec_database->ptbl_record_tbl[i].page_usage_length; j++) {
+            used += __builtin_popcount(rec_database->ptbl_record_tbl[i].page_usage[j]);
+        }
+    }
+    ASSERT(used == live, "magazines are emptied when their thread exits");
+
+    // Records in this thread's magazine are as free as those handed back
+    unsigned char one = 1;
+    database_concurrent_kv_free(ctx->main, dbc, database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 1, &one));
+    rec_database = database_concurrent_record(dbc);
+    ASSERT(rec_database->kv_record_free_count == rec_database->kv_record_count - live, "database_concurrent_record() counts every record that isn't live as free");
+
+    int mismatched = 0;
+    for(int i = 0; i < TEST_CONCURRENT_THREADS; i++) {
+        for(int j = 0; j < TEST_CONCURRENT_KEYS; j++) {
+            unsigned char *value;
+            if(workers[i].keys[j] == -1) continue;
+            value = database_kv_get_value(ctx->main, rec_database, 0, workers[i].keys[j]);
+            if(!value || value[0] != workers[i].fill[j] || KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[workers[i].keys[j]]) != workers[i].length[j]) {
+                mismatched++;
+            }
+        }
+    }
+    ASSERT(mismatched == 0, "concurrent values read back through the plain API");
+
+    memory_free(workers);
+    memory_free(shared);
+    database_concurrent_free(ctx->main, dbc);
+
+    test_concurrent_readers(ctx);
+
+    // A pointer to a value outlives the record being overwritten and freed, until the read section ends
+    dbc = database_concurrent_create(ctx->main);
+    unsigned char value[100];
+    unsigned long size;
+    memset(value, 0x5A, sizeof(value));
+    unsigned long k = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, sizeof(value), value);
+
+    ASSERT(database_concurrent_read_begin(dbc), "database_concurrent_read_begin()");
+    unsigned char *held = database_concurrent_kv_get_value(dbc, k, &size, 0);
+    ASSERT(held && size == sizeof(value) && held[0] == 0x5A, "database_concurrent_kv_get_value()");
+
+    memset(value, 0xA5, sizeof(value));
+    database_concurrent_kv_set_value(ctx->main, dbc, k, sizeof(value), value);
+    unsigned char *current = database_concurrent_kv_get_value(dbc, k, &size, 0);
+    ASSERT(current && current != held && current[0] == 0xA5, "database_concurrent_kv_get_value() sees the new value");
+    database_concurrent_kv_free(ctx->main, dbc, k);
+    ASSERT(database_concurrent_kv_get_value(dbc, k, 0, 0) == 0, "database_concurrent_kv_get_value() of a freed record");
+    database_concurrent_reclaim(ctx->main, dbc);
+    ASSERT(held[0] == 0x5A && held[sizeof(value) - 1] == 0x5A && current[0] == 0xA5, "values stay put during a read section");
+    database_concurrent_read_end(dbc);
+
+    ASSERT(database_concurrent_reclaim(ctx->main, dbc) == 0, "database_concurrent_reclaim() after the read section");
+    ASSERT(held[0] == 0 && current[0] == 0, "values are freed after the read section");
+
+    database_concurrent_free(ctx->main, dbc);
+}
+
+#define TEST_SNAPSHOT_KEYS 64
+#define TEST_SNAPSHOT_ROUNDS 300
+
+typedef struct test_snapshot_writer {
+    Context_main *main;
+    Database_concurrent *dbc;
+    unsigned long *keys;
+    atomic_int done;
+} Test_snapshot_writer;
+
+// Sets every key to the round number, in key order, so a snapshot must see a run of round r + 1
+// followed by a run of round r
+static void *test_snapshot_write(void *arg) {
+    Test_snapshot_writer *w = (Test_snapshot_writer *)arg;
+    for(unsigned long round = 1; round <= TEST_SNAPSHOT_ROUNDS; round++) {
+        for(int i = 0; i < TEST_SNAPSHOT_KEYS; i++) {
+            // Vary the size too, so that versions move between buckets
+            unsigned long value[40] = { round };
+            database_concurrent_kv_set_value(w->main, w->dbc, w->keys[i], 8 + (round % 5) * 64, (unsigned char *)value);
+        }
+    }
+    atomic_store(&w->done, 1);
+    return 0;
+}
+
+void test_snapshot(Test_context *ctx) {
+    Database_concurrent *dbc = database_concurrent_create(ctx->main);
+    unsigned long keys[TEST_SNAPSHOT_KEYS], value[40] = { 0 }, read[40], size;
+
+    for(int i = 0; i < TEST_SNAPSHOT_KEYS; i++) {
+        keys[i] = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    }
+
+    // Writes made after a snapshot was taken don't show up in it
+    Database_snapshot *snapshot = database_concurrent_snapshot_begin(ctx->main, dbc);
+    ASSERT(snapshot != 0, "database_concurrent_snapshot_begin()");
+    value[0] = 1;
+    database_concurrent_kv_set_value(ctx->main, dbc, keys[0], 16, (unsigned char *)value);
+    unsigned long added = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    database_concurrent_kv_free(ctx->main, dbc, keys[1]);
+
+    ASSERT(database_concurrent_snapshot_get(ctx->main, snapshot, keys[0], (unsigned char *)read, sizeof(read), &size, 0) && size == 8 && read[0] == 0, "snapshot keeps an overwritten value");
+    ASSERT(database_concurrent_snapshot_get(ctx->main, snapshot, keys[1], (unsigned char *)read, sizeof(read), &size, 0) && read[0] == 0, "snapshot keeps a freed value");
+    ASSERT(!database_concurrent_snapshot_get(ctx->main, snapshot, added, (unsigned char *)read, sizeof(read), &size, 0), "snapshot doesn't see a later record");
+    ASSERT(database_concurrent_kv_get(ctx->main, dbc, keys[0], (unsigned char *)read, sizeof(read), &size, 0) && size == 16 && read[0] == 1, "writes carry on past a snapshot");
+
+    // The freed record gets reused, and the snapshot still sees its old value
+    unsigned long reused = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    ASSERT(database_concurrent_snapshot_get(ctx->main, snapshot, reused, (unsigned char *)read, sizeof(read), &size, 0) == (reused == keys[1]) &&
+            (reused != keys[1] || read[0] == 0), "snapshot of a reused record");
+    database_concurrent_snapshot_end(ctx->main, snapshot);
+    if(reused == keys[1]) keys[1] = -1;
+    else database_concurrent_kv_free(ctx->main, dbc, reused);
+    database_concurrent_kv_free(ctx->main, dbc, added);
+
+    // Snapshots taken under a running writer are consistent
+    Test_snapshot_writer writer = { ctx->main, dbc, keys };
+    pthread_t thread;
+    int inconsistent = 0, snapshots = 0;
+    if(keys[1] == -1) {
+        keys[1] = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    }
+    else {
+        database_concurrent_kv_set_value(ctx->main, dbc, keys[1], 8, (unsigned char *)value);
+    }
+    atomic_init(&writer.done, 0);
+    pthread_create(&thread, 0, test_snapshot_write, &writer);
+    while(!atomic_load(&writer.done) || snapshots == 0) {
+        snapshot = database_concurrent_snapshot_begin(ctx->main, dbc);
+        unsigned long first = -1, last = -1;
+        for(int i = 0; i < TEST_SNAPSHOT_KEYS; i++) {
+            if(!database_concurrent_snapshot_get(ctx->main, snapshot, keys[i], (unsigned char *)read, sizeof(read), &size, 0) || (first != -1 && read[0] > last) || (first != -1 && read[0] + 1 < first)) {
+                inconsistent++;
+                break;
+            }
+            if(first == -1) first = read[0];
+            last = read[0];
+            sched_yield();
+        }
+        database_concurrent_snapshot_end(ctx->main, snapshot);
+        snapshots++;
+    }
+    pthread_join(thread, 0);
+    ASSERT(inconsistent == 0, "snapshots under a running writer");
+
+    // With every snapshot gone, every old version has been dropped
+    database_concurrent_reclaim(ctx->main, dbc);
+    Record_database *rec_database = database_concurrent_record(dbc);
+    unsigned long used = 0;
+    for(unsigned long i = 0; i < rec_database->ptbl_record_count; i++) {
+        for(unsigned long j = 0; j < rec_database->ptbl_record_tbl[i].page_usage_length; j++) {
+            used += __builtin_popcount(rec_database->ptbl_record_tbl[i].page_usage[j]);
+        }
+    }
+    // Apart from what our own magazine holds on to
+    ASSERT(used <= TEST_SNAPSHOT_KEYS + CONCURRENT_MAGAZINE_SIZE * CONCURRENT_MAGAZINE_BUCKETS, "old versions are freed once no snapshot needs them");
+
+    database_concurrent_free(ctx->main, dbc);
+}
+
+#define TEST_SHARD_COUNT 4
+#define TEST_SHARD_KEYS 2000
+
+typedef struct test_shard_task {
+    Shard_handle *external;  // Handles allocated by the test's own client
+    Shard_handle local[100];
+    Shard_handle remote[100];
+    long sum;
+    int shard;
+    int errors;
+} Test_shard_task;
+
+static void test_shard_run(Context_main *ctx_main, Shard_client *self, void *arg) {
+    Test_shard_task *task = (Test_shard_task *)arg;
+    long value;
+
+    for(int i = 0; i < 100; i++) {
+        value = task->shard * 1000 + i;
+
+        // Our own shard runs inline, the next one goes through its queue
+        task->local[i] = shard_kv_alloc(ctx_main, self, task->shard, KV_RECORD_TYPE_INT64, sizeof(value), (unsigned char *)&value);
+        task->remote[i] = shard_kv_alloc(ctx_main, self, (task->shard + 1) % TEST_SHARD_COUNT, KV_RECORD_TYPE_INT64, sizeof(value), (unsigned char *)&value);
+        if(task->local[i] == -1 || task->remote[i] == -1 || SHARD_HANDLE_GET_SHARD(task->local[i]) != task->shard) {
+            task->errors++;
+        }
+
+        if(shard_kv_get(ctx_main, self, task->external[i * 7], (unsigned char *)&value, sizeof(value), 0)) {
+            task->sum += value;
+        }
+        else {
+            task->errors++;
+        }
+    }
+}
+
+void test_shard(Test_context *ctx) {
+    Context_shard *runtime = shard_runtime_create(ctx->main, TEST_SHARD_COUNT, 1);
+    ASSERT(runtime != 0, "shard_runtime_create()");
+    ASSERT(shard_count(runtime) == TEST_SHARD_COUNT, "shard_count()");
+
+    Shard_client *client = shard_client_attach(runtime);
+    ASSERT(client != 0, "shard_client_attach()");
+    ASSERT(shard_client_attach(runtime) == 0, "shard_client_attach() beyond client_count");
+
+    Shard_handle *handles = (Shard_handle *)memory_alloc(TEST_SHARD_KEYS * sizeof(Shard_handle));
+    int per_shard[TEST_SHARD_COUNT] = { 0 }, wrong = 0;
+    char key[32];
+    long value, expected_sum = 0;
+    unsigned long size;
+
+    for(long i = 0; i < TEST_SHARD_KEYS; i++) {
+        int length = sprintf(key, "key-%ld", i), shard = shard_route(runtime, (unsigned char *)key, length);
+        handles[i] = shard_kv_alloc(ctx->main, client, shard, KV_RECORD_TYPE_INT64, sizeof(i), (unsigned char *)&i);
+        if(handles[i] == -1 || SHARD_HANDLE_GET_SHARD(handles[i]) != shard) wrong++;
+        per_shard[shard]++;
+    }
+    ASSERT(wrong == 0, "shard_kv_alloc() returns handles in the routed shard");
+    for(int i = 0; i < TEST_SHARD_COUNT; i++) {
+        ASSERT(per_shard[i] > TEST_SHARD_KEYS / TEST_SHARD_COUNT / 2, "shard_route() spreads keys");
+    }
+
+    for(long i = 0; i < TEST_SHARD_KEYS; i += 3) {
+        ASSERT(shard_kv_get(ctx->main, client, handles[i], (unsigned char *)&value, sizeof(value), &size) && value == i && size == sizeof(value), "shard_kv_get()");
+    }
+    value = -5;
+    ASSERT(shard_kv_set_value(ctx->main, client, handles[1], sizeof(value), (unsigned char *)&value), "shard_kv_set_value()");
+    ASSERT(shard_kv_get(ctx->main, client, handles[1], (unsigned char *)&value, sizeof(value), 0) && value == -5, "shard_kv_get() after set");
+    ASSERT(shard_kv_free(ctx->main, client, handles[2]), "shard_kv_free()");
+    ASSERT(!shard_kv_get(ctx->main, client, handles[2], (unsigned char *)&value, sizeof(value), 0), "shard_kv_get() after free");
+    value = 2;
+    ASSERT(shard_kv_set_value(ctx->main, client, handles[1], sizeof(value), (unsigned char *)&value), "shard_kv_set_value()");
+    handles[2] = shard_kv_alloc(ctx->main, client, 0, KV_RECORD_TYPE_INT64, sizeof(value), (unsigned char *)&value);
+
+    // Tasks running on every shard, talking to their own shard and to each other
+    Test_shard_task tasks[TEST_SHARD_COUNT];
+    memset(tasks, 0, sizeof(tasks));
+    for(int i = 0; i < TEST_SHARD_COUNT; i++) {
+        tasks[i].external = handles;
+        tasks[i].shard = i;
+        ASSERT(shard_submit(client, i, test_shard_run, &tasks[i]), "shard_submit()");
+    }
+    shard_wait(runtime);
+
+    for(int i = 0; i < 100; i++) {
+        expected_sum += i * 7;
+    }
+    int errors = 0;
+    for(int i = 0; i < TEST_SHARD_COUNT; i++) {
+        errors += tasks[i].errors;
+        if(tasks[i].sum != expected_sum) errors++;
+        for(int j = 0; j < 100; j++) {
+            if(!shard_kv_get(ctx->main, client, tasks[i].remote[j], (unsigned char *)&value, sizeof(value), 0) || value != i * 1000 + j) errors++;
+        }
+    }
+    ASSERT(errors == 0, "shard tasks make local and cross-shard requests");
+
+    unsigned long live = 0;
+    for(int i = 0; i < TEST_SHARD_COUNT; i++) {
+        Record_database *rec_database = shard_database(runtime, i);
+        for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+            if(KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k])) live++;
+        }
+    }
+    ASSERT(live == TEST_SHARD_KEYS + TEST_SHARD_COUNT * 200, "shard databases hold every record");
+
+    shard_client_detach(client);
+    shard_runtime_free(runtime);
+    memory_free(handles);
+}
+
+typedef struct test_epoch_reader {
+    Epoch_domain *domain;
+    atomic_int inside;
+    atomic_int leave;
+} Test_epoch_reader;
+
+static void test_epoch_count(Context_main *ctx_main, void *owner, unsigned long a, unsigned long b) {
+    ((unsigned long *)owner)[0] += a;
+}
+
+static void *test_epoch_read(void *arg) {
+    Test_epoch_reader *reader = (Test_epoch_reader *)arg;
+    epoch_enter(reader->domain);
+    atomic_store(&reader->inside, 1);
+    while(!atomic_load(&reader->leave)) sched_yield();
+    epoch_exit(reader->domain);
+    return 0;
+}
+
+static Epoch_domain *test_epoch_domain;
+
+static void *test_epoch_orphan(void *arg) {
+    epoch_retire(test_epoch_domain, test_epoch_count, arg, 1, 0);
+    return 0;
+}
+
+void test_epoch(Test_context *ctx) {
+    Epoch_domain *domain = epoch_domain_create(ctx->main);
+    ASSERT(domain != 0, "epoch_domain_create()");
+    test_epoch_domain = domain;
+
+    unsigned long freed = 0;
+    ASSERT(epoch_retire(domain, test_epoch_count, &freed, 1, 0) == 1, "epoch_retire()");
+    ASSERT(epoch_reclaim(ctx->main, domain) == 0 && freed == 1, "epoch_reclaim() with no readers");
+
+    // Nested sections of our own thread hold frees up until the outermost one ends
+    epoch_enter(domain);
+    epoch_enter(domain);
+    epoch_retire(domain, test_epoch_count, &freed, 1, 0);
+    epoch_exit(domain);
+    ASSERT(epoch_reclaim(ctx->main, domain) == 1 && freed == 1, "epoch_reclaim() inside a section");
+    epoch_exit(domain);
+    ASSERT(epoch_reclaim(ctx->main, domain) == 0 && freed == 2, "epoch_reclaim() after the section");
+
+    // So does another thread's
+    Test_epoch_reader reader = { domain };
+    pthread_t thread;
+    atomic_init(&reader.inside, 0);
+    atomic_init(&reader.leave, 0);
+    pthread_create(&thread, 0, test_epoch_read, &reader);
+    while(!atomic_load(&reader.inside)) sched_yield();
+
+    epoch_retire(domain, test_epoch_count, &freed, 1, 0);
+    for(int i = 0; i < 4; i++) epoch_reclaim(ctx->main, domain);
+    ASSERT(freed == 2, "a reader holds up frees");
+
+    atomic_store(&reader.leave, 1);
+    pthread_join(thread, 0);
+    ASSERT(epoch_reclaim(ctx->main, domain) == 0 && freed == 3, "frees run once the reader has left");
+
+    // Frees left behind by an exited thread are run by whoever reclaims next
+    pthread_create(&thread, 0, test_epoch_orphan, &freed);
+    pthread_join(thread, 0);
+    ASSERT(freed == 3, "an exited thread's frees are pending");
+    epoch_reclaim(ctx->main, domain);
+    ASSERT(freed == 4, "epoch_reclaim() runs an exited thread's frees");
+
+    epoch_domain_free(ctx->main, domain);
+}
+
+static unsigned long test_batch_used(Record_database *rec_database) {
+    unsigned long used = 0;
+    for(unsigned long i = 0; i < rec_database->ptbl_record_count; i++) {
+        for(unsigned long j = 0; j < rec_database->ptbl_record_tbl[i].page_usage_length; j++) {
+            used += __builtin_popcount(rec_database->ptbl_record_tbl[i].page_usage[j]);
+        }
+    }
+    return used;
+}
+
+void test_batch(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    Database_batch *batch = database_batch_create(ctx->main);
+    ASSERT(batch != 0, "database_batch_create()");
+
+    unsigned long keys[100], value[64];
+    for(int i = 0; i < 100; i++) {
+        value[0] = i;
+        keys[i] = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    }
+
+    // Allocations, changes and frees spread over several buckets, and enough values to grow them
+    int position[300];
+    for(int i = 0; i < 300; i++) {
+        value[0] = 1000 + i;
+        position[i] = database_batch_kv_alloc(batch, KV_RECORD_TYPE_RAW, 8 + (i % 3) * 100, (unsigned char *)value);
+    }
+    for(int i = 0; i < 50; i++) {
+        value[0] = 2000 + i;
+        database_batch_kv_set_value(batch, keys[i], 300, (unsigned char *)value);
+    }
+    for(int i = 50; i < 60; i++) {
+        database_batch_kv_free(batch, keys[i]);
+    }
+    ASSERT(database_batch_commit(ctx->main, rec_database, batch), "database_batch_commit()");
+
+    int wrong = 0;
+    for(int i = 0; i < 300; i++) {
+        unsigned long k = database_batch_key(batch, position[i]);
+        unsigned long *v = (unsigned long *)database_kv_get_value(ctx->main, rec_database, 0, k);
+        if(k == -1 || !v || v[0] != 1000 + i || KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]) != 8 + (i % 3) * 100) wrong++;
+    }
+    for(int i = 0; i < 100; i++) {
+        unsigned long *v = (unsigned long *)database_kv_get_value(ctx->main, rec_database, 0, keys[i]);
+        if(i < 50 && (!v || v[0] != 2000 + i)) wrong++;
+        if(i >= 50 && i < 60 && v) wrong++;
+        if(i >= 60 && (!v || v[0] != i)) wrong++;
+    }
+    ASSERT(wrong == 0, "database_batch_commit() applies every write");
+    ASSERT(test_batch_used(rec_database) == 390, "database_batch_commit() frees replaced values");
+
+    // A batch with one bad write leaves the database exactly as it was
+    unsigned long kv_record_count = rec_database->kv_record_count, kv_record_free_count = rec_database->kv_record_free_count, used = test_batch_used(rec_database);
+    database_batch_clear(batch);
+    value[0] = 3000;
+    int added = database_batch_kv_alloc(batch, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    database_batch_kv_set_value(batch, keys[0], 8, (unsigned char *)value);
+    database_batch_kv_free(batch, keys[1]);
+    database_batch_kv_set_value(batch, keys[1], 8, (unsigned char *)value);
+    ASSERT(!database_batch_commit(ctx->main, rec_database, batch), "database_batch_commit() of a freed record fails");
+    ASSERT(database_batch_key(batch, added) == -1, "database_batch_key() after a failed commit");
+
+    unsigned long *v0 = (unsigned long *)database_kv_get_value(ctx->main, rec_database, 0, keys[0]),
+                  *v1 = (unsigned long *)database_kv_get_value(ctx->main, rec_database, 0, keys[1]);
+    ASSERT(v0 && v0[0] == 2000 && v1 && v1[0] == 2001, "a failed commit rolls back every write");
+    ASSERT(rec_database->kv_record_count == kv_record_count && rec_database->kv_record_free_count == kv_record_free_count, "a failed commit gives back its records");
+    ASSERT(test_batch_used(rec_database) == used, "a failed commit gives back its slots");
+
+    database_batch_clear(batch);
+    database_batch_kv_set_value(batch, rec_database->kv_record_count + 5, 8, (unsigned char *)value);
+    ASSERT(!database_batch_commit(ctx->main, rec_database, batch), "database_batch_commit() of a missing record fails");
+
+    database_batch_free(ctx->main, batch);
+    database_ptbl_free(ctx->main, rec_database);
+    memory_free(rec_database);
+}
+
+void test_persist(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    RECORD_CREATE(Record_database, loaded);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-test-%d.snap", (int)getpid());
+
+    // Values in small buckets, and in one large enough that its pages are bigger than a page
+    unsigned long keys[300], value[1024];
+    for(int i = 0; i < 300; i++) {
+        value[0] = i;
+        keys[i] = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_RAW, (i % 10 == 0) ? 8000 : 8 + (i % 4) * 60, (unsigned char *)value);
+    }
+    for(int i = 0; i < 300; i += 7) {
+        database_kv_free(ctx->main, rec_database, keys[i]);
+    }
+
+    ASSERT(database_save(ctx->main, rec_database, path), "database_save()");
+    ASSERT(access(path, F_OK) == 0, "database_save() writes the snapshot");
+
+    ASSERT(database_load(ctx->main, loaded, path), "database_load()");
+    ASSERT(!database_load(ctx->main, loaded, path), "database_load() into a database that isn't empty fails");
+    ASSERT(loaded->kv_record_count == rec_database->kv_record_count
+        && loaded->kv_record_free_count == rec_database->kv_record_free_count
+        && loaded->ptbl_record_count == rec_database->ptbl_record_count, "database_load() restores the counts");
+    ASSERT(0 == memcmp(loaded->kv_record_tbl, rec_database->kv_record_tbl, loaded->kv_record_count * sizeof(Record_kv)), "database_load() restores kv_record_tbl");
+
+    int wrong = 0;
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        Record_ptbl *a = &rec_database->ptbl_record_tbl[i], *b = &loaded->ptbl_record_tbl[i];
+        if(a->key_high_and_page_count != b->key_high_and_page_count || a->page_usage_length != b->page_usage_length
+            || PTBL_RECORD_GET_OFFSET(b[0]) != 0 || memcmp(a->page_usage, b->page_usage, a->page_usage_length) != 0) wrong++;
+    }
+    ASSERT(wrong == 0, "database_load() restores every bucket's page_usage");
+    for(int i = 0; i < 300; i++) {
+        unsigned long *a = (unsigned long *)database_kv_get_value(ctx->main, rec_database, 0, keys[i]),
+                      *b = (unsigned long *)database_kv_get_value(ctx->main, loaded, 0, keys[i]);
+        if((a == 0) != (b == 0) || (a && (b[0] != i || memcmp(a, b, KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[keys[i]])) != 0))) wrong++;
+    }
+    ASSERT(wrong == 0, "database_load() restores every value");
+
+    // The loaded database is an ordinary one
+    value[0] = 12345;
+    unsigned long k = database_kv_alloc(ctx->main, loaded, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    unsigned long *v = (unsigned long *)database_kv_get_value(ctx->main, loaded, 0, k);
+    ASSERT(k == keys[294] && v && v[0] == 12345, "database_kv_alloc() after database_load() reuses freed records");
+    database_ptbl_free(ctx->main, loaded);
+
+    // A mapped database reads the same, and its changes never reach the file
+    ASSERT(database_map(ctx->main, loaded, path), "database_map()");
+    ASSERT(0 == memcmp(loaded->kv_record_tbl, rec_database->kv_record_tbl, loaded->kv_record_count * sizeof(Record_kv)), "database_map() restores kv_record_tbl");
+    for(int i = 0; i < 300; i++) {
+        unsigned long *a = (unsigned long *)database_kv_get_value(ctx->main, rec_database, 0, keys[i]),
+                      *b = (unsigned long *)database_kv_get_value(ctx->main, loaded, 0, keys[i]);
+        if((a == 0) != (b == 0) || (a && (b[0] != i || memcmp(a, b, KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[keys[i]])) != 0))) wrong++;
+    }
+    ASSERT(wrong == 0, "database_map() maps every value");
+    for(int i = 0; i < loaded->ptbl_record_count; i++) {
+        if(PTBL_RECORD_GET_OFFSET(loaded->ptbl_record_tbl[i]) == 0) wrong++;
+    }
+    ASSERT(wrong == 0, "database_map() marks every bucket as mapped");
+    ASSERT(database_map_prefetch(ctx->main, loaded), "database_map_prefetch()");
+
+    value[0] = 54321;
+    database_kv_set_value(ctx->main, loaded, keys[1], 8, (unsigned char *)value);
+    for(int i = 0; i < 2000; i++) {
+        value[0] = 100000 + i;
+        database_kv_alloc(ctx->main, loaded, KV_RECORD_TYPE_RAW, 8000, (unsigned char *)value);
+    }
+    for(int i = 0; i < 300; i++) {
+        unsigned long *b = (unsigned long *)database_kv_get_value(ctx->main, loaded, 0, keys[i]);
+        if(i % 7 != 0 && (!b || b[0] != ((i == 1) ? 54321 : i))) wrong++;
+    }
+    ASSERT(wrong == 0, "a mapped bucket keeps its values when it grows");
+    ASSERT(PTBL_RECORD_GET_OFFSET(loaded->ptbl_record_tbl[database_ptbl_get(ctx->main, loaded, database_calc_bucket(8000))]) == 0, "a mapped bucket that grows isn't mapped anymore");
+    database_ptbl_free(ctx->main, loaded);
+
+    ASSERT(database_load(ctx->main, loaded, path), "database_load() after database_map()");
+    v = (unsigned long *)database_kv_get_value(ctx->main, loaded, 0, keys[1]);
+    ASSERT(v && v[0] == 1, "changes to a mapped database stay out of the file");
+    database_ptbl_free(ctx->main, loaded);
+
+    // A header claiming more records than a kv_record_tbl can hold is rejected, however long the file
+    Persist_header header;
+    int fd = open(path, O_RDWR);
+    ASSERT(fd >= 0 && read(fd, &header, sizeof(header)) == sizeof(header), "read() of a snapshot header");
+    header.kv_record_count = (1UL << 28) + 1;
+    header.kv_record_free_count = 0;
+    header.file_length = header.kv_offset + header.kv_record_count * sizeof(Record_kv);
+    ASSERT(lseek(fd, 0, SEEK_SET) == 0 && write(fd, &header, sizeof(header)) == sizeof(header) && ftruncate(fd, header.file_length) == 0, "write() of an oversized header");
+    close(fd);
+    ASSERT(!database_load(ctx->main, loaded, path), "database_load() of an oversized kv_record_tbl fails");
+    ASSERT(!loaded->ptbl_record_tbl && !loaded->kv_record_tbl, "a failed database_load() leaves the database empty");
+
+    // A truncated or foreign file is rejected, and leaves the database empty
+    fd = open(path, O_WRONLY);
+    ASSERT(fd >= 0 && ftruncate(fd, 4096) == 0, "ftruncate()");
+    close(fd);
+    ASSERT(!database_load(ctx->main, loaded, path), "database_load() of a truncated snapshot fails");
+    ASSERT(!database_map(ctx->main, loaded, path), "database_map() of a truncated snapshot fails");
+    ASSERT(!loaded->ptbl_record_tbl && !loaded->kv_record_tbl, "a failed database_load() leaves the database empty");
+    fd = open(path, O_WRONLY | O_TRUNC);
+    ASSERT(fd >= 0 && write(fd, "not a snapshot", 14) == 14, "write()");
+    close(fd);
+    ASSERT(!database_load(ctx->main, loaded, path), "database_load() of something else fails");
+    ASSERT(!database_load(ctx->main, loaded, "/nonexistent/b-key.snap"), "database_load() of a missing file fails");
+
+    // A background save sees the database as it was when it started
+    Persist_bgsave bgsave;
+    ASSERT(database_bgsave(ctx->main, rec_database, path, &bgsave), "database_bgsave()");
+    for(int i = 0; i < 300; i++) {
+        value[0] = 7000 + i;
+        database_kv_set_value(ctx->main, rec_database, keys[i], 8, (unsigned char *)value);
+    }
+    ASSERT(database_bgsave_wait(ctx->main, &bgsave, 1) == 1, "database_bgsave_wait()");
+    ASSERT(bgsave.pid == 0 && bgsave.seconds > 0, "database_bgsave_wait() reports how long it took");
+    ASSERT(database_bgsave_wait(ctx->main, &bgsave, 1) == 0, "database_bgsave_wait() twice fails");
+    ASSERT(database_load(ctx->main, loaded, path), "database_load() of a background save");
+    for(int i = 0; i < 300; i++) {
+        v = (unsigned long *)database_kv_get_value(ctx->main, loaded, 0, keys[i]);
+        if(i % 7 != 0 && (!v || v[0] != i)) wrong++;
+    }
+    ASSERT(wrong == 0, "database_bgsave() doesn't see writes made after it started");
+    database_ptbl_free(ctx->main, loaded);
+
+    ASSERT(database_bgsave(ctx->main, rec_database, "/nonexistent/b-key.snap", &bgsave), "database_bgsave() to a missing directory");
+    ASSERT(database_bgsave_wait(ctx->main, &bgsave, 1) == 0, "database_bgsave_wait() of a failed save");
+
+    unlink(path);
+    database_ptbl_free(ctx->main, rec_database);
+    memory_free(rec_database);
+    memory_free(loaded);
+}
+
+// Counts the keys whose value, size or flags differ between a and b
+static unsigned long test_wal_diff(Context_main *ctx_main, Record_database *a, Record_database *b) {
+    unsigned long diff = 0, count = (a->kv_record_count > b->kv_record_count) ? a->kv_record_count : b->kv_record_count;
+    for(unsigned long k = 0; k < count; k++) {
+        unsigned char *va = database_kv_get_value(ctx_main, a, 0, k), *vb = database_kv_get_value(ctx_main, b, 0, k);
+        if((va == 0) != (vb == 0)) diff++;
+        else if(va && (a->kv_record_tbl[k].flags_and_size != b->kv_record_tbl[k].flags_and_size
+            || memcmp(va, vb, KV_RECORD_GET_SIZE(a->kv_record_tbl[k])) != 0)) diff++;
+    }
+    return diff;
+}
+
+#define TEST_WAL_THREADS 4
+#define TEST_WAL_OPS 200
+
+typedef struct test_wal_writer {
+    Context_main *main;
+    Database_wal *wal;
+    unsigned long keys[TEST_WAL_OPS];
+    int index;
+    int errors;
+} Test_wal_writer;
+
+static void *test_wal_write(void *arg) {
+    Test_wal_writer *w = (Test_wal_writer *)arg;
+    unsigned long value[32];
+    for(int i = 0; i < TEST_WAL_OPS; i++) {
+        value[0] = w->index * 1000 + i;
+        w->keys[i] = database_wal_kv_alloc(w->main, w->wal, KV_RECORD_TYPE_INT64, 8 + (i % 4) * 40, (unsigned char *)value);
+        if(w->keys[i] == -1) w->errors++;
+        if(i % 3 == 0 && !database_wal_kv_set_value(w->main, w->wal, w->keys[i / 2], 200, (unsigned char *)value)) w->errors++;
+    }
+    return 0;
+}
+
+void test_wal(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    RECORD_CREATE(Record_database, recovered);
+    char path[64], snapshot[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-test-%d.wal", (int)getpid());
+    snprintf(snapshot, sizeof(snapshot), "/tmp/b-key-test-%d.snap", (int)getpid());
+    unlink(path);
+    unlink(snapshot);
+
+    ASSERT(database_wal_replay(ctx->main, recovered, path) == 0, "database_wal_replay() of a missing log");
+
+    // Every kind of write, replayed onto an empty database
+    Database_wal *wal = database_wal_open(ctx->main, rec_database, path, WAL_SYNC_ALWAYS, 0);
+    ASSERT(wal != 0, "database_wal_open()");
+    unsigned long keys[100], value[128];
+    for(int i = 0; i < 100; i++) {
+        value[0] = i;
+        keys[i] = database_wal_kv_alloc(ctx->main, wal, (i % 2) ? KV_RECORD_TYPE_INT64 : KV_RECORD_TYPE_RAW, 8 + (i % 5) * 50, (unsigned char *)value);
+    }
+    for(int i = 0; i < 100; i += 3) {
+        value[0] = 500 + i;
+        ASSERT(database_wal_kv_set_value(ctx->main, wal, keys[i], 700, (unsigned char *)value), "database_wal_kv_set_value()");
+    }
+    for(int i = 0; i < 100; i += 4) {
+        ASSERT(database_wal_kv_free(ctx->main, wal, keys[i]), "database_wal_kv_free()");
+    }
+    ASSERT(!database_wal_kv_set_value(ctx->main, wal, keys[0], 8, (unsigned char *)value), "database_wal_kv_set_value() of a freed record fails");
+    value[0] = 999;
+    keys[0] = database_wal_kv_alloc(ctx->main, wal, KV_RECORD_TYPE_RAW, 8, (unsigned char *)value);
+    ASSERT(database_wal_close(ctx->main, wal), "database_wal_close()");
+
+    ASSERT(database_wal_replay(ctx->main, recovered, path) == 100 + 34 + 25 + 1, "database_wal_replay() applies every record");
+    ASSERT(test_wal_diff(ctx->main, rec_database, recovered) == 0, "database_wal_replay() restores every value");
+
+    // Replaying again changes nothing
+    ASSERT(database_wal_replay(ctx->main, recovered, path) == 160, "database_wal_replay() twice");
+    ASSERT(test_wal_diff(ctx->main, rec_database, recovered) == 0, "database_wal_replay() is idempotent");
+    database_ptbl_free(ctx->main, recovered);
+
+    // A checkpoint empties the log, and the snapshot plus what's logged after it is everything
+    wal = database_wal_open(ctx->main, rec_database, path, WAL_SYNC_NONE, 0);
+    ASSERT(wal != 0, "database_wal_open() of an existing log");
+    ASSERT(database_wal_checkpoint(ctx->main, wal, snapshot), "database_wal_checkpoint()");
+    for(int i = 1; i < 100; i += 4) {
+        value[0] = 2000 + i;
+        database_wal_kv_set_value(ctx->main, wal, keys[i], 16, (unsigned char *)value);
+    }
+    database_wal_kv_free(ctx->main, wal, keys[3]);
+    ASSERT(database_wal_close(ctx->main, wal), "database_wal_close() after a checkpoint");
+
+    ASSERT(database_load(ctx->main, recovered, snapshot), "database_load() of a checkpoint");
+    ASSERT(database_wal_replay(ctx->main, recovered, path) == 26, "database_wal_replay() after a checkpoint only has what came after it");
+    ASSERT(test_wal_diff(ctx->main, rec_database, recovered) == 0, "a checkpoint plus its log restores every value");
+    database_ptbl_free(ctx->main, recovered);
+
+    // A torn record at the end is skipped by replays, and cut off when the log is opened again
+    struct stat st;
+    stat(path, &st);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    ASSERT(fd >= 0 && write(fd, value, 40) == 40, "write()");
+    close(fd);
+    ASSERT(database_load(ctx->main, recovered, snapshot) && database_wal_replay(ctx->main, recovered, path) == 26, "database_wal_replay() stops at a torn record");
+    ASSERT(test_wal_diff(ctx->main, rec_database, recovered) == 0, "database_wal_replay() of a torn log");
+    database_ptbl_free(ctx->main, recovered);
+
+    wal = database_wal_open(ctx->main, rec_database, path, WAL_SYNC_INTERVAL, 5);
+    ASSERT(wal != 0, "database_wal_open() of a torn log");
+    struct stat st_open;
+    stat(path, &st_open);
+    ASSERT(st_open.st_size == st.st_size, "database_wal_open() cuts a torn record off");
+
+    // Writes from several threads at once, synced every 5ms
+    Test_wal_writer writers[TEST_WAL_THREADS];
+    pthread_t threads[TEST_WAL_THREADS];
+    for(int t = 0; t < TEST_WAL_THREADS; t++) {
+        writers[t] = (Test_wal_writer){ ctx->main, wal, { 0 }, t, 0 };
+        pthread_create(&threads[t], 0, test_wal_write, &writers[t]);
+    }
+    int errors = 0;
+    for(int t = 0; t < TEST_WAL_THREADS; t++) {
+        pthread_join(threads[t], 0);
+        errors += writers[t].errors;
+    }
+    ASSERT(errors == 0, "database_wal_kv_alloc() from several threads");
+    ASSERT(database_wal_close(ctx->main, wal), "database_wal_close() with WAL_SYNC_INTERVAL");
+
+    ASSERT(database_load(ctx->main, recovered, snapshot) && database_wal_replay(ctx->main, recovered, path) > 0, "database_wal_replay() of concurrent writes");
+    ASSERT(test_wal_diff(ctx->main, rec_database, recovered) == 0, "database_wal_replay() restores concurrent writes");
+    database_ptbl_free(ctx->main, recovered);
+
+    // Group commit from several threads, each waiting for its own fdatasync()
+    wal = database_wal_open(ctx->main, rec_database, path, WAL_SYNC_ALWAYS, 0);
+    for(int t = 0; t < TEST_WAL_THREADS; t++) {
+        writers[t] = (Test_wal_writer){ ctx->main, wal, { 0 }, t + TEST_WAL_THREADS, 0 };
+        pthread_create(&threads[t], 0, test_wal_write, &writers[t]);
+    }
+    for(int t = 0; t < TEST_WAL_THREADS; t++) {
+        pthread_join(threads[t], 0);
+        errors += writers[t].errors;
+    }
+    ASSERT(errors == 0, "database_wal_kv_alloc() with WAL_SYNC_ALWAYS from several threads");
+    ASSERT(database_wal_close(ctx->main, wal), "database_wal_close() with WAL_SYNC_ALWAYS");
+
+    ASSERT(database_load(ctx->main, recovered, snapshot) && database_wal_replay(ctx->main, recovered, path) > 0, "database_wal_replay() of group commits");
+    ASSERT(test_wal_diff(ctx->main, rec_database, recovered) == 0, "database_wal_replay() restores group commits");
+
+    // Something that isn't a log
+    fd = open(path, O_WRONLY | O_TRUNC);
+    ASSERT(fd >= 0 && write(fd, "not a log, not a log, not a log", 31) == 31, "write()");
+    close(fd);
+    ASSERT(database_wal_replay(ctx->main, recovered, path) == -1, "database_wal_replay() of something else fails");
+    ASSERT(database_wal_open(ctx->main, rec_database, path, WAL_SYNC_ALWAYS, 0) == 0, "database_wal_open() of something else fails");
+
+    unlink(path);
+    unlink(snapshot);
+    database_ptbl_free(ctx->main, recovered);
+    database_ptbl_free(ctx->main, rec_database);
+    memory_free(recovered);
+    memory_free(rec_database);
+}
+
+void test_checkpoint(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    RECORD_CREATE(Record_database, restored);
+    char base[64], delta1[64], delta2[64];
+    snprintf(base, sizeof(base), "/tmp/b-key-test-%d.snap", (int)getpid());
+    snprintf(delta1, sizeof(delta1), "/tmp/b-key-test-%d.1", (int)getpid());
+    snprintf(delta2, sizeof(delta2), "/tmp/b-key-test-%d.2", (int)getpid());
+
+    unsigned long keys[4000], value[1024];
+    for(int i = 0; i < 3000; i++) {
+        value[0] = i;
+        keys[i] = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_RAW, (i % 50 == 0) ? 8000 : 8 + (i % 4) * 60, (unsigned char *)value);
+    }
+    ASSERT(database_checkpoint(ctx->main, rec_database, base, 0), "database_checkpoint() of the base snapshot");
+    ASSERT(rec_database->kv_dirty != 0 && rec_database->ptbl_record_tbl[0].page_dirty != 0, "database_checkpoint() starts tracking changes");
+
+    // A few of every kind of write, including to a bucket that didn't exist yet
+    for(int i = 0; i < 3000; i += 300) {
+        value[0] = 10000 + i;
+        database_kv_set_value(ctx->main, rec_database, keys[i], 100, (unsigned char *)value);
+    }
+    for(int i = 5; i < 3000; i += 500) {
+        database_kv_free(ctx->main, rec_database, keys[i]);
+    }
+    for(int i = 3000; i < 3010; i++) {
+        value[0] = i;
+        keys[i] = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_INT64, (i % 2) ? 8 : 3000, (unsigned char *)value);
+    }
+    Database_batch *batch = database_batch_create(ctx->main);
+    value[0] = 77;
+    database_batch_kv_set_value(batch, keys[1234], 8, (unsigned char *)value);
+    database_batch_kv_free(batch, keys[2345]);
+    ASSERT(database_batch_commit(ctx->main, rec_database, batch), "database_batch_commit()");
+    database_batch_free(ctx->main, batch);
+
+    struct stat st_base, st_delta;
+    ASSERT(database_checkpoint(ctx->main, rec_database, delta1, 1), "database_checkpoint() of the first changes");
+    ASSERT(stat(base, &st_base) == 0 && stat(delta1, &st_delta) == 0 && st_delta.st_size * 4 < st_base.st_size, "database_checkpoint() writes only what changed");
+
+    // Shrink kv_record_tbl and grow a bucket
+    for(int i = 3009; i > 3000; i--) {
+        database_kv_free(ctx->main, rec_database, keys[i]);
+    }
+    for(int i = 3000; i < 3200; i++) {
+        value[0] = i;
+        keys[i] = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_RAW, 8000, (unsigned char *)value);
+    }
+    ASSERT(database_checkpoint(ctx->main, rec_database, delta2, 2), "database_checkpoint() of the second changes");
+
+    // Restoring is the snapshot plus the checkpoints, in order
+    ASSERT(database_load(ctx->main, restored, base), "database_load() of the base snapshot");
+    ASSERT(!database_checkpoint_apply(ctx->main, restored, delta2, 1), "database_checkpoint_apply() out of order fails");
+    ASSERT(!database_checkpoint_apply(ctx->main, restored, base, 1), "database_checkpoint_apply() of a snapshot fails");
+
+    // A checkpoint with a kv record pointing outside its bucket is rejected before anything is changed
+    char bad[64];
+    snprintf(bad, sizeof(bad), "/tmp/b-key-test-%d.bad", (int)getpid());
+    unsigned char *file = malloc(st_delta.st_size);
+    int fd = open(delta1, O_RDONLY);
+    ASSERT(fd >= 0 && read(fd, file, st_delta.st_size) == st_delta.st_size, "read() of a checkpoint");
+    close(fd);
+    Record_kv *chunk = (Record_kv *)(file + ((Persist_delta *)file)->kv_offset);
+    int corrupted = 0;
+    for(int k = 0; !corrupted && k < DATABASE_KV_DIRTY_CHUNK; k++) {
+        if(KV_RECORD_GET_SIZE(chunk[k])) {
+            KV_RECORD_SET_INDEX(chunk[k], 1UL << 40);
+            corrupted = 1;
+        }
+    }
+    fd = open(bad, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(corrupted && fd >= 0 && write(fd, file, st_delta.st_size) == st_delta.st_size, "write() of a corrupt checkpoint");
+    close(fd);
+    free(file);
+    RECORD_CREATE(Record_database, snapshot);
+    ASSERT(database_load(ctx->main, snapshot, base), "database_load() of the base snapshot");
+    ASSERT(!database_checkpoint_apply(ctx->main, restored, bad, 1), "database_checkpoint_apply() of a corrupt kv record fails");
+    ASSERT(restored->kv_record_count == snapshot->kv_record_count
+        && restored->kv_record_free_count == snapshot->kv_record_free_count
+        && test_wal_diff(ctx->main, snapshot, restored) == 0, "database_checkpoint_apply() of a corrupt kv record changes nothing");
+    unlink(bad);
+    database_ptbl_free(ctx->main, snapshot);
+    memory_free(snapshot);
+
+    ASSERT(database_checkpoint_apply(ctx->main, restored, delta1, 1), "database_checkpoint_apply() of the first checkpoint");
+    ASSERT(database_checkpoint_apply(ctx->main, restored, delta2, 2), "database_checkpoint_apply() of the second checkpoint");
+    ASSERT(restored->kv_record_count == rec_database->kv_record_count
+        && restored->kv_record_free_count == rec_database->kv_record_free_count
+        && restored->ptbl_record_count == rec_database->ptbl_record_count, "database_checkpoint_apply() restores the counts");
+    ASSERT(test_wal_diff(ctx->main, rec_database, restored) == 0, "database_checkpoint_apply() restores every value");
+    int wrong = 0;
+    for(int i = 0; i < rec_database->ptbl_record_count; i++) {
+        Record_ptbl *a = &rec_database->ptbl_record_tbl[i],
+                    *b = &restored->ptbl_record_tbl[database_ptbl_get(ctx->main, restored, PTBL_RECORD_GET_KEY(a[0]))];
+        if(PTBL_RECORD_GET_PAGE_COUNT(a[0]) != PTBL_RECORD_GET_PAGE_COUNT(b[0]) || a->page_usage_length != b->page_usage_length
+            || memcmp(a->page_usage, b->page_usage, a->page_usage_length) != 0) wrong++;
+    }
+    ASSERT(wrong == 0, "database_checkpoint_apply() restores every bucket");
+
+    database_ptbl_free(ctx->main, restored);
+
+    // The same chain applies onto a mapped snapshot
+    ASSERT(database_map(ctx->main, restored, base)
+        && database_checkpoint_apply(ctx->main, restored, delta1, 1)
+        && database_checkpoint_apply(ctx->main, restored, delta2, 2), "database_checkpoint_apply() onto database_map()");
+    ASSERT(test_wal_diff(ctx->main, rec_database, restored) == 0, "database_checkpoint_apply() onto database_map() restores every value");
+
+    // A restored database carries on the chain
+    value[0] = 4242;
+    database_kv_set_value(ctx->main, restored, keys[7], 8, (unsigned char *)value);
+    database_kv_set_value(ctx->main, rec_database, keys[7], 8, (unsigned char *)value);
+    ASSERT(database_checkpoint(ctx->main, restored, delta1, 3), "database_checkpoint() of a restored database");
+    database_ptbl_free(ctx->main, restored);
+
+    // Nothing tracked a database that was never checkpointed, so everything is written
+    RECORD_CREATE(Record_database, fresh);
+    for(int i = 0; i < 100; i++) {
+        value[0] = i;
+        database_kv_alloc(ctx->main, fresh, KV_RECORD_TYPE_RAW, 8 + i, (unsigned char *)value);
+    }
+    ASSERT(database_checkpoint(ctx->main, fresh, delta1, 1), "database_checkpoint() of an untracked database");
+    ASSERT(database_checkpoint_apply(ctx->main, restored, delta1, 1), "database_checkpoint_apply() onto an empty database");
+    ASSERT(test_wal_diff(ctx->main, fresh, restored) == 0, "a checkpoint of an untracked database holds everything");
+    ASSERT(!database_checkpoint_apply(ctx->main, restored, "/nonexistent/b-key.1", 2), "database_checkpoint_apply() of a missing file fails");
+
+    unlink(base);
+    unlink(delta1);
+    unlink(delta2);
+    database_ptbl_free(ctx->main, fresh);
+    database_ptbl_free(ctx->main, restored);
+    database_ptbl_free(ctx->main, rec_database);
+    memory_free(fresh);
+    memory_free(restored);
+    memory_free(rec_database);
+}
+
+void test_io(Test_context *ctx) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-test-%d.io", (int)getpid());
+    unsigned long length = 3 * IO_CHUNK + 12345;
+    unsigned char *region = memory_page_alloc(ctx->main, (length + ctx->main->system_page_size - 1) / ctx->main->system_page_size),
+                  *small = memory_alloc(100),
+                  *back = memory_alloc(length);
+    for(unsigned long i = 0; i < length; i++) region[i] = (unsigned char)(i * 7 + i / 4096);
+    memset(small, 0x5A, 100);
+
+    Context_io *io = io_create(ctx->main, IO_ENGINE_AUTO, 0);
+    ASSERT(io != 0 && io_engine(io) != IO_ENGINE_AUTO, "io_create() with IO_ENGINE_AUTO");
+    io_free(io);
+
+    int engines[2] = { IO_ENGINE_URING, IO_ENGINE_THREADS };
+    for(int e = 0; e < 2; e++) {
+        // Only a kernel that allows io_uring can run it
+        io = io_create(ctx->main, engines[e], 4);
+        if(!io) {
+            ASSERT(engines[e] == IO_ENGINE_URING, "io_create() with IO_ENGINE_THREADS");
+            continue;
+        }
+        ASSERT(io_engine(io) == engines[e], "io_engine()");
+        ASSERT(io_register(io, &region, &length, 1), "io_register()");
+
+        // More pieces than the queue is deep, from a registered region and from anywhere
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ASSERT(fd >= 0, "open()");
+        ASSERT(io_write(io, fd, region, length, 100, 0), "io_write() from a registered region");
+        ASSERT(io_write(io, fd, small, 100, 0, -1), "io_write()");
+        ASSERT(io_fsync(io, fd, 0), "io_fsync()");
+        ASSERT(io_wait(io), "io_wait()");
+        ASSERT(lseek(fd, 0, SEEK_SET) == 0 && read(fd, back, 100) == 100 && memcmp(back, small, 100) == 0, "io_write() writes");
+        ASSERT(read(fd, back, length) == length && memcmp(back, region, length) == 0, "io_write() writes every piece in place");
+        close(fd);
+
+        // A write that fails is reported once, by the next io_wait()
+        fd = open(path, O_RDONLY);
+        ASSERT(io_write(io, fd, small, 100, 0, -1), "io_write() to a read-only file is queued");
+        ASSERT(!io_wait(io), "io_wait() reports a failed write");
+        ASSERT(io_wait(io), "io_wait() only reports a failure once");
+        close(fd);
+        io_free(io);
+    }
+
+    unlink(path);
+    memory_page_free(ctx->main, region, (length + ctx->main->system_page_size - 1) / ctx->main->system_page_size);
+    memory_free(small);
+    memory_free(back);
+}
+
+void test_paged(Test_context *ctx) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-test-%d.paged", (int)getpid());
+    Paged_stats stats;
+    unsigned long pin, pins[16];
+    unsigned char value[8192];
+
+    // A pool of 16 pages, and a few hundred pages of values of three buckets, a unit of the largest
+    // taking two pages
+    Database_paged *dbp = database_paged_open(ctx->main, path, 16);
+    ASSERT(dbp != 0, "database_paged_open()");
+
+    int count = 3000;
+    unsigned long *keys = (unsigned long *)memory_alloc(count * sizeof(unsigned long));
+    for(int i = 0; i < count; i++) {
+        int size = (i % 3 == 0) ? 8000 : (i % 3 == 1) ? 100 : 12;
+        memset(value, (unsigned char)i, size);
+        value[0] = (unsigned char)(i >> 8);
+        keys[i] = database_paged_kv_alloc(ctx->main, dbp, KV_RECORD_TYPE_RAW, size, value);
+        ASSERT(keys[i] != -1, "database_paged_kv_alloc()");
+    }
+    database_paged_stats(dbp, &stats);
+    ASSERT(stats.resident_pages <= 16, "The pool stays within its capacity");
+    Record_database *paged_db = database_paged_record(dbp);
+    char ptbl_index = database_ptbl_get(ctx->main, paged_db, 0);
+    ASSERT(ptbl_index != -1 && PTBL_RECORD_GET_PAGE_COUNT(paged_db->ptbl_record_tbl[ptbl_index]) == (count / 3 + 255) / 256, "Units are filled before a bucket grows");
+    ASSERT(stats.evictions > 0 && stats.writes > 0, "Dirty units are written back when evicted");
+
+    // Every value survives being evicted and read back
+    int bad = 0;
+    for(int i = count - 1; i >= 0; i--) {
+        int size = (i % 3 == 0) ? 8000 : (i % 3 == 1) ? 100 : 12;
+        unsigned char *v = database_paged_kv_get_value(ctx->main, dbp, &pin, keys[i]);
+        if(!v || v[0] != (unsigned char)(i >> 8) || v[size - 1] != (unsigned char)i) bad++;
+        if(v) database_paged_unpin(dbp, pin);
+    }
+    ASSERT(bad == 0, "database_paged_kv_get_value() reads back every value");
+    database_paged_stats(dbp, &stats);
+    ASSERT(stats.resident_pages <= 16, "The pool stays within its capacity while reading");
+
+    // A hit doesn't touch the file
+    unsigned char *v = database_paged_kv_get_value(ctx->main, dbp, &pin, keys[1]);
+    database_paged_unpin(dbp, pin);
+    database_paged_stats(dbp, &stats);
+    unsigned long misses = stats.misses;
+    v = database_paged_kv_get_value(ctx->main, dbp, &pin, keys[1]);
+    database_paged_stats(dbp, &stats);
+    ASSERT(v && v[99] == 1 && stats.misses == misses, "A resident unit is a hit");
+
+    // Pinned units stay put, and once every page is pinned nothing more can be read in
+    int pinned = 1;
+    pins[0] = pin;
+    for(int i = 1; i < 16; i++) {
+        // Every 32nd value of 100 bytes, one per unit
+        unsigned char *p = database_paged_kv_get_value(ctx->main, dbp, &pins[pinned], keys[i * 96 + 1]);
+        if(!p) break;
+        pinned++;
+    }
+    ASSERT(pinned == 16, "Units can be pinned up to the pool's capacity");
+    ASSERT(!database_paged_kv_get_value(ctx->main, dbp, &pin, keys[2000]), "Nothing is evicted while every frame is pinned");
+    ASSERT(v[99] == 1, "A pinned value stays in place");
+    for(int i = 0; i < pinned; i++) database_paged_unpin(dbp, pins[i]);
+    v = database_paged_kv_get_value(ctx->main, dbp, &pin, keys[2000]);
+    ASSERT(v && v[1] == (unsigned char)2000, "Units are read in again once unpinned");
+    database_paged_unpin(dbp, pin);
+
+    // Changing, moving between buckets and freeing values
+    memset(value, 0xAB, 8000);
+    ASSERT(database_paged_kv_set_value(ctx->main, dbp, keys[1], 8000, value), "database_paged_kv_set_value()");
+    ASSERT(database_paged_kv_free(ctx->main, dbp, keys[2]), "database_paged_kv_free()");
+    ASSERT(!database_paged_kv_get_value(ctx->main, dbp, &pin, keys[2]), "A freed value can't be read");
+    unsigned long k = database_paged_kv_alloc(ctx->main, dbp, KV_RECORD_TYPE_RAW, 12, value);
+    ASSERT(k == keys[2], "A freed record is reused");
+    ASSERT(database_paged_record(dbp)->kv_record_count == count, "kv_record_tbl keeps count");
+
+    // Flushing leaves nothing to write back, so evicting afterwards writes nothing
+    ASSERT(database_paged_flush(ctx->main, dbp), "database_paged_flush()");
+    database_paged_stats(dbp, &stats);
+    unsigned long writes = stats.writes;
+    for(int i = 0; i < 300; i++) {
+        v = database_paged_kv_get_value(ctx->main, dbp, &pin, keys[i]);
+        if(v) database_paged_unpin(dbp, pin);
+    }
+    database_paged_stats(dbp, &stats);
+    ASSERT(stats.writes == writes, "Clean units are dropped without writing");
+
+    v = database_paged_kv_get_value(ctx->main, dbp, &pin, keys[1]);
+    ASSERT(v && v[0] == 0xAB && v[7999] == 0xAB, "A changed value is read back");
+    database_paged_unpin(dbp, pin);
+
+    database_paged_close(ctx->main, dbp);
+    ASSERT(access(path, F_OK) != 0, "database_paged_close() removes the data file");
+    memory_free(keys);
+}
+
+// Reads value k of dbs consistently, and returns 1 if it's size bytes of fill
+static int
+test_shared_check(Database_shared *dbs, unsigned long k, unsigned long size, unsigned char fill) {
+    unsigned long sequence, length;
+    int ok;
+    do {
+        if(!database_shared_read_begin(dbs, &sequence)) return 0;
+        unsigned char *v = database_shared_kv_get_value(dbs, k, &length);
+        ok = (v != 0 && length == size);
+        for(unsigned long i = 0; ok && i < size; i++) ok = (v[i] == fill);
+    } while(!database_shared_read_end(dbs, sequence));
+    return ok;
+}
+
+void test_shared(Test_context *ctx) {
+    unsigned char value[5000];
+    unsigned long keys[1000], sequence, size;
+
+    Database_shared *dbs = database_shared_create(ctx->main, 0, 64 << 20);
+    ASSERT(dbs != 0, "database_shared_create()");
+    for(int i = 0; i < 1000; i++) {
+        size = (i % 2) ? 5000 : 20;
+        memset(value, (unsigned char)i, size);
+        keys[i] = database_shared_kv_alloc(ctx->main, dbs, KV_RECORD_TYPE_RAW, size, value);
+        ASSERT(keys[i] == i, "database_shared_kv_alloc()");
+    }
+    int bad = 0;
+    for(int i = 0; i < 1000; i++) bad += !test_shared_check(dbs, keys[i], (i % 2) ? 5000 : 20, (unsigned char)i);
+    ASSERT(bad == 0, "database_shared_kv_get_value() reads back every value");
+    ASSERT(database_shared_kv_count(dbs) == 1000, "database_shared_kv_count()");
+
+    // Another mapping of the segment, at another address, sees the same values, and the changes
+    // made by another process
+    pid_t pid = fork();
+    if(pid == 0) {
+        Database_shared *child = database_shared_attach(ctx->main, database_shared_fd(dbs));
+        int ok = child != 0
+              && database_shared_kv_get_value(child, keys[3], 0) != database_shared_kv_get_value(dbs, keys[3], 0)
+              && test_shared_check(child, keys[3], 5000, 3);
+        memset(value, 0xEE, 300);
+        ok = ok && database_shared_kv_set_value(ctx->main, child, keys[3], 300, value)
+                && database_shared_kv_alloc(ctx->main, child, KV_RECORD_TYPE_RAW, 300, value) == 1000
+                && database_shared_kv_free(ctx->main, child, keys[4]);
+        database_shared_detach(ctx->main, child);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    ASSERT(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "database_shared_attach() in another process");
+    ASSERT(test_shared_check(dbs, keys[3], 300, 0xEE), "Values changed by another process are seen");
+    ASSERT(test_shared_check(dbs, 1000, 300, 0xEE), "Values added by another process are seen");
+    ASSERT(database_shared_read_begin(dbs, &sequence) && !database_shared_kv_get_value(dbs, keys[4], 0), "Values freed by another process are gone");
+
+    // A reader never finishes a read of a value that a writer was halfway through
+    pid = fork();
+    if(pid == 0) {
+        for(int i = 0; i < 20000; i++) {
+            memset(value, (unsigned char)i, 5000);
+            if(!database_shared_kv_set_value(ctx->main, dbs, keys[5], (i % 2) ? 5000 : 4000, value)) _exit(1);
+        }
+        _exit(0);
+    }
+    unsigned long reads = 0, torn = 0;
+    while(waitpid(pid, &status, WNOHANG) == 0) {
+        if(!database_shared_read_begin(dbs, &sequence)) break;
+        unsigned char *v = database_shared_kv_get_value(dbs, keys[5], &size);
+        int same = (v != 0 && (size == 5000 || size == 4000));
+        for(unsigned long i = 1; same && i < size; i++) same = (v[i] == v[0]);
+        if(database_shared_read_end(dbs, sequence)) {
+            reads++;
+            torn += !same;
+        }
+    }
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Another process writes alongside a reader");
+    ASSERT(reads > 0 && torn == 0, "A read that a write got in the way of is always retried");
+    database_shared_detach(ctx->main, dbs);
+
+    // A segment at a path, filled up, and reused once values are freed
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/b-key-test-%d", (int)getpid());
+    dbs = database_shared_create(ctx->main, path, 64 * ctx->main->system_page_size);
+    if(!dbs) {
+        // No /dev/shm
+        snprintf(path, sizeof(path), "/tmp/b-key-test-%d.shm", (int)getpid());
+        dbs = database_shared_create(ctx->main, path, 64 * ctx->main->system_page_size);
+    }
+    ASSERT(dbs != 0, "database_shared_create() at a path");
+    int fd = open(path, O_RDWR);
+    Database_shared *other = database_shared_attach(ctx->main, fd);
+    close(fd);
+    ASSERT(other != 0, "database_shared_attach() from the segment's path");
+    unlink(path);
+
+    int count = 0;
+    memset(value, 0x11, 5000);
+    while(database_shared_kv_alloc(ctx->main, dbs, KV_RECORD_TYPE_RAW, 5000, value) != -1) count++;
+    ASSERT(count > 0 && count < 64, "database_shared_kv_alloc() fails once the segment is full");
+    ASSERT(database_shared_used(other) <= 64 * ctx->main->system_page_size, "database_shared_used()");
+    ASSERT(database_shared_kv_free(ctx->main, other, 0), "database_shared_kv_free()");
+    ASSERT(database_shared_kv_alloc(ctx->main, other, KV_RECORD_TYPE_RAW, 5000, value) == 0, "A freed unit is reused");
+    ASSERT(test_shared_check(dbs, 0, 5000, 0x11), "Both mappings agree");
+
+    database_shared_detach(ctx->main, other);
+    database_shared_detach(ctx->main, dbs);
+
+    fd = open("/dev/null", O_RDWR);
+    ASSERT(database_shared_attach(ctx->main, fd) == 0, "database_shared_attach() rejects anything else");
+    close(fd);
+}
+
+static void *
+test_server_run(void *arg) {
+    server_run((Context_server *)arg);
+    return 0;
+}
+
+// Appends a request to buffer at *length
+static void
+test_server_request(unsigned char *buffer, unsigned long *length, unsigned char op, unsigned int id, unsigned long k, unsigned int value_length, unsigned char fill) {
+    Server_request request = { value_length, op, KV_RECORD_TYPE_RAW, 0, id, 0, k };
+    memcpy(buffer + *length, &request, sizeof(request));
+    memset(buffer + *length + sizeof(request), fill, value_length);
+    *length += sizeof(request) + value_length;
+}
+
+// Reads the next response, and its value into value if there's room, and returns 1 if it's for id
+// with status and a value of value_length bytes of fill
+static int
+test_server_response(int fd, unsigned int id, unsigned char status, unsigned int value_length, unsigned char fill, unsigned long *k) {
+    Server_response response;
+    static unsigned char value[8192];
+    unsigned char *at = (unsigned char *)&response;
+    for(unsigned long got = 0; got < sizeof(response); ) {
+        ssize_t n = read(fd, at + got, sizeof(response) - got);
+        if(n <= 0) return 0;
+        got += n;
+    }
+    if(response.length > sizeof(value)) return 0;
+    for(unsigned long got = 0; got < response.length; ) {
+        ssize_t n = read(fd, value + got, response.length - got);
+        if(n <= 0) return 0;
+        got += n;
+    }
+    if(k) *k = response.k;
+    int ok = (response.id == id && response.status == status && response.length == value_length);
+    for(unsigned int i = 0; ok && i < value_length; i++) ok = (value[i] == fill);
+    return ok;
+}
+
+void test_server(Test_context *ctx) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-test-%d.sock", (int)getpid());
+    RECORD_CREATE(Record_database, rec_database);
+    Context_server *srv = server_create(ctx->main, rec_database, path);
+    ASSERT(srv != 0, "server_create()");
+    pthread_t thread;
+    pthread_create(&thread, 0, test_server_run, srv);
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0, "Clients connect to the socket");
+
+    // Requests written together are answered in order
+    static unsigned char buffer[1024 * (sizeof(Server_request) + 100)];
+    unsigned long length = 0, k = 0, k2 = 0;
+    test_server_request(buffer, &length, SERVER_OP_PING, 1, 0, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_ALLOC, 2, 0, 100, 0xAB);
+    test_server_request(buffer, &length, SERVER_OP_ALLOC, 3, 0, 5000, 0xCD);
+    ASSERT(write(fd, buffer, length) == length, "Requests written");
+    ASSERT(test_server_response(fd, 1, SERVER_STATUS_OK, 0, 0, 0), "SERVER_OP_PING");
+    ASSERT(test_server_response(fd, 2, SERVER_STATUS_OK, 0, 0, &k), "SERVER_OP_ALLOC");
+    ASSERT(test_server_response(fd, 3, SERVER_STATUS_OK, 0, 0, &k2) && k2 != k, "SERVER_OP_ALLOC of a larger value");
+
+    length = 0;
+    test_server_request(buffer, &length, SERVER_OP_GET, 4, k, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_SET_VALUE, 5, k, 300, 0x12);
+    test_server_request(buffer, &length, SERVER_OP_GET, 6, k, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_FREE, 7, k2, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_GET, 8, k2, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_FREE, 9, k2, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_SET_VALUE, 10, 1 << 30, 1, 0);
+    test_server_request(buffer, &length, 99, 11, k, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_GET, 12, k, 0, 0);
+    ASSERT(write(fd, buffer, length) == length, "Requests written");
+    ASSERT(test_server_response(fd, 4, SERVER_STATUS_OK, 100, 0xAB, 0), "SERVER_OP_GET returns the value");
+    ASSERT(test_server_response(fd, 5, SERVER_STATUS_OK, 0, 0, 0), "SERVER_OP_SET_VALUE");
+    ASSERT(test_server_response(fd, 6, SERVER_STATUS_OK, 300, 0x12, 0), "SERVER_OP_GET after SERVER_OP_SET_VALUE in the same batch");
+    ASSERT(test_server_response(fd, 7, SERVER_STATUS_OK, 0, 0, 0), "SERVER_OP_FREE");
+    ASSERT(test_server_response(fd, 8, SERVER_STATUS_NOT_FOUND, 0, 0, 0), "SERVER_OP_GET of a freed key");
+    ASSERT(test_server_response(fd, 9, SERVER_STATUS_NOT_FOUND, 0, 0, 0), "SERVER_OP_FREE of a freed key");
+    ASSERT(test_server_response(fd, 10, SERVER_STATUS_NOT_FOUND, 0, 0, 0), "SERVER_OP_SET_VALUE of a key past the end");
+    ASSERT(test_server_response(fd, 11, SERVER_STATUS_BAD_REQUEST, 0, 0, 0), "An unknown op is a bad request");
+    ASSERT(test_server_response(fd, 12, SERVER_STATUS_OK, 300, 0x12, 0), "The connection carries on after a bad request");
+
+    // A request split across writes waits for the rest of it
+    length = 0;
+    test_server_request(buffer, &length, SERVER_OP_SET_VALUE, 13, k, 100, 0x34);
+    ASSERT(write(fd, buffer, 10) == 10 && write(fd, buffer + 10, 50) == 50, "Part of a request written");
+    for(int i = 0; i < 10; i++) sched_yield();
+    ASSERT(write(fd, buffer + 60, length - 60) == length - 60, "Rest of the request written");
+    ASSERT(test_server_response(fd, 13, SERVER_STATUS_OK, 0, 0, 0), "A request split across writes");
+
+    // An empty value would look like a free record, so none can be stored
+    length = 0;
+    test_server_request(buffer, &length, SERVER_OP_ALLOC, 19, 0, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_SET_VALUE, 20, k, 0, 0);
+    test_server_request(buffer, &length, SERVER_OP_PUT, 21, 1, 1, 0x62);
+    test_server_request(buffer, &length, SERVER_OP_INSERT, 22, 1, 1, 0x62);
+    test_server_request(buffer, &length, SERVER_OP_LOOKUP, 23, 1, 1, 0x62);
+    ASSERT(write(fd, buffer, length) == length, "Requests written");
+    ASSERT(test_server_response(fd, 19, SERVER_STATUS_BAD_REQUEST, 0, 0, 0), "SERVER_OP_ALLOC of an empty value is a bad request");
+    ASSERT(test_server_response(fd, 20, SERVER_STATUS_BAD_REQUEST, 0, 0, 0), "SERVER_OP_SET_VALUE to an empty value is a bad request");
+    ASSERT(test_server_response(fd, 21, SERVER_STATUS_BAD_REQUEST, 0, 0, 0), "SERVER_OP_PUT of an empty value is a bad request");
+    ASSERT(test_server_response(fd, 22, SERVER_STATUS_BAD_REQUEST, 0, 0, 0), "SERVER_OP_INSERT of an empty value is a bad request");
+    ASSERT(test_server_response(fd, 23, SERVER_STATUS_NOT_FOUND, 0, 0, 0), "and adds nothing");
+
+    // Named keys live apart from the raw ones, which can't free them from under the index
+    length = 0;
+    test_server_request(buffer, &length, SERVER_OP_PUT, 15, 1, 2, 0x61);
+    for(unsigned long raw = 0; raw < 4; raw++) {
+        if(raw != k) test_server_request(buffer, &length, SERVER_OP_FREE, 16, raw, 0, 0);
+    }
+    test_server_request(buffer, &length, SERVER_OP_LOOKUP, 17, 1, 1, 0x61);
+    test_server_request(buffer, &length, SERVER_OP_SCAN, 18, 0, 0, 0);
+    ASSERT(write(fd, buffer, length) == length, "Requests written");
+    ASSERT(test_server_response(fd, 15, SERVER_STATUS_OK, 0, 0, 0), "SERVER_OP_PUT");
+    for(unsigned long raw = 0; raw < 4; raw++) {
+        if(raw != k) test_server_response(fd, 16, SERVER_STATUS_NOT_FOUND, 0, 0, 0);
+    }
+    ASSERT(test_server_response(fd, 17, SERVER_STATUS_OK, 1, 0x61, 0), "SERVER_OP_LOOKUP after raw frees");
+    Server_response scanned;
+    Server_entry entry;
+    ASSERT(read(fd, &scanned, sizeof(scanned)) == sizeof(scanned) && scanned.id == 18 && scanned.length == sizeof(entry) + 2
+        && read(fd, &entry, sizeof(entry)) == sizeof(entry) && read(fd, buffer, 2) == 2
+        && entry.key_length == 1 && entry.value_length == 1 && buffer[0] == 0x61, "SERVER_OP_SCAN after raw frees");
+
+    // Many requests in flight at once, on two connections
+    int other = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(connect(other, (struct sockaddr *)&address, sizeof(address)) == 0, "A second connection");
+    length = 0;
+    for(int i = 0; i < 1024; i++) test_server_request(buffer, &length, SERVER_OP_GET, i, k, 0, 0);
+    ASSERT(write(fd, buffer, length) == length && write(other, buffer, length) == length, "1024 requests written on each connection");
+    int bad = 0;
+    for(int i = 0; i < 1024; i++) {
+        bad += !test_server_response(fd, i, SERVER_STATUS_OK, 100, 0x34, 0);
+        bad += !test_server_response(other, i, SERVER_STATUS_OK, 100, 0x34, 0);
+    }
+    ASSERT(bad == 0, "Pipelined requests are all answered, in order");
+    close(other);
+
+    // A value longer than the protocol allows closes the connection
+    length = 0;
+    test_server_request(buffer, &length, SERVER_OP_PING, 14, 0, 0, 0);
+    ((Server_request *)buffer)->length = SERVER_VALUE_MAX + 1;
+    ASSERT(write(fd, buffer, length) == length, "Oversized request written");
+    ASSERT(test_server_response(fd, 14, SERVER_STATUS_BAD_REQUEST, 0, 0, 0), "A value too long is a bad request");
+    ASSERT(read(fd, buffer, 1) == 0, "and the server hangs up");
+    close(fd);
+
+    server_stop(srv);
+    pthread_join(thread, 0);
+    server_free(srv);
+    ASSERT(access(path, F_OK) != 0, "server_free() removes the socket");
+    ASSERT(k < rec_database->kv_record_count && KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]) == 100, "The database holds what the clients left");
+    database_ptbl_free(ctx->main, rec_database);
+    memory_free(rec_database);
+}
+
+#define TEST_CLUSTER_KEYS 20000
+
+// Runs op on key i of the cluster test, with a value of i + version, and returns its status
+static int
+test_cluster_op(Cluster_router *router, unsigned char op, int i, int version, unsigned int *value) {
+    char key[32];
+    unsigned int v = i + version;
+    Cluster_op cop = { .op = op, .key = (unsigned char *)key, .value = (unsigned char *)&v, .value_length = sizeof(v) };
+    cop.key_length = snprintf(key, sizeof(key), "key-%d", i);
+    if(!cluster_router_execute(router, &cop, 1)) return -1;
+    if(value) *value = (cop.status == SERVER_STATUS_OK && cop.size == sizeof(v)) ? v : -1;
+    return cop.status;
+}
+
+// Looks every key up with one batch, and returns the number that don't have the value expected[i],
+// or aren't there when expected[i] is -1
+static int
+test_cluster_check(Cluster_router *router, unsigned int *expected) {
+    static char keys[TEST_CLUSTER_KEYS][32];
+    static unsigned int values[TEST_CLUSTER_KEYS];
+    static Cluster_op ops[TEST_CLUSTER_KEYS];
+    for(int i = 0; i < TEST_CLUSTER_KEYS; i++) {
+        ops[i] = (Cluster_op){ .op = SERVER_OP_LOOKUP, .key = (unsigned char *)keys[i], .value = (unsigned char *)&values[i], .value_length = sizeof(values[i]) };
+        ops[i].key_length = snprintf(keys[i], sizeof(keys[i]), "key-%d", i);
+    }
+    if(!cluster_router_execute(router, ops, TEST_CLUSTER_KEYS)) return -1;
+    int bad = 0;
+    for(int i = 0; i < TEST_CLUSTER_KEYS; i++) {
+        if(expected[i] == -1) bad += (ops[i].status != SERVER_STATUS_NOT_FOUND);
+        else bad += (ops[i].status != SERVER_STATUS_OK || values[i] != expected[i]);
+    }
+    return bad;
+}
+
+void test_cluster(Test_context *ctx) {
+    int moved = 0, counts[3] = { 0 };
+    for(int i = 0; i < TEST_CLUSTER_KEYS; i++) {
+        char key[32];
+        int length = snprintf(key, sizeof(key), "key-%d", i),
+            p = cluster_partition((unsigned char *)key, length, 2);
+        counts[p]++;
+        int q = cluster_partition((unsigned char *)key, length, 3);
+        moved += (q != p);
+        counts[2] += (q != p && q != 2);
+    }
+    ASSERT(counts[0] > TEST_CLUSTER_KEYS / 3 && counts[1] > TEST_CLUSTER_KEYS / 3, "cluster_partition() spreads keys evenly");
+    ASSERT(counts[2] == 0 && moved > TEST_CLUSTER_KEYS / 4 && moved < TEST_CLUSTER_KEYS * 5 / 12, "A third partition only takes keys, a third of them");
+
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "/tmp/b-key-test-%d", (int)getpid());
+    Context_cluster *cluster = cluster_create(ctx->main, prefix, 2);
+    ASSERT(cluster != 0 && cluster_count(cluster) == 2, "cluster_create()");
+    const char *paths[3] = { cluster_path(cluster, 0), cluster_path(cluster, 1) };
+    Cluster_router *router = cluster_router_create(ctx->main, paths, 2);
+    ASSERT(router != 0, "cluster_router_create()");
+
+    // One batch spread over both partitions
+    static char keys[TEST_CLUSTER_KEYS][32];
+    static unsigned int expected[TEST_CLUSTER_KEYS];
+    static Cluster_op ops[TEST_CLUSTER_KEYS];
+    for(int i = 0; i < TEST_CLUSTER_KEYS; i++) {
+        expected[i] = i;
+        ops[i] = (Cluster_op){ .op = SERVER_OP_PUT, .key = (unsigned char *)keys[i], .value = (unsigned char *)&expected[i], .value_length = sizeof(expected[i]) };
+        ops[i].key_length = snprintf(keys[i], sizeof(keys[i]), "key-%d", i);
+    }
+    ASSERT(cluster_router_execute(router, ops, TEST_CLUSTER_KEYS), "cluster_router_execute() of SERVER_OP_PUT");
+    int bad = 0;
+    for(int i = 0; i < TEST_CLUSTER_KEYS; i++) bad += (ops[i].status != SERVER_STATUS_OK);
+    ASSERT(bad == 0, "Every SERVER_OP_PUT succeeds");
+    ASSERT(test_cluster_check(router, expected) == 0, "SERVER_OP_LOOKUP finds every key");
+    ASSERT(test_cluster_op(router, SERVER_OP_INSERT, 7, 100, 0) == SERVER_STATUS_EXISTS, "SERVER_OP_INSERT of a key that's there");
+    ASSERT(test_cluster_op(router, SERVER_OP_DELETE, 7, 0, 0) == SERVER_STATUS_OK && test_cluster_op(router, SERVER_OP_DELETE, 7, 0, 0) == SERVER_STATUS_NOT_FOUND, "SERVER_OP_DELETE");
+    expected[7] = -1;
+
+    // A third partition, filled while the keys are being changed
+    ASSERT(cluster_add(cluster) == 2, "cluster_add()");
+    paths[2] = cluster_path(cluster, 2);
+    ASSERT(cluster_router_add(router, paths[2]) && cluster_router_rebalancing(router), "cluster_router_add() starts moving keys");
+    int unmoved = 0;
+    for(char key[32]; expected[unmoved] == -1 || cluster_partition((unsigned char *)key, snprintf(key, sizeof(key), "key-%d", unmoved), 3) != 2; unmoved++);
+    unsigned int found;
+    ASSERT(test_cluster_op(router, SERVER_OP_INSERT, unmoved, 9000, 0) == SERVER_STATUS_EXISTS, "SERVER_OP_INSERT of a key not moved yet");
+    ASSERT(test_cluster_op(router, SERVER_OP_LOOKUP, unmoved, 0, &found) == SERVER_STATUS_OK && found == expected[unmoved], "leaves its value as it was");
+    char unmoved_key[32];
+    unsigned int replaced = unmoved + 9100;
+    Cluster_op replace[2] = {
+        { .op = SERVER_OP_DELETE, .key = (unsigned char *)unmoved_key },
+        { .op = SERVER_OP_INSERT, .key = (unsigned char *)unmoved_key, .value = (unsigned char *)&replaced, .value_length = sizeof(replaced) }
+    };
+    replace[0].key_length = replace[1].key_length = snprintf(unmoved_key, sizeof(unmoved_key), "key-%d", unmoved);
+    ASSERT(cluster_router_execute(router, replace, 2) && replace[0].status == SERVER_STATUS_OK && replace[1].status == SERVER_STATUS_OK, "SERVER_OP_DELETE then SERVER_OP_INSERT of a key not moved yet");
+    expected[unmoved] = replaced;
+    ASSERT(test_cluster_op(router, SERVER_OP_LOOKUP, unmoved, 0, &found) == SERVER_STATUS_OK && found == replaced, "leaves the inserted value");
+    int steps = 0, failed = 0, midway = -1;
+    for(int i = 0; cluster_router_rebalancing(router); i++, steps++) {
+        int k = (i * 7919) % TEST_CLUSTER_KEYS;
+        unsigned int value;
+        if(i == 5) {
+            midway = test_cluster_check(router, expected);
+        }
+        else if(expected[k] == -1) {
+            failed += (test_cluster_op(router, SERVER_OP_LOOKUP, k, 0, &value) != SERVER_STATUS_NOT_FOUND);
+        }
+        else if(i % 4 == 3) {
+            failed += (test_cluster_op(router, SERVER_OP_INSERT, k, 9000, 0) != SERVER_STATUS_EXISTS);
+        }
+        else if(i % 3 == 0) {
+            failed += (test_cluster_op(router, SERVER_OP_PUT, k, 5000, 0) != SERVER_STATUS_OK);
+            expected[k] = k + 5000;
+        }
+        else if(i % 3 == 1) {
+            failed += (test_cluster_op(router, SERVER_OP_DELETE, k, 0, 0) != SERVER_STATUS_OK);
+            expected[k] = -1;
+        }
+        else {
+            failed += (test_cluster_op(router, SERVER_OP_LOOKUP, k, 0, &value) != SERVER_STATUS_OK || value != expected[k]);
+        }
+    }
+    ASSERT(steps > 10 && failed == 0, "Keys are read, written and deleted correctly while being moved");
+    ASSERT(midway == 0, "Every key is where it should be midway");
+    ASSERT(cluster_router_rebalance(router, 1) && !cluster_router_rebalancing(router), "cluster_router_rebalance() finishes");
+    ASSERT(test_cluster_check(router, expected) == 0, "Every key is where it should be afterwards");
+
+    // A router that never saw the old layout finds every key in place
+    Cluster_router *fresh = cluster_router_create(ctx->main, paths, 3);
+    ASSERT(fresh != 0 && test_cluster_check(fresh, expected) == 0, "Moved keys are in the partition they're routed to");
+    cluster_router_free(fresh);
+
+    cluster_router_free(router);
+    cluster_free(cluster);
+    ASSERT(access(paths[0], F_OK) != 0 && access(prefix, F_OK) != 0, "cluster_free() stops every server");
+}
+
+void test_replica(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    RECORD_CREATE(Record_database, follower);
+    RECORD_CREATE(Record_database, other);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/b-key-test-%d.wal", (int)getpid());
+    unlink(path);
+
+    // A database that's been written to before the replica starts
+    Database_wal *wal = database_wal_open(ctx->main, rec_database, path, WAL_SYNC_NONE, 0);
+    ASSERT(wal != 0, "database_wal_open()");
+    unsigned long keys[300], value[128];
+    for(int i = 0; i < 300; i++) {
+        value[0] = i;
+        keys[i] = database_wal_kv_alloc(ctx->main, wal, (i % 2) ? KV_RECORD_TYPE_INT64 : KV_RECORD_TYPE_RAW, 8 + (i % 7) * 100, (unsigned char *)value);
+    }
+    for(int i = 0; i < 300; i += 5) database_wal_kv_free(ctx->main, wal, keys[i]);
+
+    int fds[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair()");
+    Database_replica *replica = database_replica_open(ctx->main, follower, fds[1]);
+    ASSERT(replica != 0, "database_replica_open()");
+    ASSERT(database_wal_ship(ctx->main, wal, fds[0]), "database_wal_ship() to a socket");
+    ASSERT(database_replica_wait(replica, database_wal_lsn(wal), 5000), "database_replica_wait()");
+    database_replica_read_begin(replica);
+    ASSERT(test_wal_diff(ctx->main, rec_database, follower) == 0, "A replica starts with the whole database");
+    database_replica_read_end(replica);
+
+    // Writes made after it started, to a second follower over a pipe too
+    int pipe_fds[2];
+    ASSERT(pipe(pipe_fds) == 0, "pipe()");
+    Database_replica *piped = database_replica_open(ctx->main, other, pipe_fds[0]);
+    ASSERT(piped != 0 && database_wal_ship(ctx->main, wal, pipe_fds[1]), "database_wal_ship() to a pipe");
+    for(int i = 1; i < 300; i += 3) {
+        value[0] = 1000 + i;
+        if(keys[i] % 5) database_wal_kv_set_value(ctx->main, wal, keys[i], 300 + i, (unsigned char *)value);
+    }
+    for(int i = 2; i < 300; i += 10) database_wal_kv_free(ctx->main, wal, keys[i]);
+    for(int i = 0; i < 50; i++) {
+        value[0] = 2000 + i;
+        database_wal_kv_alloc(ctx->main, wal, KV_RECORD_TYPE_RAW, 40, (unsigned char *)value);
+    }
+    unsigned long lsn = database_wal_lsn(wal);
+    ASSERT(database_replica_wait(replica, lsn, 5000) && database_replica_wait(piped, lsn, 5000), "Both replicas catch up");
+    database_replica_read_begin(replica);
+    ASSERT(test_wal_diff(ctx->main, rec_database, follower) == 0, "A replica applies every write");
+    database_replica_read_end(replica);
+    database_replica_read_begin(piped);
+    ASSERT(test_wal_diff(ctx->main, rec_database, other) == 0, "A replica over a pipe applies every write");
+    database_replica_read_end(piped);
+
+    Replica_stats stats;
+    database_replica_stats(replica, &stats);
+    ASSERT(stats.applied == lsn && stats.primary == lsn && stats.lag == 0, "Replica_stats of a replica that's caught up");
+    ASSERT(stats.batches > 100 && stats.records > 300 && stats.delay >= 0 && stats.delay_max >= stats.delay, "Replica_stats counts every batch");
+
+    // A replica that goes away is dropped, and the others carry on
+    ASSERT(database_replica_close(replica), "database_replica_close()");
+    value[0] = 3000;
+    ASSERT(database_wal_kv_set_value(ctx->main, wal, keys[1], 8, (unsigned char *)value), "Writes go on once a follower is gone");
+    ASSERT(database_replica_wait(piped, database_wal_lsn(wal), 5000), "and reach the other follower");
+    ASSERT(database_kv_get_value(ctx->main, other, 0, keys[1])[0] == (unsigned char)3000 && database_replica_wait(piped, database_wal_lsn(wal), 0), "Waiting for what's been applied doesn't wait");
+
+    // A follower that never reads doesn't hold the writes up, however far behind it falls
+    int stalled[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, stalled) == 0 && database_wal_ship(ctx->main, wal, stalled[0]), "database_wal_ship() to a follower that never reads");
+    unsigned char big[4096] = { 0 };
+    int written = 0;
+    for(int i = 0; i < 1000; i++) {
+        big[0] = i;
+        written += database_wal_kv_set_value(ctx->main, wal, keys[1], sizeof(big), big);
+    }
+    ASSERT(written == 1000, "Writes go on past what the follower's socket holds");
+    ASSERT(database_replica_wait(piped, database_wal_lsn(wal), 5000) && database_kv_get_value(ctx->main, other, 0, keys[1])[0] == (unsigned char)999, "and reach the follower that reads");
+    close(stalled[1]);
+    value[0] = 3000;
+    ASSERT(database_wal_kv_set_value(ctx->main, wal, keys[1], 8, (unsigned char *)value), "A stalled follower that goes away is dropped");
+
+    // The log ending, and a stream that isn't a log
+    lsn = database_wal_lsn(wal);
+    ASSERT(database_wal_close(ctx->main, wal), "database_wal_close()");
+    ASSERT(!database_replica_wait(piped, lsn * 2, 5000), "database_replica_wait() gives up once the log ends");
+    ASSERT(database_replica_close(piped), "A replica whose log ended");
+    ASSERT(pipe(pipe_fds) == 0 && write(pipe_fds[1], "NOTALOG!NOTALOG!", 16) == 16, "A bad log written");
+    close(pipe_fds[1]);
+    RECORD_CREATE(Record_database, bad);
+    replica = database_replica_open(ctx->main, bad, pipe_fds[0]);
+    ASSERT(replica != 0 && !database_replica_wait(replica, 0, 5000), "A bad log applies nothing");
+    ASSERT(!database_replica_close(replica), "database_replica_close() reports a bad log");
+    Wal_header header = { WAL_MAGIC, WAL_VERSION, PERSIST_BYTE_ORDER };
+    Wal_frame frame = { 0, 0, -1UL, 0 };
+    ASSERT(pipe(pipe_fds) == 0 && write(pipe_fds[1], &header, sizeof(header)) == sizeof(header) && write(pipe_fds[1], &frame, sizeof(frame)) == sizeof(frame), "A batch too long to be real written");
+    replica = database_replica_open(ctx->main, bad, pipe_fds[0]);
+    ASSERT(replica != 0 && !database_replica_wait(replica, 0, 5000), "A batch too long to be real applies nothing");
+    close(pipe_fds[1]);
+    ASSERT(!database_replica_close(replica), "and is reported as a bad log");
+
+    unlink(path);
+    database_ptbl_free(ctx->main, rec_database);
+    database_ptbl_free(ctx->main, follower);
+    database_ptbl_free(ctx->main, other);
+    memory_free(rec_database);
+    memory_free(follower);
+    memory_free(other);
+    memory_free(bad);
+}
+
+#define TEST_CDC_PRODUCERS 4
+#define TEST_CDC_EVENTS 200000
+
+typedef struct test_cdc_producer {
+    Cdc_feed *feed;
+    unsigned long id;
+    atomic_int *done;
+} Test_cdc_producer;
+
+static void *
+test_cdc_produce(void *arg) {
+    Test_cdc_producer *p = (Test_cdc_producer *)arg;
+    for(unsigned long i = 0; i < TEST_CDC_EVENTS; i++) {
+        unsigned long k = (p->id << 32) | i;
+        cdc_publish(p->feed, CDC_OP_SET_VALUE, k, k ^ 0x5a5a);
+        if((i % 256) == 0) sched_yield();
+    }
+    atomic_fetch_add(p->done, 1);
+    return 0;
+}
+
+void test_cdc(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    unsigned char value[256];
+    memset(value, 1, sizeof(value));
+
+    unsigned long before = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_RAW, 8, value);
+    Cdc_feed *feed = cdc_feed_create(ctx->main, rec_database, 12);
+    ASSERT(feed != 0 && rec_database->cdc == feed, "cdc_feed_create()");
+    ASSERT(cdc_feed_create(ctx->main, rec_database, 16) == 0, "A database has one feed at most");
+
+    Cdc_cursor a, b;
+    Cdc_event event;
+    cdc_cursor_init(feed, &a);
+    ASSERT(cdc_next(feed, &a, &event) == CDC_NONE, "A new feed is empty, whatever was written before it");
+
+    // Every kind of change, in order
+    unsigned long k = database_kv_alloc(ctx->main, rec_database, KV_RECORD_TYPE_RAW, 100, value);
+    ASSERT(database_kv_set_value(ctx->main, rec_database, k, 200, value), "database_kv_set_value()");
+    ASSERT(database_kv_free(ctx->main, rec_database, before), "database_kv_free()");
+    ASSERT(database_kv_free(ctx->main, rec_database, before), "database_kv_free() of a free record");
+    ASSERT(!database_kv_set_value(ctx->main, rec_database, before, 8, value), "database_kv_set_value() of a free record fails");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.op == CDC_OP_ALLOC && event.k == k && event.size == 100 && event.version == 1, "database_kv_alloc() is published");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.op == CDC_OP_SET_VALUE && event.k == k && event.size == 200 && event.version == 2, "database_kv_set_value() is published");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.op == CDC_OP_FREE && event.k == before && event.size == 0 && event.version == 3, "database_kv_free() is published");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_NONE, "Changes that didn't happen aren't published");
+
+    // A batch is published once it's committed, and only then
+    Database_batch *batch = database_batch_create(ctx->main);
+    database_batch_kv_alloc(batch, KV_RECORD_TYPE_RAW, 50, value);
+    database_batch_kv_set_value(batch, k, 60, value);
+    database_batch_kv_free(batch, k);
+    database_batch_kv_free(batch, k);
+    cdc_cursor_init(feed, &b);
+    ASSERT(cdc_next(feed, &b, &event) == CDC_NONE, "A staged batch isn't published");
+    ASSERT(database_batch_commit(ctx->main, rec_database, batch), "database_batch_commit()");
+    ASSERT(cdc_next(feed, &b, &event) == CDC_EVENT && event.op == CDC_OP_ALLOC && event.k == database_batch_key(batch, 0) && event.size == 50 && event.version == 4, "A batch's allocation is published");
+    ASSERT(event.k == before, "reusing the record freed before");
+    ASSERT(cdc_next(feed, &b, &event) == CDC_EVENT && event.op == CDC_OP_SET_VALUE && event.k == k && event.size == 60, "A batch's set_value is published");
+    ASSERT(cdc_next(feed, &b, &event) == CDC_EVENT && event.op == CDC_OP_FREE && event.k == k && event.version == 6, "A batch's free is published, but not of a free record");
+    ASSERT(cdc_next(feed, &b, &event) == CDC_NONE, "The end of a batch");
+    database_batch_free(ctx->main, batch);
+
+    // Consumers go at their own pace: a lags behind b, until it's lapped and told to resync
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.version == 4, "Cursors are independent");
+    for(int i = 0; i < 14; i++) database_kv_set_value(ctx->main, rec_database, 0, 8 + i, value);
+    ASSERT(cdc_next(feed, &b, &event) == CDC_EVENT && event.version == 7 && event.size == 8, "A cursor a ring behind still reads everything");
+    database_kv_set_value(ctx->main, rec_database, 0, 30, value);
+    ASSERT(cdc_next(feed, &a, &event) == CDC_RESYNC, "A cursor more than a ring behind resyncs");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_NONE, "and reads what comes after");
+    database_kv_set_value(ctx->main, rec_database, 0, 31, value);
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.version == 22 && event.size == 31, "A resynced cursor picks up new events");
+    for(int i = 0; i < 2; i++) database_kv_set_value(ctx->main, rec_database, 0, 40 + i, value);
+    ASSERT(cdc_next(feed, &b, &event) == CDC_RESYNC, "Every cursor that's lapped resyncs");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.version == 23, "while those keeping up don't");
+
+    cdc_feed_free(ctx->main, rec_database);
+    ASSERT(rec_database->cdc == 0, "cdc_feed_free()");
+    ASSERT(database_kv_set_value(ctx->main, rec_database, 0, 8, value), "A database goes on without its feed");
+    database_ptbl_free(ctx->main, rec_database);
+
+    // Writers on several threads: a consumer never sees an event torn, or out of order
+    feed = cdc_feed_create(ctx->main, rec_database, 1024);
+    Test_cdc_producer producers[TEST_CDC_PRODUCERS];
+    pthread_t threads[TEST_CDC_PRODUCERS];
+    atomic_int done;
+    atomic_init(&done, 0);
+    cdc_cursor_init(feed, &a);
+    for(int i = 0; i < TEST_CDC_PRODUCERS; i++) {
+        producers[i] = (Test_cdc_producer){ feed, i, &done };
+        pthread_create(&threads[i], 0, test_cdc_produce, &producers[i]);
+    }
+    unsigned long events = 0, last = 0, errors = 0;
+    int resynced = 1;
+    for(int finished = 0, got = CDC_EVENT; !finished || got != CDC_NONE; ) {
+        // Whatever is read once every producer is done is the last of it
+        finished = (atomic_load(&done) == TEST_CDC_PRODUCERS);
+        got = cdc_next(feed, &a, &event);
+        if(got == CDC_EVENT) {
+            if(event.size != (event.k ^ 0x5a5a) || event.op != CDC_OP_SET_VALUE) errors++;
+            // Versions only skip ahead where the consumer was told it missed some
+            if(resynced ? event.version <= last : event.version != last + 1) errors++;
+            last = event.version;
+            resynced = 0;
+            events++;
+        }
+        else if(got == CDC_RESYNC) {
+            resynced = 1;
+        }
+        else {
+            sched_yield();
+        }
+    }
+    for(int i = 0; i < TEST_CDC_PRODUCERS; i++) {
+        pthread_join(threads[i], 0);
+    }
+    ASSERT(errors == 0, "Events written from several threads at once read whole, and in order");
+    ASSERT(events > 0 && last <= TEST_CDC_PRODUCERS * TEST_CDC_EVENTS, "A consumer gets every event, or is told what it missed");
+
+    cdc_feed_free(ctx->main, rec_database);
+    memory_free(rec_database);
+
+    // A concurrent database publishes its changes too, snapshot open or not
+    Database_concurrent *dbc = database_concurrent_create(ctx->main);
+    feed = cdc_feed_create(ctx->main, database_concurrent_record(dbc), 16);
+    ASSERT(feed != 0, "cdc_feed_create() of a concurrent database");
+    cdc_cursor_init(feed, &a);
+    k = database_concurrent_kv_alloc(ctx->main, dbc, KV_RECORD_TYPE_RAW, 100, value);
+    Database_snapshot *snapshot = database_concurrent_snapshot_begin(ctx->main, dbc);
+    ASSERT(database_concurrent_kv_set_value(ctx->main, dbc, k, 200, value), "database_concurrent_kv_set_value()");
+    ASSERT(database_concurrent_kv_free(ctx->main, dbc, k) && database_concurrent_kv_free(ctx->main, dbc, k), "database_concurrent_kv_free()");
+    database_concurrent_snapshot_end(ctx->main, snapshot);
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.op == CDC_OP_ALLOC && event.k == k && event.size == 100, "database_concurrent_kv_alloc() is published");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.op == CDC_OP_SET_VALUE && event.k == k && event.size == 200, "database_concurrent_kv_set_value() is published");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_EVENT && event.op == CDC_OP_FREE && event.k == k, "database_concurrent_kv_free() is published");
+    ASSERT(cdc_next(feed, &a, &event) == CDC_NONE, "but not of a free record");
+    cdc_feed_free(ctx->main, database_concurrent_record(dbc));
+    database_concurrent_free(ctx->main, dbc);
+}
+
+#define TEST_ASYNC_KEYS 1000
+
+void test_async(Test_context *ctx) {
+    RECORD_CREATE(Record_database, rec_database);
+    Database_async *async = database_async_create(ctx->main, rec_database, 2000);
+    ASSERT(async != 0, "database_async_create()");
+
+    // Allocations of every size, in flight all at once
+    unsigned long keys[TEST_ASYNC_KEYS], values[TEST_ASYNC_KEYS][64];
+    Async_cqe cqe[2048];
+    for(int i = 0; i < TEST_ASYNC_KEYS; i++) {
+        Async_sqe *sqe = database_async_sqe(async);
+        values[i][0] = i;
+        sqe->op = ASYNC_OP_ALLOC;
+        sqe->flags = (i % 2) ? KV_RECORD_TYPE_INT64 : KV_RECORD_TYPE_RAW;
+        sqe->length = 8 + (i % 60) * 8;
+        sqe->buffer = (unsigned char *)values[i];
+        sqe->user_data = i;
+    }
+    ASSERT(database_async_submit(async) == TEST_ASYNC_KEYS, "database_async_submit()");
+    ASSERT(database_async_submit(async) == 0, "Submitting nothing");
+    unsigned long done = 0;
+    int errors = 0;
+    while(done < TEST_ASYNC_KEYS) {
+        unsigned long got = database_async_complete(async, cqe, 2048, 1);
+        for(unsigned long j = 0; j < got; j++) {
+            if(!cqe[j].result || cqe[j].user_data >= TEST_ASYNC_KEYS) errors++;
+            else keys[cqe[j].user_data] = cqe[j].k;
+        }
+        done += got;
+    }
+    ASSERT(errors == 0 && done == TEST_ASYNC_KEYS, "Every allocation completes");
+    ASSERT(database_async_complete(async, cqe, 2048, 100) == 0, "Waiting with nothing in flight doesn't wait");
+
+    // Reads, some into buffers too short for the value
+    unsigned long read[TEST_ASYNC_KEYS][64];
+    for(int i = 0; i < TEST_ASYNC_KEYS; i++) {
+        Async_sqe *sqe = database_async_sqe(async);
+        sqe->op = ASYNC_OP_GET;
+        sqe->k = keys[i];
+        sqe->length = (i % 3) ? sizeof(read[i]) : 8;
+        sqe->buffer = (unsigned char *)read[i];
+        sqe->user_data = i;
+    }
+    database_async_submit(async);
+    ASSERT(database_async_complete(async, cqe, 2048, TEST_ASYNC_KEYS) == TEST_ASYNC_KEYS, "Waiting for every completion");
+    for(int j = 0; j < TEST_ASYNC_KEYS; j++) {
+        int i = cqe[j].user_data;
+        if(!cqe[j].result || cqe[j].k != keys[i] || cqe[j].length != 8 + (i % 60) * 8 || read[i][0] != i
+            || cqe[j].flags != ((i % 2) ? KV_RECORD_TYPE_INT64 : KV_RECORD_TYPE_RAW)) errors++;
+    }
+    ASSERT(errors == 0, "Every read completes with its value");
+
+    // Operations on one key run in the order they were submitted, among others that get reordered
+    unsigned long newer = 777, value = 0;
+    Async_sqe *sqe;
+    for(int i = TEST_ASYNC_KEYS - 1; i >= 0; i -= 7) {
+        sqe = database_async_sqe(async);
+        sqe->op = ASYNC_OP_SET_VALUE; sqe->k = keys[i]; sqe->length = 300; sqe->buffer = (unsigned char *)values[i]; sqe->user_data = 1;
+    }
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_SET_VALUE; sqe->k = keys[5]; sqe->length = sizeof(newer); sqe->buffer = (unsigned char *)&newer; sqe->user_data = 2;
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_GET; sqe->k = keys[5]; sqe->length = sizeof(value); sqe->buffer = (unsigned char *)&value; sqe->user_data = 3;
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_FREE; sqe->k = keys[5]; sqe->user_data = 4;
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_GET; sqe->k = keys[5]; sqe->length = sizeof(value); sqe->buffer = (unsigned char *)&value; sqe->user_data = 5;
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_SET_VALUE; sqe->k = -2; sqe->length = 8; sqe->buffer = (unsigned char *)&newer; sqe->user_data = 6;
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_NOP; sqe->user_data = 7;
+    unsigned long submitted = database_async_submit(async);
+    ASSERT(database_async_complete(async, cqe, 2048, submitted) == submitted, "A mixed batch completes");
+    int seen = 0;
+    for(unsigned long j = 0; j < submitted; j++) {
+        if(cqe[j].user_data == 1 && !cqe[j].result) errors++;
+        if(cqe[j].user_data == 2 && cqe[j].result && seen == 0) seen = 1;
+        if(cqe[j].user_data == 3 && cqe[j].result && value == 777 && seen == 1) seen = 2;
+        if(cqe[j].user_data == 4 && cqe[j].result && seen == 2) seen = 3;
+        if(cqe[j].user_data == 5 && !cqe[j].result && seen == 3) seen = 4;
+        if(cqe[j].user_data == 6 && cqe[j].result) errors++;
+        if(cqe[j].user_data == 7 && !cqe[j].result) errors++;
+    }
+    ASSERT(errors == 0, "Operations on other keys, or none, complete");
+    ASSERT(seen == 4, "set_value, get, free then get of one key run in order");
+
+    // No more than the depth in flight
+    database_async_free(async);
+    async = database_async_create(ctx->main, rec_database, 10);
+    int room = 0;
+    while(database_async_sqe(async)) room++;
+    ASSERT(room == 16, "A Database_async holds its depth in flight, rounded up to a power of two");
+    database_async_submit(async);
+    ASSERT(database_async_complete(async, cqe, 4, 4) == 4 && database_async_sqe(async) != 0, "Reaping makes room");
+    ASSERT(database_async_complete(async, cqe, 2048, 2048) == 12, "and the rest complete");
+
+    // What's submitted when it's freed still runs
+    sqe = database_async_sqe(async);
+    sqe->op = ASYNC_OP_FREE; sqe->k = keys[0];
+    database_async_submit(async);
+    database_async_free(async);
+    ASSERT(database_kv_get_value(ctx->main, rec_database, 0, keys[0]) == 0, "database_async_free() runs what was submitted");
+    ASSERT(database_kv_get_value(ctx->main, rec_database, 0, keys[1])[0] == 1, "and leaves the database to the caller");
+
+    database_ptbl_free(ctx->main, rec_database);
+    memory_free(rec_database);
+}
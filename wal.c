@@ -0,0 +1,953 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "records.h"
+#include "context.h"
+#include "memory.h"
+#include "database.h"
+#include "cdc.h"
+#include "hash.h"
+#include "persist.h"
+#include "wal.h"
+
+#ifndef DEBUG_WAL
+    #undef DEBUG_PRINT
+    #define DEBUG_PRINT(...)
+#endif
+
+enum {
+    WAL_OP_ALLOC,
+    WAL_OP_SET_VALUE,
+    WAL_OP_FREE
+};
+
+// Followed by length bytes of value
+typedef struct wal_record {
+    unsigned long checksum; // hash_bytes() of everything after it, value included
+    unsigned long k;
+    unsigned long length;
+    unsigned char type;
+    unsigned char flags;
+    unsigned char reserved[6];
+} Wal_record;
+
+typedef struct wal_buffer {
+    unsigned char *data;
+    unsigned long length;
+    unsigned long capacity;
+} Wal_buffer;
+
+// How long the shipping thread waits for a follower to take more before it looks for new ones
+#define _WAL_SHIP_POLL_MS 10
+
+typedef struct wal_follower {
+    int fd;                // Non-blocking
+    Wal_buffer queue;      // Bytes shipped and not yet sent, from sent on
+    unsigned long sent;
+    unsigned long limit;   // Most bytes it may have queued
+} Wal_follower;
+
+// Positions in the log (LSNs) count the bytes of records ever appended, so that they keep growing
+// when a checkpoint empties the file
+struct database_wal {
+    Record_database *rec_database;
+    int fd;
+    int sync;
+    unsigned long interval_ms;
+
+    pthread_mutex_t lock;      // Guards rec_database, active, appended and base
+    Wal_buffer active;         // Records appended, and not yet taken by a flush
+    unsigned long appended;    // LSN just past the last record appended
+    unsigned long base;        // LSN of the first record in the file
+
+    pthread_mutex_t sync_lock; // Guards everything below
+    pthread_cond_t synced;     // Signalled whenever a thread gives the file back
+    pthread_cond_t wake;       // Wakes the interval thread up early
+    int flushing;              // Set while a thread owns the file
+    unsigned long durable;     // LSN that everything before has been written (and synced, unless WAL_SYNC_NONE)
+    int failed;                // A write or sync failed, so nothing after durable ever will be
+    int stop;
+    Wal_buffer spare;          // Only touched by the thread that owns the file
+    pthread_t thread;          // Syncs every interval_ms, for WAL_SYNC_INTERVAL
+    int thread_started;
+
+    pthread_mutex_t ship_lock; // Guards everything below
+    pthread_cond_t ship_wake;  // Wakes the shipping thread up when a follower has bytes queued
+    Wal_follower followers[WAL_FOLLOWERS_MAX];
+    int follower_count;
+    int ship_stop;
+    pthread_t ship_thread;     // Sends what followers couldn't take straight away
+    int ship_started;
+};
+
+static int
+_wal_write(
+    int fd,
+    const unsigned char *buffer,
+    unsigned long length,
+    unsigned long offset
+) {
+    while(length > 0) {
+        ssize_t written = pwrite(fd, buffer, length, offset);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            DEBUG_PRINT("\tERR write failed: %s\n", strerror(errno));
+            return 0;
+        }
+        buffer += written;
+        offset += written;
+        length -= written;
+    }
+
+    return 1;
+}
+
+// Makes room for length more bytes in active. lock must be held.
+static int
+_wal_reserve(
+    Database_wal *wal,
+    unsigned long length
+) {
+    if(wal->active.length + length <= wal->active.capacity) {
+        return 1;
+    }
+
+    unsigned long new_capacity = wal->active.capacity * 2;
+    while(new_capacity < wal->active.length + length) {
+        new_capacity *= 2;
+    }
+    unsigned char *new_data = memory_realloc(wal->active.data, wal->active.capacity, new_capacity);
+    if(!new_data) {
+        DEBUG_PRINT("\tERR failed to grow log buffer\n");
+        return 0;
+    }
+    wal->active.data = new_data;
+    wal->active.capacity = new_capacity;
+
+    return 1;
+}
+
+// Writes a record to at, and returns its length
+static unsigned long
+_wal_encode(
+    unsigned char *at,
+    unsigned char type,
+    unsigned char flags,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    Wal_record record = { 0, k, length, type, flags };
+
+    memcpy(at, &record, sizeof(Wal_record));
+    if(length) {
+        memcpy(at + sizeof(Wal_record), buffer, length);
+    }
+    record.checksum = hash_bytes(at + sizeof(record.checksum), sizeof(Wal_record) - sizeof(record.checksum) + length);
+    memcpy(at, &record.checksum, sizeof(record.checksum));
+
+    return sizeof(Wal_record) + length;
+}
+
+// Appends a record to active, which must have room for it. lock must be held.
+// Returns the LSN just past it.
+static unsigned long
+_wal_append(
+    Database_wal *wal,
+    unsigned char type,
+    unsigned char flags,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    unsigned long written = _wal_encode(wal->active.data + wal->active.length, type, flags, k, length, buffer);
+
+    wal->active.length += written;
+    wal->appended += written;
+
+    return wal->appended;
+}
+
+// Queues length bytes of data for a follower, unless that takes it past its limit. ship_lock must be held.
+static int
+_wal_follower_queue(
+    Wal_follower *follower,
+    const unsigned char *data,
+    unsigned long length
+) {
+    Wal_buffer *queue = &follower->queue;
+    if(queue->length - follower->sent + length > follower->limit) {
+        return 0;
+    }
+    if(queue->length + length > queue->capacity && follower->sent) {
+        memmove(queue->data, queue->data + follower->sent, queue->length - follower->sent);
+        queue->length -= follower->sent;
+        follower->sent = 0;
+    }
+    if(queue->length + length > queue->capacity) {
+        // realloc() rather than memory_realloc(), as a queue may hold more than an int's worth
+        size_t new_capacity = queue->capacity ? queue->capacity * 2 : WAL_BUFFER_INITIAL_CAPACITY;
+        while(new_capacity < queue->length + length) {
+            new_capacity *= 2;
+        }
+        unsigned char *new_data = realloc(queue->data, new_capacity);
+        if(!new_data) {
+            return 0;
+        }
+        queue->data = new_data;
+        queue->capacity = new_capacity;
+    }
+    memcpy(queue->data + queue->length, data, length);
+    queue->length += length;
+
+    return 1;
+}
+
+// Sends what a follower takes of its queue without blocking. Returns 0 if it's gone. ship_lock must be held.
+static int
+_wal_follower_send(
+    Wal_follower *follower
+) {
+    while(follower->sent < follower->queue.length) {
+        unsigned char *buffer = follower->queue.data + follower->sent;
+        unsigned long length = follower->queue.length - follower->sent;
+        // send() so that a follower gone away is an error rather than SIGPIPE, write() for pipes
+        ssize_t written = send(follower->fd, buffer, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(written < 0 && errno == ENOTSOCK) {
+            written = write(follower->fd, buffer, length);
+        }
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        follower->sent += written;
+    }
+    follower->sent = follower->queue.length = 0;
+
+    return 1;
+}
+
+// Closes a follower, and takes it off the list. ship_lock must be held.
+static void
+_wal_follower_drop(
+    Database_wal *wal,
+    int i
+) {
+    DEBUG_PRINT("\tfollower on fd %d dropped: %s\n", wal->followers[i].fd, strerror(errno));
+    close(wal->followers[i].fd);
+    free(wal->followers[i].queue.data);
+    wal->followers[i] = wal->followers[--wal->follower_count];
+}
+
+// The Wal_frame of a batch of length bytes of records, which end at LSN end
+static void
+_wal_frame(
+    Database_wal *wal,
+    Wal_frame *frame,
+    unsigned long length,
+    unsigned long end
+) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    frame->end = end;
+    frame->appended = __atomic_load_n(&wal->appended, __ATOMIC_RELAXED);
+    frame->length = length;
+    frame->shipped_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Queues a batch of records for every follower, and sends what each takes without blocking. Those
+// that are gone, or that have more queued than they may, are dropped. The file must be owned.
+static void
+_wal_ship(
+    Database_wal *wal,
+    unsigned char *data,
+    unsigned long length,
+    unsigned long end
+) {
+    Wal_frame frame;
+    _wal_frame(wal, &frame, length, end);
+
+    pthread_mutex_lock(&wal->ship_lock);
+    int pending = 0;
+    for(int i = 0; i < wal->follower_count; ) {
+        Wal_follower *follower = &wal->followers[i];
+        if(follower->queue.length - follower->sent + sizeof(frame) + length <= follower->limit
+                && _wal_follower_queue(follower, (unsigned char *)&frame, sizeof(frame))
+                && _wal_follower_queue(follower, data, length)
+                && _wal_follower_send(follower)) {
+            pending |= (follower->queue.length != 0);
+            i++;
+            continue;
+        }
+        _wal_follower_drop(wal, i);
+    }
+    if(pending) {
+        pthread_cond_signal(&wal->ship_wake);
+    }
+    pthread_mutex_unlock(&wal->ship_lock);
+}
+
+// Sends the followers what they couldn't take when it was shipped, as they take it
+static void *
+_wal_ship_thread(
+    void *arg
+) {
+    Database_wal *wal = (Database_wal *)arg;
+
+    pthread_mutex_lock(&wal->ship_lock);
+    while(!wal->ship_stop) {
+        struct pollfd fds[WAL_FOLLOWERS_MAX];
+        int count = 0;
+        for(int i = 0; i < wal->follower_count; i++) {
+            if(wal->followers[i].queue.length) {
+                fds[count].fd = wal->followers[i].fd;
+                fds[count].events = POLLOUT;
+                fds[count++].revents = 0;
+            }
+        }
+        if(!count) {
+            pthread_cond_wait(&wal->ship_wake, &wal->ship_lock);
+            continue;
+        }
+
+        // A follower may be dropped, and its fd closed, while this waits, which only wakes it up early
+        pthread_mutex_unlock(&wal->ship_lock);
+        poll(fds, count, _WAL_SHIP_POLL_MS);
+        pthread_mutex_lock(&wal->ship_lock);
+
+        for(int i = 0; i < wal->follower_count; ) {
+            if(!wal->followers[i].queue.length || _wal_follower_send(&wal->followers[i])) {
+                i++;
+                continue;
+            }
+            _wal_follower_drop(wal, i);
+        }
+    }
+    pthread_mutex_unlock(&wal->ship_lock);
+
+    return 0;
+}
+
+// Waits for the file, and takes it. sync_lock must be held.
+static void
+_wal_own(
+    Database_wal *wal
+) {
+    while(wal->flushing) {
+        pthread_cond_wait(&wal->synced, &wal->sync_lock);
+    }
+    wal->flushing = 1;
+}
+
+// Gives the file back, with everything up to end written if ok. sync_lock must be held.
+static void
+_wal_release(
+    Database_wal *wal,
+    unsigned long end,
+    int ok
+) {
+    if(ok) {
+        if(end > wal->durable) wal->durable = end;
+    }
+    else {
+        wal->failed = 1;
+    }
+    wal->flushing = 0;
+    pthread_cond_broadcast(&wal->synced);
+}
+
+// Writes everything appended so far in one write, and syncs it if datasync is set. Everything
+// appended while it runs is left for the next flush, which is what batches concurrent commits.
+// sync_lock must be held, and is held again on return.
+static int
+_wal_flush(
+    Database_wal *wal,
+    int datasync
+) {
+    _wal_own(wal);
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    pthread_mutex_lock(&wal->lock);
+    Wal_buffer taken = wal->active;
+    wal->active = wal->spare;
+    wal->active.length = 0;
+    unsigned long end = wal->appended,
+                  offset = sizeof(Wal_header) + (end - taken.length - wal->base);
+    pthread_mutex_unlock(&wal->lock);
+
+    int ok = !__atomic_load_n(&wal->failed, __ATOMIC_RELAXED)
+          && _wal_write(wal->fd, taken.data, taken.length, offset)
+          && (!datasync || fdatasync(wal->fd) == 0);
+    if(ok && taken.length && wal->follower_count) {
+        _wal_ship(wal, taken.data, taken.length, end);
+    }
+    taken.length = 0;
+    wal->spare = taken;
+
+    pthread_mutex_lock(&wal->sync_lock);
+    _wal_release(wal, end, ok);
+
+    return ok;
+}
+
+// Returns once the record ending at end is as durable as wal->sync asks for
+static int
+_wal_commit(
+    Database_wal *wal,
+    unsigned long end
+) {
+    if(wal->sync == WAL_SYNC_INTERVAL) {
+        return !__atomic_load_n(&wal->failed, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&wal->sync_lock);
+    while(!wal->failed && wal->durable < end) {
+        if(wal->flushing) {
+            pthread_cond_wait(&wal->synced, &wal->sync_lock);
+        }
+        else {
+            _wal_flush(wal, wal->sync == WAL_SYNC_ALWAYS);
+        }
+    }
+    int ok = (wal->durable >= end);
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    return ok;
+}
+
+static void *
+_wal_thread(
+    void *arg
+) {
+    Database_wal *wal = (Database_wal *)arg;
+
+    pthread_mutex_lock(&wal->sync_lock);
+    while(!wal->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += wal->interval_ms / 1000;
+        until.tv_nsec += (wal->interval_ms % 1000) * 1000000;
+        if(until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wal->wake, &wal->sync_lock, &until);
+
+        if(!wal->stop && !wal->failed && wal->durable < __atomic_load_n(&wal->appended, __ATOMIC_RELAXED)) {
+            _wal_flush(wal, 1);
+        }
+    }
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    return 0;
+}
+
+#undef _REC_KV
+#define _REC_KV rec_database->kv_record_tbl[k]
+
+// Leaves record k holding size bytes of buffer, whatever state it was in
+static int
+_wal_put(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned long k,
+    int set_flags,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    if(k < rec_database->kv_record_count && KV_RECORD_GET_SIZE(_REC_KV)) {
+        if(!database_kv_set_value(ctx_main, rec_database, k, size, buffer)) {
+            return 0;
+        }
+        if(set_flags) {
+            KV_RECORD_SET_FLAGS(_REC_KV, flags);
+        }
+        return 1;
+    }
+
+    char ptbl_index, bucket = database_calc_bucket(size);
+    unsigned long index = _database_value_alloc(ctx_main, rec_database, &ptbl_index, bucket);
+    if(index == -1) {
+        return 0;
+    }
+
+    if(k >= rec_database->kv_record_count) {
+        Record_kv *new_kv_tbl = (Record_kv *)memory_realloc(rec_database->kv_record_tbl, rec_database->kv_record_count * sizeof(Record_kv), (k + 1) * sizeof(Record_kv));
+        if(!new_kv_tbl) {
+            PTBL_RECORD_PAGE_USAGE_FREE(rec_database, ptbl_index, index);
+            return 0;
+        }
+        rec_database->kv_record_tbl = new_kv_tbl;
+        // The records skipped over are free, like those database_kv_free() leaves in the middle
+        rec_database->kv_record_free_count += k - rec_database->kv_record_count;
+        rec_database->kv_record_count = k + 1;
+    }
+    else {
+        rec_database->kv_record_free_count--;
+    }
+
+    KV_RECORD_SET_FLAGS(_REC_KV, flags);
+    KV_RECORD_SET_BUCKET(_REC_KV, bucket);
+    KV_RECORD_SET_INDEX(_REC_KV, index);
+    KV_RECORD_SET_SIZE(_REC_KV, size);
+    memcpy(PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, _REC_KV), buffer, size);
+    database_dirty_mark(ctx_main, rec_database, ptbl_index, PTBL_RECORD_VALUE_PTR(rec_database, ptbl_index, _REC_KV), size);
+    database_dirty_mark_kv(rec_database, k);
+    if(rec_database->cdc) cdc_publish(rec_database->cdc, CDC_OP_ALLOC, k, size);
+
+    return 1;
+}
+
+long
+database_wal_apply(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    unsigned char *log,
+    unsigned long length,
+    unsigned long *end
+) {
+    long count = 0;
+    unsigned long offset = 0;
+    while(offset + sizeof(Wal_record) <= length) {
+        Wal_record record;
+        memcpy(&record, log + offset, sizeof(Wal_record));
+        unsigned char *value = log + offset + sizeof(Wal_record);
+
+        // Anything that doesn't add up is where a write was torn
+        if(record.length > length - offset - sizeof(Wal_record)
+            || record.type > WAL_OP_FREE
+            || (record.type != WAL_OP_FREE && record.length == 0)
+            || record.checksum != hash_bytes(log + offset + sizeof(record.checksum), sizeof(Wal_record) - sizeof(record.checksum) + record.length)) {
+            DEBUG_PRINT("\tlog ends at a torn record, offset %lu\n", offset);
+            break;
+        }
+
+        if(rec_database) {
+            int ok = (record.type == WAL_OP_FREE)
+                ? (record.k >= rec_database->kv_record_count || database_kv_free(ctx_main, rec_database, record.k))
+                : _wal_put(ctx_main, rec_database, record.k, record.type == WAL_OP_ALLOC, record.flags, record.length, value);
+            if(!ok) {
+                DEBUG_PRINT("\tERR failed to apply record at offset %lu\n", offset);
+                count = -1;
+                break;
+            }
+        }
+
+        count++;
+        offset += sizeof(Wal_record) + record.length;
+    }
+
+    if(end) end[0] = offset;
+
+    return count;
+}
+
+// Walks the complete records of the log in fd, applying them to rec_database unless it's 0, and
+// writes the offset just past the last one to end. Returns the number of records, or -1 on failure.
+static long
+_wal_scan(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    int fd,
+    unsigned long length,
+    unsigned long *end
+) {
+    Wal_header header;
+    if(length < sizeof(Wal_header)) {
+        DEBUG_PRINT("\tERR log is too short\n");
+        return -1;
+    }
+
+    int pages = (length + ctx_main->system_page_size - 1) / ctx_main->system_page_size;
+    unsigned char *log = memory_page_map(ctx_main, fd, 0, pages);
+    if(!log) {
+        return -1;
+    }
+
+    memcpy(&header, log, sizeof(Wal_header));
+    if(memcmp(header.magic, WAL_MAGIC, sizeof(header.magic)) != 0
+        || header.version != WAL_VERSION
+        || header.byte_order != PERSIST_BYTE_ORDER) {
+        DEBUG_PRINT("\tERR not a log this build can read\n");
+        memory_page_free(ctx_main, log, pages);
+        return -1;
+    }
+
+    unsigned long applied;
+    long count = database_wal_apply(ctx_main, rec_database, log + sizeof(Wal_header), length - sizeof(Wal_header), &applied);
+    unsigned long offset = sizeof(Wal_header) + applied;
+
+    memory_page_free(ctx_main, log, pages);
+    if(end) end[0] = offset;
+
+    return count;
+}
+
+long
+database_wal_replay(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path
+) {
+    DEBUG_PRINT("database_wal_replay(path = %s);\n", path);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        if(errno == ENOENT) {
+            return 0;
+        }
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    long count = (fstat(fd, &st) != 0) ? -1
+               : (st.st_size == 0) ? 0
+               : _wal_scan(ctx_main, rec_database, fd, st.st_size, 0);
+    close(fd);
+
+    DEBUG_PRINT("\treplayed %ld records\n", count);
+
+    return count;
+}
+
+Database_wal *
+database_wal_open(
+    Context_main *ctx_main,
+    Record_database *rec_database,
+    const char *path,
+    int sync,
+    unsigned long interval_ms
+) {
+    DEBUG_PRINT("database_wal_open(path = %s, sync = %d, interval_ms = %lu);\n", path, sync, interval_ms);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        DEBUG_PRINT("\tERR failed to open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    struct stat st;
+    unsigned long end = sizeof(Wal_header);
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    if(st.st_size == 0) {
+        Wal_header header = { WAL_MAGIC, WAL_VERSION, PERSIST_BYTE_ORDER };
+        if(!_wal_write(fd, (unsigned char *)&header, sizeof(Wal_header), 0) || fdatasync(fd) != 0) {
+            close(fd);
+            return 0;
+        }
+    }
+    else if(_wal_scan(ctx_main, 0, fd, st.st_size, &end) == -1
+        || (end < st.st_size && ftruncate(fd, end) != 0)) {
+        close(fd);
+        return 0;
+    }
+
+    RECORD_CREATE(Database_wal, wal);
+    if(!wal) {
+        close(fd);
+        return 0;
+    }
+    wal->rec_database = rec_database;
+    wal->fd = fd;
+    wal->sync = sync;
+    wal->interval_ms = interval_ms ? interval_ms : 1;
+    wal->appended = wal->durable = end - sizeof(Wal_header);
+    pthread_mutex_init(&wal->lock, 0);
+    pthread_mutex_init(&wal->sync_lock, 0);
+    pthread_cond_init(&wal->synced, 0);
+    pthread_cond_init(&wal->wake, 0);
+    pthread_mutex_init(&wal->ship_lock, 0);
+    pthread_cond_init(&wal->ship_wake, 0);
+
+    wal->active.data = memory_alloc(WAL_BUFFER_INITIAL_CAPACITY);
+    wal->spare.data = memory_alloc(WAL_BUFFER_INITIAL_CAPACITY);
+    wal->active.capacity = wal->spare.capacity = WAL_BUFFER_INITIAL_CAPACITY;
+    if(!wal->active.data || !wal->spare.data) {
+        database_wal_close(ctx_main, wal);
+        return 0;
+    }
+
+    if(sync == WAL_SYNC_INTERVAL) {
+        if(pthread_create(&wal->thread, 0, _wal_thread, wal)) {
+            DEBUG_PRINT("\tERR failed to start sync thread\n");
+            database_wal_close(ctx_main, wal);
+            return 0;
+        }
+        wal->thread_started = 1;
+    }
+
+    return wal;
+}
+
+int
+database_wal_sync(
+    Context_main *ctx_main,
+    Database_wal *wal
+) {
+    DEBUG_PRINT("database_wal_sync();\n");
+
+    pthread_mutex_lock(&wal->sync_lock);
+    int ok = _wal_flush(wal, 1);
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    return ok;
+}
+
+int
+database_wal_close(
+    Context_main *ctx_main,
+    Database_wal *wal
+) {
+    DEBUG_PRINT("database_wal_close();\n");
+
+    if(wal->thread_started) {
+        pthread_mutex_lock(&wal->sync_lock);
+        wal->stop = 1;
+        pthread_cond_signal(&wal->wake);
+        pthread_mutex_unlock(&wal->sync_lock);
+        pthread_join(wal->thread, 0);
+    }
+
+    int ok = wal->active.data && wal->spare.data && database_wal_sync(ctx_main, wal);
+    if(close(wal->fd) != 0) ok = 0;
+
+    if(wal->ship_started) {
+        pthread_mutex_lock(&wal->ship_lock);
+        wal->ship_stop = 1;
+        pthread_cond_signal(&wal->ship_wake);
+        pthread_mutex_unlock(&wal->ship_lock);
+        pthread_join(wal->ship_thread, 0);
+    }
+    // Followers get what they take straight away, and lose the rest
+    for(int i = 0; i < wal->follower_count; i++) {
+        _wal_follower_send(&wal->followers[i]);
+        close(wal->followers[i].fd);
+        free(wal->followers[i].queue.data);
+    }
+
+    pthread_mutex_destroy(&wal->lock);
+    pthread_mutex_destroy(&wal->sync_lock);
+    pthread_cond_destroy(&wal->synced);
+    pthread_cond_destroy(&wal->wake);
+    pthread_mutex_destroy(&wal->ship_lock);
+    pthread_cond_destroy(&wal->ship_wake);
+    memory_free(wal->active.data);
+    memory_free(wal->spare.data);
+    memory_free(wal);
+
+    return ok;
+}
+
+unsigned long
+database_wal_kv_alloc(
+    Context_main *ctx_main,
+    Database_wal *wal,
+    unsigned char flags,
+    unsigned long size,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_wal_kv_alloc(flags = %02x, size = %lu);\n", flags, size);
+
+    pthread_mutex_lock(&wal->lock);
+    // Room for the record is made first, so that nothing is applied that couldn't be logged
+    if(__atomic_load_n(&wal->failed, __ATOMIC_RELAXED) || !_wal_reserve(wal, sizeof(Wal_record) + size)) {
+        pthread_mutex_unlock(&wal->lock);
+        return -1;
+    }
+    unsigned long k = database_kv_alloc(ctx_main, wal->rec_database, flags, size, buffer), end = 0;
+    if(k != -1) {
+        end = _wal_append(wal, WAL_OP_ALLOC, flags, k, size, buffer);
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    if(k == -1 || !_wal_commit(wal, end)) {
+        return -1;
+    }
+
+    return k;
+}
+
+int
+database_wal_kv_set_value(
+    Context_main *ctx_main,
+    Database_wal *wal,
+    unsigned long k,
+    unsigned long length,
+    unsigned char *buffer
+) {
+    DEBUG_PRINT("database_wal_kv_set_value(k = %lu, length = %lu);\n", k, length);
+
+    pthread_mutex_lock(&wal->lock);
+    if(__atomic_load_n(&wal->failed, __ATOMIC_RELAXED) || !_wal_reserve(wal, sizeof(Wal_record) + length)) {
+        pthread_mutex_unlock(&wal->lock);
+        return 0;
+    }
+    int ok = database_kv_set_value(ctx_main, wal->rec_database, k, length, buffer);
+    unsigned long end = ok ? _wal_append(wal, WAL_OP_SET_VALUE, 0, k, length, buffer) : 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    return ok && _wal_commit(wal, end);
+}
+
+int
+database_wal_kv_free(
+    Context_main *ctx_main,
+    Database_wal *wal,
+    unsigned long k
+) {
+    DEBUG_PRINT("database_wal_kv_free(k = %lu);\n", k);
+
+    pthread_mutex_lock(&wal->lock);
+    if(__atomic_load_n(&wal->failed, __ATOMIC_RELAXED) || !_wal_reserve(wal, sizeof(Wal_record))) {
+        pthread_mutex_unlock(&wal->lock);
+        return 0;
+    }
+    int ok = database_kv_free(ctx_main, wal->rec_database, k);
+    unsigned long end = ok ? _wal_append(wal, WAL_OP_FREE, 0, k, 0, 0) : 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    return ok && _wal_commit(wal, end);
+}
+
+int
+database_wal_checkpoint(
+    Context_main *ctx_main,
+    Database_wal *wal,
+    const char *path
+) {
+    DEBUG_PRINT("database_wal_checkpoint(path = %s);\n", path);
+
+    pthread_mutex_lock(&wal->sync_lock);
+    _wal_own(wal);
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    // Holding lock keeps every write out until the log is empty again. Whatever was appended goes
+    // to the log first, so that it's complete whatever happens next.
+    pthread_mutex_lock(&wal->lock);
+    unsigned long end = wal->appended;
+    int written = !__atomic_load_n(&wal->failed, __ATOMIC_RELAXED)
+               && _wal_write(wal->fd, wal->active.data, wal->active.length, sizeof(Wal_header) + (end - wal->active.length - wal->base))
+               && fdatasync(wal->fd) == 0,
+        saved = 0, emptied = 0, truncated = 0;
+    if(written) {
+        if(wal->active.length && wal->follower_count) {
+            _wal_ship(wal, wal->active.data, wal->active.length, end);
+        }
+        wal->active.length = 0;
+        saved = database_save(ctx_main, wal->rec_database, path);
+    }
+    if(saved) {
+        // database_save() only returns once the snapshot, and its rename, are on disk
+        truncated = (ftruncate(wal->fd, sizeof(Wal_header)) == 0);
+        if(truncated) wal->base = end;
+        emptied = truncated && fdatasync(wal->fd) == 0;
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    pthread_mutex_lock(&wal->sync_lock);
+    _wal_release(wal, end, written);
+    if(truncated && !emptied) {
+        wal->failed = 1;
+    }
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    return emptied;
+}
+
+int
+database_wal_ship(
+    Context_main *ctx_main,
+    Database_wal *wal,
+    int fd
+) {
+    DEBUG_PRINT("database_wal_ship(fd = %d);\n", fd);
+
+    pthread_mutex_lock(&wal->sync_lock);
+    _wal_own(wal);
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    // With the file owned, nothing is shipped or applied until the follower is in the list. Records
+    // appended but not yet flushed are in the base as well as shipped after it, and applying them
+    // twice changes nothing. Only the encoding is done under lock: the base is sent once it's let go.
+    pthread_mutex_lock(&wal->lock);
+    Record_database *rec_database = wal->rec_database;
+    unsigned long end = wal->appended, length = 0;
+    for(unsigned long k = 0; k < rec_database->kv_record_count; k++) {
+        length += KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]) ? sizeof(Wal_record) + KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]) : 0;
+    }
+    Wal_follower follower = { fd };
+    follower.queue.capacity = sizeof(Wal_header) + sizeof(Wal_frame) + length;
+    follower.queue.data = malloc(follower.queue.capacity);
+    follower.limit = follower.queue.capacity + WAL_FOLLOWER_QUEUE_MAX;
+    int ok = (follower.queue.data != 0);
+    if(ok) {
+        Wal_header header = { WAL_MAGIC, WAL_VERSION, PERSIST_BYTE_ORDER };
+        Wal_frame frame;
+        _wal_frame(wal, &frame, length, end);
+        memcpy(follower.queue.data, &header, sizeof(header));
+        memcpy(follower.queue.data + sizeof(header), &frame, sizeof(frame));
+        follower.queue.length = sizeof(header) + sizeof(frame);
+    }
+    for(unsigned long k = 0; ok && k < rec_database->kv_record_count; k++) {
+        unsigned long size = KV_RECORD_GET_SIZE(rec_database->kv_record_tbl[k]);
+        if(size) {
+            follower.queue.length += _wal_encode(follower.queue.data + follower.queue.length, WAL_OP_ALLOC, KV_RECORD_GET_FLAGS(rec_database->kv_record_tbl[k]), k, size, database_kv_get_value(ctx_main, rec_database, 0, k));
+        }
+    }
+    pthread_mutex_unlock(&wal->lock);
+
+    int flags = fcntl(fd, F_GETFL);
+    ok = ok && flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    if(ok && !wal->ship_started) {
+        ok = wal->ship_started = (pthread_create(&wal->ship_thread, 0, _wal_ship_thread, wal) == 0);
+    }
+    pthread_mutex_lock(&wal->ship_lock);
+    ok = ok && (wal->follower_count < WAL_FOLLOWERS_MAX) && _wal_follower_send(&follower);
+    if(ok) {
+        wal->followers[wal->follower_count++] = follower;
+        if(follower.queue.length) {
+            pthread_cond_signal(&wal->ship_wake);
+        }
+    }
+    pthread_mutex_unlock(&wal->ship_lock);
+    if(!ok) {
+        DEBUG_PRINT("\tERR failed to ship to fd %d\n", fd);
+        if(flags != -1) fcntl(fd, F_SETFL, flags);
+        free(follower.queue.data);
+    }
+
+    pthread_mutex_lock(&wal->sync_lock);
+    _wal_release(wal, 0, 1);
+    pthread_mutex_unlock(&wal->sync_lock);
+
+    return ok;
+}
+
+unsigned long
+database_wal_lsn(
+    Database_wal *wal
+) {
+    pthread_mutex_lock(&wal->lock);
+    unsigned long lsn = wal->appended;
+    pthread_mutex_unlock(&wal->lock);
+
+    return lsn;
+}
@@ -0,0 +1,205 @@
+/** @file  wal.h
+ *  @brief Write-ahead log: makes database_kv_alloc(), database_kv_set_value() and database_kv_free() durable
+ */
+
+/** @brief The first eight bytes of every log file */
+#define WAL_MAGIC "BKEYWLOG"
+
+/** @brief Version of the log format written by database_wal_open(). Logs of any other version are rejected. */
+#define WAL_VERSION 1
+
+/** @brief Bytes of records a log buffers before it first grows its buffer */
+#define WAL_BUFFER_INITIAL_CAPACITY (64 << 10)
+
+/** @brief Most followers a log ships its records to at once */
+#define WAL_FOLLOWERS_MAX 8
+
+/** @brief Most bytes of batches a follower may have queued, on top of its first batch, before it's dropped */
+#define WAL_FOLLOWER_QUEUE_MAX (64 << 20)
+
+/** @brief The start of every log file, and of the log shipped to a follower */
+typedef struct wal_header {
+    char magic[8];           ///< WAL_MAGIC
+    unsigned int version;    ///< WAL_VERSION
+    unsigned int byte_order; ///< PERSIST_BYTE_ORDER of the build that wrote it
+} Wal_header;
+
+/** @brief Precedes every batch of records shipped to a follower
+ *  @see   database_wal_ship()
+ */
+typedef struct wal_frame {
+    unsigned long end;        ///< LSN just past the last record of the batch
+    unsigned long appended;   ///< LSN just past the last record appended to the log when the batch was shipped
+    unsigned long length;     ///< Bytes of records after the frame, as they're laid out in the log file
+    unsigned long shipped_ns; ///< CLOCK_MONOTONIC time the batch was shipped at, in nanoseconds
+} Wal_frame;
+
+/** @brief When the writes made through a log reach the disk */
+enum wal_sync {
+    /** Every write returns only once it is on disk. Writes from several threads that arrive while one
+     *  fdatasync() is running are written and synced together by the next one (group commit). */
+    WAL_SYNC_ALWAYS,
+    /** Writes return straight away, and a background thread writes and syncs everything every
+     *  \a interval_ms, so a crash loses at most that much */
+    WAL_SYNC_INTERVAL,
+    /** Every write is handed to the OS before it returns, like WAL_SYNC_ALWAYS but never synced, so
+     *  it survives the process crashing, but not the machine */
+    WAL_SYNC_NONE
+};
+
+/** @brief An append-only log of the writes made to a Record_database
+ *
+ * Every write made through the log is applied to the database, and then appended to the log as a
+ * record that holds the key, the flags and the value it leaves behind, with a checksum. Replaying a
+ * record only ever puts a key into that state, so replaying a record twice, or onto a snapshot that
+ * already has it, changes nothing. Recovering is:
+ *
+ * 1. database_load() or database_map() the last snapshot, if there is one
+ * 2. database_wal_replay() the log onto it
+ * 3. database_wal_open() the log to carry on writing to it
+ *
+ * database_wal_checkpoint() writes a new snapshot and empties the log. A crash in between the two
+ * leaves a log that replays onto the new snapshot without changing it.
+ *
+ * The log's functions may be called from any number of threads, and keep the database consistent
+ * with each other. The database may only be read directly while no thread writes through the log.
+ */
+typedef struct database_wal Database_wal;
+
+/** @brief Opens the log at \a path for writes to \a rec_database, creating it if it doesn't exist
+ *
+ * An existing log is appended to, after the last complete record. A torn record at the end, from a
+ * crash in the middle of a write, is cut off.
+ *
+ * @returns A pointer to the log on success, or 0 on failure
+ * @see     database_wal_close()
+ */
+Database_wal *
+database_wal_open(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path,              ///<[in] log file
+    int sync,                      ///<[in] one of wal_sync
+    unsigned long interval_ms      ///<[in] how often WAL_SYNC_INTERVAL syncs, in milliseconds
+    );
+
+/** @brief   Writes and syncs everything left in \a wal, then closes it
+ *  @returns 1 if every write made through \a wal is on disk, 0 otherwise
+ */
+int
+database_wal_close(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal       ///<[in] log
+    );
+
+/** @brief   database_kv_alloc(), logged
+ *  @returns The key of the new record on success, or -1 if it couldn't be allocated, or couldn't be
+ *           logged, in which case the log can't be written to anymore
+ */
+unsigned long
+database_wal_kv_alloc(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal,      ///<[in] log
+    unsigned char flags,    ///<[in] flags of the new record
+    unsigned long size,     ///<[in] size of the value in bytes
+    unsigned char *buffer   ///<[in] \a size bytes to initialize the value with
+    );
+
+/** @brief   database_kv_set_value(), logged
+ *  @returns 1 on success, 0 if the value couldn't be set, or couldn't be logged, like database_wal_kv_alloc()
+ */
+int
+database_wal_kv_set_value(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal,      ///<[in] log
+    unsigned long k,        ///<[in] key of the record to change
+    unsigned long length,   ///<[in] length of \a buffer in bytes
+    unsigned char *buffer   ///<[in] new value
+    );
+
+/** @brief   database_kv_free(), logged
+ *  @returns 1 on success, 0 if the record couldn't be freed, or couldn't be logged, like database_wal_kv_alloc()
+ */
+int
+database_wal_kv_free(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal,      ///<[in] log
+    unsigned long k         ///<[in] key of the record to free
+    );
+
+/** @brief   Writes and syncs every write made through \a wal so far, whatever its wal_sync
+ *  @returns 1 on success, 0 on failure
+ */
+int
+database_wal_sync(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal       ///<[in] log
+    );
+
+/** @brief Saves the database to a snapshot at \a path with database_save(), then empties \a wal
+ *
+ * Writes through the log wait until the checkpoint is done.
+ *
+ * @returns 1 on success, 0 on failure, in which case the log is kept as it was
+ */
+int
+database_wal_checkpoint(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal,      ///<[in] log
+    const char *path        ///<[in] snapshot file to write
+    );
+
+/** @brief Applies every complete record of the log at \a path to \a rec_database
+ *
+ * Stops at the first torn or corrupt record. A log that doesn't exist replays nothing.
+ *
+ * @returns The number of records applied, or -1 on failure
+ */
+long
+database_wal_replay(
+    Context_main *ctx_main,        ///<[in] main context
+    Record_database *rec_database, ///<[in] database record
+    const char *path               ///<[in] log file
+    );
+
+/** @brief Applies the complete records at the start of \a log, laid out as they are in a log file after its header
+ *
+ * Stops at the first record that's cut short or doesn't match its checksum.
+ *
+ * @returns The number of records applied, or -1 on failure
+ */
+long
+database_wal_apply(
+    Context_main *ctx_main,        ///<[in]  main context
+    Record_database *rec_database, ///<[in]  database record, or 0 to only check the records
+    unsigned char *log,            ///<[in]  records
+    unsigned long length,          ///<[in]  length of \a log in bytes
+    unsigned long *end             ///<[out] offset just past the last record applied (optional)
+    );
+
+/** @brief Starts shipping the log to a follower on \a fd, a pipe or a socket
+ *
+ * The follower is sent a log file header, and a first batch of records that rebuilds the whole
+ * database. After that it's sent every batch of records as it's written to the log file, each
+ * behind a Wal_frame, so it sees the writes that are committed, as they're committed. Nothing
+ * waits on a follower: \a fd is made non-blocking, what a follower doesn't take straight away is
+ * queued for it and sent by a shipping thread as it reads, and a follower that falls more than
+ * WAL_FOLLOWER_QUEUE_MAX behind, or goes away, is dropped. \a fd belongs to the log from then on,
+ * and is closed when the follower is dropped or by database_wal_close(), which sends what's queued
+ * only as far as the follower takes it without waiting.
+ *
+ * @returns 1 on success, 0 on failure, in which case \a fd is left open
+ * @see     database_replica_open()
+ */
+int
+database_wal_ship(
+    Context_main *ctx_main, ///<[in] main context
+    Database_wal *wal,      ///<[in] log
+    int fd                  ///<[in] where to ship to
+    );
+
+/** @brief   Returns the LSN just past the last record appended to \a wal, which only ever grows */
+unsigned long
+database_wal_lsn(
+    Database_wal *wal ///<[in] log
+    );